@@ -23,13 +23,68 @@
 #include <poll.h>
 #include <getopt.h>
 #include <unistd.h>
+#include <time.h>
 #include "iscsi.h"
 #include "scsi-lowlevel.h"
 
 const char *initiator = "iqn.2010-11.ronnie:iscsi-inq";
 int max_in_flight = 50;
+int max_writes_in_flight = 50;
 int blocks_per_io = 200;
 
+/* A range of blocks that has to be copied again using READ/WRITE */
+struct range {
+	struct range *next;
+	uint64_t lba;
+	uint64_t num_blocks;
+};
+
+struct xcopy_task {
+	struct xcopy_task *next;
+	struct client *client;
+	int list_id;
+	uint64_t lba;
+	uint64_t num_blocks;
+	/* blocks reported as copied by RECEIVE COPY RESULTS */
+	uint64_t copied;
+	unsigned char *param;
+};
+
+/* Allocation status of a window of the source, see --sparse */
+struct lba_map {
+	struct lba_map *next;
+	struct client *client;
+	uint64_t start;
+	uint64_t end;
+	/* the status of the blocks before this is known */
+	uint64_t mapped_to;
+	int num_extents;
+	int max_extents;
+	struct scsi_lba_status_descriptor *extents;
+};
+
+/* --sync compares a chunk of the source with the same chunk of the
+ * destination and only writes the blocks that differ.
+ */
+struct sync_chunk {
+	struct client *client;
+	uint64_t lba;
+	uint32_t num_blocks;
+	struct scsi_task *src_task;
+	struct scsi_task *dst_task;
+	int reads;
+	/* writes in flight or queued */
+	int writes;
+};
+
+struct sync_write {
+	struct sync_write *next;
+	struct sync_chunk *chunk;
+	uint64_t lba;
+	uint32_t num_blocks;
+	unsigned char *data;
+};
+
 struct client {
 	int finished;
 	int in_flight;
@@ -47,16 +102,67 @@ struct client {
 	int use_16_for_rw;
 	int progress;
 	int ignore_errors;
+
+	struct range *redo;
+
+	int use_xcopy;
+	unsigned char xcopy_tgt_desc[64];
+	int xcopy_segments;
+	uint32_t xcopy_segment_blocks;
+	int xcopy_max_in_flight;
+	int xcopy_list_id;
+	int xcopy_poll;
+	uint64_t xcopy_copied;
+	struct xcopy_task *xcopy_tasks;
+
+	int sparse;
+	struct lba_map *map;
+	uint64_t map_next;
+	int map_windows;
+	uint64_t skipped;
+	struct iscsi_unmap_batch *dst_unmap;
+	uint32_t dst_ws_max;
+	unsigned char *zero_block;
+
+	int sync;
+	int writes_in_flight;
+	struct sync_write *write_queue;
+	struct sync_write **write_queue_tail;
+	uint64_t bytes_compared;
+	uint64_t bytes_written;
 };
 
 
-void fill_read_queue(struct client *client);
+void fill_queue(struct client *client);
+
+static int all_issued(struct client *client)
+{
+	return client->pos == client->src_num_blocks && client->redo == NULL;
+}
 
 struct write_task {
        struct scsi_task *rt;
        struct client *client;
 };
 
+/* A read/write or a deallocation of a range has completed */
+static void io_done(struct client *client)
+{
+	client->in_flight--;
+	fill_queue(client);
+
+	if (client->progress) {
+		printf("\r%"PRIu64" of %"PRIu64" blocks transferred.", client->pos, client->src_num_blocks);
+	}
+
+	if ((client->in_flight == 0) && all_issued(client)) {
+		client->finished = 1;
+		if (client->progress) {
+			printf("\n");
+		}
+	}
+}
+
 void write_cb(struct iscsi_context *iscsi, int status, void *command_data, void *private_data)
 {
 	struct write_task *wt = (struct write_task *)private_data;
@@ -77,19 +183,8 @@ void write_cb(struct iscsi_context *iscsi, int status, void *command_data, void
 		}
 	}
 
-	client->in_flight--;
-	fill_read_queue(client);
+	io_done(client);
 
-	if (client->progress) {
-		printf("\r%"PRIu64" of %"PRIu64" blocks transferred.", client->pos, client->src_num_blocks);
-	}
-
-	if ((client->in_flight == 0) && (client->pos == client->src_num_blocks)) {
-		client->finished = 1;
-		if (client->progress) {
-			printf("\n");
-		}
-	}
 	scsi_free_scsi_task(wt->rt);
 	scsi_free_scsi_task(task);
 	free(wt);
@@ -151,28 +246,358 @@ void read_cb(struct iscsi_context *iscsi _U_, int status, void *command_data, vo
 }
 
 
+/*
+ * Sparse copies.
+ *
+ * The allocation status of the source is read with GET LBA STATUS in
+ * windows of MAP_WINDOW_BLOCKS blocks. Up to MAP_WINDOWS windows ahead of
+ * the copy cursor are mapped in parallel, each of them starting at its
+ * own LBA so that the sweeps do not depend on each other. Ranges that
+ * are not mapped on the source are not read, they are deallocated on the
+ * destination instead: with UNMAP if unmapped blocks read back as zero
+ * there and otherwise with WRITE SAME16.
+ */
+#define MAP_WINDOW_BLOCKS (1024 * 1024)
+#define MAP_WINDOWS 4
+#define MAP_DESCRIPTORS 256
+
+void fill_map_queue(struct client *client);
+void map_cb(struct iscsi_context *iscsi, int status, void *command_data, void *private_data);
+
+static void map_sweep(struct client *client, struct lba_map *map)
+{
+	struct scsi_task *task;
+
+	task = iscsi_get_lba_status_task(client->src_iscsi, client->src_lun,
+					 map->mapped_to, 8 + 16 * MAP_DESCRIPTORS,
+					 map_cb, map);
+	if (task == NULL) {
+		printf("failed to send GET LBA STATUS command\n");
+		exit(10);
+	}
+}
+
+void map_cb(struct iscsi_context *iscsi _U_, int status, void *command_data, void *private_data)
+{
+	struct lba_map *map = private_data;
+	struct scsi_task *task = command_data;
+	struct client *client = map->client;
+	struct scsi_get_lba_status *lbas = NULL;
+	uint64_t mapped_to = map->mapped_to;
+	uint32_t i;
+
+	if (status == SCSI_STATUS_GOOD) {
+		lbas = scsi_datain_unmarshall(task);
+	}
+	if (lbas == NULL) {
+		/* we don't know, so copy the rest of the window */
+		printf("GET LBA STATUS failed, copying all blocks of lba %"PRIu64"-%"PRIu64"\n",
+		       map->mapped_to, map->end - 1);
+		map->mapped_to = map->end;
+	}
+
+	for (i = 0; lbas && i < lbas->num_descriptors; i++) {
+		struct scsi_lba_status_descriptor *d = &lbas->descriptors[i];
+		uint64_t start = d->lba, end = d->lba + d->num_blocks;
+
+		if (start < map->mapped_to) {
+			start = map->mapped_to;
+		}
+		if (end > map->end) {
+			end = map->end;
+		}
+		if (start >= end) {
+			continue;
+		}
+		if (map->num_extents == map->max_extents) {
+			map->max_extents = map->max_extents ? map->max_extents * 2 : 16;
+			map->extents = realloc(map->extents, map->max_extents
+					       * sizeof(struct scsi_lba_status_descriptor));
+			if (map->extents == NULL) {
+				printf("failed to allocate lba map\n");
+				exit(10);
+			}
+		}
+		map->extents[map->num_extents].lba = start;
+		map->extents[map->num_extents].num_blocks = end - start;
+		map->extents[map->num_extents].provisioning = d->provisioning;
+		map->num_extents++;
+		map->mapped_to = end;
+	}
+	if (map->mapped_to == mapped_to) {
+		/* no progress, treat the rest of the window as mapped */
+		map->mapped_to = map->end;
+	}
+	scsi_free_scsi_task(task);
+
+	if (map->mapped_to < map->end) {
+		map_sweep(client, map);
+	}
+	fill_queue(client);
+}
+
+void fill_map_queue(struct client *client)
+{
+	while (client->map_windows < MAP_WINDOWS
+	       && client->map_next < client->src_num_blocks) {
+		struct lba_map *map, **mp;
+
+		map = malloc(sizeof(struct lba_map));
+		if (map == NULL) {
+			printf("failed to allocate lba map\n");
+			exit(10);
+		}
+		memset(map, 0, sizeof(struct lba_map));
+		map->client = client;
+		map->start = map->mapped_to = client->map_next;
+		map->end = map->start + MAP_WINDOW_BLOCKS;
+		if (map->end > client->src_num_blocks) {
+			map->end = client->src_num_blocks;
+		}
+		client->map_next = map->end;
+
+		for (mp = &client->map; *mp; mp = &(*mp)->next)
+			;
+		*mp = map;
+		client->map_windows++;
+
+		map_sweep(client, map);
+	}
+}
+
+/* Returns 1 if the blocks from lba on are mapped on the source, 0 if
+ * they are not and -1 if that is not known yet. *num_blocks is set to
+ * the number of blocks with the same status.
+ */
+static int map_lookup(struct client *client, uint64_t lba, uint64_t *num_blocks)
+{
+	struct lba_map *map;
+	int i;
+
+	while ((map = client->map) != NULL && map->end <= lba) {
+		client->map = map->next;
+		client->map_windows--;
+		free(map->extents);
+		free(map);
+	}
+	fill_map_queue(client);
+
+	if (map == NULL || lba < map->start || lba >= map->mapped_to) {
+		return -1;
+	}
+	for (i = 0; i < map->num_extents; i++) {
+		struct scsi_lba_status_descriptor *d = &map->extents[i];
+
+		if (d->lba > lba) {
+			/* not described, so copy it */
+			*num_blocks = d->lba - lba;
+			return 1;
+		}
+		if (lba < d->lba + d->num_blocks) {
+			*num_blocks = d->lba + d->num_blocks - lba;
+			return d->provisioning == SCSI_PROVISIONING_TYPE_MAPPED;
+		}
+	}
+	*num_blocks = map->mapped_to - lba;
+	return 1;
+}
+
+void dealloc_cb(struct iscsi_context *iscsi, int status, void *command_data, void *private_data)
+{
+	struct client *client = (struct client *)private_data;
+	struct scsi_task *task = command_data;
+
+	if (status != SCSI_STATUS_GOOD) {
+		printf("Deallocating blocks on the destination failed with %s\n", iscsi_get_error(iscsi));
+		if (!client->ignore_errors) {
+			exit(10);
+		}
+	}
+	/* command_data is NULL for UNMAP batch completions */
+	if (task != NULL) {
+		scsi_free_scsi_task(task);
+	}
+	io_done(client);
+}
+
+/* Deallocate blocks on the destination. Returns the number of blocks
+ * this covers. UNMAP ranges are only queued, see dealloc_submit().
+ */
+static uint64_t dealloc_range(struct client *client, uint64_t lba, uint64_t num_blocks)
+{
+	if (client->dst_unmap != NULL) {
+		if (num_blocks > 0xffffffff) {
+			num_blocks = 0xffffffff;
+		}
+		if (iscsi_unmap_batch_add(client->dst_unmap, lba, num_blocks,
+					  dealloc_cb, client) != 0) {
+			printf("failed to queue UNMAP range\n");
+			exit(10);
+		}
+	} else {
+		struct scsi_task *task;
+
+		if (num_blocks > client->dst_ws_max) {
+			num_blocks = client->dst_ws_max;
+		}
+		task = iscsi_writesame16_task(client->dst_iscsi, client->dst_lun,
+					      lba, client->zero_block,
+					      client->dst_blocksize,
+					      num_blocks, 0, 0, 0, 0,
+					      dealloc_cb, client);
+		if (task == NULL) {
+			printf("failed to send WRITE SAME16 command\n");
+			exit(10);
+		}
+	}
+	client->skipped += num_blocks;
+	return num_blocks;
+}
+
+/* Send the queued UNMAP ranges once the queue is full, once the whole
+ * source has been issued or when they are all that is in flight and
+ * nothing else would bring us back here. Each range counts as in flight
+ * from the moment it is queued.
+ */
+static void dealloc_submit(struct client *client)
+{
+	int pending;
+
+	if (client->dst_unmap == NULL) {
+		return;
+	}
+	pending = iscsi_unmap_batch_pending(client->dst_unmap);
+	if (pending == 0) {
+		return;
+	}
+	if (client->in_flight < max_in_flight && !all_issued(client)
+	    && client->in_flight > pending) {
+		return;
+	}
+	if (iscsi_unmap_batch_submit(client->dst_unmap) != 0) {
+		printf("failed to send UNMAP command\n");
+		exit(10);
+	}
+}
+
+/* Set up --sparse. Returns -1 if the source is not thin provisioned. */
+static int sparse_init(struct client *client)
+{
+	struct scsi_task *task;
+	struct scsi_readcapacity16 *rc16;
+	struct scsi_inquiry_block_limits *inq = NULL;
+	int unmap = 0;
+
+	task = iscsi_readcapacity16_sync(client->src_iscsi, client->src_lun);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD
+	    || (rc16 = scsi_datain_unmarshall(task)) == NULL
+	    || !rc16->lbpme) {
+		fprintf(stderr, "source LUN is not thin provisioned\n");
+		scsi_free_scsi_task(task);
+		return -1;
+	}
+	scsi_free_scsi_task(task);
+
+	task = iscsi_readcapacity16_sync(client->dst_iscsi, client->dst_lun);
+	if (task != NULL && task->status == SCSI_STATUS_GOOD
+	    && (rc16 = scsi_datain_unmarshall(task)) != NULL) {
+		unmap = rc16->lbpme && rc16->lbprz;
+	}
+	scsi_free_scsi_task(task);
+
+	client->dst_ws_max = 0xffff;
+	task = iscsi_inquiry_sync(client->dst_iscsi, client->dst_lun, 1,
+				  SCSI_INQUIRY_PAGECODE_BLOCK_LIMITS, 64);
+	if (task != NULL && task->status == SCSI_STATUS_GOOD) {
+		inq = scsi_datain_unmarshall(task);
+	}
+	if (inq != NULL && inq->max_ws_len
+	    && inq->max_ws_len < client->dst_ws_max) {
+		client->dst_ws_max = inq->max_ws_len;
+	}
+	client->zero_block = calloc(1, client->dst_blocksize);
+	if (client->zero_block == NULL) {
+		fprintf(stderr, "failed to allocate zero block\n");
+		scsi_free_scsi_task(task);
+		return -1;
+	}
+	if (unmap) {
+		client->dst_unmap = iscsi_unmap_batch_create(client->dst_iscsi,
+							     client->dst_lun, inq);
+		if (client->dst_unmap == NULL) {
+			fprintf(stderr, "failed to create unmap batch: %s\n",
+				iscsi_get_error(client->dst_iscsi));
+		}
+	}
+	scsi_free_scsi_task(task);
+
+	client->sparse = 1;
+	fill_map_queue(client);
+	return 0;
+}
+
 void fill_read_queue(struct client *client)
 {
 	int num_blocks;
+	uint64_t lba;
 
-	while(client->in_flight < max_in_flight && client->pos < client->src_num_blocks) {
+	while(client->in_flight < max_in_flight && !all_issued(client)) {
 		struct scsi_task *task;
+		struct range *r = client->redo;
+
 		client->in_flight++;
 
-		num_blocks = client->src_num_blocks - client->pos;
-		if (num_blocks > blocks_per_io) {
+		/* ranges that EXTENDED COPY failed to copy go first */
+		if (r != NULL) {
+			lba = r->lba;
 			num_blocks = blocks_per_io;
+			if (r->num_blocks < (uint64_t)blocks_per_io) {
+				num_blocks = r->num_blocks;
+			}
+			r->lba += num_blocks;
+			r->num_blocks -= num_blocks;
+			if (r->num_blocks == 0) {
+				client->redo = r->next;
+				free(r);
+			}
+		} else if (client->sparse) {
+			uint64_t len;
+			int mapped;
+
+			mapped = map_lookup(client, client->pos, &len);
+			if (mapped < 0) {
+				/* wait for GET LBA STATUS */
+				client->in_flight--;
+				break;
+			}
+			lba = client->pos;
+			if (!mapped) {
+				client->pos += dealloc_range(client, lba, len);
+				continue;
+			}
+			num_blocks = blocks_per_io;
+			if (len < (uint64_t)blocks_per_io) {
+				num_blocks = len;
+			}
+			client->pos += num_blocks;
+		} else {
+			lba = client->pos;
+			num_blocks = client->src_num_blocks - client->pos;
+			if (num_blocks > blocks_per_io) {
+				num_blocks = blocks_per_io;
+			}
+			client->pos += num_blocks;
 		}
 
 		if (client->use_16_for_rw) {
 			task = iscsi_read16_task(client->src_iscsi,
-									client->src_lun, client->pos,
+									client->src_lun, lba,
 									num_blocks * client->src_blocksize,
 									client->src_blocksize, 0, 0, 0, 0, 0,
 									read_cb, client);
 		} else {
 			task = iscsi_read10_task(client->src_iscsi,
-									client->src_lun, client->pos,
+									client->src_lun, lba,
 									num_blocks * client->src_blocksize,
 									client->src_blocksize, 0, 0, 0, 0, 0,
 									read_cb, client);
@@ -181,8 +606,588 @@ void fill_read_queue(struct client *client)
 			printf("failed to send read10/16 command\n");
 			exit(10);
 		}
-		client->pos += num_blocks;
 	}
+	dealloc_submit(client);
+}
+
+/*
+ * EXTENDED COPY offload.
+ *
+ * The copy is done by the copy manager of the destination LUN, using
+ * block to block segment descriptors that refer to the source and the
+ * destination through their Device Identification designators. Each
+ * EXTENDED COPY covers xcopy_segments segments of up to
+ * xcopy_segment_blocks blocks. If the target rejects a command its range
+ * is copied using READ/WRITE instead and no further EXTENDED COPY
+ * commands are sent.
+ */
+static void xcopy_print_progress(struct client *client)
+{
+	struct xcopy_task *xt;
+	uint64_t copied = client->xcopy_copied;
+
+	for (xt = client->xcopy_tasks; xt; xt = xt->next) {
+		copied += xt->copied;
+	}
+	printf("\r%"PRIu64" of %"PRIu64" blocks copied.", copied, client->src_num_blocks);
+	fflush(stdout);
+}
+
+void xcopy_cb(struct iscsi_context *iscsi, int status, void *command_data, void *private_data)
+{
+	struct xcopy_task *xt = private_data;
+	struct scsi_task *task = command_data;
+	struct client *client = xt->client;
+	struct xcopy_task **xtp;
+
+	for (xtp = &client->xcopy_tasks; *xtp != xt; xtp = &(*xtp)->next)
+		;
+	*xtp = xt->next;
+
+	if (status == SCSI_STATUS_GOOD) {
+		client->xcopy_copied += xt->num_blocks;
+	} else {
+		struct range *r;
+
+		if (client->use_xcopy) {
+			if (status == SCSI_STATUS_CHECK_CONDITION) {
+				printf("\nEXTENDED COPY failed with sense key:%s ascq:%s\n",
+				       scsi_sense_key_str(task->sense.key),
+				       scsi_sense_ascq_str(task->sense.ascq));
+			} else {
+				printf("\nEXTENDED COPY failed with %s\n", iscsi_get_error(iscsi));
+			}
+			printf("Falling back to READ/WRITE\n");
+			client->use_xcopy = 0;
+		}
+
+		r = malloc(sizeof(struct range));
+		if (r == NULL) {
+			printf("failed to allocate range\n");
+			exit(10);
+		}
+		r->lba = xt->lba;
+		r->num_blocks = xt->num_blocks;
+		r->next = client->redo;
+		client->redo = r;
+	}
+
+	client->in_flight--;
+	fill_queue(client);
+
+	if (client->progress && client->use_xcopy) {
+		xcopy_print_progress(client);
+	}
+
+	if ((client->in_flight == 0) && all_issued(client)) {
+		client->finished = 1;
+		if (client->progress) {
+			printf("\n");
+		}
+	}
+	scsi_free_scsi_task(task);
+	free(xt->param);
+	free(xt);
+}
+
+static void xcopy_status_cb(struct iscsi_context *iscsi _U_, int status, void *command_data, void *private_data)
+{
+	struct client *client = private_data;
+	struct scsi_task *task = command_data;
+	struct scsi_copy_results_copy_status *cs;
+	struct xcopy_task *xt;
+
+	if (status != SCSI_STATUS_GOOD) {
+		/* the target can not report progress, stop asking */
+		client->xcopy_poll = 0;
+		scsi_free_scsi_task(task);
+		return;
+	}
+
+	cs = scsi_datain_unmarshall(task);
+	for (xt = client->xcopy_tasks; cs && xt; xt = xt->next) {
+		if (xt->list_id == task->cdb[2]) {
+			uint64_t bytes = cs->transfer_count;
+
+			if (cs->transfer_count_units <= 6) {
+				bytes <<= 10 * cs->transfer_count_units;
+			}
+			xt->copied = bytes / client->dst_blocksize;
+			if (xt->copied > xt->num_blocks) {
+				xt->copied = xt->num_blocks;
+			}
+			break;
+		}
+	}
+	if (client->progress && client->use_xcopy) {
+		xcopy_print_progress(client);
+	}
+	scsi_free_scsi_task(task);
+}
+
+/* Ask the copy manager how far each EXTENDED COPY in flight has come */
+static void xcopy_poll_status(struct client *client)
+{
+	struct xcopy_task *xt;
+
+	for (xt = client->xcopy_tasks; xt && client->xcopy_poll; xt = xt->next) {
+		struct scsi_task *task;
+
+		task = scsi_cdb_receive_copy_results(SCSI_COPY_RESULTS_COPY_STATUS,
+						     xt->list_id, 12);
+		if (task == NULL) {
+			return;
+		}
+		if (iscsi_scsi_command_async(client->dst_iscsi, client->dst_lun,
+					     task, xcopy_status_cb, NULL, client) != 0) {
+			scsi_free_scsi_task(task);
+			return;
+		}
+	}
+}
+
+static void populate_seg_desc_b2b(unsigned char *desc, int num_blocks,
+				  uint64_t src_lba, uint64_t dst_lba)
+{
+	desc[0] = BLK_TO_BLK_SEG_DESCR;
+	scsi_set_uint16(&desc[2], 0x18);
+	/* source is target descriptor 0, destination is 1 */
+	scsi_set_uint16(&desc[4], 0);
+	scsi_set_uint16(&desc[6], 1);
+	scsi_set_uint16(&desc[10], num_blocks);
+	scsi_set_uint64(&desc[12], src_lba);
+	scsi_set_uint64(&desc[20], dst_lba);
+}
+
+void fill_xcopy_queue(struct client *client)
+{
+	while (client->use_xcopy && client->in_flight < client->xcopy_max_in_flight
+	       && client->pos < client->src_num_blocks) {
+		struct xcopy_task *xt;
+		struct scsi_task *task;
+		struct iscsi_data data;
+		int i, seg_len;
+
+		xt = malloc(sizeof(struct xcopy_task));
+		if (xt == NULL) {
+			printf("failed to allocate xcopy task\n");
+			exit(10);
+		}
+		memset(xt, 0, sizeof(struct xcopy_task));
+		xt->client = client;
+		xt->lba = client->pos;
+
+		data.size = XCOPY_DESC_OFFSET + sizeof(client->xcopy_tgt_desc)
+			+ client->xcopy_segments * 0x1c;
+		data.data = xt->param = malloc(data.size);
+		if (xt->param == NULL) {
+			printf("failed to allocate xcopy parameter list\n");
+			exit(10);
+		}
+		memset(xt->param, 0, data.size);
+		memcpy(&xt->param[XCOPY_DESC_OFFSET], client->xcopy_tgt_desc,
+		       sizeof(client->xcopy_tgt_desc));
+
+		seg_len = 0;
+		for (i = 0; i < client->xcopy_segments && client->pos < client->src_num_blocks; i++) {
+			uint32_t num_blocks = client->xcopy_segment_blocks;
+
+			if (num_blocks > client->src_num_blocks - client->pos) {
+				num_blocks = client->src_num_blocks - client->pos;
+			}
+			populate_seg_desc_b2b(&xt->param[XCOPY_DESC_OFFSET
+					+ sizeof(client->xcopy_tgt_desc) + seg_len],
+					num_blocks, client->pos, client->pos);
+			seg_len += 0x1c;
+			client->pos += num_blocks;
+		}
+		xt->num_blocks = client->pos - xt->lba;
+		data.size = XCOPY_DESC_OFFSET + sizeof(client->xcopy_tgt_desc) + seg_len;
+
+		/* list ids are only used to poll for progress */
+		xt->list_id = client->xcopy_list_id++ & 0xff;
+		xt->param[0] = xt->list_id;
+		xt->param[1] = LIST_ID_USAGE_DISCARD << 3;
+		scsi_set_uint16(&xt->param[2], sizeof(client->xcopy_tgt_desc));
+		scsi_set_uint32(&xt->param[8], seg_len);
+
+		task = scsi_cdb_extended_copy(data.size);
+		if (task == NULL) {
+			printf("failed to create EXTENDED COPY cdb\n");
+			exit(10);
+		}
+		if (iscsi_scsi_command_async(client->dst_iscsi, client->dst_lun,
+					     task, xcopy_cb, &data, xt) != 0) {
+			printf("failed to send EXTENDED COPY command\n");
+			exit(10);
+		}
+		xt->next = client->xcopy_tasks;
+		client->xcopy_tasks = xt;
+		client->in_flight++;
+	}
+}
+
+/*
+ * Incremental sync.
+ *
+ * The same chunk is read from the source and the destination in parallel.
+ * If they differ, the runs of differing blocks are written to the
+ * destination, joining runs that are less than SYNC_MERGE_GAP blocks
+ * apart. --max limits the number of chunks being compared and
+ * --write-max the number of writes in flight.
+ */
+#define SYNC_MERGE_GAP 8
+
+static void sync_chunk_done(struct sync_chunk *chunk)
+{
+	struct client *client = chunk->client;
+
+	scsi_free_scsi_task(chunk->src_task);
+	scsi_free_scsi_task(chunk->dst_task);
+	free(chunk);
+	io_done(client);
+}
+
+void sync_write_cb(struct iscsi_context *iscsi, int status, void *command_data, void *private_data);
+
+static void sync_issue_writes(struct client *client)
+{
+	while (client->writes_in_flight < max_writes_in_flight
+	       && client->write_queue != NULL) {
+		struct sync_write *sw = client->write_queue;
+		struct scsi_task *task;
+
+		client->write_queue = sw->next;
+		if (client->write_queue == NULL) {
+			client->write_queue_tail = &client->write_queue;
+		}
+
+		if (client->use_16_for_rw) {
+			task = iscsi_write16_task(client->dst_iscsi, client->dst_lun,
+						  sw->lba, sw->data,
+						  sw->num_blocks * client->dst_blocksize,
+						  client->dst_blocksize, 0, 0, 0, 0, 0,
+						  sync_write_cb, sw);
+		} else {
+			task = iscsi_write10_task(client->dst_iscsi, client->dst_lun,
+						  sw->lba, sw->data,
+						  sw->num_blocks * client->dst_blocksize,
+						  client->dst_blocksize, 0, 0, 0, 0, 0,
+						  sync_write_cb, sw);
+		}
+		if (task == NULL) {
+			printf("failed to send write10/16 command\n");
+			exit(10);
+		}
+		client->writes_in_flight++;
+	}
+}
+
+void sync_write_cb(struct iscsi_context *iscsi, int status, void *command_data, void *private_data)
+{
+	struct sync_write *sw = private_data;
+	struct scsi_task *task = command_data;
+	struct sync_chunk *chunk = sw->chunk;
+	struct client *client = chunk->client;
+
+	if (status == SCSI_STATUS_CHECK_CONDITION) {
+		printf("Write10/16 failed with sense key:%d ascq:%04x\n", task->sense.key, task->sense.ascq);
+		exit(10);
+	}
+	if (status != SCSI_STATUS_GOOD) {
+		printf("Write10/16 failed with %s\n", iscsi_get_error(iscsi));
+		if (!client->ignore_errors) {
+			exit(10);
+		}
+	} else {
+		client->bytes_written += (uint64_t)sw->num_blocks * client->dst_blocksize;
+	}
+	scsi_free_scsi_task(task);
+	free(sw);
+
+	client->writes_in_flight--;
+	sync_issue_writes(client);
+
+	if (--chunk->writes == 0) {
+		sync_chunk_done(chunk);
+	}
+}
+
+static void sync_queue_write(struct sync_chunk *chunk, uint32_t first, uint32_t num_blocks)
+{
+	struct client *client = chunk->client;
+	struct sync_write *sw;
+
+	sw = malloc(sizeof(struct sync_write));
+	if (sw == NULL) {
+		printf("failed to allocate write\n");
+		exit(10);
+	}
+	sw->next = NULL;
+	sw->chunk = chunk;
+	sw->lba = chunk->lba + first;
+	sw->num_blocks = num_blocks;
+	sw->data = &chunk->src_task->datain.data[first * client->src_blocksize];
+
+	*client->write_queue_tail = sw;
+	client->write_queue_tail = &sw->next;
+	chunk->writes++;
+}
+
+/* Both halves of the chunk have been read, queue writes for the blocks
+ * that differ.
+ */
+static void sync_compare(struct sync_chunk *chunk)
+{
+	struct client *client = chunk->client;
+	unsigned char *src = chunk->src_task->datain.data;
+	unsigned char *dst = chunk->dst_task->datain.data;
+	uint32_t bs = client->src_blocksize;
+	uint32_t i, run_start = 0, run_end = 0;
+	int in_run = 0;
+
+	client->bytes_compared += (uint64_t)chunk->num_blocks * bs;
+
+	/* most chunks are unchanged, so compare all of it first */
+	if (memcmp(src, dst, chunk->num_blocks * bs)) {
+		for (i = 0; i < chunk->num_blocks; i++) {
+			if (!memcmp(&src[i * bs], &dst[i * bs], bs)) {
+				continue;
+			}
+			if (in_run && i - run_end < SYNC_MERGE_GAP) {
+				run_end = i + 1;
+				continue;
+			}
+			if (in_run) {
+				sync_queue_write(chunk, run_start, run_end - run_start);
+			}
+			in_run = 1;
+			run_start = i;
+			run_end = i + 1;
+		}
+		if (in_run) {
+			sync_queue_write(chunk, run_start, run_end - run_start);
+		}
+	}
+
+	if (chunk->writes == 0) {
+		sync_chunk_done(chunk);
+		return;
+	}
+	sync_issue_writes(client);
+}
+
+void sync_read_cb(struct iscsi_context *iscsi, int status, void *command_data, void *private_data)
+{
+	struct sync_chunk *chunk = private_data;
+	struct scsi_task *task = command_data;
+	struct client *client = chunk->client;
+
+	if (status == SCSI_STATUS_CHECK_CONDITION) {
+		printf("Read10/16 failed with sense key:%d ascq:%04x\n", task->sense.key, task->sense.ascq);
+		exit(10);
+	}
+	if (status != SCSI_STATUS_GOOD) {
+		printf("Read10/16 failed with %s\n", iscsi_get_error(iscsi));
+		exit(10);
+	}
+	if (task->datain.size < (int)(chunk->num_blocks * client->src_blocksize)) {
+		printf("Read10/16 returned short data\n");
+		exit(10);
+	}
+
+	if (iscsi == client->src_iscsi) {
+		chunk->src_task = task;
+	} else {
+		chunk->dst_task = task;
+	}
+	if (--chunk->reads == 0) {
+		sync_compare(chunk);
+	}
+}
+
+static void sync_read(struct client *client, struct iscsi_context *iscsi,
+		      int lun, struct sync_chunk *chunk)
+{
+	struct scsi_task *task;
+
+	if (client->use_16_for_rw) {
+		task = iscsi_read16_task(iscsi, lun, chunk->lba,
+					 chunk->num_blocks * client->src_blocksize,
+					 client->src_blocksize, 0, 0, 0, 0, 0,
+					 sync_read_cb, chunk);
+	} else {
+		task = iscsi_read10_task(iscsi, lun, chunk->lba,
+					 chunk->num_blocks * client->src_blocksize,
+					 client->src_blocksize, 0, 0, 0, 0, 0,
+					 sync_read_cb, chunk);
+	}
+	if (task == NULL) {
+		printf("failed to send read10/16 command\n");
+		exit(10);
+	}
+}
+
+void fill_sync_queue(struct client *client)
+{
+	while (client->in_flight < max_in_flight
+	       && client->pos < client->src_num_blocks) {
+		struct sync_chunk *chunk;
+
+		chunk = malloc(sizeof(struct sync_chunk));
+		if (chunk == NULL) {
+			printf("failed to allocate chunk\n");
+			exit(10);
+		}
+		memset(chunk, 0, sizeof(struct sync_chunk));
+		chunk->client = client;
+		chunk->lba = client->pos;
+		chunk->num_blocks = blocks_per_io;
+		if (chunk->num_blocks > client->src_num_blocks - client->pos) {
+			chunk->num_blocks = client->src_num_blocks - client->pos;
+		}
+		chunk->reads = 2;
+
+		sync_read(client, client->src_iscsi, client->src_lun, chunk);
+		sync_read(client, client->dst_iscsi, client->dst_lun, chunk);
+
+		client->in_flight++;
+		client->pos += chunk->num_blocks;
+	}
+}
+
+void fill_queue(struct client *client)
+{
+	if (client->sync) {
+		fill_sync_queue(client);
+		return;
+	}
+	if (client->use_xcopy) {
+		fill_xcopy_queue(client);
+	} else {
+		fill_read_queue(client);
+	}
+}
+
+/* Build an identification descriptor target descriptor for a LUN */
+static int xcopy_tgt_desc(struct iscsi_context *iscsi, int lun,
+			  int blocksize, unsigned char *desc)
+{
+	struct scsi_task *task;
+	struct scsi_inquiry_device_identification *inq;
+	struct scsi_inquiry_device_designator *desig, *best = NULL;
+
+	task = iscsi_inquiry_sync(iscsi, lun, 1,
+				  SCSI_INQUIRY_PAGECODE_DEVICE_IDENTIFICATION, 255);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		scsi_free_scsi_task(task);
+		return -1;
+	}
+	inq = scsi_datain_unmarshall(task);
+	if (inq == NULL) {
+		scsi_free_scsi_task(task);
+		return -1;
+	}
+
+	/* prefer NAA, then EUI-64, T10 and vendor specific designators */
+	for (desig = inq->designators; desig; desig = desig->next) {
+		if (desig->association != SCSI_ASSOCIATION_LOGICAL_UNIT
+		    || desig->designator_type > SCSI_DESIGNATOR_TYPE_NAA
+		    || desig->designator_length > 20) {
+			continue;
+		}
+		if (best == NULL || desig->designator_type > best->designator_type) {
+			best = desig;
+		}
+	}
+	if (best == NULL) {
+		scsi_free_scsi_task(task);
+		return -1;
+	}
+
+	memset(desc, 0, 32);
+	desc[0] = IDENT_DESCR_TGT_DESCR;
+	desc[1] = LU_ID_TYPE_LUN << 6;
+	desc[4] = best->code_set;
+	desc[5] = best->designator_type & 0x0f;
+	desc[7] = best->designator_length;
+	memcpy(&desc[8], best->designator, best->designator_length);
+	desc[29] = (blocksize >> 16) & 0xff;
+	desc[30] = (blocksize >> 8) & 0xff;
+	desc[31] = blocksize & 0xff;
+
+	scsi_free_scsi_task(task);
+	return 0;
+}
+
+/* Check that the copy manager of the destination can do the copy and
+ * size the EXTENDED COPY commands by its operating parameters.
+ */
+static int xcopy_init(struct client *client)
+{
+	struct scsi_task *task;
+	struct scsi_copy_results_op_params *op;
+	uint32_t max_blocks;
+	int segments;
+
+	task = scsi_cdb_receive_copy_results(SCSI_COPY_RESULTS_OP_PARAMS, 0, 1024);
+	if (task == NULL) {
+		return -1;
+	}
+	task = iscsi_scsi_command_sync(client->dst_iscsi, client->dst_lun, task, NULL);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "RECEIVE COPY RESULTS failed, EXTENDED COPY "
+			"not supported\n");
+		scsi_free_scsi_task(task);
+		return -1;
+	}
+	op = scsi_datain_unmarshall(task);
+	if (op == NULL || op->max_target_desc_count < 2
+	    || op->max_segment_desc_count < 1) {
+		fprintf(stderr, "copy manager can not do block to block copies\n");
+		scsi_free_scsi_task(task);
+		return -1;
+	}
+
+	max_blocks = 0xffff;
+	if (op->max_segment_length
+	    && op->max_segment_length / client->src_blocksize < max_blocks) {
+		max_blocks = op->max_segment_length / client->src_blocksize;
+	}
+	segments = 8;
+	if (op->max_segment_desc_count < segments) {
+		segments = op->max_segment_desc_count;
+	}
+	if (op->max_desc_list_length) {
+		int fit = ((int)op->max_desc_list_length
+			   - (int)sizeof(client->xcopy_tgt_desc)) / 0x1c;
+
+		if (fit < segments) {
+			segments = fit;
+		}
+	}
+	client->xcopy_max_in_flight = max_in_flight < 16 ? max_in_flight : 16;
+	if (op->total_concurrent_copies
+	    && op->total_concurrent_copies < client->xcopy_max_in_flight) {
+		client->xcopy_max_in_flight = op->total_concurrent_copies;
+	}
+	scsi_free_scsi_task(task);
+
+	if (max_blocks == 0 || segments < 1) {
+		fprintf(stderr, "copy manager limits are too small\n");
+		return -1;
+	}
+	client->xcopy_segment_blocks = max_blocks;
+	client->xcopy_segments = segments;
+
+	if (xcopy_tgt_desc(client->src_iscsi, client->src_lun,
+			   client->src_blocksize, &client->xcopy_tgt_desc[0]) != 0
+	    || xcopy_tgt_desc(client->dst_iscsi, client->dst_lun,
+			      client->dst_blocksize, &client->xcopy_tgt_desc[32]) != 0) {
+		fprintf(stderr, "no usable LUN designator for EXTENDED COPY\n");
+		return -1;
+	}
+	return 0;
 }
 
 int main(int argc, char *argv[])
@@ -196,6 +1201,7 @@ int main(int argc, char *argv[])
 	int c;
 	struct pollfd pfd[2];
 	struct client client;
+	time_t last_poll = 0;
 
 	static struct option long_options[] = {
 		{"dst",            required_argument,    NULL,        'd'},
@@ -206,13 +1212,17 @@ int main(int argc, char *argv[])
 		{"max",            required_argument,    NULL,        'm'},
 		{"blocks",         required_argument,    NULL,        'b'},
 		{"ignore-errors",  no_argument,          NULL,        'n'},
+		{"xcopy",          no_argument,          NULL,        'x'},
+		{"sparse",         no_argument,          NULL,        'S'},
+		{"sync",           no_argument,          NULL,        'y'},
+		{"write-max",      required_argument,    NULL,        'w'},
 		{0, 0, 0, 0}
 	};
 	int option_index;
 
 	memset(&client, 0, sizeof(client));
 
-	while ((c = getopt_long(argc, argv, "d:s:i:m:b:p6n", long_options,
+	while ((c = getopt_long(argc, argv, "d:s:i:m:b:p6nxSyw:", long_options,
 			&option_index)) != -1) {
 		switch (c) {
 		case 'd':
@@ -239,6 +1249,18 @@ int main(int argc, char *argv[])
 		case 'n':
 			client.ignore_errors = 1;
 			break;
+		case 'x':
+			client.use_xcopy = 1;
+			break;
+		case 'S':
+			client.sparse = 1;
+			break;
+		case 'y':
+			client.sync = 1;
+			break;
+		case 'w':
+			max_writes_in_flight = atoi(optarg);
+			break;
 		default:
 			fprintf(stderr, "Unrecognized option '%c'\n\n", c);
 			exit(1);
@@ -370,9 +1392,35 @@ int main(int argc, char *argv[])
 		exit(10);
 	}
 
-	fill_read_queue(&client);
+	client.write_queue_tail = &client.write_queue;
+	if (client.sync && (client.use_xcopy || client.sparse)) {
+		fprintf(stderr, "--xcopy and --sparse are ignored with --sync\n");
+		client.use_xcopy = 0;
+		client.sparse = 0;
+	}
+
+	if (client.use_xcopy) {
+		if (xcopy_init(&client) != 0) {
+			fprintf(stderr, "Falling back to READ/WRITE\n");
+			client.use_xcopy = 0;
+		}
+		client.xcopy_poll = client.progress;
+	}
+
+	if (client.sparse) {
+		client.sparse = 0;
+		if (client.use_xcopy) {
+			fprintf(stderr, "--sparse is ignored with --xcopy\n");
+		} else if (sparse_init(&client) != 0) {
+			fprintf(stderr, "Copying all blocks\n");
+		}
+	}
+
+	fill_queue(&client);
 
 	while (client.finished == 0) {
+		int timeout = -1;
+
 		pfd[0].fd = iscsi_get_fd(client.src_iscsi);
 		pfd[0].events = iscsi_which_events(client.src_iscsi);
 		pfd[1].fd = iscsi_get_fd(client.dst_iscsi);
@@ -383,7 +1431,16 @@ int main(int argc, char *argv[])
 			continue;
 		}
 
-		if (poll(&pfd[0], 2, -1) < 0) {
+		/* poll the copy manager for progress once a second */
+		if (client.use_xcopy && client.xcopy_poll) {
+			if (time(NULL) - last_poll >= 1) {
+				xcopy_poll_status(&client);
+				last_poll = time(NULL);
+			}
+			timeout = 1000;
+		}
+
+		if (poll(&pfd[0], 2, timeout) < 0) {
 			printf("Poll failed");
 			exit(10);
 		}
@@ -397,6 +1454,18 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (client.sync) {
+		printf("%"PRIu64" bytes compared, %"PRIu64" bytes written\n",
+		       client.bytes_compared, client.bytes_written);
+	}
+
+	if (client.sparse) {
+		printf("%"PRIu64" of %"PRIu64" blocks were not allocated on the source and were not copied\n",
+		       client.skipped, client.src_num_blocks);
+		iscsi_unmap_batch_destroy(client.dst_unmap);
+		free(client.zero_block);
+	}
+
 	iscsi_logout_sync(client.src_iscsi);
 	iscsi_destroy_context(client.src_iscsi);
 	iscsi_logout_sync(client.dst_iscsi);
@@ -55,6 +55,8 @@ struct iscsi_fd_list {
        int get_lba_status;
        struct scsi_lba_status_descriptor lbasd_cached;
        int lbasd_cache_valid;
+       struct iscsi_readahead *ra;
+       struct iscsi_writeback *wb;
 };
 
 static struct iscsi_fd_list iscsi_fd_list[ISCSI_MAX_FD];
@@ -150,6 +152,49 @@ int open(const char *path, int flags, mode_t mode)
 			}
 		}
 
+		if (getenv("LD_ISCSI_READAHEAD") != NULL) {
+			int window = atoi(getenv("LD_ISCSI_READAHEAD"));
+			uint32_t chunk_size = 262144;
+
+			if (getenv("LD_ISCSI_READAHEAD_SIZE") != NULL) {
+				chunk_size = strtoul(getenv("LD_ISCSI_READAHEAD_SIZE"), NULL, 0);
+			}
+			chunk_size -= chunk_size % rc16->block_length;
+			if (window > 0) {
+				iscsi_fd_list[fd].ra = iscsi_readahead_create(iscsi, iscsi_url->lun, rc16->block_length, rc16->returned_lba + 1, window, chunk_size);
+				if (iscsi_fd_list[fd].ra == NULL) {
+					LD_ISCSI_DPRINTF(0,"Failed to set up read-ahead: %s", iscsi_get_error(iscsi));
+				} else {
+					LD_ISCSI_DPRINTF(1,"Read-ahead of %d x %u bytes enabled", window, chunk_size);
+				}
+			}
+		}
+
+		if (getenv("LD_ISCSI_WRITEBACK") != NULL) {
+			size_t max_dirty = strtoul(getenv("LD_ISCSI_WRITEBACK"), NULL, 0);
+			uint32_t flush_size = 1024 * 1024;
+
+			if (getenv("LD_ISCSI_WRITEBACK_FLUSH") != NULL) {
+				flush_size = strtoul(getenv("LD_ISCSI_WRITEBACK_FLUSH"), NULL, 0);
+			}
+			flush_size -= flush_size % rc16->block_length;
+			if (flush_size > max_dirty) {
+				flush_size = max_dirty - max_dirty % rc16->block_length;
+			}
+			if (max_dirty > 0) {
+				iscsi_fd_list[fd].wb = iscsi_writeback_create(iscsi, iscsi_url->lun, rc16->block_length, rc16->returned_lba + 1, max_dirty, flush_size);
+				if (iscsi_fd_list[fd].wb == NULL) {
+					LD_ISCSI_DPRINTF(0,"Failed to set up write-back: %s", iscsi_get_error(iscsi));
+				} else {
+					LD_ISCSI_DPRINTF(1,"Write-back of up to %lu bytes in %u byte writes enabled", (unsigned long)max_dirty, flush_size);
+					/* never read ahead data that is only in the write-back cache */
+					if (iscsi_fd_list[fd].ra != NULL) {
+						iscsi_readahead_set_writeback(iscsi_fd_list[fd].ra, iscsi_fd_list[fd].wb);
+					}
+				}
+			}
+		}
+
 		scsi_free_scsi_task(task);
 		iscsi_destroy_url(iscsi_url);
 
@@ -169,7 +214,7 @@ int (*real_close)(int fd);
 int close(int fd)
 {
 	if (iscsi_fd_list[fd].is_iscsi == 1) {
-		int i;
+		int i, ret = 0;
 
 		if (iscsi_fd_list[fd].dup2fd >= 0) {
 			iscsi_fd_list[fd].is_iscsi = 0;
@@ -210,10 +255,23 @@ int close(int fd)
 
 		iscsi_fd_list[fd].is_iscsi = 0;
 		iscsi_fd_list[fd].dup2fd   = -1;
+		if (iscsi_fd_list[fd].ra != NULL) {
+			iscsi_readahead_set_writeback(iscsi_fd_list[fd].ra, NULL);
+		}
+		if (iscsi_writeback_destroy(iscsi_fd_list[fd].wb) != 0) {
+			LD_ISCSI_DPRINTF(0,"write-back failed: %s", iscsi_get_error(iscsi_fd_list[fd].iscsi));
+			ret = -1;
+		}
+		iscsi_fd_list[fd].wb       = NULL;
+		iscsi_readahead_destroy(iscsi_fd_list[fd].ra);
+		iscsi_fd_list[fd].ra       = NULL;
 		iscsi_destroy_context(iscsi_fd_list[fd].iscsi);
 		iscsi_fd_list[fd].iscsi    = NULL;
 
-		return 0;
+		if (ret != 0) {
+			errno = EIO;
+		}
+		return ret;
 	}
 
         return real_close(fd);
@@ -325,6 +383,14 @@ ssize_t read(int fd, void *buf, size_t count)
 		}
 
 		iscsi_fd_list[fd].in_flight = 1;
+		if (iscsi_fd_list[fd].wb != NULL) {
+			if (iscsi_writeback_flush_range(iscsi_fd_list[fd].wb, iscsi_fd_list[fd].offset, count) != 0) {
+				LD_ISCSI_DPRINTF(0,"failed to flush write-back: %s", iscsi_get_error(iscsi_fd_list[fd].iscsi));
+				iscsi_fd_list[fd].in_flight = 0;
+				errno = EIO;
+				return -1;
+			}
+		}
         if (iscsi_fd_list[fd].get_lba_status != 0) {
 			uint32_t i;
 			uint32_t _num_allocated=0;
@@ -384,6 +450,21 @@ ssize_t read(int fd, void *buf, size_t count)
 			}
 		}
 
+		if (iscsi_fd_list[fd].ra != NULL) {
+			int ret;
+
+			LD_ISCSI_DPRINTF(4,"readahead_read: lun %d, offset: %"PRIu64" count: %lu",iscsi_fd_list[fd].lun,(uint64_t)iscsi_fd_list[fd].offset,(unsigned long)count);
+			ret = iscsi_readahead_read(iscsi_fd_list[fd].ra, iscsi_fd_list[fd].offset, buf, count);
+			iscsi_fd_list[fd].in_flight = 0;
+			if (ret < 0) {
+				LD_ISCSI_DPRINTF(0,"read-ahead read failed: %s", iscsi_get_error(iscsi_fd_list[fd].iscsi));
+				errno = EIO;
+				return -1;
+			}
+			iscsi_fd_list[fd].offset += ret;
+			return ret;
+		}
+
 		LD_ISCSI_DPRINTF(4,"read16_sync: lun %d, lba %"PRIu64", num_blocks: %"PRIu64", block_size: %d, offset: %"PRIu64" count: %lu",iscsi_fd_list[fd].lun,lba,num_blocks,iscsi_fd_list[fd].block_size,offset,(unsigned long)count);
 
 		task = iscsi_read16_sync(iscsi_fd_list[fd].iscsi, iscsi_fd_list[fd].lun, lba, num_blocks * iscsi_fd_list[fd].block_size, iscsi_fd_list[fd].block_size, 0, 0, 0, 0, 0);
@@ -448,6 +529,9 @@ ssize_t write(int fd, const void *buf, size_t count)
 		}
 
                 iscsi_fd_list[fd].lbasd_cache_valid = 0;
+		if (iscsi_fd_list[fd].ra != NULL) {
+			iscsi_readahead_invalidate(iscsi_fd_list[fd].ra, iscsi_fd_list[fd].offset, count);
+		}
 
 		offset = iscsi_fd_list[fd].offset;
 		num_blocks = count/iscsi_fd_list[fd].block_size;
@@ -464,6 +548,20 @@ ssize_t write(int fd, const void *buf, size_t count)
 		}
 
 		iscsi_fd_list[fd].in_flight = 1;
+		if (iscsi_fd_list[fd].wb != NULL) {
+			int ret;
+
+			LD_ISCSI_DPRINTF(4,"writeback_write: lun %d, lba %"PRIu64", num_blocks: %"PRIu64", block_size: %d, offset: %"PRIu64" count: %lu",iscsi_fd_list[fd].lun,lba,num_blocks,iscsi_fd_list[fd].block_size,offset,(unsigned long)count);
+			ret = iscsi_writeback_write(iscsi_fd_list[fd].wb, offset, buf, count);
+			iscsi_fd_list[fd].in_flight = 0;
+			if (ret < 0) {
+				LD_ISCSI_DPRINTF(0,"write-back write failed: %s", iscsi_get_error(iscsi_fd_list[fd].iscsi));
+				errno = EIO;
+				return -1;
+			}
+			iscsi_fd_list[fd].offset += count;
+			return count;
+		}
 		LD_ISCSI_DPRINTF(4,"write16_sync: lun %d, lba %"PRIu64", num_blocks: %"PRIu64", block_size: %d, offset: %"PRIu64" count: %lu",iscsi_fd_list[fd].lun,lba,num_blocks,iscsi_fd_list[fd].block_size,offset,(unsigned long)count);
 		task = iscsi_write16_sync(iscsi_fd_list[fd].iscsi, iscsi_fd_list[fd].lun, lba, (unsigned char *) buf, count, iscsi_fd_list[fd].block_size, 0, 0, 0, 0, 0);
 		iscsi_fd_list[fd].in_flight = 0;
@@ -503,6 +601,51 @@ ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset) {
 	return real_pwrite(fd, buf, count, offset);
 }
 
+int (*real_fsync)(int fd);
+int (*real_fdatasync)(int fd);
+
+int fsync(int fd)
+{
+	if (iscsi_fd_list[fd].is_iscsi == 1) {
+		struct scsi_task *task;
+
+		if (iscsi_fd_list[fd].dup2fd >= 0) {
+			return fsync(iscsi_fd_list[fd].dup2fd);
+		}
+
+		if (iscsi_fd_list[fd].wb != NULL) {
+			if (iscsi_writeback_sync(iscsi_fd_list[fd].wb) != 0) {
+				LD_ISCSI_DPRINTF(0,"write-back sync failed: %s", iscsi_get_error(iscsi_fd_list[fd].iscsi));
+				errno = EIO;
+				return -1;
+			}
+			return 0;
+		}
+
+		LD_ISCSI_DPRINTF(4,"synchronizecache16_sync: lun %d",iscsi_fd_list[fd].lun);
+		task = iscsi_synchronizecache16_sync(iscsi_fd_list[fd].iscsi, iscsi_fd_list[fd].lun, 0, 0, 0, 0);
+		if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+			LD_ISCSI_DPRINTF(0,"failed to send synchronizecache16 command");
+			scsi_free_scsi_task(task);
+			errno = EIO;
+			return -1;
+		}
+		scsi_free_scsi_task(task);
+		return 0;
+	}
+
+	return real_fsync(fd);
+}
+
+int fdatasync(int fd)
+{
+	if (iscsi_fd_list[fd].is_iscsi == 1) {
+		return fsync(fd);
+	}
+
+	return real_fdatasync(fd);
+}
+
 int (*real_dup2)(int oldfd, int newfd);
 
 int dup2(int oldfd, int newfd)
@@ -655,6 +798,18 @@ static void __attribute__((constructor)) _init(void)
 		exit(10);
 	}
 
+	real_fsync = dlsym(RTLD_NEXT, "fsync");
+	if (real_fsync == NULL) {
+		LD_ISCSI_DPRINTF(0,"Failed to dlsym(fsync)");
+		exit(10);
+	}
+
+	real_fdatasync = dlsym(RTLD_NEXT, "fdatasync");
+	if (real_fdatasync == NULL) {
+		LD_ISCSI_DPRINTF(0,"Failed to dlsym(fdatasync)");
+		exit(10);
+	}
+
 	real_dup2 = dlsym(RTLD_NEXT, "dup2");
 	if (real_dup2 == NULL) {
 		LD_ISCSI_DPRINTF(0,"Failed to dlsym(dup2)");
@@ -18,6 +18,7 @@
 #define __iscsi_private_h__
 
 #include <stdint.h>
+#include <string.h>
 #include <time.h>
 
 #if defined(WIN32)
@@ -25,6 +26,10 @@
 #define ssize_t SSIZE_T
 #endif
 
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -56,6 +61,9 @@ struct iscsi_in_pdu {
 
 	long long data_pos;
 	unsigned char *data;
+
+	/* when the header was read, see iscsi_set_stats_latency() */
+	uint64_t hdr_ns;
 };
 void iscsi_free_iscsi_in_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in);
 void iscsi_free_iscsi_inqueue(struct iscsi_context *iscsi, struct iscsi_in_pdu *inqueue);
@@ -66,6 +74,22 @@ void iscsi_free_iscsi_inqueue(struct iscsi_context *iscsi, struct iscsi_in_pdu *
 /* max length of chap challange */
 #define MAX_CHAP_C_LENGTH 2048
 
+/* The parts of the Block Limits VPD page that the library itself makes
+ * use of. Lengths are in logical blocks.
+ */
+struct iscsi_block_limits {
+	int valid;
+	uint32_t max_xfer_len;
+	uint32_t opt_xfer_len;
+	uint32_t opt_gran;
+	uint32_t max_unmap;
+	uint32_t max_unmap_bdc;
+	uint32_t opt_unmap_gran;
+	uint32_t unmap_gran_align;
+	int ugavalid;
+	uint64_t max_ws_len;
+};
+
 struct iscsi_context {
 	char initiator_name[MAX_STRING_SIZE+1];
 	char target_name[MAX_STRING_SIZE+1];
@@ -128,6 +152,30 @@ struct iscsi_context {
 	struct iscsi_pdu *outqueue_current;
 	struct iscsi_pdu *waitpdu;
 
+	/* SCSI commands waiting for the CmdSN window to open, one list
+	 * per task priority. These do not have a CmdSN assigned yet.
+	 */
+	struct iscsi_pdu *pendingqueue[ISCSI_TASK_PRIORITY_HIGH + 1];
+	enum iscsi_task_priority task_priority;
+	unsigned char task_attr[ISCSI_TASK_PRIORITY_HIGH + 1];
+	int starvation_limit;
+	int starvation_cnt;
+
+	/* Block Limits VPD of the LUN, read at login when READ/WRITE
+	 * splitting is enabled. It only applies to commands for that LUN,
+	 * iscsi->lun.
+	 */
+	int split_io;
+	int split_io_opt_multiple;
+	struct iscsi_block_limits block_limits;
+
+	/* Zero runs of at least zero_detect blocks in WRITEs to iscsi->lun
+	 * are sent as WRITE SAME16. zero_unmap is set from the Logical
+	 * Block Provisioning VPD of that LUN at login.
+	 */
+	uint32_t zero_detect;
+	int zero_unmap;
+
 	struct iscsi_in_pdu *incoming;
 	struct iscsi_in_pdu *inqueue;
 
@@ -163,6 +211,27 @@ struct iscsi_context {
 	struct iscsi_context *old_iscsi;
 	int retry_cnt;
 	int no_ua_on_reconnect;
+
+	struct iscsi_stats stats;
+	int stats_latency;
+	/* of the last task a PDU was received for, see
+	 * iscsi_get_task_timing()
+	 */
+	struct scsi_task *timing_task;
+	uint32_t timing_itt;
+	struct scsi_task_timing task_timing;
+	uint64_t cmdsn_blocked_since;
+
+	iscsi_trace_fn trace_fn;
+	void *trace_private_data;
+
+	struct iscsi_log_ring *log_ring;
+	struct iscsi_pcap *pcap;
+	struct iscsi_buffer_pool *buffer_pool;
+
+	/* see iscsi_init_pdu_templates() */
+	unsigned char scsi_command_template[ISCSI_RAW_HEADER_SIZE];
+	unsigned char data_out_template[ISCSI_RAW_HEADER_SIZE];
 };
 
 #define ISCSI_PDU_IMMEDIATE		       0x40
@@ -255,12 +324,24 @@ struct iscsi_pdu {
 	uint32_t payload_len;      /* Amount of payload data to write */
 	uint32_t payload_written;  /* How much of the payload we have written */
 
+	/* A Data-Out PDU can carry a whole burst, sent as one Data-Out PDU
+	 * per segment with the header advanced in place, see
+	 * iscsi_send_data_out(). Zero for all other PDUs.
+	 */
+	uint32_t burst_end;        /* Offset the burst ends at */
+	uint32_t segment_len;      /* Largest payload of a segment */
 
 	struct iscsi_data indata;
 
 	struct iscsi_scsi_cbdata scsi_cbdata;
 	time_t scsi_timeout;
 	uint32_t expxferlen;
+	enum iscsi_task_priority priority;
+
+	/* for the latency histograms, see iscsi_set_stats_latency() */
+	uint64_t queued_ns;
+	uint64_t write_start_ns;
+	uint64_t sent_ns;
 };
 
 struct iscsi_pdu *iscsi_allocate_pdu(struct iscsi_context *iscsi,
@@ -268,6 +349,41 @@ struct iscsi_pdu *iscsi_allocate_pdu(struct iscsi_context *iscsi,
 				     enum iscsi_opcode response_opcode,
 				     uint32_t itt,
 				     uint32_t flags);
+struct iscsi_pdu *iscsi_allocate_pdu_from_template(struct iscsi_context *iscsi,
+		const unsigned char *hdr, enum iscsi_opcode response_opcode,
+		uint32_t itt, uint32_t flags);
+void iscsi_init_pdu_templates(struct iscsi_context *iscsi);
+
+/* Big endian stores for the fields of the PDU headers, as a byte swap
+ * and a single store where the compiler provides one.
+ */
+static inline void
+iscsi_set_be32(unsigned char *c, uint32_t val)
+{
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && \
+	__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	val = __builtin_bswap32(val);
+	memcpy(c, &val, sizeof(val));
+#else
+	c[0] = val >> 24;
+	c[1] = val >> 16;
+	c[2] = val >> 8;
+	c[3] = val;
+#endif
+}
+
+static inline void
+iscsi_set_be16(unsigned char *c, uint16_t val)
+{
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && \
+	__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	val = __builtin_bswap16(val);
+	memcpy(c, &val, sizeof(val));
+#else
+	c[0] = val >> 8;
+	c[1] = val;
+#endif
+}
 void iscsi_free_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
 void iscsi_pdu_set_pduflags(struct iscsi_pdu *pdu, unsigned char flags);
 void iscsi_pdu_set_immediate(struct iscsi_pdu *pdu);
@@ -334,12 +450,19 @@ struct scsi_iovector *iscsi_get_scsi_task_iovector_in(struct iscsi_context *iscs
 struct scsi_iovector *iscsi_get_scsi_task_iovector_out(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
 void scsi_task_reset_iov(struct scsi_iovector *iovector);
 
+/* go through the allocator set with iscsi_set_allocator() */
+void *iscsi_mem_malloc(size_t size);
+void *iscsi_mem_realloc(void *ptr, size_t size);
+void iscsi_mem_free(void *ptr);
+char *iscsi_mem_strdup(const char *str);
+
 void* iscsi_malloc(struct iscsi_context *iscsi, size_t size);
 void* iscsi_zmalloc(struct iscsi_context *iscsi, size_t size);
 void* iscsi_realloc(struct iscsi_context *iscsi, void* ptr, size_t size);
 void iscsi_free(struct iscsi_context *iscsi, void* ptr);
 char* iscsi_strdup(struct iscsi_context *iscsi, const char* str);
 void* iscsi_szmalloc(struct iscsi_context *iscsi, size_t size);
+void* iscsi_smalloc(struct iscsi_context *iscsi, size_t size);
 void iscsi_sfree(struct iscsi_context *iscsi, void* ptr);
 
 unsigned long crc32c(char *buf, int len);
@@ -360,9 +483,20 @@ void iscsi_decrement_iface_rr(void);
 void
 iscsi_log_message(struct iscsi_context *iscsi, int level, const char *format, ...);
 
+void iscsi_log_ring_dump(struct iscsi_context *iscsi, const char *reason);
+void iscsi_log_ring_free(struct iscsi_context *iscsi);
+
 void
 iscsi_add_to_outqueue(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
 
+void iscsi_dispatch_pending_commands(struct iscsi_context *iscsi);
+int iscsi_sync_poll(struct iscsi_context *iscsi, int timeout);
+
+int iscsi_is_zero(const unsigned char *buf, size_t len);
+
+int iscsi_writeback_cached(struct iscsi_writeback *wb, uint64_t offset,
+			   uint64_t count);
+
 int iscsi_serial32_compare(uint32_t s1, uint32_t s2);
 
 uint32_t iscsi_itt_post_increment(struct iscsi_context *iscsi);
@@ -372,6 +506,68 @@ void iscsi_timeout_scan(struct iscsi_context *iscsi);
 void iscsi_reconnect_cb(struct iscsi_context *iscsi _U_, int status,
                         void *command_data, void *private_data);
 
+uint64_t iscsi_clock_ns(void);
+void iscsi_stats_latency_record(struct iscsi_latency_histogram *h, uint64_t ns);
+void iscsi_stats_scsi_status(struct iscsi_context *iscsi, int status);
+void iscsi_stats_cmdsn_window(struct iscsi_context *iscsi);
+
+/*
+ * Tracepoints, see iscsi_set_trace_callback(). The USDT probe is named
+ * after the tracepoint and the callback is only called when one is set.
+ */
+#ifdef HAVE_SYS_SDT_H
+#define ISCSI_PROBE(name, iscsi, itt, sn, opcode, lun, length, status) \
+	DTRACE_PROBE7(libiscsi, name, iscsi, itt, sn, opcode, lun, length, status)
+#else
+#define ISCSI_PROBE(name, iscsi, itt, sn, opcode, lun, length, status)
+#endif
+
+#define ISCSI_TRACE(iscsi, name, point, itt, sn, opcode, lun, length, status) \
+	do { \
+		ISCSI_PROBE(name, iscsi, itt, sn, opcode, lun, length, status); \
+		if (iscsi->trace_fn) { \
+			iscsi_trace(iscsi, point, itt, sn, opcode, lun, length, status); \
+		} \
+	} while (0)
+
+/* PDUs we send */
+#define ISCSI_TRACE_PDU(iscsi, name, point, pdu) \
+	ISCSI_TRACE(iscsi, name, point, (pdu)->itt, (pdu)->cmdsn, \
+		    (pdu)->outdata.data[0] & 0x3f, \
+		    scsi_get_uint16(&(pdu)->outdata.data[8]), \
+		    iscsi_get_pdu_data_size((pdu)->outdata.data), 0)
+
+/* PDUs we receive */
+#define ISCSI_TRACE_IN_PDU(iscsi, name, point, in) \
+	ISCSI_TRACE(iscsi, name, point, scsi_get_uint32(&(in)->hdr[16]), \
+		    scsi_get_uint32(&(in)->hdr[24]), (in)->hdr[0] & 0x3f, \
+		    scsi_get_uint16(&(in)->hdr[8]), \
+		    iscsi_get_pdu_data_size((in)->hdr), 0)
+
+void iscsi_pcap_pdu_out(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+void iscsi_pcap_pdu_in(struct iscsi_context *iscsi, struct iscsi_in_pdu *in);
+void iscsi_pcap_free(struct iscsi_context *iscsi);
+
+/* memory that is released with the task, see scsi_malloc() */
+struct scsi_allocated_memory {
+	struct scsi_allocated_memory *next;
+	/* releases memory that did not come from scsi_malloc() */
+	void (*free)(struct scsi_task *task, struct scsi_allocated_memory *mem);
+	char buf[0];
+};
+
+unsigned char *iscsi_buffer_pool_get(struct iscsi_buffer_pool *pool);
+void iscsi_buffer_pool_put(struct iscsi_buffer_pool *pool, unsigned char *buf);
+unsigned char *iscsi_buffer_pool_datain(struct iscsi_context *iscsi,
+					struct scsi_task *task);
+int iscsi_buffer_pool_task(struct scsi_task *task);
+void iscsi_buffer_pool_release_datain(struct scsi_task *task);
+void iscsi_buffer_pool_free(struct iscsi_context *iscsi);
+
+void iscsi_trace(struct iscsi_context *iscsi, enum iscsi_trace_point point,
+		 uint32_t itt, uint32_t sn, uint8_t opcode, uint32_t lun,
+		 uint32_t length, int status);
+
 #ifdef __cplusplus
 }
 #endif
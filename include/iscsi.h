@@ -39,6 +39,12 @@ struct sockaddr;
 /* FEATURES */
 #define LIBISCSI_FEATURE_IOVECTOR (1)
 #define LIBISCSI_FEATURE_NOP_COUNTER (1)
+#define LIBISCSI_FEATURE_STATS (1)
+#define LIBISCSI_FEATURE_TRACE (1)
+#define LIBISCSI_FEATURE_LOG_RING (1)
+#define LIBISCSI_FEATURE_PCAP (1)
+#define LIBISCSI_FEATURE_ALLOCATOR (1)
+#define LIBISCSI_FEATURE_BUFFER_POOL (1)
 
 #define MAX_STRING_SIZE (255)
 
@@ -53,6 +59,85 @@ struct sockaddr;
 
 EXTERN void iscsi_set_cache_allocations(struct iscsi_context *iscsi, int ca);
 
+/*
+ * Replace malloc(), realloc() and free() for all memory allocated by
+ * libiscsi: contexts, PDUs, receive buffers, tasks and the data and sense
+ * buffers hanging off them, URLs and discovery data. private_data is
+ * passed to every call. The allocator is process wide since tasks are
+ * created and freed without a context. Pass NULL for all three callbacks
+ * to go back to the C library.
+ *
+ * This must be called before any other libiscsi function and must not be
+ * called again while anything allocated through the previous allocator
+ * is still around. With contexts used from more than one thread the
+ * callbacks must be thread safe.
+ *
+ * Ownership:
+ * Memory libiscsi hands to the application is released through libiscsi,
+ * e.g. scsi_free_scsi_task(), iscsi_destroy_url(),
+ * iscsi_free_discovery_data() and iscsi_destroy_context(), and so ends up
+ * in free_fn. A buffer the application stores in task->datain.data must
+ * come from malloc_fn since scsi_free_scsi_task() frees it.
+ * Buffers the application passes in, such as the data of a write or
+ * those added with scsi_task_add_data_in_buffer(), remain owned by the
+ * application and are never freed by libiscsi.
+ *
+ * Returns:
+ *  0: success
+ * -1: only some of the callbacks were given
+ */
+typedef void *(*iscsi_malloc_fn)(size_t size, void *private_data);
+typedef void *(*iscsi_realloc_fn)(void *ptr, size_t size, void *private_data);
+typedef void (*iscsi_free_fn)(void *ptr, void *private_data);
+
+EXTERN int iscsi_set_allocator(iscsi_malloc_fn malloc_fn, iscsi_free_fn free_fn,
+			       iscsi_realloc_fn realloc_fn, void *private_data);
+
+/*
+ * A pool of count I/O buffers of buffer_size bytes each, rounded up to a
+ * multiple of the page size and page aligned. The buffers are carved from
+ * one region mapped from 2 MiB huge pages when the system has some
+ * reserved, and from transparent huge pages otherwise. They are handed out and
+ * taken back without going through the allocator.
+ *
+ * Flags:
+ * ISCSI_BUFFER_POOL_MLOCK:   lock the buffers in memory.
+ * ISCSI_BUFFER_POOL_DATA_IN: read tasks that have no iovector of their own
+ *                            when their data arrives, and that fit in a
+ *                            buffer, receive straight into a buffer of the
+ *                            pool. It is task->datain.data and goes back
+ *                            to the pool in scsi_free_scsi_task(). When
+ *                            the pool is empty the data is collected the
+ *                            usual way and iscsi_stats.buffer_pool_empty
+ *                            is incremented.
+ *
+ * A count of 0 removes the pool. The pool can only be removed or replaced
+ * while all its buffers are free. Tasks still holding a buffer when the
+ * context is destroyed keep the pool alive until they are freed.
+ *
+ * The pool is not locked, buffers must be taken and returned, and tasks
+ * holding one freed, from the thread that services the context.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+#define ISCSI_BUFFER_POOL_MLOCK   0x01
+#define ISCSI_BUFFER_POOL_DATA_IN 0x02
+
+EXTERN int iscsi_set_buffer_pool(struct iscsi_context *iscsi,
+				 size_t buffer_size, int count, int flags);
+
+/*
+ * The size of the buffers of the pool, or 0 when there is no pool.
+ */
+EXTERN size_t iscsi_buffer_size(struct iscsi_context *iscsi);
+
+/*
+ * Take a buffer from the pool, or NULL when there is no pool or all
+ * buffers are in use. Return it with iscsi_buffer_put().
+ */
+EXTERN void *iscsi_buffer_get(struct iscsi_context *iscsi);
+EXTERN void iscsi_buffer_put(struct iscsi_context *iscsi, void *buf);
+
 /*
  * The following three functions are used to integrate libiscsi in an event
  * system.
@@ -88,6 +173,248 @@ EXTERN int iscsi_queue_length(struct iscsi_context *iscsi);
 EXTERN int iscsi_out_queue_length(struct iscsi_context *iscsi);
 
 
+/************************************************************
+ * Statistics.
+ ************************************************************/
+#define ISCSI_STATS_OPCODES 64
+#define ISCSI_STATS_LATENCY_OPCODES 8
+#define ISCSI_STATS_LATENCY_BUCKETS 32
+
+/* completed SCSI commands are counted by the status they completed with */
+enum iscsi_stats_status {
+	ISCSI_STATS_GOOD                 = 0,
+	ISCSI_STATS_CHECK_CONDITION      = 1,
+	ISCSI_STATS_CONDITION_MET        = 2,
+	ISCSI_STATS_BUSY                 = 3,
+	ISCSI_STATS_RESERVATION_CONFLICT = 4,
+	ISCSI_STATS_TASK_SET_FULL        = 5,
+	ISCSI_STATS_ACA_ACTIVE           = 6,
+	ISCSI_STATS_TASK_ABORTED         = 7,
+	ISCSI_STATS_CANCELLED            = 8,
+	ISCSI_STATS_ERROR                = 9,
+	ISCSI_STATS_TIMEOUT              = 10,
+	ISCSI_STATS_NUM_STATUS           = 11
+};
+
+/*
+ * Latencies in microseconds. Bucket i counts the latencies below 2^i us
+ * that are not counted in a lower bucket, the last bucket counts all
+ * longer ones.
+ */
+struct iscsi_latency_histogram {
+	uint64_t count;
+	uint64_t sum_us;
+	uint64_t max_us;
+	uint64_t buckets[ISCSI_STATS_LATENCY_BUCKETS];
+};
+
+struct iscsi_stats {
+	/* PDUs and bytes sent and received, indexed by the iSCSI opcode.
+	 * Bytes include the header, digests and padding.
+	 */
+	uint64_t pdus_out[ISCSI_STATS_OPCODES];
+	uint64_t bytes_out[ISCSI_STATS_OPCODES];
+	uint64_t pdus_in[ISCSI_STATS_OPCODES];
+	uint64_t bytes_in[ISCSI_STATS_OPCODES];
+
+	/* SCSI commands completed, indexed by enum iscsi_stats_status */
+	uint64_t scsi_status[ISCSI_STATS_NUM_STATUS];
+
+	uint64_t r2ts;
+	/* SCSI commands that were sent again after a reconnect */
+	uint64_t retries;
+	/* reconnects that were started */
+	uint64_t reconnects;
+	/* PDUs that timed out, see iscsi_set_timeout() */
+	uint64_t timeouts;
+	/* PDUs left out of the capture because the writer fell behind,
+	 * see iscsi_set_pcap_capture()
+	 */
+	uint64_t pcap_dropped;
+
+	/* buffers that could not be taken from the buffer pool because all
+	 * of them were in use, see iscsi_set_buffer_pool()
+	 */
+	uint64_t buffer_pool_empty;
+
+	/* How often and for how long SCSI commands had to wait because the
+	 * CmdSN window of the target was closed.
+	 */
+	uint64_t cmdsn_blocked;
+	uint64_t cmdsn_blocked_us;
+
+	/* PDUs queued for sending, PDUs waiting for a response and SCSI
+	 * commands waiting for the CmdSN window at the time of the call.
+	 */
+	uint32_t outqueue_depth;
+	uint32_t waitpdu_depth;
+	uint32_t pending_depth;
+
+	/* Only kept when enabled with iscsi_set_stats_latency(). Indexed by
+	 * the opcode of the request: the time from when the PDU was
+	 * created until its last byte was written to the socket, and from
+	 * then until the header of the response completing it was read.
+	 * queue_wait is the part of submit_to_wire until the first byte
+	 * was written, spent on the pending queue waiting for the CmdSN
+	 * window and behind other PDUs on the outqueue. The rest of it was
+	 * spent waiting for room in the socket send buffer.
+	 */
+	struct iscsi_latency_histogram submit_to_wire[ISCSI_STATS_LATENCY_OPCODES];
+	struct iscsi_latency_histogram wire_to_response[ISCSI_STATS_LATENCY_OPCODES];
+	struct iscsi_latency_histogram queue_wait[ISCSI_STATS_LATENCY_OPCODES];
+};
+
+/*
+ * Copy the counters of the context to *stats. The counters are always
+ * kept, cost next to nothing and are carried over across reconnects.
+ * The queue depths are counted at the time of the call.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+EXTERN int iscsi_get_stats(struct iscsi_context *iscsi,
+			   struct iscsi_stats *stats);
+
+/*
+ * Reset all counters and histograms of the context to zero.
+ */
+EXTERN void iscsi_reset_stats(struct iscsi_context *iscsi);
+
+/*
+ * Keep the per opcode latency histograms and the timestamps returned by
+ * iscsi_get_task_timing(). This reads the clock three times for every PDU
+ * sent and once for every PDU received.
+ *
+ * enable: 0 disables the histograms, which is the default.
+ */
+EXTERN int iscsi_set_stats_latency(struct iscsi_context *iscsi, int enable);
+
+/* CLOCK_MONOTONIC timestamps in nanoseconds of an iSCSI command. A stage
+ * that was not reached is 0.
+ */
+struct scsi_task_timing {
+	/* handed to libiscsi */
+	uint64_t queued_ns;
+	/* first byte of the command PDU written to the socket */
+	uint64_t write_start_ns;
+	/* last byte of the command PDU written to the socket */
+	uint64_t written_ns;
+	/* header of the response received */
+	uint64_t response_ns;
+};
+
+struct scsi_task;
+
+/*
+ * Get the timestamps of a task from its callback. They are only kept
+ * when enabled with iscsi_set_stats_latency().
+ *
+ * Returns 0 on success and -1, with all the timestamps 0, when there are
+ * none for the task.
+ */
+EXTERN int iscsi_get_task_timing(struct iscsi_context *iscsi,
+				 struct scsi_task *task,
+				 struct scsi_task_timing *timing);
+
+
+/************************************************************
+ * Tracing.
+ * Libiscsi has a static tracepoint at each step a SCSI command and
+ * its PDUs go through. When built with <sys/sdt.h> every tracepoint is
+ * also a USDT probe in the "libiscsi" provider that bpftrace, perf or
+ * systemtap can attach to, for example
+ *
+ *   bpftrace -e 'usdt:libiscsi.so:libiscsi:pdu_last_byte { ... }'
+ *
+ * The probes are task_submit, pdu_queued, pdu_first_byte,
+ * pdu_last_byte, pdu_header_received, pdu_data_placed and
+ * task_callback. Their arguments are the context followed by the
+ * itt, sn, opcode, lun, length and status fields of
+ * struct iscsi_trace_event below. A probe that is not attached to
+ * costs a single nop.
+ ************************************************************/
+enum iscsi_trace_point {
+	/* a SCSI command was handed to libiscsi */
+	ISCSI_TRACE_TASK_SUBMIT          = 0,
+	/* a PDU was added to the queue of PDUs to send */
+	ISCSI_TRACE_PDU_QUEUED           = 1,
+	/* the first byte of a PDU was written to the socket */
+	ISCSI_TRACE_PDU_FIRST_BYTE       = 2,
+	/* the last byte of a PDU was written to the socket */
+	ISCSI_TRACE_PDU_LAST_BYTE        = 3,
+	/* the header of a PDU from the target was read */
+	ISCSI_TRACE_PDU_HEADER_RECEIVED  = 4,
+	/* the data segment of a PDU from the target was read into the
+	 * buffers of the task or of the PDU
+	 */
+	ISCSI_TRACE_PDU_DATA_PLACED      = 5,
+	/* the callback of a SCSI command is about to be invoked */
+	ISCSI_TRACE_TASK_CALLBACK        = 6
+};
+
+struct iscsi_trace_event {
+	enum iscsi_trace_point point;
+	/* CLOCK_MONOTONIC in nanoseconds */
+	uint64_t time_ns;
+	uint32_t itt;
+	/* CmdSN for commands and PDUs sent, StatSN for PDUs received.
+	 * Commands that are still waiting for the CmdSN window to open
+	 * have not been assigned a CmdSN yet and report 0.
+	 */
+	uint32_t sn;
+	/* iSCSI opcode, 0x01 (SCSI Command) for the task points */
+	uint8_t opcode;
+	/* only meaningful for PDUs that carry a LUN */
+	uint32_t lun;
+	/* the DataSegmentLength of the PDU, or the expected transfer
+	 * length for the task points
+	 */
+	uint32_t length;
+	/* the SCSI status passed to the callback, 0 for all other points */
+	int status;
+};
+
+typedef void (*iscsi_trace_fn)(struct iscsi_context *iscsi,
+			       const struct iscsi_trace_event *event,
+			       void *private_data);
+
+/*
+ * Call fn for every tracepoint passed in this context. The callback is
+ * invoked synchronously from within libiscsi and must not call back
+ * into the context. Pass NULL to remove the callback.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+EXTERN int iscsi_set_trace_callback(struct iscsi_context *iscsi,
+				    iscsi_trace_fn fn, void *private_data);
+
+#define ISCSI_PCAP_ALL_DATA 0xffffffff
+
+/*
+ * Capture the PDUs sent and received in this context to a pcap file
+ * that Wireshark can dissect. The PDUs are wrapped in made up IP and
+ * TCP headers for the addresses and ports of the connection.
+ *
+ * The file is written by a thread of its own. When it can not keep up,
+ * PDUs are left out of the capture rather than slowing down
+ * iscsi_service() and are counted in iscsi_stats.pcap_dropped.
+ *
+ * filename:      the file to write to, NULL stops the capture.
+ * data_len:      how many bytes of the data segment of each PDU to
+ *                capture. 0 captures only the headers,
+ *                ISCSI_PCAP_ALL_DATA the whole PDUs.
+ * max_file_size: start the file over when it would grow beyond this
+ *                many bytes, 0 for no limit.
+ * max_files:     with more than one file, they are named <filename>.0,
+ *                <filename>.1 and so on, and when the last one is full
+ *                the capture continues in the first one again.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+EXTERN int iscsi_set_pcap_capture(struct iscsi_context *iscsi,
+				  const char *filename, uint32_t data_len,
+				  uint64_t max_file_size, int max_files);
+
+
 /************************************************************
  * Timeout Handling.
  * Libiscsi does not use or interface with any system timers.
@@ -130,6 +457,138 @@ EXTERN int iscsi_out_queue_length(struct iscsi_context *iscsi);
  */
 EXTERN int iscsi_set_timeout(struct iscsi_context *iscsi, int timeout);
 
+
+/************************************************************
+ * Task Priorities.
+ * SCSI commands are either NORMAL (bulk) or HIGH priority.
+ * Commands that can not be sent yet because the CmdSN window
+ * is closed are held in one local queue per priority and are
+ * only assigned a CmdSN once the window opens again. HIGH
+ * priority commands are assigned their CmdSN, and a slot on the
+ * wire, ahead of any NORMAL commands that are still waiting.
+ ************************************************************/
+enum iscsi_task_priority {
+	ISCSI_TASK_PRIORITY_NORMAL = 0,
+	ISCSI_TASK_PRIORITY_HIGH   = 1
+};
+
+/*
+ * SCSI task attributes as carried in the SCSI Command PDU.
+ */
+enum iscsi_task_attribute {
+	ISCSI_TASK_ATTR_UNTAGGED      = 0,
+	ISCSI_TASK_ATTR_SIMPLE        = 1,
+	ISCSI_TASK_ATTR_ORDERED       = 2,
+	ISCSI_TASK_ATTR_HEAD_OF_QUEUE = 3,
+	ISCSI_TASK_ATTR_ACA           = 4
+};
+
+/*
+ * Set the priority for all SCSI commands that are issued from now on.
+ * Just like iscsi_set_timeout() the priority is assigned to the task when
+ * it is created, so the recommended usecase is to raise the priority
+ * temporarily around a latency critical command:
+ *
+ * iscsi_set_task_priority(iscsi, ISCSI_TASK_PRIORITY_HIGH);
+ * iscsi_read16_task(iscsi, ...
+ * iscsi_set_task_priority(iscsi, ISCSI_TASK_PRIORITY_NORMAL);
+ *
+ * Default is ISCSI_TASK_PRIORITY_NORMAL.
+ */
+EXTERN int iscsi_set_task_priority(struct iscsi_context *iscsi,
+				   enum iscsi_task_priority priority);
+
+/*
+ * Set the SCSI task attribute that is used on the wire for commands of
+ * the given priority.
+ * The default is ISCSI_TASK_ATTR_SIMPLE for both priorities since not all
+ * targets support the other attributes. Applications that have verified
+ * that the target supports it (HEADSUP/ORDSUP in the Extended INQUIRY
+ * Data VPD page) can map HIGH priority commands to
+ * ISCSI_TASK_ATTR_HEAD_OF_QUEUE or ISCSI_TASK_ATTR_ORDERED.
+ */
+EXTERN int iscsi_set_task_attribute(struct iscsi_context *iscsi,
+				    enum iscsi_task_priority priority,
+				    enum iscsi_task_attribute attr);
+
+/*
+ * Limit how long NORMAL priority commands can be starved by HIGH priority
+ * commands. After this many HIGH priority commands have been dispatched
+ * in a row while NORMAL commands are waiting for the CmdSN window, one
+ * NORMAL command is dispatched.
+ *
+ * 0 means HIGH priority commands are always dispatched first.
+ * Default is 8.
+ */
+EXTERN int iscsi_set_task_starvation_limit(struct iscsi_context *iscsi,
+					   int count);
+
+/*
+ * Transparent splitting of large READ/WRITE commands.
+ *
+ * When enabled, the Block Limits VPD page of the LUN is read and cached
+ * during iscsi_full_connect_[a]sync(). Any READ10/12/16 or WRITE10/12/16
+ * that is issued afterwards and that is larger than the MAXIMUM TRANSFER
+ * LENGTH of the device, or larger than opt_multiple times the OPTIMAL
+ * TRANSFER LENGTH, is then split into a number of smaller commands that
+ * are all issued in parallel. The sub-commands are aligned to the optimal
+ * transfer length so that they do not straddle internal boundaries of the
+ * device.
+ *
+ * The sub-commands read or write directly from/to the iovector or data
+ * buffer of the original task and the callback for the original task is
+ * only invoked once all sub-commands have completed. The status, sense
+ * and residual of the task are then those of the first sub-command that
+ * failed, or GOOD if all of them succeeded.
+ *
+ * A task that has been split has no itt of its own and can not be
+ * aborted using task management functions.
+ *
+ * enable:       0 disables splitting, which is the default.
+ * opt_multiple: 0 only splits commands that are larger than the maximum
+ *               transfer length. Otherwise commands larger than this
+ *               many times the optimal transfer length are also split,
+ *               into commands of the optimal transfer length.
+ *
+ * This must be set before logging in. If the device does not report
+ * the Block Limits VPD page no commands are split. The page is only read
+ * for the LUN given to iscsi_full_connect_[a]sync() and commands for other
+ * LUNs are never split.
+ */
+EXTERN int iscsi_set_split_io(struct iscsi_context *iscsi, int enable,
+			      int opt_multiple);
+
+/*
+ * Detection of zero blocks in writes.
+ *
+ * When enabled, the data-out buffer of every WRITE10/12/16 is scanned
+ * for runs of logical blocks that contain only zeroes. Runs of at least
+ * min_blocks blocks are sent as WRITE SAME16 with a single block of
+ * zeroes instead of being transferred, and the rest of the data is sent
+ * as writes of the same kind as the original one. The callback for the
+ * original task is invoked once all of these have completed, as for
+ * iscsi_set_split_io().
+ *
+ * If the Logical Block Provisioning VPD page of the LUN, which is read
+ * during iscsi_full_connect_[a]sync(), reports that WRITE SAME16 can
+ * unmap blocks and that unmapped blocks read back as zero, the UNMAP
+ * bit is set so that thin provisioned LUNs release the space.
+ *
+ * Only writes whose data-out buffer is known when the task is issued,
+ * i.e. writes issued with a data buffer such as iscsi_write16_task(),
+ * are scanned. Writes with the FUA bit set are always sent as is. If
+ * the target rejects WRITE SAME16 the zero run is written normally and
+ * zero detection is switched off for the context. Like splitting, zero
+ * detection only applies to writes to the LUN given to
+ * iscsi_full_connect_[a]sync().
+ *
+ * min_blocks: 0 disables zero detection, which is the default.
+ *
+ * This must be set before logging in.
+ */
+EXTERN int iscsi_set_zero_detect(struct iscsi_context *iscsi,
+				 uint32_t min_blocks);
+
 /*
  * To set tcp keepalive for the session.
  * Only options supported by given platform (if any) are set.
@@ -1269,6 +1728,51 @@ EXTERN void iscsi_set_log_fn(struct iscsi_context *iscsi, iscsi_log_fn fn);
 /* predefined log function that just writes to stderr */
 EXTERN void iscsi_log_to_stderr(int level, const char *message);
 
+enum iscsi_log_ring_mode {
+	/* Messages are kept until iscsi_log_ring_drain() is called. When
+	 * the ring is full new messages are dropped and counted.
+	 */
+	ISCSI_LOG_RING_DRAIN           = 0,
+	/* The ring keeps the last messages, overwriting the oldest ones.
+	 * They are passed to the log function when a command times out or
+	 * the connection fails, or when iscsi_log_ring_drain() is called.
+	 */
+	ISCSI_LOG_RING_FLIGHT_RECORDER = 1
+};
+
+/*
+ * Record log messages into a ring of entries instead of formatting them
+ * and calling the log function right away. Only the format string and
+ * the arguments are stored, %s arguments are copied and truncated, and
+ * the messages are formatted when they are passed to the log function.
+ * The log level and the log function still decide what is recorded.
+ *
+ * entries: the number of messages the ring holds, rounded up to a power
+ *          of two. 0 removes the ring, which is the default. Messages
+ *          still in an ISCSI_LOG_RING_DRAIN ring are passed to the log
+ *          function first, those in a flight recorder are discarded.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+EXTERN int iscsi_set_log_ring(struct iscsi_context *iscsi, int entries,
+			      enum iscsi_log_ring_mode mode);
+
+/*
+ * Format the messages in the ring and pass them to the log function,
+ * oldest first.
+ *
+ * max: the most messages to pass on, 0 for all of them.
+ *
+ * In ISCSI_LOG_RING_DRAIN mode the ring is lock-free for one thread
+ * using the context and one other thread calling this function, so the
+ * formatting can be moved off the thread doing the I/O. The log
+ * function is then called from that other thread. A flight recorder
+ * must only be drained by the thread using the context.
+ *
+ * Returns the number of messages passed to the log function.
+ */
+EXTERN int iscsi_log_ring_drain(struct iscsi_context *iscsi, int max);
+
 /*
  * This function is to set the TCP_USER_TIMEOUT option. It has to be called after iscsi
  * context creation. The value given in ms is then applied each time a new socket is created.
@@ -1327,6 +1831,168 @@ iscsi_set_reconnect_max_retries(struct iscsi_context *iscsi, int count);
 EXTERN void
 iscsi_set_no_ua_on_reconnect(struct iscsi_context *iscsi, int state);
 
+/*
+ * Sequential read-ahead.
+ *
+ * A read-ahead context sits on top of a logged in context and LUN and
+ * serves synchronous reads at arbitrary byte offsets. When reads are
+ * seen to be sequential, up to 'window' READ16 commands of chunk_size
+ * bytes each are kept in flight ahead of the reader and following reads
+ * are served from those buffers instead of paying a round trip each.
+ * Reads that are not covered by the read-ahead are sent to the target
+ * directly.
+ *
+ * Like the *_sync() functions these drive the event loop themselves and
+ * must not be used on a context that is serviced by the application.
+ *
+ * chunk_size must be a multiple of block_size.
+ */
+struct iscsi_readahead;
+
+EXTERN struct iscsi_readahead *
+iscsi_readahead_create(struct iscsi_context *iscsi, int lun,
+		       uint32_t block_size, uint64_t num_blocks,
+		       int window, uint32_t chunk_size);
+
+/* Waits for any outstanding read-ahead and releases all buffers. */
+EXTERN void iscsi_readahead_destroy(struct iscsi_readahead *ra);
+
+/*
+ * Read count bytes at byte offset into buf. Reads are truncated at the
+ * end of the LUN.
+ *
+ * Returns the number of bytes read or -1 on error.
+ */
+EXTERN int iscsi_readahead_read(struct iscsi_readahead *ra, uint64_t offset,
+				unsigned char *buf, uint32_t count);
+
+/*
+ * Discard any read-ahead data for the given byte range. This must be
+ * called whenever the range is written to by other means.
+ */
+EXTERN void iscsi_readahead_invalidate(struct iscsi_readahead *ra,
+				       uint64_t offset, uint64_t count);
+
+/*
+ * Use the read-ahead together with a write-back cache for the same LUN,
+ * see below. Ranges that are dirty in wb, or still being written from
+ * it, are not read ahead, and reads flush any dirty data in their range
+ * first. Writes through wb must still invalidate the range here before
+ * they are made. Pass NULL before destroying wb.
+ */
+struct iscsi_writeback;
+
+EXTERN void iscsi_readahead_set_writeback(struct iscsi_readahead *ra,
+					  struct iscsi_writeback *wb);
+
+/*
+ * Write-back cache.
+ *
+ * A write-back context sits on top of a logged in context and LUN and
+ * absorbs block aligned writes into dirty extents in memory. Adjacent
+ * and overlapping writes are merged and extents are written to the
+ * target asynchronously with a single WRITE16 once they grow to
+ * flush_size bytes. The cache never holds more than max_dirty bytes of
+ * data, dirty or being written. Writes larger than half of max_dirty are
+ * written through.
+ *
+ * Like the *_sync() functions these drive the event loop themselves and
+ * must not be used on a context that is serviced by the application.
+ *
+ * Crash consistency:
+ * Data written with iscsi_writeback_write() is only guaranteed to be on
+ * stable storage once a following iscsi_writeback_sync() has returned
+ * success. Until then a crash or a lost connection may persist any subset
+ * of the blocks written since the last successful sync, in any order,
+ * except that multiple writes to the same block are always applied in
+ * the order they were made.
+ * Errors from asynchronous write-backs are reported by the next call to
+ * iscsi_writeback_sync() or iscsi_writeback_destroy().
+ */
+struct iscsi_writeback;
+
+EXTERN struct iscsi_writeback *
+iscsi_writeback_create(struct iscsi_context *iscsi, int lun,
+		       uint32_t block_size, uint64_t num_blocks,
+		       size_t max_dirty, uint32_t flush_size);
+
+/*
+ * Write count bytes at byte offset. Both must be multiples of the block
+ * size.
+ *
+ * Returns count or -1 on error.
+ */
+EXTERN int iscsi_writeback_write(struct iscsi_writeback *wb, uint64_t offset,
+				 const unsigned char *buf, uint32_t count);
+
+/*
+ * Write any cached data for the byte range to the target and wait for
+ * it to complete. Use this before reading the range by other means.
+ */
+EXTERN int iscsi_writeback_flush_range(struct iscsi_writeback *wb,
+				       uint64_t offset, uint64_t count);
+
+/*
+ * Write all cached data to the target, wait for it to complete and then
+ * issue SYNCHRONIZE CACHE16 for the whole LUN.
+ *
+ * Returns 0 on success or -1 if this or any earlier write-back failed.
+ */
+EXTERN int iscsi_writeback_sync(struct iscsi_writeback *wb);
+
+/* Sync the cache and release it. Returns the result of the sync. */
+EXTERN int iscsi_writeback_destroy(struct iscsi_writeback *wb);
+
+/*
+ * UNMAP batching.
+ *
+ * Collects ranges to be unmapped and sends them as few multi-descriptor
+ * UNMAP commands as possible. When the batch is submitted the ranges are
+ * sorted and overlapping or adjacent ranges are merged. The result is cut
+ * into block descriptors and commands that stay within the MAXIMUM UNMAP
+ * LBA COUNT and MAXIMUM UNMAP BLOCK DESCRIPTOR COUNT of the device. Where
+ * a range has to be cut, it is cut on an OPTIMAL UNMAP GRANULARITY
+ * boundary, taking UNMAP GRANULARITY ALIGNMENT into account. All the
+ * commands are sent in parallel.
+ *
+ * The callback for each range is invoked with command_data set to NULL
+ * once all commands covering its merged extent have completed. status is
+ * SCSI_STATUS_GOOD or the status of the first of them that failed.
+ *
+ * The limits are taken from inq, a Block Limits VPD page read by the
+ * application. If inq is NULL the limits read at login are used for the
+ * LUN that was logged in to, see iscsi_set_split_io(). Otherwise only the
+ * size of the UNMAP parameter list limits the commands.
+ */
+struct iscsi_unmap_batch;
+struct scsi_inquiry_block_limits;
+
+EXTERN struct iscsi_unmap_batch *
+iscsi_unmap_batch_create(struct iscsi_context *iscsi, int lun,
+			 struct scsi_inquiry_block_limits *inq);
+
+/* Queue a range. Nothing is sent until iscsi_unmap_batch_submit(). */
+EXTERN int iscsi_unmap_batch_add(struct iscsi_unmap_batch *batch,
+				 uint64_t lba, uint32_t num,
+				 iscsi_command_cb cb, void *private_data);
+
+/* Number of ranges queued since the last submit. */
+EXTERN int iscsi_unmap_batch_pending(struct iscsi_unmap_batch *batch);
+
+/*
+ * Send all queued ranges.
+ * Returns -1 if one or more commands could not be sent. The callbacks of
+ * the affected ranges are then invoked with SCSI_STATUS_ERROR.
+ */
+EXTERN int iscsi_unmap_batch_submit(struct iscsi_unmap_batch *batch);
+
+/*
+ * Release the batch. Ranges that have not been submitted are completed
+ * with SCSI_STATUS_CANCELLED. Commands that have already been submitted
+ * are not affected.
+ */
+EXTERN void iscsi_unmap_batch_destroy(struct iscsi_unmap_batch *batch);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,424 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef AROS
+#include "aros/aros_compat.h"
+#endif
+
+#if defined(WIN32)
+#include <winsock2.h>
+#include "win32/win32_compat.h"
+#else
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "slist.h"
+
+/*
+ * A pool of I/O buffers of one size, see iscsi_set_buffer_pool().
+ *
+ * All buffers are carved from one region that is mapped from 2 MiB huge
+ * pages when the system has some reserved, and otherwise asks for
+ * transparent huge pages. The free buffers are kept on a stack so that the buffer
+ * that was used last, and is most likely still in the cache, is handed
+ * out first.
+ *
+ * Tasks that read into a buffer of the pool keep a reference to the pool
+ * so that it stays around until the last of them has been freed, also
+ * after the context is gone. The reference is one of the memory blocks
+ * released with the task, so that struct scsi_task does not have to grow.
+ * There is one for every buffer, so no memory is allocated per read.
+ */
+
+#define BUFFER_POOL_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/*
+ * The region is rounded to 2 MiB huge pages, so ask for pages of that
+ * size rather than the default size of the system, which can be 1 GiB,
+ * or 512 MiB on aarch64 with 64K pages, and would not match the length
+ * the region is unmapped with. Without a way to ask for the size, only
+ * transparent huge pages are used.
+ */
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_2MB)
+#define BUFFER_POOL_MAP_HUGE (MAP_HUGETLB | MAP_HUGE_2MB)
+#elif defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+#define BUFFER_POOL_MAP_HUGE (MAP_HUGETLB | (21 << MAP_HUGE_SHIFT))
+#endif
+
+struct iscsi_buffer_pool {
+	unsigned char *base;
+	size_t region_size;
+	size_t buffer_size;
+	int count;
+	int flags;
+
+	/* the region was mmap()ed rather than allocated */
+	int mapped;
+	/* the allocation the region was aligned in */
+	void *allocation;
+
+	/* the context and every buffer that is handed out */
+	int refs;
+
+	int nfree;
+	unsigned char **stack;
+
+	/* one for every buffer, in the same order */
+	struct buffer_pool_task_ref *task_refs;
+};
+
+/* the buffer a task read into, on the memory list of the task */
+struct buffer_pool_task_ref {
+	struct scsi_allocated_memory mem;
+	struct iscsi_buffer_pool *pool;
+};
+
+static size_t
+buffer_pool_page_size(void)
+{
+#if defined(_SC_PAGESIZE)
+	long size = sysconf(_SC_PAGESIZE);
+
+	if (size > 0) {
+		return size;
+	}
+#endif
+	return 4096;
+}
+
+static void
+buffer_pool_unmap(struct iscsi_buffer_pool *pool)
+{
+#ifdef HAVE_SYS_MMAN_H
+	if (pool->mapped) {
+		munmap(pool->base, pool->region_size);
+		return;
+	}
+#endif
+	iscsi_mem_free(pool->allocation);
+}
+
+static int
+buffer_pool_map(struct iscsi_context *iscsi, struct iscsi_buffer_pool *pool)
+{
+	size_t page_size = buffer_pool_page_size();
+	const char *backing = "memory from the allocator";
+
+#ifdef HAVE_SYS_MMAN_H
+	void *base = MAP_FAILED;
+
+#ifdef BUFFER_POOL_MAP_HUGE
+	base = mmap(NULL, pool->region_size, PROT_READ|PROT_WRITE,
+		    MAP_PRIVATE|MAP_ANONYMOUS|BUFFER_POOL_MAP_HUGE, -1, 0);
+	backing = "huge pages";
+#endif
+	if (base == MAP_FAILED) {
+		base = mmap(NULL, pool->region_size, PROT_READ|PROT_WRITE,
+			    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		backing = "pages";
+#ifdef MADV_HUGEPAGE
+		if (base != MAP_FAILED &&
+		    madvise(base, pool->region_size, MADV_HUGEPAGE) == 0) {
+			backing = "transparent huge pages";
+		}
+#endif
+	}
+	if (base != MAP_FAILED) {
+		pool->base   = base;
+		pool->mapped = 1;
+	}
+#endif
+	if (!pool->mapped) {
+		pool->allocation = iscsi_mem_malloc(pool->region_size +
+						    page_size);
+		if (pool->allocation == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory: failed to "
+					"allocate %lu bytes for the buffer pool",
+					(unsigned long)pool->region_size);
+			return -1;
+		}
+		pool->base = (unsigned char *)(((uintptr_t)pool->allocation +
+					page_size - 1) & ~(page_size - 1));
+	}
+
+	if (pool->flags & ISCSI_BUFFER_POOL_MLOCK) {
+#ifdef HAVE_SYS_MMAN_H
+		if (mlock(pool->base, pool->region_size) != 0) {
+			iscsi_set_error(iscsi, "failed to lock the buffer "
+					"pool in memory: %s", strerror(errno));
+			buffer_pool_unmap(pool);
+			return -1;
+		}
+#else
+		iscsi_set_error(iscsi, "locking the buffer pool in memory is "
+				"not supported on this platform");
+		buffer_pool_unmap(pool);
+		return -1;
+#endif
+	}
+
+	ISCSI_LOG(iscsi, 2, "buffer pool of %d buffers of %lu bytes in %s",
+		  pool->count, (unsigned long)pool->buffer_size, backing);
+	return 0;
+}
+
+static void
+buffer_pool_unref(struct iscsi_buffer_pool *pool)
+{
+	if (--pool->refs > 0) {
+		return;
+	}
+	buffer_pool_unmap(pool);
+	iscsi_mem_free(pool->task_refs);
+	iscsi_mem_free(pool->stack);
+	iscsi_mem_free(pool);
+}
+
+unsigned char *
+iscsi_buffer_pool_get(struct iscsi_buffer_pool *pool)
+{
+	if (pool->nfree == 0) {
+		return NULL;
+	}
+	pool->refs++;
+	return pool->stack[--pool->nfree];
+}
+
+void
+iscsi_buffer_pool_put(struct iscsi_buffer_pool *pool, unsigned char *buf)
+{
+	pool->stack[pool->nfree++] = buf;
+	buffer_pool_unref(pool);
+}
+
+/* the task is freed, put the buffer it read into back */
+static void
+buffer_pool_task_free(struct scsi_task *task, struct scsi_allocated_memory *mem)
+{
+	struct buffer_pool_task_ref *ref = (struct buffer_pool_task_ref *)mem;
+
+	iscsi_buffer_pool_put(ref->pool, task->datain.data);
+	task->datain.data = NULL;
+	task->datain.size = 0;
+}
+
+static struct scsi_allocated_memory *
+buffer_pool_task_ref(struct scsi_task *task)
+{
+	struct scsi_allocated_memory *mem;
+
+	for (mem = task->mem; mem; mem = mem->next) {
+		if (mem->free == buffer_pool_task_free) {
+			return mem;
+		}
+	}
+	return NULL;
+}
+
+/* Did the task read into a buffer of the pool */
+int
+iscsi_buffer_pool_task(struct scsi_task *task)
+{
+	return buffer_pool_task_ref(task) != NULL;
+}
+
+/*
+ * Take the buffer for the Data-In of a read that the application gave
+ * no buffer for from the pool. Returns NULL when the pool is not used for
+ * this, the transfer does not fit or the pool is empty, and the data is
+ * then collected the usual way.
+ */
+unsigned char *
+iscsi_buffer_pool_datain(struct iscsi_context *iscsi, struct scsi_task *task)
+{
+	struct iscsi_buffer_pool *pool = iscsi->buffer_pool;
+	struct buffer_pool_task_ref *ref;
+	unsigned char *buf;
+
+	if (pool == NULL || !(pool->flags & ISCSI_BUFFER_POOL_DATA_IN) ||
+	    task->datain.data != NULL || task->expxferlen <= 0 ||
+	    (size_t)task->expxferlen > pool->buffer_size) {
+		return NULL;
+	}
+	buf = iscsi_buffer_pool_get(pool);
+	if (buf == NULL) {
+		iscsi->stats.buffer_pool_empty++;
+		return NULL;
+	}
+	ref = &pool->task_refs[(buf - pool->base) / pool->buffer_size];
+	ref->pool = pool;
+	ISCSI_LIST_ADD(&task->mem, &ref->mem);
+	task->datain.data = buf;
+	task->datain.size = task->expxferlen;
+	return buf;
+}
+
+/* A task that read into the pool got sense data instead */
+void
+iscsi_buffer_pool_release_datain(struct scsi_task *task)
+{
+	struct scsi_allocated_memory *mem = buffer_pool_task_ref(task);
+
+	if (mem == NULL) {
+		return;
+	}
+	ISCSI_LIST_REMOVE(&task->mem, mem);
+	mem->free(task, mem);
+}
+
+void
+iscsi_buffer_pool_free(struct iscsi_context *iscsi)
+{
+	struct iscsi_buffer_pool *pool = iscsi->buffer_pool;
+
+	if (pool == NULL) {
+		return;
+	}
+	iscsi->buffer_pool = NULL;
+	buffer_pool_unref(pool);
+}
+
+int
+iscsi_set_buffer_pool(struct iscsi_context *iscsi, size_t buffer_size,
+		      int count, int flags)
+{
+	struct iscsi_buffer_pool *pool = iscsi->buffer_pool;
+	size_t page_size = buffer_pool_page_size();
+	int i;
+
+	if (pool != NULL && pool->nfree != pool->count) {
+		iscsi_set_error(iscsi, "%d buffers of the buffer pool are "
+				"still in use", pool->count - pool->nfree);
+		return -1;
+	}
+	iscsi_buffer_pool_free(iscsi);
+	if (count == 0) {
+		return 0;
+	}
+	if (count < 0 || buffer_size == 0) {
+		iscsi_set_error(iscsi, "invalid buffer pool of %d buffers of "
+				"%lu bytes", count, (unsigned long)buffer_size);
+		return -1;
+	}
+
+	pool = iscsi_mem_malloc(sizeof(struct iscsi_buffer_pool));
+	if (pool == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"buffer pool");
+		return -1;
+	}
+	memset(pool, 0, sizeof(struct iscsi_buffer_pool));
+	pool->flags = flags;
+	pool->count = count;
+	pool->refs  = 1;
+	pool->buffer_size = (buffer_size + page_size - 1) & ~(page_size - 1);
+	pool->region_size = pool->buffer_size * count;
+	pool->region_size = (pool->region_size + BUFFER_POOL_HUGE_PAGE_SIZE - 1)
+		& ~((size_t)BUFFER_POOL_HUGE_PAGE_SIZE - 1);
+
+	pool->stack = iscsi_mem_malloc(count * sizeof(unsigned char *));
+	pool->task_refs = iscsi_mem_malloc(count *
+					   sizeof(struct buffer_pool_task_ref));
+	if (pool->stack == NULL || pool->task_refs == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"buffer pool");
+		iscsi_mem_free(pool->task_refs);
+		iscsi_mem_free(pool->stack);
+		iscsi_mem_free(pool);
+		return -1;
+	}
+	memset(pool->task_refs, 0, count * sizeof(struct buffer_pool_task_ref));
+	for (i = 0; i < count; i++) {
+		pool->task_refs[i].mem.free = buffer_pool_task_free;
+	}
+	if (buffer_pool_map(iscsi, pool) != 0) {
+		iscsi_mem_free(pool->task_refs);
+		iscsi_mem_free(pool->stack);
+		iscsi_mem_free(pool);
+		return -1;
+	}
+
+	/* the first buffer ends up on top of the stack */
+	for (i = count - 1; i >= 0; i--) {
+		pool->stack[pool->nfree++] = pool->base + i * pool->buffer_size;
+	}
+
+	iscsi->buffer_pool = pool;
+	return 0;
+}
+
+size_t
+iscsi_buffer_size(struct iscsi_context *iscsi)
+{
+	if (iscsi->buffer_pool == NULL) {
+		return 0;
+	}
+	return iscsi->buffer_pool->buffer_size;
+}
+
+void *
+iscsi_buffer_get(struct iscsi_context *iscsi)
+{
+	unsigned char *buf;
+
+	if (iscsi->buffer_pool == NULL) {
+		iscsi_set_error(iscsi, "no buffer pool");
+		return NULL;
+	}
+	buf = iscsi_buffer_pool_get(iscsi->buffer_pool);
+	if (buf == NULL) {
+		iscsi->stats.buffer_pool_empty++;
+		iscsi_set_error(iscsi, "all %d buffers of the buffer pool are "
+				"in use", iscsi->buffer_pool->count);
+	}
+	return buf;
+}
+
+void
+iscsi_buffer_put(struct iscsi_context *iscsi, void *buf)
+{
+	struct iscsi_buffer_pool *pool = iscsi->buffer_pool;
+	unsigned char *b = buf;
+
+	if (b == NULL) {
+		return;
+	}
+	if (pool == NULL || b < pool->base ||
+	    b >= pool->base + pool->buffer_size * pool->count ||
+	    (size_t)(b - pool->base) % pool->buffer_size) {
+		ISCSI_LOG(iscsi, 1, "iscsi_buffer_put: %p is not a buffer "
+			  "of the buffer pool", buf);
+		return;
+	}
+	iscsi_buffer_pool_put(pool, b);
+}
@@ -69,6 +69,78 @@ iscsi_testunitready_connect(struct iscsi_context *iscsi, int lun,
 	return task;
 }
 
+/* Zero runs in writes may only be unmapped if WRITE SAME with the UNMAP
+ * bit is supported and unmapped blocks are guaranteed to read back as
+ * zero, see iscsi_set_zero_detect().
+ */
+static void
+iscsi_lbp_cb(struct iscsi_context *iscsi, int status,
+	     void *command_data, void *private_data)
+{
+	struct connect_task *ct = private_data;
+	struct scsi_task *task = command_data;
+	struct scsi_inquiry_logical_block_provisioning *inq = NULL;
+
+	if (status == SCSI_STATUS_GOOD) {
+		inq = scsi_datain_unmarshall(task);
+	}
+	iscsi->zero_unmap = inq != NULL && inq->lbpws && inq->lbprz;
+	ISCSI_LOG(iscsi, 2, "zero runs in writes will %sbe unmapped",
+		  iscsi->zero_unmap ? "" : "not ");
+
+	ct->cb(iscsi, SCSI_STATUS_GOOD, NULL, ct->private_data);
+	scsi_free_scsi_task(task);
+	iscsi_free(iscsi, ct);
+}
+
+/* Cache the Block Limits VPD so that large READ/WRITE commands can be
+ * split, see iscsi_set_split_io(). Not all devices implement this page so
+ * failing to read it does not fail the login, it only means that no
+ * commands will be split.
+ */
+static void
+iscsi_block_limits_cb(struct iscsi_context *iscsi, int status,
+		      void *command_data, void *private_data)
+{
+	struct connect_task *ct = private_data;
+	struct scsi_task *task = command_data;
+	struct scsi_inquiry_block_limits *inq = NULL;
+	struct iscsi_block_limits *bl = &iscsi->block_limits;
+
+	if (status == SCSI_STATUS_GOOD) {
+		inq = scsi_datain_unmarshall(task);
+	}
+	if (inq != NULL) {
+		bl->max_xfer_len     = inq->max_xfer_len;
+		bl->opt_xfer_len     = inq->opt_xfer_len;
+		bl->opt_gran         = inq->opt_gran;
+		bl->max_unmap        = inq->max_unmap;
+		bl->max_unmap_bdc    = inq->max_unmap_bdc;
+		bl->opt_unmap_gran   = inq->opt_unmap_gran;
+		bl->unmap_gran_align = inq->unmap_gran_align;
+		bl->ugavalid         = inq->ugavalid;
+		bl->max_ws_len       = inq->max_ws_len;
+		bl->valid            = 1;
+	} else {
+		ISCSI_LOG(iscsi, 2, "block limits vpd not available, "
+			  "commands will not be split");
+	}
+	scsi_free_scsi_task(task);
+
+	if (iscsi->zero_detect) {
+		if (iscsi_inquiry_task(iscsi, ct->lun, 1,
+			       SCSI_INQUIRY_PAGECODE_LOGICAL_BLOCK_PROVISIONING,
+			       64, iscsi_lbp_cb, ct) != NULL) {
+			return;
+		}
+		ISCSI_LOG(iscsi, 1, "failed to send inquiry for the logical "
+			  "block provisioning vpd: %s", iscsi_get_error(iscsi));
+	}
+
+	ct->cb(iscsi, SCSI_STATUS_GOOD, NULL, ct->private_data);
+	iscsi_free(iscsi, ct);
+}
+
 static void
 iscsi_testunitready_cb(struct iscsi_context *iscsi, int status,
 		       void *command_data, void *private_data)
@@ -130,9 +202,21 @@ iscsi_testunitready_cb(struct iscsi_context *iscsi, int status,
 		status = 0;
 	}
 
+	scsi_free_scsi_task(task);
+
+	if (status == 0 && (iscsi->split_io || iscsi->zero_detect)
+	    && !iscsi->old_iscsi) {
+		if (iscsi_inquiry_task(iscsi, ct->lun, 1,
+				       SCSI_INQUIRY_PAGECODE_BLOCK_LIMITS,
+				       64, iscsi_block_limits_cb, ct) != NULL) {
+			return;
+		}
+		ISCSI_LOG(iscsi, 1, "failed to send inquiry for the block "
+			  "limits vpd: %s", iscsi_get_error(iscsi));
+	}
+
 	ct->cb(iscsi, status?SCSI_STATUS_ERROR:SCSI_STATUS_GOOD, NULL,
 	       ct->private_data);
-	scsi_free_scsi_task(task);
 	iscsi_free(iscsi, ct);
 }
 
@@ -263,6 +347,7 @@ void iscsi_set_reconnect_max_retries(struct iscsi_context *iscsi, int count)
 void iscsi_defer_reconnect(struct iscsi_context *iscsi)
 {
 	struct iscsi_pdu *pdu;
+	int i;
 
 	iscsi->reconnect_deferred = 1;
 
@@ -290,12 +375,24 @@ void iscsi_defer_reconnect(struct iscsi_context *iscsi)
 		}
 		iscsi_free_pdu(iscsi, pdu);
 	}
+	for (i = 0; i <= ISCSI_TASK_PRIORITY_HIGH; i++) {
+		while ((pdu = iscsi->pendingqueue[i])) {
+			ISCSI_LIST_REMOVE(&iscsi->pendingqueue[i], pdu);
+			if (iscsi->is_loggedin && pdu->callback) {
+				pdu->callback(iscsi, SCSI_STATUS_CANCELLED,
+				              NULL, pdu->private_data);
+			}
+			iscsi_free_pdu(iscsi, pdu);
+		}
+	}
+	iscsi_stats_cmdsn_window(iscsi);
 }
 
 void iscsi_reconnect_cb(struct iscsi_context *iscsi _U_, int status,
                         void *command_data _U_, void *private_data _U_)
 {
         struct iscsi_context *old_iscsi;
+	enum iscsi_task_priority task_priority;
 	int i;
 
 	if (status != SCSI_STATUS_GOOD) {
@@ -327,6 +424,15 @@ void iscsi_reconnect_cb(struct iscsi_context *iscsi _U_, int status,
 		ISCSI_LIST_ADD_END(&old_iscsi->waitpdu, pdu);
 	}
 
+	/* commands that never got a CmdSN go last, high priority first */
+	for (i = ISCSI_TASK_PRIORITY_HIGH; i >= 0; i--) {
+		while (old_iscsi->pendingqueue[i]) {
+			struct iscsi_pdu *pdu = old_iscsi->pendingqueue[i];
+			ISCSI_LIST_REMOVE(&old_iscsi->pendingqueue[i], pdu);
+			ISCSI_LIST_ADD_END(&old_iscsi->waitpdu, pdu);
+		}
+	}
+
 	while (old_iscsi->waitpdu) {
 		struct iscsi_pdu *pdu = old_iscsi->waitpdu;
 
@@ -356,7 +462,12 @@ void iscsi_reconnect_cb(struct iscsi_context *iscsi _U_, int status,
 		/* We pass NULL as 'd' since any databuffer has already
 		 * been converted to a task-> iovector first time this
 		 * PDU was sent.
+		 * Re-issue the command with the priority it was
+		 * originally created with.
 		 */
+		task_priority = iscsi->task_priority;
+		iscsi->task_priority = pdu->priority;
+		iscsi->stats.retries++;
 		if (iscsi_scsi_command_async(iscsi, pdu->lun,
 					     pdu->scsi_cbdata.task,
 					     pdu->scsi_cbdata.callback,
@@ -364,6 +475,7 @@ void iscsi_reconnect_cb(struct iscsi_context *iscsi _U_, int status,
 					     pdu->scsi_cbdata.private_data)) {
 			/* not much we can really do at this point */
 		}
+		iscsi->task_priority = task_priority;
 		iscsi_free_pdu(old_iscsi, pdu);
 	}
 
@@ -385,7 +497,7 @@ void iscsi_reconnect_cb(struct iscsi_context *iscsi _U_, int status,
 	iscsi->mallocs += old_iscsi->mallocs;
 	iscsi->frees += old_iscsi->frees;
 
-	free(old_iscsi);
+	iscsi_mem_free(old_iscsi);
 	
 	/* avoid a reconnect faster than 3 seconds */
 	iscsi->next_reconnect = time(NULL) + 3;
@@ -463,9 +575,31 @@ int iscsi_reconnect(struct iscsi_context *old_iscsi)
 	iscsi->cache_allocations = old_iscsi->cache_allocations;
 	iscsi->scsi_timeout = old_iscsi->scsi_timeout;
 	iscsi->no_ua_on_reconnect = old_iscsi->no_ua_on_reconnect;
+	iscsi->task_priority = old_iscsi->task_priority;
+	memcpy(iscsi->task_attr, old_iscsi->task_attr, sizeof(iscsi->task_attr));
+	iscsi->starvation_limit = old_iscsi->starvation_limit;
+	iscsi->split_io = old_iscsi->split_io;
+	iscsi->split_io_opt_multiple = old_iscsi->split_io_opt_multiple;
+	iscsi->block_limits = old_iscsi->block_limits;
+	iscsi->zero_detect = old_iscsi->zero_detect;
+	iscsi->zero_unmap = old_iscsi->zero_unmap;
 
 	iscsi->reconnect_max_retries = old_iscsi->reconnect_max_retries;
 
+	iscsi->stats = old_iscsi->stats;
+	iscsi->stats.reconnects++;
+	iscsi->stats_latency = old_iscsi->stats_latency;
+
+	iscsi->trace_fn = old_iscsi->trace_fn;
+	iscsi->trace_private_data = old_iscsi->trace_private_data;
+
+	/* the log ring, the capture and the buffer pool move on to the
+	 * new context
+	 */
+	iscsi->log_ring = old_iscsi->log_ring;
+	iscsi->pcap = old_iscsi->pcap;
+	iscsi->buffer_pool = old_iscsi->buffer_pool;
+
 	if (old_iscsi->old_iscsi) {
 		int i;
 		for (i = 0; i < old_iscsi->smalloc_free; i++) {
@@ -473,11 +607,14 @@ int iscsi_reconnect(struct iscsi_context *old_iscsi)
 		}
 		iscsi->old_iscsi = old_iscsi->old_iscsi;
 	} else {
-		iscsi->old_iscsi = malloc(sizeof(struct iscsi_context));
+		iscsi->old_iscsi = iscsi_mem_malloc(sizeof(struct iscsi_context));
 		memcpy(iscsi->old_iscsi, old_iscsi, sizeof(struct iscsi_context));
+		iscsi->old_iscsi->log_ring = NULL;
+		iscsi->old_iscsi->pcap = NULL;
+		iscsi->old_iscsi->buffer_pool = NULL;
 	}
 	memcpy(old_iscsi, iscsi, sizeof(struct iscsi_context));
-	free(iscsi);
+	iscsi_mem_free(iscsi);
 
 	return  iscsi_full_connect_async(old_iscsi, old_iscsi->portal,
 					 old_iscsi->lun, iscsi_reconnect_cb,
@@ -43,14 +43,95 @@ void iscsi_set_cache_allocations(struct iscsi_context *iscsi, int ca)
 	iscsi->cache_allocations = ca;
 }
 
+static void *
+default_malloc(size_t size, void *private_data _U_)
+{
+	return malloc(size);
+}
+
+static void *
+default_realloc(void *ptr, size_t size, void *private_data _U_)
+{
+	return realloc(ptr, size);
+}
+
+static void
+default_free(void *ptr, void *private_data _U_)
+{
+	free(ptr);
+}
+
+static struct {
+	iscsi_malloc_fn malloc_fn;
+	iscsi_realloc_fn realloc_fn;
+	iscsi_free_fn free_fn;
+	void *private_data;
+} allocator = {
+	default_malloc, default_realloc, default_free, NULL
+};
+
+int
+iscsi_set_allocator(iscsi_malloc_fn malloc_fn, iscsi_free_fn free_fn,
+		    iscsi_realloc_fn realloc_fn, void *private_data)
+{
+	if (malloc_fn == NULL && free_fn == NULL && realloc_fn == NULL) {
+		malloc_fn  = default_malloc;
+		realloc_fn = default_realloc;
+		free_fn    = default_free;
+		private_data = NULL;
+	} else if (malloc_fn == NULL || free_fn == NULL || realloc_fn == NULL) {
+		return -1;
+	}
+
+	allocator.malloc_fn    = malloc_fn;
+	allocator.realloc_fn   = realloc_fn;
+	allocator.free_fn      = free_fn;
+	allocator.private_data = private_data;
+	return 0;
+}
+
+void *
+iscsi_mem_malloc(size_t size)
+{
+	return allocator.malloc_fn(size, allocator.private_data);
+}
+
+void *
+iscsi_mem_realloc(void *ptr, size_t size)
+{
+	return allocator.realloc_fn(ptr, size, allocator.private_data);
+}
+
+void
+iscsi_mem_free(void *ptr)
+{
+	if (ptr == NULL) {
+		return;
+	}
+	allocator.free_fn(ptr, allocator.private_data);
+}
+
+char *
+iscsi_mem_strdup(const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *str2;
+
+	str2 = iscsi_mem_malloc(len);
+	if (str2 != NULL) {
+		memcpy(str2, str, len);
+	}
+	return str2;
+}
+
 void* iscsi_malloc(struct iscsi_context *iscsi, size_t size) {
-	void * ptr = malloc(size);
+	void * ptr = iscsi_mem_malloc(size);
 	if (ptr != NULL) iscsi->mallocs++;
 	return ptr;
 }
 
 void* iscsi_zmalloc(struct iscsi_context *iscsi, size_t size) {
-	void * ptr = malloc(size);
+	void * ptr = iscsi_mem_malloc(size);
 	if (ptr != NULL) {
 		memset(ptr,0x00,size);
 		iscsi->mallocs++;
@@ -59,7 +140,7 @@ void* iscsi_zmalloc(struct iscsi_context *iscsi, size_t size) {
 }
 
 void* iscsi_realloc(struct iscsi_context *iscsi, void* ptr, size_t size) {
-	void * _ptr = realloc(ptr, size);
+	void * _ptr = iscsi_mem_realloc(ptr, size);
 	if (_ptr != NULL) {
 		iscsi->reallocs++;
 	}
@@ -68,12 +149,12 @@ void* iscsi_realloc(struct iscsi_context *iscsi, void* ptr, size_t size) {
 
 void iscsi_free(struct iscsi_context *iscsi, void* ptr) {
 	if (ptr == NULL) return;
-	free(ptr);
+	iscsi_mem_free(ptr);
 	iscsi->frees++;
 }
 
 char* iscsi_strdup(struct iscsi_context *iscsi, const char* str) {
-	char *str2 = strdup(str);
+	char *str2 = iscsi_mem_strdup(str);
 	if (str2 != NULL) iscsi->mallocs++;
 	return str2;
 }
@@ -91,6 +172,19 @@ void* iscsi_szmalloc(struct iscsi_context *iscsi, size_t size) {
 	return ptr;
 }
 
+/* Like iscsi_szmalloc() for callers that fill in every byte they use */
+void* iscsi_smalloc(struct iscsi_context *iscsi, size_t size) {
+	void *ptr;
+	if (size > iscsi->smalloc_size) return NULL;
+	if (iscsi->smalloc_free > 0) {
+		ptr = iscsi->smalloc_ptrs[--iscsi->smalloc_free];
+		iscsi->smallocs++;
+	} else {
+		ptr = iscsi_malloc(iscsi, iscsi->smalloc_size);
+	}
+	return ptr;
+}
+
 void iscsi_sfree(struct iscsi_context *iscsi, void* ptr) {
 	if (ptr == NULL) {
 		return;
@@ -118,7 +212,7 @@ iscsi_create_context(const char *initiator_name)
 		return NULL;
 	}
 
-	iscsi = malloc(sizeof(struct iscsi_context));
+	iscsi = iscsi_mem_malloc(sizeof(struct iscsi_context));
 	if (iscsi == NULL) {
 		return NULL;
 	}
@@ -128,6 +222,8 @@ iscsi_create_context(const char *initiator_name)
 	strncpy(iscsi->initiator_name,initiator_name,MAX_STRING_SIZE);
 
 	iscsi->fd = -1;
+
+	iscsi_init_pdu_templates(iscsi);
 	
 	srand(time(NULL) ^ getpid() ^ (uint32_t) ((uintptr_t) iscsi));
 
@@ -149,6 +245,10 @@ iscsi_create_context(const char *initiator_name)
 	iscsi->use_immediate_data                     = ISCSI_IMMEDIATE_DATA_YES;
 	iscsi->want_header_digest                     = ISCSI_HEADER_DIGEST_NONE_CRC32C;
 
+	iscsi->task_attr[ISCSI_TASK_PRIORITY_NORMAL]   = ISCSI_TASK_ATTR_SIMPLE;
+	iscsi->task_attr[ISCSI_TASK_PRIORITY_HIGH]     = ISCSI_TASK_ATTR_SIMPLE;
+	iscsi->starvation_limit                       = 8;
+
 	iscsi->tcp_keepcnt=3;
 	iscsi->tcp_keepintvl=30;
 	iscsi->tcp_keepidle=30;
@@ -325,6 +425,17 @@ iscsi_destroy_context(struct iscsi_context *iscsi)
 		iscsi_free_pdu(iscsi, pdu);
 	}
 
+	for (i = 0; i <= ISCSI_TASK_PRIORITY_HIGH; i++) {
+		while ((pdu = iscsi->pendingqueue[i])) {
+			ISCSI_LIST_REMOVE(&iscsi->pendingqueue[i], pdu);
+			if (iscsi->is_loggedin && pdu->callback) {
+				pdu->callback(iscsi, SCSI_STATUS_CANCELLED, NULL,
+				              pdu->private_data);
+			}
+			iscsi_free_pdu(iscsi, pdu);
+		}
+	}
+
 	if (iscsi->outqueue_current != NULL && iscsi->outqueue_current->flags & ISCSI_PDU_DELETE_WHEN_SENT) {
 		iscsi_free_pdu(iscsi, iscsi->outqueue_current);
 	}
@@ -348,13 +459,17 @@ iscsi_destroy_context(struct iscsi_context *iscsi)
 		ISCSI_LOG(iscsi,5,"memory is clean at iscsi_destroy_context() after %d mallocs, %d realloc(s), %d free(s) and %d reused small allocations",iscsi->mallocs,iscsi->reallocs,iscsi->frees,iscsi->smallocs);
 	}
 
+	iscsi_log_ring_free(iscsi);
+	iscsi_pcap_free(iscsi);
+	iscsi_buffer_pool_free(iscsi);
+
 	if (iscsi->old_iscsi) {
 		iscsi->old_iscsi->fd = -1;
 		iscsi_destroy_context(iscsi->old_iscsi);
 	}
 
 	memset(iscsi, 0, sizeof(struct iscsi_context));
-	free(iscsi);
+	iscsi_mem_free(iscsi);
 
 	return 0;
 }
@@ -583,7 +698,7 @@ iscsi_parse_url(struct iscsi_context *iscsi, const char *url, int full)
 	if (iscsi != NULL) {
 		iscsi_url = iscsi_malloc(iscsi, sizeof(struct iscsi_url));
 	} else {
-		iscsi_url = malloc(sizeof(struct iscsi_url));
+		iscsi_url = iscsi_mem_malloc(sizeof(struct iscsi_url));
 	}
 
 	if (iscsi_url == NULL) {
@@ -646,7 +761,7 @@ iscsi_destroy_url(struct iscsi_url *iscsi_url)
 	if (iscsi != NULL)
 		iscsi_free(iscsi, iscsi_url);
 	else
-		free(iscsi_url);
+		iscsi_mem_free(iscsi_url);
 }
 
 
@@ -46,6 +46,13 @@ iscsi_scsi_response_cb(struct iscsi_context *iscsi, int status,
 	struct iscsi_scsi_cbdata *scsi_cbdata =
 	  (struct iscsi_scsi_cbdata *)private_data;
 
+	iscsi_stats_scsi_status(iscsi, status);
+
+	ISCSI_TRACE(iscsi, task_callback, ISCSI_TRACE_TASK_CALLBACK,
+		    scsi_cbdata->task->itt, scsi_cbdata->task->cmdsn,
+		    ISCSI_PDU_SCSI_REQUEST, scsi_cbdata->task->lun,
+		    scsi_cbdata->task->expxferlen, status);
+
 	switch (status) {
 	case SCSI_STATUS_RESERVATION_CONFLICT:
 	case SCSI_STATUS_CHECK_CONDITION:
@@ -79,64 +86,73 @@ static int
 iscsi_send_data_out(struct iscsi_context *iscsi, struct iscsi_pdu *cmd_pdu,
 		    uint32_t ttt, uint32_t offset, uint32_t tot_len)
 {
-	while (tot_len > 0) {
-		uint32_t len = tot_len;
-		struct iscsi_pdu *pdu;
-		int flags;
-
-		len = MIN(len, iscsi->target_max_recv_data_segment_length);
-
-		pdu = iscsi_allocate_pdu(iscsi,
-					 ISCSI_PDU_DATA_OUT,
-					 ISCSI_PDU_NO_PDU,
-					 cmd_pdu->itt,
-					 ISCSI_PDU_DROP_ON_RECONNECT|ISCSI_PDU_DELETE_WHEN_SENT);
-		if (pdu == NULL) {
-			iscsi_set_error(iscsi, "Out-of-memory, Failed to allocate "
-				"scsi data out pdu.");
-			goto error;
-		}
-		pdu->scsi_cbdata.task         = cmd_pdu->scsi_cbdata.task;
-		/* set the cmdsn in the pdu struct so we can compare with
-		 * maxcmdsn when sending to socket even if data-out pdus
-		 * do not carry a cmdsn on the wire */
-		pdu->cmdsn                    = cmd_pdu->cmdsn;
-
-		if (tot_len == len) {
-			flags = ISCSI_PDU_SCSI_FINAL;
-		} else {
-			flags = 0;
-		}
+	unsigned char hdr[ISCSI_RAW_HEADER_SIZE];
+	struct iscsi_pdu *pdu;
+	uint32_t len, segments;
+	int flags;
 
-		/* flags */
-		iscsi_pdu_set_pduflags(pdu, flags);
+	if (tot_len == 0) {
+		return 0;
+	}
 
-		/* lun */
-		iscsi_pdu_set_lun(pdu, cmd_pdu->lun);
+	/* the header all Data-Out PDUs of the burst start out from */
+	memcpy(hdr, iscsi->data_out_template, ISCSI_RAW_HEADER_SIZE);
+	iscsi_set_be16(&hdr[8], cmd_pdu->lun);
+	iscsi_set_be32(&hdr[20], ttt);
 
-		/* ttt */
-		iscsi_pdu_set_ttt(pdu, ttt);
+	/* The whole burst is queued as this one PDU. It goes out as the
+	 * first segment, and once that has been written the header is
+	 * advanced to the next segment and the PDU written again, see
+	 * iscsi_write_to_socket().
+	 */
+	len = MIN(tot_len, iscsi->target_max_recv_data_segment_length);
+	segments = (tot_len + iscsi->target_max_recv_data_segment_length - 1)
+		/ iscsi->target_max_recv_data_segment_length;
+
+	pdu = iscsi_allocate_pdu_from_template(iscsi, hdr,
+				 ISCSI_PDU_NO_PDU,
+				 cmd_pdu->itt,
+				 ISCSI_PDU_DROP_ON_RECONNECT|ISCSI_PDU_DELETE_WHEN_SENT);
+	if (pdu == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory, Failed to allocate "
+			"scsi data out pdu.");
+		goto error;
+	}
+	pdu->scsi_cbdata.task         = cmd_pdu->scsi_cbdata.task;
+	/* set the cmdsn in the pdu struct so we can compare with
+	 * maxcmdsn when sending to socket even if data-out pdus
+	 * do not carry a cmdsn on the wire */
+	pdu->cmdsn                    = cmd_pdu->cmdsn;
 
-		/* data sn */
-		iscsi_pdu_set_datasn(pdu, cmd_pdu->datasn++);
+	if (tot_len == len) {
+		flags = ISCSI_PDU_SCSI_FINAL;
+	} else {
+		flags = 0;
+	}
 
-		/* buffer offset */
-		iscsi_pdu_set_bufferoffset(pdu, offset);
+	/* flags */
+	iscsi_pdu_set_pduflags(pdu, flags);
 
-		pdu->payload_offset = offset;
-		pdu->payload_len    = len;
+	/* data sn, one for every segment of the burst */
+	pdu->datasn = cmd_pdu->datasn;
+	iscsi_pdu_set_datasn(pdu, pdu->datasn);
+	cmd_pdu->datasn += segments;
 
-		/* update data segment length */
-		scsi_set_uint32(&pdu->outdata.data[4], pdu->payload_len);
+	/* buffer offset */
+	iscsi_pdu_set_bufferoffset(pdu, offset);
 
-		if (iscsi_queue_pdu(iscsi, pdu) != 0) {
-			iscsi_set_error(iscsi, "Out-of-memory: failed to queue iscsi "
-				"scsi pdu.");
-			goto error;
-		}
+	pdu->payload_offset = offset;
+	pdu->payload_len    = len;
+	pdu->burst_end      = offset + tot_len;
+	pdu->segment_len    = iscsi->target_max_recv_data_segment_length;
 
-		tot_len -= len;
-		offset  += len;
+	/* update data segment length */
+	iscsi_set_be32(&pdu->outdata.data[4], pdu->payload_len);
+
+	if (iscsi_queue_pdu(iscsi, pdu) != 0) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to queue iscsi "
+			"scsi pdu.");
+		goto error;
 	}
 	return 0;
 
@@ -160,6 +176,642 @@ iscsi_send_unsolicited_data_out(struct iscsi_context *iscsi, struct iscsi_pdu *p
 				   pdu->payload_len, len);
 }
 
+/* Assign the next CmdSN to a SCSI command PDU and queue it for sending,
+ * followed by any unsolicited data.
+ */
+static int
+iscsi_dispatch_scsi_command(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	time_t scsi_timeout = pdu->scsi_timeout;
+
+	/* cmdsn */
+	iscsi_pdu_set_cmdsn(pdu, iscsi->cmdsn++);
+
+	if (iscsi_queue_pdu(iscsi, pdu) != 0) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to queue iscsi "
+				"scsi pdu.");
+		return -1;
+	}
+
+	/* keep the timeout that was assigned when the task was created */
+	pdu->scsi_timeout = scsi_timeout;
+
+	/* remember cmdsn so we can use task management */
+	pdu->scsi_cbdata.task->cmdsn = pdu->cmdsn;
+
+	/* The F flag is not set. This means we haven't sent all the unsolicited
+	 * data yet. Sent as much as we are allowed as a train of DATA-OUT PDUs.
+	 * We might already have sent some data as immediate data, which we must
+	 * subtract from first_burst_length.
+	 */
+	if (!(pdu->outdata.data[1] & ISCSI_PDU_SCSI_FINAL)) {
+		iscsi_send_unsolicited_data_out(iscsi, pdu);
+	}
+
+	return 0;
+}
+
+/*
+ * Splitting of large READ/WRITE commands into several smaller ones,
+ * see iscsi_set_split_io().
+ */
+struct iscsi_split_task;
+
+struct iscsi_split_part {
+	struct iscsi_split_task *split;
+	uint32_t offset;
+	uint32_t len;
+	uint64_t lba;
+	/* the part is all zero and was sent as WRITE SAME16 */
+	int zero;
+};
+
+struct iscsi_split_task {
+	struct scsi_task *task;
+	iscsi_command_cb cb;
+	void *private_data;
+
+	int outstanding;
+	int status;
+	struct scsi_sense sense;
+	size_t residual;
+
+	struct iscsi_split_part *parts;
+};
+
+static int
+iscsi_split_get_lba(struct scsi_task *task, uint64_t *lba,
+		    uint32_t *num_blocks)
+{
+	switch (task->cdb[0]) {
+	case SCSI_OPCODE_READ10:
+	case SCSI_OPCODE_WRITE10:
+		*lba        = scsi_get_uint32(&task->cdb[2]);
+		*num_blocks = scsi_get_uint16(&task->cdb[7]);
+		return 0;
+	case SCSI_OPCODE_READ12:
+	case SCSI_OPCODE_WRITE12:
+		*lba        = scsi_get_uint32(&task->cdb[2]);
+		*num_blocks = scsi_get_uint32(&task->cdb[6]);
+		return 0;
+	case SCSI_OPCODE_READ16:
+	case SCSI_OPCODE_WRITE16:
+		*lba        = scsi_get_uint64(&task->cdb[2]);
+		*num_blocks = scsi_get_uint32(&task->cdb[10]);
+		return 0;
+	}
+	return -1;
+}
+
+static void
+iscsi_split_set_lba(struct scsi_task *task, uint64_t lba, uint32_t num_blocks)
+{
+	switch (task->cdb[0]) {
+	case SCSI_OPCODE_READ10:
+	case SCSI_OPCODE_WRITE10:
+		scsi_set_uint32(&task->cdb[2], (uint32_t)lba);
+		scsi_set_uint16(&task->cdb[7], (uint16_t)num_blocks);
+		break;
+	case SCSI_OPCODE_READ12:
+	case SCSI_OPCODE_WRITE12:
+		scsi_set_uint32(&task->cdb[2], (uint32_t)lba);
+		scsi_set_uint32(&task->cdb[6], num_blocks);
+		break;
+	case SCSI_OPCODE_READ16:
+	case SCSI_OPCODE_WRITE16:
+		scsi_set_uint64(&task->cdb[2], lba);
+		scsi_set_uint32(&task->cdb[10], num_blocks);
+		break;
+	}
+}
+
+/* Returns the number of blocks each sub-command should transfer, or 0
+ * if the task should be sent as is.
+ */
+static uint32_t
+iscsi_split_chunk_size(struct iscsi_context *iscsi, int lun,
+		       struct scsi_task *task)
+{
+	struct iscsi_block_limits *bl = &iscsi->block_limits;
+	uint64_t lba;
+	uint32_t num_blocks, chunk = 0;
+
+	/* the limits were read from the LUN we logged in to */
+	if (!iscsi->split_io || !bl->valid || lun != iscsi->lun) {
+		return 0;
+	}
+	if (task->xfer_dir == SCSI_XFER_NONE || task->expxferlen <= 0) {
+		return 0;
+	}
+	if (iscsi_split_get_lba(task, &lba, &num_blocks) != 0) {
+		return 0;
+	}
+	if (num_blocks == 0 || task->expxferlen % num_blocks) {
+		return 0;
+	}
+
+	if (bl->max_xfer_len && num_blocks > bl->max_xfer_len) {
+		chunk = bl->max_xfer_len;
+	}
+	if (iscsi->split_io_opt_multiple && bl->opt_xfer_len &&
+	    num_blocks > (uint64_t)bl->opt_xfer_len
+			 * iscsi->split_io_opt_multiple) {
+		chunk = bl->opt_xfer_len;
+		if (bl->max_xfer_len && chunk > bl->max_xfer_len) {
+			chunk = bl->max_xfer_len;
+		}
+	}
+
+	/* keep the sub-commands a multiple of the optimal granularity */
+	if (bl->opt_gran && chunk > bl->opt_gran) {
+		chunk -= chunk % bl->opt_gran;
+	}
+
+	return chunk;
+}
+
+static int
+iscsi_split_write_part(struct iscsi_context *iscsi, int lun,
+		       struct iscsi_split_part *part);
+
+/* All sub-commands have completed, complete the original task */
+static void
+iscsi_split_done(struct iscsi_context *iscsi, struct iscsi_split_task *split)
+{
+	struct scsi_task *task = split->task;
+	iscsi_command_cb cb;
+	void *private_data;
+
+	task->status = split->status;
+	task->sense  = split->sense;
+	task->residual = split->residual;
+	task->residual_status = split->residual ? SCSI_RESIDUAL_UNDERFLOW
+						: SCSI_RESIDUAL_NO_RESIDUAL;
+	if (task->datain.data != NULL) {
+		task->datain.size = task->expxferlen - (int)split->residual;
+	}
+
+	cb = split->cb;
+	private_data = split->private_data;
+	iscsi_free(iscsi, split);
+
+	if (cb) {
+		cb(iscsi, task->status, task, private_data);
+	}
+}
+
+static void
+iscsi_split_cb(struct iscsi_context *iscsi, int status,
+	       void *command_data, void *private_data)
+{
+	struct iscsi_split_part *part = private_data;
+	struct iscsi_split_task *split = part->split;
+	struct scsi_task *sub = command_data;
+
+	if (part->zero && status == SCSI_STATUS_CHECK_CONDITION
+	    && sub->sense.key == SCSI_SENSE_ILLEGAL_REQUEST) {
+		/* The target does not do WRITE SAME16, write the zeroes
+		 * and stop looking for them in later writes.
+		 */
+		ISCSI_LOG(iscsi, 1, "WRITE SAME16 not supported, disabling "
+			  "zero detection");
+		iscsi->zero_detect = 0;
+		scsi_free_scsi_task(sub);
+		if (iscsi_split_write_part(iscsi, split->task->lun,
+					   part) == 0) {
+			return;
+		}
+		status = SCSI_STATUS_ERROR;
+		sub = NULL;
+	}
+
+	if (status != SCSI_STATUS_GOOD && split->status == SCSI_STATUS_GOOD) {
+		split->status = status;
+		if (sub != NULL) {
+			split->sense = sub->sense;
+		}
+	}
+	if (sub != NULL) {
+		if (sub->residual_status == SCSI_RESIDUAL_UNDERFLOW) {
+			split->residual += sub->residual;
+		}
+		scsi_free_scsi_task(sub);
+	}
+
+	if (--split->outstanding == 0) {
+		iscsi_split_done(iscsi, split);
+	}
+}
+
+/* Describe the part of the data of the original task that belongs to
+ * a sub-command. This is done when the data is first needed since the
+ * application may set up the iovectors only after the task has been
+ * issued.
+ */
+static struct scsi_iovector *
+iscsi_split_get_iovector(struct iscsi_context *iscsi, struct scsi_task *sub,
+			 struct iscsi_split_part *part, int is_in)
+{
+	struct scsi_task *task = part->split->task;
+	struct scsi_iovector *src, *dst;
+	uint32_t offset = part->offset;
+	uint32_t len = part->len;
+	int i;
+
+	src = is_in ? &task->iovector_in  : &task->iovector_out;
+	dst = is_in ? &sub->iovector_in   : &sub->iovector_out;
+
+	if (dst->iov != NULL) {
+		return dst;
+	}
+
+	if (src->iov == NULL) {
+		if (!is_in) {
+			return NULL;
+		}
+		/* no buffer from the application, read into task->datain */
+		if (task->datain.data == NULL &&
+		    iscsi_buffer_pool_datain(iscsi, task) == NULL) {
+			task->datain.data = iscsi_mem_malloc(task->expxferlen);
+			if (task->datain.data == NULL) {
+				return NULL;
+			}
+			task->datain.size = task->expxferlen;
+		}
+		if (scsi_task_add_data_in_buffer(sub, len,
+				&task->datain.data[offset]) != 0) {
+			return NULL;
+		}
+		return dst;
+	}
+
+	for (i = 0; i < src->niov && len > 0; i++) {
+		unsigned char *base = src->iov[i].iov_base;
+		uint32_t n;
+
+		if (offset >= src->iov[i].iov_len) {
+			offset -= src->iov[i].iov_len;
+			continue;
+		}
+		n = MIN(src->iov[i].iov_len - offset, len);
+		if (is_in) {
+			if (scsi_task_add_data_in_buffer(sub, n,
+					&base[offset]) != 0) {
+				return NULL;
+			}
+		} else {
+			if (scsi_task_add_data_out_buffer(sub, n,
+					&base[offset]) != 0) {
+				return NULL;
+			}
+		}
+		offset = 0;
+		len -= n;
+	}
+
+	return dst;
+}
+
+static struct iscsi_split_task *
+iscsi_split_alloc(struct iscsi_context *iscsi, struct scsi_task *task,
+		  int nparts, iscsi_command_cb cb, void *private_data)
+{
+	struct iscsi_split_task *split;
+
+	split = iscsi_zmalloc(iscsi, sizeof(struct iscsi_split_task)
+			      + nparts * sizeof(struct iscsi_split_part));
+	if (split == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"split task.");
+		return NULL;
+	}
+	split->parts        = (struct iscsi_split_part *)&split[1];
+	split->task         = task;
+	split->cb           = cb;
+	split->private_data = private_data;
+	split->status       = SCSI_STATUS_GOOD;
+	/* hold a reference of our own until all parts have been issued */
+	split->outstanding  = nparts + 1;
+
+	return split;
+}
+
+/* The first 'issued' of the 'nparts' parts have been sent */
+static int
+iscsi_split_issued(struct iscsi_context *iscsi, int lun,
+		   struct iscsi_split_task *split, int issued, int nparts)
+{
+	split->task->lun = lun;
+
+	if (issued == 0) {
+		iscsi_free(iscsi, split);
+		return -1;
+	}
+	if (issued < nparts) {
+		/* some of the data will never be transferred */
+		split->status = SCSI_STATUS_ERROR;
+	}
+
+	/* drop our own reference and the parts that were never issued */
+	split->outstanding -= nparts - issued;
+	if (--split->outstanding == 0) {
+		iscsi_split_done(iscsi, split);
+	}
+	return 0;
+}
+
+static int
+iscsi_split_scsi_command(struct iscsi_context *iscsi, int lun,
+			 struct scsi_task *task, uint32_t chunk,
+			 iscsi_command_cb cb, void *private_data)
+{
+	struct iscsi_split_task *split;
+	uint64_t lba, end, next;
+	uint32_t num_blocks, block_size, offset;
+	int i, nparts;
+
+	iscsi_split_get_lba(task, &lba, &num_blocks);
+	block_size = task->expxferlen / num_blocks;
+	end = lba + num_blocks;
+
+	/* sub-commands start on a multiple of the chunk size */
+	nparts = 0;
+	for (next = lba; next < end; nparts++) {
+		next += chunk - next % chunk;
+	}
+
+	split = iscsi_split_alloc(iscsi, task, nparts, cb, private_data);
+	if (split == NULL) {
+		return -1;
+	}
+
+	ISCSI_LOG(iscsi, 6, "splitting %u block command at lba %llu "
+		  "into %d commands", num_blocks, (unsigned long long)lba,
+		  nparts);
+
+	offset = 0;
+	for (i = 0; i < nparts; i++) {
+		struct iscsi_split_part *part = &split->parts[i];
+		struct scsi_task *sub;
+		uint32_t len;
+
+		len = MIN(chunk - lba % chunk, end - lba);
+
+		part->split  = split;
+		part->offset = offset;
+		part->len    = len * block_size;
+		part->lba    = lba;
+
+		sub = scsi_create_task(task->cdb_size, task->cdb,
+				       task->xfer_dir, part->len);
+		if (sub == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory: failed to "
+					"create split task.");
+			break;
+		}
+		iscsi_split_set_lba(sub, lba, len);
+
+		if (iscsi_scsi_command_async(iscsi, lun, sub, iscsi_split_cb,
+					     NULL, part) != 0) {
+			scsi_free_scsi_task(sub);
+			break;
+		}
+
+		lba    += len;
+		offset += part->len;
+	}
+
+	return iscsi_split_issued(iscsi, lun, split, i, nparts);
+}
+
+/*
+ * Zero detection in writes, see iscsi_set_zero_detect().
+ */
+
+/* Send a part of a write as a write of its own. The data-out iovector
+ * is set up right away so that the part can be split further.
+ */
+static int
+iscsi_split_write_part(struct iscsi_context *iscsi, int lun,
+		       struct iscsi_split_part *part)
+{
+	struct scsi_task *task = part->split->task;
+	struct scsi_task *sub;
+	uint32_t block_size;
+	uint64_t lba;
+	uint32_t num_blocks;
+
+	iscsi_split_get_lba(task, &lba, &num_blocks);
+	block_size = task->expxferlen / num_blocks;
+
+	part->zero = 0;
+	sub = scsi_create_task(task->cdb_size, task->cdb, SCSI_XFER_WRITE,
+			       part->len);
+	if (sub == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to "
+				"create split task.");
+		return -1;
+	}
+	iscsi_split_set_lba(sub, part->lba, part->len / block_size);
+
+	if (iscsi_split_get_iovector(iscsi, sub, part, 0) == NULL ||
+	    iscsi_scsi_command_async(iscsi, lun, sub, iscsi_split_cb,
+				     NULL, part) != 0) {
+		scsi_free_scsi_task(sub);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+iscsi_split_zero_part(struct iscsi_context *iscsi, int lun,
+		      struct iscsi_split_part *part, uint32_t block_size)
+{
+	struct scsi_task *task = part->split->task;
+	struct scsi_task *sub;
+	unsigned char *zero;
+
+	part->zero = 1;
+	sub = scsi_cdb_writesame16(task->cdb[1] >> 5, 0, iscsi->zero_unmap,
+				   part->lba, 0, part->len / block_size,
+				   block_size);
+	if (sub == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to "
+				"create writesame16 cdb.");
+		return -1;
+	}
+	zero = scsi_malloc(sub, block_size);
+	if (zero == NULL ||
+	    scsi_task_add_data_out_buffer(sub, block_size, zero) != 0 ||
+	    iscsi_scsi_command_async(iscsi, lun, sub, iscsi_split_cb,
+				     NULL, part) != 0) {
+		scsi_free_scsi_task(sub);
+		return -1;
+	}
+	return 0;
+}
+
+/* Is the block at the cursor all zero? Moves the cursor to the next
+ * block.
+ */
+static int
+iscsi_zero_block(struct scsi_iovector *iovector, int *idx, size_t *off,
+		 uint32_t block_size)
+{
+	int zero = 1;
+
+	while (block_size > 0 && *idx < iovector->niov) {
+		struct scsi_iovec *iov = &iovector->iov[*idx];
+		size_t n = MIN(iov->iov_len - *off, block_size);
+
+		if (zero && !iscsi_is_zero((unsigned char *)iov->iov_base
+					   + *off, n)) {
+			zero = 0;
+		}
+		*off += n;
+		block_size -= n;
+		if (*off == iov->iov_len) {
+			(*idx)++;
+			*off = 0;
+		}
+	}
+	return zero && block_size == 0;
+}
+
+struct iscsi_zero_run {
+	uint32_t start;
+	uint32_t len;
+};
+
+/* Returns 1 if there were no zero runs worth sending separately and the
+ * task should be sent as is.
+ */
+static int
+iscsi_zero_scsi_command(struct iscsi_context *iscsi, int lun,
+			struct scsi_task *task, iscsi_command_cb cb,
+			void *private_data)
+{
+	struct iscsi_zero_run *runs = NULL, *tmp;
+	struct iscsi_split_task *split;
+	uint64_t lba, max_ws;
+	uint32_t num_blocks, block_size, blk, start, pos;
+	size_t off = 0;
+	int idx = 0, nruns = 0, maxruns = 0, nparts, i, r;
+
+	if (task->xfer_dir != SCSI_XFER_WRITE
+	    || task->iovector_out.iov == NULL
+	    || iscsi_split_get_lba(task, &lba, &num_blocks) != 0
+	    || num_blocks == 0 || task->expxferlen % num_blocks) {
+		return 1;
+	}
+	/* WRITE SAME has no FUA bit */
+	if (task->cdb[1] & 0x08) {
+		return 1;
+	}
+	block_size = task->expxferlen / num_blocks;
+
+	/* find the runs of zero blocks that are long enough, the end of
+	 * the write terminates the last run.
+	 */
+	start = 0;
+	for (blk = 0; blk <= num_blocks; blk++) {
+		if (blk < num_blocks &&
+		    iscsi_zero_block(&task->iovector_out, &idx, &off,
+				     block_size)) {
+			continue;
+		}
+		if (blk - start >= iscsi->zero_detect) {
+			if (nruns == maxruns) {
+				maxruns = maxruns ? maxruns * 2 : 8;
+				tmp = iscsi_realloc(iscsi, runs, maxruns
+					* sizeof(struct iscsi_zero_run));
+				if (tmp == NULL) {
+					iscsi_free(iscsi, runs);
+					return 1;
+				}
+				runs = tmp;
+			}
+			runs[nruns].start = start;
+			runs[nruns].len = blk - start;
+			nruns++;
+		}
+		start = blk + 1;
+	}
+	if (nruns == 0) {
+		return 1;
+	}
+
+	max_ws = iscsi->block_limits.max_ws_len;
+	if (max_ws == 0 || max_ws > 0xffffffff) {
+		max_ws = 0xffffffff;
+	}
+
+	/* one part for every zero run, or more if it is longer than the
+	 * device allows for a single WRITE SAME, and one for the data
+	 * before every run and after the last one.
+	 */
+	nparts = 0;
+	pos = 0;
+	for (r = 0; r < nruns; r++) {
+		if (runs[r].start > pos) {
+			nparts++;
+		}
+		nparts += (runs[r].len + max_ws - 1) / max_ws;
+		pos = runs[r].start + runs[r].len;
+	}
+	if (pos < num_blocks) {
+		nparts++;
+	}
+
+	split = iscsi_split_alloc(iscsi, task, nparts, cb, private_data);
+	if (split == NULL) {
+		iscsi_free(iscsi, runs);
+		return -1;
+	}
+
+	ISCSI_LOG(iscsi, 6, "sending %d zero runs of the %u block write at "
+		  "lba %llu as WRITE SAME16", nruns, num_blocks,
+		  (unsigned long long)lba);
+
+	i = 0;
+	pos = 0;
+	for (r = 0; r <= nruns && i < nparts; r++) {
+		uint32_t zstart = r < nruns ? runs[r].start : num_blocks;
+		uint32_t zend = r < nruns ? zstart + runs[r].len : num_blocks;
+		struct iscsi_split_part *part;
+
+		if (zstart > pos) {
+			part = &split->parts[i];
+			part->split  = split;
+			part->offset = pos * block_size;
+			part->len    = (zstart - pos) * block_size;
+			part->lba    = lba + pos;
+			if (iscsi_split_write_part(iscsi, lun, part) != 0) {
+				break;
+			}
+			i++;
+		}
+		for (pos = zstart; pos < zend; pos += part->len / block_size) {
+			part = &split->parts[i];
+			part->split  = split;
+			part->offset = pos * block_size;
+			part->len    = MIN(zend - pos, max_ws) * block_size;
+			part->lba    = lba + pos;
+			if (iscsi_split_zero_part(iscsi, lun, part,
+						  block_size) != 0) {
+				break;
+			}
+			i++;
+		}
+		if (pos < zend) {
+			break;
+		}
+	}
+	iscsi_free(iscsi, runs);
+
+	return iscsi_split_issued(iscsi, lun, split, i, nparts);
+}
+
 /* Using 'struct iscsi_data *d' for data-out is optional
  * and will be converted into a one element data-out iovector.
  */
@@ -169,6 +821,7 @@ iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
 			 struct iscsi_data *d, void *private_data)
 {
 	struct iscsi_pdu *pdu;
+	uint32_t chunk;
 	int flags;
 
 	if (iscsi->old_iscsi) {
@@ -203,8 +856,25 @@ iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
 		scsi_task_set_iov_out(task, iov, 1);
 	}
 
-	pdu = iscsi_allocate_pdu(iscsi,
-				 ISCSI_PDU_SCSI_REQUEST,
+	/* The parts of a write that has already been taken apart are not
+	 * looked at again.
+	 */
+	if (iscsi->zero_detect && cb != iscsi_split_cb && lun == iscsi->lun) {
+		int ret = iscsi_zero_scsi_command(iscsi, lun, task, cb,
+						  private_data);
+		if (ret <= 0) {
+			return ret;
+		}
+	}
+
+	chunk = iscsi_split_chunk_size(iscsi, lun, task);
+	if (chunk) {
+		return iscsi_split_scsi_command(iscsi, lun, task, chunk,
+						cb, private_data);
+	}
+
+	pdu = iscsi_allocate_pdu_from_template(iscsi,
+				 iscsi->scsi_command_template,
 				 ISCSI_PDU_SCSI_RESPONSE,
 				 iscsi_itt_post_increment(iscsi),
 				 0);
@@ -224,7 +894,7 @@ iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
 	scsi_set_task_private_ptr(task, &pdu->scsi_cbdata);
 	
 	/* flags */
-	flags = ISCSI_PDU_SCSI_FINAL|ISCSI_PDU_SCSI_ATTR_SIMPLE;
+	flags = ISCSI_PDU_SCSI_FINAL|iscsi->task_attr[iscsi->task_priority];
 	switch (task->xfer_dir) {
 	case SCSI_XFER_NONE:
 		break;
@@ -245,7 +915,7 @@ iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
 			pdu->payload_len    = len;
 
 			/* update data segment length */
-			scsi_set_uint32(&pdu->outdata.data[4], pdu->payload_len);
+			iscsi_set_be32(&pdu->outdata.data[4], pdu->payload_len);
 		}
 		/* We have (more) data to send and we are allowed to send
 		 * it as unsolicited data-out segments.
@@ -271,36 +941,148 @@ iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
 	/* expxferlen */
 	iscsi_pdu_set_expxferlen(pdu, task->expxferlen);
 
-	/* cmdsn */
-	iscsi_pdu_set_cmdsn(pdu, iscsi->cmdsn++);
-
-	/* cdb */
-	iscsi_pdu_set_cdb(pdu, task);
+	/* cdb, the rest of the field is zero in the template */
+	memcpy(&pdu->outdata.data[32], task->cdb, task->cdb_size);
 
 	pdu->callback     = iscsi_scsi_response_cb;
 	pdu->private_data = &pdu->scsi_cbdata;
+	pdu->priority     = iscsi->task_priority;
 
-	if (iscsi_queue_pdu(iscsi, pdu) != 0) {
-		iscsi_set_error(iscsi, "Out-of-memory: failed to queue iscsi "
-				"scsi pdu.");
+	/* remember itt so we can use task management. The cmdsn is
+	 * filled in once the command is dispatched.
+	 */
+	task->itt   = pdu->itt;
+	task->lun   = lun;
+
+	ISCSI_TRACE(iscsi, task_submit, ISCSI_TRACE_TASK_SUBMIT, task->itt,
+		    pdu->cmdsn, ISCSI_PDU_SCSI_REQUEST, lun, task->expxferlen, 0);
+
+	if (iscsi->scsi_timeout > 0) {
+		pdu->scsi_timeout = time(NULL) + iscsi->scsi_timeout;
+	}
+
+	/* If the CmdSN window is closed, or other commands are already
+	 * waiting for it to open, keep the command on the pending queue
+	 * for its priority. It will be assigned a CmdSN and be queued for
+	 * sending from iscsi_dispatch_pending_commands().
+	 */
+	if (iscsi->pendingqueue[ISCSI_TASK_PRIORITY_NORMAL] != NULL ||
+	    iscsi->pendingqueue[ISCSI_TASK_PRIORITY_HIGH] != NULL ||
+	    iscsi_serial32_compare(iscsi->cmdsn, iscsi->maxcmdsn) > 0) {
+		ISCSI_LIST_ADD_END(&iscsi->pendingqueue[pdu->priority], pdu);
+		iscsi_dispatch_pending_commands(iscsi);
+		return 0;
+	}
+
+	if (iscsi_dispatch_scsi_command(iscsi, pdu) != 0) {
 		iscsi_free_pdu(iscsi, pdu);
 		return -1;
 	}
 
-	/* The F flag is not set. This means we haven't sent all the unsolicited
-	 * data yet. Sent as much as we are allowed as a train of DATA-OUT PDUs.
-	 * We might already have sent some data as immediate data, which we must
-	 * subtract from first_burst_length.
-	 */
-	if (!(flags & ISCSI_PDU_SCSI_FINAL)) {
-		iscsi_send_unsolicited_data_out(iscsi, pdu);
+	return 0;
+}
+
+void
+iscsi_dispatch_pending_commands(struct iscsi_context *iscsi)
+{
+	struct iscsi_pdu **queue;
+	struct iscsi_pdu *pdu;
+
+	while (iscsi_serial32_compare(iscsi->cmdsn, iscsi->maxcmdsn) <= 0) {
+		if (iscsi->pendingqueue[ISCSI_TASK_PRIORITY_NORMAL] == NULL) {
+			iscsi->starvation_cnt = 0;
+		}
+		if (iscsi->pendingqueue[ISCSI_TASK_PRIORITY_HIGH] != NULL &&
+		    (iscsi->starvation_limit == 0 ||
+		     iscsi->starvation_cnt < iscsi->starvation_limit)) {
+			queue = &iscsi->pendingqueue[ISCSI_TASK_PRIORITY_HIGH];
+			if (iscsi->pendingqueue[ISCSI_TASK_PRIORITY_NORMAL] != NULL) {
+				iscsi->starvation_cnt++;
+			}
+		} else if (iscsi->pendingqueue[ISCSI_TASK_PRIORITY_NORMAL] != NULL) {
+			queue = &iscsi->pendingqueue[ISCSI_TASK_PRIORITY_NORMAL];
+			iscsi->starvation_cnt = 0;
+		} else {
+			break;
+		}
+
+		pdu = *queue;
+		ISCSI_LIST_REMOVE(queue, pdu);
+
+		if (iscsi_dispatch_scsi_command(iscsi, pdu) != 0) {
+			if (pdu->callback) {
+				pdu->callback(iscsi, SCSI_STATUS_ERROR, NULL,
+				              pdu->private_data);
+			}
+			iscsi_free_pdu(iscsi, pdu);
+		}
 	}
 
-	/* remember cmdsn and itt so we can use task management */
-	task->cmdsn = pdu->cmdsn;
-	task->itt   = pdu->itt;
-	task->lun   = lun;
+	iscsi_stats_cmdsn_window(iscsi);
+}
 
+int
+iscsi_set_task_priority(struct iscsi_context *iscsi,
+			enum iscsi_task_priority priority)
+{
+	if ((unsigned)priority > ISCSI_TASK_PRIORITY_HIGH) {
+		iscsi_set_error(iscsi, "invalid task priority %d", priority);
+		return -1;
+	}
+
+	iscsi->task_priority = priority;
+	return 0;
+}
+
+int
+iscsi_set_task_attribute(struct iscsi_context *iscsi,
+			 enum iscsi_task_priority priority,
+			 enum iscsi_task_attribute attr)
+{
+	if ((unsigned)priority > ISCSI_TASK_PRIORITY_HIGH) {
+		iscsi_set_error(iscsi, "invalid task priority %d", priority);
+		return -1;
+	}
+	if ((unsigned)attr > ISCSI_TASK_ATTR_ACA) {
+		iscsi_set_error(iscsi, "invalid task attribute %d", attr);
+		return -1;
+	}
+
+	iscsi->task_attr[priority] = attr;
+	return 0;
+}
+
+int
+iscsi_set_task_starvation_limit(struct iscsi_context *iscsi, int count)
+{
+	if (count < 0) {
+		iscsi_set_error(iscsi, "invalid task starvation limit %d",
+				count);
+		return -1;
+	}
+
+	iscsi->starvation_limit = count;
+	return 0;
+}
+
+int
+iscsi_set_split_io(struct iscsi_context *iscsi, int enable, int opt_multiple)
+{
+	if (opt_multiple < 0) {
+		iscsi_set_error(iscsi, "invalid optimal transfer length "
+				"multiple %d", opt_multiple);
+		return -1;
+	}
+
+	iscsi->split_io = enable ? 1 : 0;
+	iscsi->split_io_opt_multiple = opt_multiple;
+	return 0;
+}
+
+int
+iscsi_set_zero_detect(struct iscsi_context *iscsi, uint32_t min_blocks)
+{
+	iscsi->zero_detect = min_blocks;
 	return 0;
 }
 
@@ -360,6 +1142,33 @@ void scsi_parse_sense_data(struct scsi_sense *sense, const uint8_t *sb)
 	}
 }
 
+/* Hand the data read by the command over to the task */
+static void
+iscsi_scsi_set_datain(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+		      struct scsi_task *task)
+{
+	if (iscsi_buffer_pool_task(task)) {
+		/* it went straight into a buffer of the pool */
+		task->datain.size = task->expxferlen;
+		if (task->residual_status == SCSI_RESIDUAL_UNDERFLOW) {
+			task->datain.size -= task->residual;
+		}
+		return;
+	}
+
+	task->datain.data = pdu->indata.data;
+	task->datain.size = pdu->indata.size;
+
+	/* the pdu->indata.data was malloc'ed by iscsi_malloc,
+	   as long as we have no struct iscsi_task we cannot track
+	   the free'ing of this buffer which is currently
+	   done in scsi_free_scsi_task() */
+	if (pdu->indata.data != NULL) iscsi->frees++;
+
+	pdu->indata.data = NULL;
+	pdu->indata.size = 0;
+}
+
 int
 iscsi_process_scsi_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 			 struct iscsi_in_pdu *in)
@@ -417,17 +1226,7 @@ iscsi_process_scsi_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 	switch (status) {
 	case SCSI_STATUS_GOOD:
 	case SCSI_STATUS_CONDITION_MET:
-		task->datain.data = pdu->indata.data;
-		task->datain.size = pdu->indata.size;
-
-		/* the pdu->datain.data was malloc'ed by iscsi_malloc,
-		   as long as we have no struct iscsi_task we cannot track
-		   the free'ing of this buffer which is currently
-		   done in scsi_free_scsi_task() */
-		if (pdu->indata.data != NULL) iscsi->frees++;
-
-		pdu->indata.data = NULL;
-		pdu->indata.size = 0;
+		iscsi_scsi_set_datain(iscsi, pdu, task);
 
 		if (pdu->callback) {
 			pdu->callback(iscsi, SCSI_STATUS_GOOD, task,
@@ -435,8 +1234,9 @@ iscsi_process_scsi_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 		}
 		break;
 	case SCSI_STATUS_CHECK_CONDITION:
+		iscsi_buffer_pool_release_datain(task);
 		task->datain.size = in->data_pos;
-		task->datain.data = malloc(task->datain.size);
+		task->datain.data = iscsi_mem_malloc(task->datain.size);
 		if (task->datain.data == NULL) {
 			iscsi_set_error(iscsi, "failed to allocate blob for "
 					"sense data");
@@ -563,17 +1363,7 @@ iscsi_process_scsi_data_in(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 	 * the s-bit set, so invoke the callback.
 	 */
 	status = in->hdr[3];
-	task->datain.data = pdu->indata.data;
-	task->datain.size = pdu->indata.size;
-
-	/* the pdu->indata.data was malloc'ed by iscsi_malloc,
-	   as long as we have no struct iscsi_task we cannot track
-	   the free'ing of this buffer which is currently
-	   done in scsi_free_scsi_task() */
-	if (pdu->indata.data != NULL) iscsi->frees++;
-	
-	pdu->indata.data = NULL;
-	pdu->indata.size = 0;
+	iscsi_scsi_set_datain(iscsi, pdu, task);
 
 	if (pdu->callback) {
 		pdu->callback(iscsi, status, task, pdu->private_data);
@@ -592,6 +1382,7 @@ iscsi_process_r2t(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 	offset = scsi_get_uint32(&in->hdr[40]);
 	len    = scsi_get_uint32(&in->hdr[44]);
 
+	iscsi->stats.r2ts++;
 	pdu->datasn = 0;
 	iscsi_send_data_out(iscsi, pdu, ttt, offset, len);
 	return 0;
@@ -1689,6 +2480,7 @@ struct scsi_iovector *
 iscsi_get_scsi_task_iovector_in(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
 {
 	struct iscsi_pdu *pdu;
+	struct scsi_task *task;
 	uint32_t itt;
 
 	if ((in->hdr[0] & 0x3f) != ISCSI_PDU_DATA_IN) {
@@ -1706,16 +2498,46 @@ iscsi_get_scsi_task_iovector_in(struct iscsi_context *iscsi, struct iscsi_in_pdu
 		return NULL;
 	}
 
-	if (pdu->scsi_cbdata.task->iovector_in.iov == NULL) {
-		return NULL;
+	if (pdu->scsi_cbdata.callback == iscsi_split_cb) {
+		return iscsi_split_get_iovector(iscsi, pdu->scsi_cbdata.task,
+						pdu->scsi_cbdata.private_data,
+						1);
+	}
+
+	task = pdu->scsi_cbdata.task;
+	if (task->iovector_in.iov == NULL) {
+		/* no buffer from the application, receive straight into
+		 * one from the pool rather than reassembling the data,
+		 * unless the reassembly has already started
+		 */
+		if (pdu->indata.size != 0 ||
+		    iscsi_buffer_pool_datain(iscsi, task) == NULL) {
+			return NULL;
+		}
+		if (scsi_task_add_data_in_buffer(task, task->expxferlen,
+						 task->datain.data) != 0) {
+			iscsi_buffer_pool_release_datain(task);
+			return NULL;
+		}
 	}
 
-	return &pdu->scsi_cbdata.task->iovector_in;
+	return &task->iovector_in;
 }
 
 struct scsi_iovector *
 iscsi_get_scsi_task_iovector_out(struct iscsi_context *iscsi _U_, struct iscsi_pdu *pdu)
 {
+	struct iscsi_scsi_cbdata *scsi_cbdata;
+
+	/* DATA-OUT PDUs only reference the task, the callback is found
+	 * through the SCSI command PDU.
+	 */
+	scsi_cbdata = scsi_get_task_private_ptr(pdu->scsi_cbdata.task);
+	if (scsi_cbdata != NULL && scsi_cbdata->callback == iscsi_split_cb) {
+		return iscsi_split_get_iovector(iscsi, pdu->scsi_cbdata.task,
+						scsi_cbdata->private_data, 0);
+	}
+
 	if (pdu->scsi_cbdata.task->iovector_out.iov == NULL) {
 		return NULL;
 	}
@@ -1914,6 +2736,7 @@ iscsi_scsi_cancel_task(struct iscsi_context *iscsi,
 		       struct scsi_task *task)
 {
 	struct iscsi_pdu *pdu;
+	int i;
 
 	for (pdu = iscsi->waitpdu; pdu; pdu = pdu->next) {
 		if (pdu->itt == task->itt) {
@@ -1937,6 +2760,20 @@ iscsi_scsi_cancel_task(struct iscsi_context *iscsi,
 			return 0;
 		}
 	}
+	for (i = 0; i <= ISCSI_TASK_PRIORITY_HIGH; i++) {
+		for (pdu = iscsi->pendingqueue[i]; pdu; pdu = pdu->next) {
+			if (pdu->itt == task->itt) {
+				ISCSI_LIST_REMOVE(&iscsi->pendingqueue[i], pdu);
+				iscsi_stats_cmdsn_window(iscsi);
+				if (pdu->callback) {
+					pdu->callback(iscsi, SCSI_STATUS_CANCELLED,
+						      NULL, pdu->private_data);
+				}
+				iscsi_free_pdu(iscsi, pdu);
+				return 0;
+			}
+		}
+	}
 	return -1;
 }
 
@@ -1944,6 +2781,7 @@ void
 iscsi_scsi_cancel_all_tasks(struct iscsi_context *iscsi)
 {
 	struct iscsi_pdu *pdu;
+	int i;
 
 	while ((pdu = iscsi->waitpdu)) {
 		ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
@@ -1961,4 +2799,15 @@ iscsi_scsi_cancel_all_tasks(struct iscsi_context *iscsi)
 		}
 		iscsi_free_pdu(iscsi, pdu);
 	}
+	for (i = 0; i <= ISCSI_TASK_PRIORITY_HIGH; i++) {
+		while ((pdu = iscsi->pendingqueue[i])) {
+			ISCSI_LIST_REMOVE(&iscsi->pendingqueue[i], pdu);
+			if (pdu->callback) {
+				pdu->callback(iscsi, SCSI_STATUS_CANCELLED, NULL,
+					      pdu->private_data);
+			}
+			iscsi_free_pdu(iscsi, pdu);
+		}
+	}
+	iscsi_stats_cmdsn_window(iscsi);
 }
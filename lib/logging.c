@@ -37,6 +37,10 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include "iscsi.h"
 #include "iscsi-private.h"
 #include "scsi-lowlevel.h"
@@ -53,6 +57,435 @@ iscsi_set_log_fn(struct iscsi_context *iscsi, iscsi_log_fn fn)
 	iscsi->log_fn = fn;
 }
 
+/*
+ * Deferred logging, see iscsi_set_log_ring().
+ *
+ * An entry keeps the format string and the raw arguments. The arguments
+ * are fetched by walking the conversions of the format string, and the
+ * message is put together again one conversion at a time with
+ * snprintf(). Formats this can not handle, such as '*' widths, are
+ * formatted right away into the string buffer of the entry instead.
+ */
+#define LOG_RING_ARGS     8
+#define LOG_RING_STRINGS  128
+
+#if defined(__GNUC__)
+#define LOG_RING_LOAD(p)     __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define LOG_RING_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#else
+#define LOG_RING_LOAD(p)     (*(volatile uint32_t *)(p))
+#define LOG_RING_STORE(p, v) (*(volatile uint32_t *)(p) = (v))
+#endif
+
+enum log_arg_type {
+	LOG_ARG_NONE,
+	LOG_ARG_INT,
+	LOG_ARG_LONG,
+	LOG_ARG_LLONG,
+	LOG_ARG_SIZE,
+	LOG_ARG_INTMAX,
+	LOG_ARG_PTRDIFF,
+	LOG_ARG_DOUBLE,
+	LOG_ARG_PTR,
+	LOG_ARG_STR,
+	LOG_ARG_UNSUPPORTED
+};
+
+struct log_entry {
+	const char *format;
+	int level;
+	int nargs;
+	/* whether the target name was set when the message was logged */
+	int target;
+	union {
+		intmax_t i;
+		double d;
+		const void *p;
+	} args[LOG_RING_ARGS];
+	/* copies of the %s arguments, args[].i is the offset */
+	char strings[LOG_RING_STRINGS];
+};
+
+struct iscsi_log_ring {
+	enum iscsi_log_ring_mode mode;
+	uint32_t size;
+	/* only written by the thread using the context */
+	uint32_t head;
+	uint32_t dropped;
+	/* only written by the thread draining the ring */
+	uint32_t tail;
+	uint32_t dropped_reported;
+	struct log_entry entries[1];
+};
+
+/*
+ * Find the next conversion in format. Returns a pointer to its '%' or
+ * NULL if there is none, and sets *end to the character following it
+ * and *type to the type of its argument.
+ */
+static const char *
+log_next_conversion(const char *format, const char **end,
+		    enum log_arg_type *type)
+{
+	const char *conv, *p;
+	int longs = 0, other = 0;
+
+	conv = strchr(format, '%');
+	if (conv == NULL) {
+		return NULL;
+	}
+	p = conv + 1;
+	p += strspn(p, "-+ #0");
+	p += strspn(p, "0123456789.");
+	if (*p == '*') {
+		*type = LOG_ARG_UNSUPPORTED;
+		*end = p;
+		return conv;
+	}
+
+	while (*p == 'h' || *p == 'l') {
+		if (*p++ == 'l') {
+			longs++;
+		}
+	}
+	if (*p == 'z' || *p == 'j' || *p == 't' || *p == 'L') {
+		other = *p++;
+	}
+
+	switch (*p) {
+	case '%':
+		*type = LOG_ARG_NONE;
+		break;
+	case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+		if (other == 'z') {
+			*type = LOG_ARG_SIZE;
+		} else if (other == 'j') {
+			*type = LOG_ARG_INTMAX;
+		} else if (other == 't') {
+			*type = LOG_ARG_PTRDIFF;
+		} else if (other) {
+			*type = LOG_ARG_UNSUPPORTED;
+		} else {
+			*type = longs == 0 ? LOG_ARG_INT :
+				longs == 1 ? LOG_ARG_LONG : LOG_ARG_LLONG;
+		}
+		break;
+	case 'e': case 'E': case 'f': case 'F':
+	case 'g': case 'G': case 'a': case 'A':
+		*type = other || longs ? LOG_ARG_UNSUPPORTED : LOG_ARG_DOUBLE;
+		break;
+	case 'p':
+		*type = LOG_ARG_PTR;
+		break;
+	case 's':
+		*type = other || longs ? LOG_ARG_UNSUPPORTED : LOG_ARG_STR;
+		break;
+	default:
+		*type = LOG_ARG_UNSUPPORTED;
+		break;
+	}
+	*end = *p ? p + 1 : p;
+	return conv;
+}
+
+static void
+log_entry_record(struct iscsi_context *iscsi, struct log_entry *e,
+		 int level, const char *format, va_list ap)
+{
+	const char *conv, *end, *str;
+	enum log_arg_type type;
+	size_t used = 0, len;
+	va_list aq;
+
+	e->format = format;
+	e->level  = level;
+	e->nargs  = 0;
+	e->target = iscsi->target_name[0] != 0;
+
+	va_copy(aq, ap);
+	while ((conv = log_next_conversion(format, &end, &type)) != NULL) {
+		format = end;
+		if (type == LOG_ARG_NONE) {
+			continue;
+		}
+		if (type == LOG_ARG_UNSUPPORTED || e->nargs == LOG_RING_ARGS) {
+			goto format_now;
+		}
+		switch (type) {
+		case LOG_ARG_INT:
+			e->args[e->nargs].i = va_arg(aq, int);
+			break;
+		case LOG_ARG_LONG:
+			e->args[e->nargs].i = va_arg(aq, long);
+			break;
+		case LOG_ARG_LLONG:
+			e->args[e->nargs].i = va_arg(aq, long long);
+			break;
+		case LOG_ARG_SIZE:
+			e->args[e->nargs].i = va_arg(aq, size_t);
+			break;
+		case LOG_ARG_INTMAX:
+			e->args[e->nargs].i = va_arg(aq, intmax_t);
+			break;
+		case LOG_ARG_PTRDIFF:
+			e->args[e->nargs].i = va_arg(aq, ptrdiff_t);
+			break;
+		case LOG_ARG_DOUBLE:
+			e->args[e->nargs].d = va_arg(aq, double);
+			break;
+		case LOG_ARG_PTR:
+			e->args[e->nargs].p = va_arg(aq, void *);
+			break;
+		case LOG_ARG_STR:
+			str = va_arg(aq, const char *);
+			if (str == NULL) {
+				str = "(null)";
+			}
+			if (used == LOG_RING_STRINGS) {
+				/* points at the terminator of the last copy */
+				e->args[e->nargs].i = LOG_RING_STRINGS - 1;
+				break;
+			}
+			len = strlen(str);
+			if (len > LOG_RING_STRINGS - used - 1) {
+				len = LOG_RING_STRINGS - used - 1;
+			}
+			memcpy(&e->strings[used], str, len);
+			e->strings[used + len] = 0;
+			e->args[e->nargs].i = used;
+			used += len + 1;
+			break;
+		default:
+			break;
+		}
+		e->nargs++;
+	}
+	va_end(aq);
+	return;
+
+ format_now:
+	va_end(aq);
+	vsnprintf(e->strings, LOG_RING_STRINGS, e->format, ap);
+	e->format = "%s";
+	e->nargs = 1;
+	e->args[0].i = 0;
+}
+
+static void
+log_entry_format(struct iscsi_context *iscsi, const struct log_entry *e,
+		 char *buf, size_t size)
+{
+	const char *format = e->format, *conv, *end;
+	enum log_arg_type type;
+	char spec[32];
+	size_t pos = 0;
+	int i = 0, ret;
+
+	while ((conv = log_next_conversion(format, &end, &type)) != NULL) {
+		ret = snprintf(&buf[pos], size - pos, "%.*s",
+			       (int)(conv - format), format);
+		pos += ret > 0 ? ret : 0;
+		if (pos >= size - 1) {
+			break;
+		}
+		format = end;
+
+		if (type == LOG_ARG_NONE || i == e->nargs ||
+		    end - conv >= (int)sizeof(spec)) {
+			buf[pos++] = '%';
+			buf[pos] = 0;
+			continue;
+		}
+		memcpy(spec, conv, end - conv);
+		spec[end - conv] = 0;
+
+		switch (type) {
+		case LOG_ARG_INT:
+			ret = snprintf(&buf[pos], size - pos, spec,
+				       (int)e->args[i].i);
+			break;
+		case LOG_ARG_LONG:
+			ret = snprintf(&buf[pos], size - pos, spec,
+				       (long)e->args[i].i);
+			break;
+		case LOG_ARG_LLONG:
+			ret = snprintf(&buf[pos], size - pos, spec,
+				       (long long)e->args[i].i);
+			break;
+		case LOG_ARG_SIZE:
+			ret = snprintf(&buf[pos], size - pos, spec,
+				       (size_t)e->args[i].i);
+			break;
+		case LOG_ARG_INTMAX:
+			ret = snprintf(&buf[pos], size - pos, spec,
+				       e->args[i].i);
+			break;
+		case LOG_ARG_PTRDIFF:
+			ret = snprintf(&buf[pos], size - pos, spec,
+				       (ptrdiff_t)e->args[i].i);
+			break;
+		case LOG_ARG_DOUBLE:
+			ret = snprintf(&buf[pos], size - pos, spec,
+				       e->args[i].d);
+			break;
+		case LOG_ARG_PTR:
+			ret = snprintf(&buf[pos], size - pos, spec,
+				       e->args[i].p);
+			break;
+		case LOG_ARG_STR:
+			ret = snprintf(&buf[pos], size - pos, spec,
+				       &e->strings[e->args[i].i]);
+			break;
+		default:
+			ret = 0;
+			break;
+		}
+		i++;
+		pos += ret > 0 ? ret : 0;
+		if (pos >= size - 1) {
+			break;
+		}
+	}
+	if (pos < size - 1) {
+		snprintf(&buf[pos], size - pos, "%s", format);
+	}
+	pos = strlen(buf);
+
+	if (e->target && pos < size - 1) {
+		snprintf(&buf[pos], size - pos, " [%s]", iscsi->target_name);
+	}
+}
+
+static void
+iscsi_log_ring_record(struct iscsi_context *iscsi, int level,
+		      const char *format, va_list ap)
+{
+	struct iscsi_log_ring *ring = iscsi->log_ring;
+	uint32_t head = ring->head;
+	uint32_t tail = LOG_RING_LOAD(&ring->tail);
+
+	if (head - tail == ring->size) {
+		if (ring->mode != ISCSI_LOG_RING_FLIGHT_RECORDER) {
+			LOG_RING_STORE(&ring->dropped, ring->dropped + 1);
+			return;
+		}
+		/* a flight recorder is only drained by this thread */
+		LOG_RING_STORE(&ring->tail, tail + 1);
+	}
+	log_entry_record(iscsi, &ring->entries[head & (ring->size - 1)],
+			 level, format, ap);
+	LOG_RING_STORE(&ring->head, head + 1);
+}
+
+int
+iscsi_log_ring_drain(struct iscsi_context *iscsi, int max)
+{
+	struct iscsi_log_ring *ring = iscsi->log_ring;
+	char message[1024];
+	uint32_t head, tail, dropped;
+	int count = 0;
+
+	if (ring == NULL) {
+		return 0;
+	}
+
+	dropped = LOG_RING_LOAD(&ring->dropped);
+	if (dropped != ring->dropped_reported && iscsi->log_fn) {
+		snprintf(message, sizeof(message),
+			 "%u log messages were dropped, the log ring is full",
+			 dropped - ring->dropped_reported);
+		iscsi->log_fn(1, message);
+	}
+	ring->dropped_reported = dropped;
+
+	tail = ring->tail;
+	head = LOG_RING_LOAD(&ring->head);
+	while (tail != head && (max <= 0 || count < max)) {
+		const struct log_entry *e = &ring->entries[tail & (ring->size - 1)];
+
+		if (iscsi->log_fn) {
+			log_entry_format(iscsi, e, message, sizeof(message));
+			iscsi->log_fn(e->level, message);
+		}
+		LOG_RING_STORE(&ring->tail, ++tail);
+		count++;
+	}
+	return count;
+}
+
+/*
+ * Pass the contents of a flight recorder to the log function. Called
+ * when a command timed out or the connection failed.
+ */
+void
+iscsi_log_ring_dump(struct iscsi_context *iscsi, const char *reason)
+{
+	struct iscsi_log_ring *ring = iscsi->log_ring;
+	char message[1024];
+
+	if (ring == NULL || ring->mode != ISCSI_LOG_RING_FLIGHT_RECORDER ||
+	    iscsi->log_fn == NULL || ring->head == ring->tail) {
+		return;
+	}
+
+	snprintf(message, sizeof(message),
+		 "flight recorder: the last %u log messages before: %s",
+		 ring->head - ring->tail, reason);
+	iscsi->log_fn(1, message);
+	iscsi_log_ring_drain(iscsi, 0);
+	iscsi->log_fn(1, "flight recorder: end");
+}
+
+void
+iscsi_log_ring_free(struct iscsi_context *iscsi)
+{
+	if (iscsi->log_ring == NULL) {
+		return;
+	}
+	if (iscsi->log_ring->mode == ISCSI_LOG_RING_DRAIN) {
+		iscsi_log_ring_drain(iscsi, 0);
+	}
+	iscsi_mem_free(iscsi->log_ring);
+	iscsi->log_ring = NULL;
+}
+
+int
+iscsi_set_log_ring(struct iscsi_context *iscsi, int entries,
+		   enum iscsi_log_ring_mode mode)
+{
+	struct iscsi_log_ring *ring;
+	uint32_t size = 1;
+
+	if (entries < 0 || entries > (1 << 24) ||
+	    (mode != ISCSI_LOG_RING_DRAIN &&
+	     mode != ISCSI_LOG_RING_FLIGHT_RECORDER)) {
+		iscsi_set_error(iscsi, "invalid log ring of %d entries, mode %d",
+				entries, mode);
+		return -1;
+	}
+
+	iscsi_log_ring_free(iscsi);
+	if (entries == 0) {
+		return 0;
+	}
+
+	while (size < (uint32_t)entries) {
+		size <<= 1;
+	}
+	ring = iscsi_mem_malloc(offsetof(struct iscsi_log_ring, entries) +
+		      size * sizeof(struct log_entry));
+	if (ring == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"a log ring of %u entries", size);
+		return -1;
+	}
+	memset(ring, 0, offsetof(struct iscsi_log_ring, entries));
+	ring->mode = mode;
+	ring->size = size;
+	iscsi->log_ring = ring;
+	return 0;
+}
+
 void
 iscsi_log_message(struct iscsi_context *iscsi, int level, const char *format, ...)
 {
@@ -64,6 +497,13 @@ iscsi_log_message(struct iscsi_context *iscsi, int level, const char *format, ..
 		return;
 	}
 
+	if (iscsi->log_ring) {
+		va_start(ap, format);
+		iscsi_log_ring_record(iscsi, level, format, ap);
+		va_end(ap);
+		return;
+	}
+
         va_start(ap, format);
 	ret = vsnprintf(message, 1024, format, ap);
         va_end(ap);
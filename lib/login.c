@@ -615,7 +615,7 @@ typedef struct MD5Context *gcry_md_hd_t;
 static void gcry_md_open(gcry_md_hd_t *hd, int algo, unsigned int flags)
 {
 	assert(algo == GCRY_MD_MD5 && flags == 0);
-	*hd = malloc(sizeof(struct MD5Context));
+	*hd = iscsi_mem_malloc(sizeof(struct MD5Context));
 	if (*hd) {
 		MD5Init(*hd);
 	}
@@ -638,7 +638,7 @@ static char *gcry_md_read(gcry_md_hd_t h, int algo)
 static void gcry_md_close(gcry_md_hd_t h)
 {
 	memset(h, 0, sizeof(*h));
-	free(h);
+	iscsi_mem_free(h);
 }
 #endif
 
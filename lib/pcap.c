@@ -0,0 +1,718 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#ifdef HAVE_ARPA_INET_H
+#include <arpa/inet.h>
+#endif
+
+#ifdef AROS
+#include "aros/aros_compat.h"
+#endif
+
+#if defined(WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include "win32/win32_compat.h"
+#else
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "slist.h"
+
+/*
+ * Capture of the PDUs of a context into pcap files, see
+ * iscsi_set_pcap_capture().
+ *
+ * Every PDU is written as one or more TCP segments with made up IP and
+ * TCP headers, using the addresses and ports of the connection and
+ * sequence numbers that count the bytes of the PDUs, so that Wireshark
+ * can reassemble and dissect them.
+ *
+ * The records are put together in chunks of memory by the thread doing
+ * the I/O and written to the file by a thread of their own. When all
+ * chunks are waiting to be written, PDUs are dropped and counted rather
+ * than waiting for the disk. Without pthread support the chunks are
+ * written from the I/O thread when they fill up.
+ */
+
+#define PCAP_CHUNK_SIZE    (1024 * 1024)
+#define PCAP_MAX_CHUNKS    8
+#define PCAP_SEGMENT_SIZE  65000
+#define PCAP_SNAPLEN       262144
+#define PCAP_LINKTYPE_RAW  101
+#define PCAP_RECORD_SIZE   16
+#define PCAP_FILE_HEADER   24
+#define PCAP_IP4_SIZE      20
+#define PCAP_IP6_SIZE      40
+#define PCAP_TCP_SIZE      20
+
+union pcap_address {
+	struct sockaddr sa;
+	struct sockaddr_in sin;
+#ifdef HAVE_SOCKADDR_IN6
+	struct sockaddr_in6 sin6;
+#endif
+};
+
+struct pcap_chunk {
+	struct pcap_chunk *next;
+	size_t len;
+	unsigned char data[PCAP_CHUNK_SIZE];
+};
+
+/* a part of a PDU as it goes on the wire, from a buffer or an iovector */
+struct pcap_part {
+	const unsigned char *buf;
+	struct scsi_iovector *iov;
+	size_t offset;
+	size_t len;
+};
+
+struct iscsi_pcap {
+	char *filename;
+	uint32_t data_len;
+	uint64_t max_file_size;
+	int max_files;
+
+	/* the connection the addresses were taken from */
+	int fd;
+	int ipv6;
+	unsigned char local_addr[16];
+	unsigned char remote_addr[16];
+	uint16_t local_port;
+	uint16_t remote_port;
+	uint32_t seq_out;
+	uint32_t seq_in;
+	uint16_t ip_id;
+
+	/* the chunk the I/O thread is filling */
+	struct pcap_chunk *chunk;
+
+	/* only used by the writer */
+	FILE *file;
+	int file_index;
+	uint64_t file_size;
+
+#ifdef HAVE_PTHREAD
+	pthread_t thread;
+	/* protects the fields below */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int error;
+	struct pcap_chunk *full;
+	struct pcap_chunk *spare;
+	int chunks;
+	int stop;
+#endif
+};
+
+/* returns 0 or the errno of the failure */
+static int
+pcap_open_file(struct iscsi_pcap *pcap)
+{
+	char name[1024];
+	uint32_t u32;
+	uint16_t u16;
+	unsigned char hdr[PCAP_FILE_HEADER];
+
+	if (pcap->max_files > 1) {
+		snprintf(name, sizeof(name), "%s.%d", pcap->filename,
+			 pcap->file_index);
+	} else {
+		snprintf(name, sizeof(name), "%s", pcap->filename);
+	}
+	pcap->file = fopen(name, "wb");
+	if (pcap->file == NULL) {
+		return errno;
+	}
+
+	/* the file header is in host byte order */
+	u32 = 0xa1b2c3d4;
+	memcpy(&hdr[0], &u32, 4);
+	u16 = 2;
+	memcpy(&hdr[4], &u16, 2);
+	u16 = 4;
+	memcpy(&hdr[6], &u16, 2);
+	memset(&hdr[8], 0, 8);
+	u32 = PCAP_SNAPLEN;
+	memcpy(&hdr[16], &u32, 4);
+	u32 = PCAP_LINKTYPE_RAW;
+	memcpy(&hdr[20], &u32, 4);
+
+	if (fwrite(hdr, sizeof(hdr), 1, pcap->file) != 1) {
+		int error = errno;
+
+		fclose(pcap->file);
+		pcap->file = NULL;
+		return error;
+	}
+	pcap->file_size = sizeof(hdr);
+	return 0;
+}
+
+/*
+ * Write the records of a chunk, moving on to the next file of the ring
+ * whenever a record would take the file over its maximum size. Returns
+ * 0 or the errno of the failure, after which the file is closed.
+ */
+static int
+pcap_write_chunk(struct iscsi_pcap *pcap, struct pcap_chunk *chunk)
+{
+	size_t pos = 0;
+	int error;
+
+	while (pos < chunk->len) {
+		uint32_t incl_len;
+		size_t len;
+
+		memcpy(&incl_len, &chunk->data[pos + 8], 4);
+		len = PCAP_RECORD_SIZE + incl_len;
+
+		if (pcap->max_file_size &&
+		    pcap->file_size + len > pcap->max_file_size &&
+		    pcap->file_size > PCAP_FILE_HEADER) {
+			fclose(pcap->file);
+			pcap->file = NULL;
+			if (pcap->max_files > 1) {
+				pcap->file_index = (pcap->file_index + 1)
+					% pcap->max_files;
+			}
+			error = pcap_open_file(pcap);
+			if (error) {
+				return error;
+			}
+		}
+		if (fwrite(&chunk->data[pos], len, 1, pcap->file) != 1) {
+			error = errno;
+			fclose(pcap->file);
+			pcap->file = NULL;
+			return error;
+		}
+		pcap->file_size += len;
+		pos += len;
+	}
+	return 0;
+}
+
+#ifdef HAVE_PTHREAD
+static void *
+pcap_writer(void *arg)
+{
+	struct iscsi_pcap *pcap = arg;
+	struct pcap_chunk *chunk;
+	int error = 0;
+
+	pthread_mutex_lock(&pcap->mutex);
+	while (1) {
+		while (pcap->full == NULL && !pcap->stop) {
+			pthread_cond_wait(&pcap->cond, &pcap->mutex);
+		}
+		chunk = pcap->full;
+		if (chunk == NULL) {
+			break;
+		}
+		ISCSI_LIST_REMOVE(&pcap->full, chunk);
+		pthread_mutex_unlock(&pcap->mutex);
+
+		/* after an error the chunks are only recycled */
+		if (!error) {
+			error = pcap_write_chunk(pcap, chunk);
+		}
+
+		pthread_mutex_lock(&pcap->mutex);
+		pcap->error = error;
+		chunk->len = 0;
+		ISCSI_LIST_ADD(&pcap->spare, chunk);
+	}
+	pthread_mutex_unlock(&pcap->mutex);
+	return NULL;
+}
+#endif
+
+/*
+ * Hand the current chunk to the writer and find an empty one. Returns
+ * the error of the writer, if it failed.
+ */
+static int
+pcap_next_chunk(struct iscsi_pcap *pcap)
+{
+	int error;
+#ifdef HAVE_PTHREAD
+	int grow = 0;
+
+	pthread_mutex_lock(&pcap->mutex);
+	if (pcap->chunk != NULL) {
+		ISCSI_LIST_ADD_END(&pcap->full, pcap->chunk);
+		pcap->chunk = NULL;
+		pthread_cond_signal(&pcap->cond);
+	}
+	if (pcap->spare != NULL) {
+		pcap->chunk = pcap->spare;
+		ISCSI_LIST_REMOVE(&pcap->spare, pcap->chunk);
+	} else if (pcap->chunks < PCAP_MAX_CHUNKS) {
+		pcap->chunks++;
+		grow = 1;
+	}
+	error = pcap->error;
+	pthread_mutex_unlock(&pcap->mutex);
+
+	if (grow) {
+		pcap->chunk = iscsi_mem_malloc(sizeof(struct pcap_chunk));
+		if (pcap->chunk == NULL) {
+			return ENOMEM;
+		}
+		pcap->chunk->len = 0;
+	}
+#else
+	error = pcap_write_chunk(pcap, pcap->chunk);
+	pcap->chunk->len = 0;
+#endif
+	return error;
+}
+
+/*
+ * Take the addresses and ports of the connection the first time a PDU
+ * is captured on it.
+ */
+static void
+pcap_connection(struct iscsi_context *iscsi, struct iscsi_pcap *pcap)
+{
+	union pcap_address local, remote;
+	socklen_t local_l = sizeof(local), remote_l = sizeof(remote);
+
+	pcap->fd = iscsi->fd;
+	pcap->seq_out = 1;
+	pcap->seq_in = 1;
+	pcap->ipv6 = 0;
+
+	memset(&local, 0, sizeof(local));
+	memset(&remote, 0, sizeof(remote));
+	if (getsockname(iscsi->fd, &local.sa, &local_l) != 0 ||
+	    getpeername(iscsi->fd, &remote.sa, &remote_l) != 0) {
+		local.sa.sa_family = AF_UNSPEC;
+	}
+
+	switch (local.sa.sa_family) {
+	case AF_INET:
+		memcpy(pcap->local_addr, &local.sin.sin_addr, 4);
+		memcpy(pcap->remote_addr, &remote.sin.sin_addr, 4);
+		pcap->local_port = local.sin.sin_port;
+		pcap->remote_port = remote.sin.sin_port;
+		break;
+#ifdef HAVE_SOCKADDR_IN6
+	case AF_INET6:
+		pcap->ipv6 = 1;
+		memcpy(pcap->local_addr, &local.sin6.sin6_addr, 16);
+		memcpy(pcap->remote_addr, &remote.sin6.sin6_addr, 16);
+		pcap->local_port = local.sin6.sin6_port;
+		pcap->remote_port = remote.sin6.sin6_port;
+		break;
+#endif
+	default:
+		/* 127.0.0.1:1024 -> 127.0.0.2:3260 */
+		memcpy(pcap->local_addr, "\x7f\x00\x00\x01", 4);
+		memcpy(pcap->remote_addr, "\x7f\x00\x00\x02", 4);
+		pcap->local_port = htons(1024);
+		pcap->remote_port = htons(3260);
+		break;
+	}
+}
+
+static void
+pcap_copy_iovector(unsigned char *dst, const struct scsi_iovector *iov,
+		   size_t offset, size_t len)
+{
+	int i;
+
+	for (i = 0; i < iov->niov && len; i++) {
+		size_t n;
+
+		if (offset >= iov->iov[i].iov_len) {
+			offset -= iov->iov[i].iov_len;
+			continue;
+		}
+		n = iov->iov[i].iov_len - offset;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(dst, (unsigned char *)iov->iov[i].iov_base + offset, n);
+		dst += n;
+		len -= n;
+		offset = 0;
+	}
+	memset(dst, 0, len);
+}
+
+/* copy len bytes of the PDU from offset on, anything past the parts is
+ * padding
+ */
+static void
+pcap_copy_pdu(unsigned char *dst, const struct pcap_part *parts, int nparts,
+	      size_t offset, size_t len)
+{
+	int i;
+
+	for (i = 0; i < nparts && len; i++) {
+		size_t n;
+
+		if (offset >= parts[i].len) {
+			offset -= parts[i].len;
+			continue;
+		}
+		n = parts[i].len - offset;
+		if (n > len) {
+			n = len;
+		}
+		if (parts[i].buf != NULL) {
+			memcpy(dst, parts[i].buf + offset, n);
+		} else {
+			pcap_copy_iovector(dst, parts[i].iov,
+					   parts[i].offset + offset, n);
+		}
+		dst += n;
+		len -= n;
+		offset = 0;
+	}
+	memset(dst, 0, len);
+}
+
+static void
+pcap_ip_checksum(unsigned char *ip)
+{
+	uint32_t sum = 0;
+	int i;
+
+	for (i = 0; i < PCAP_IP4_SIZE; i += 2) {
+		sum += (ip[i] << 8) | ip[i + 1];
+	}
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	scsi_set_uint16(&ip[10], ~sum & 0xffff);
+}
+
+/*
+ * Add a PDU of wire_len bytes as TCP segments. Only the header and up to
+ * data_len bytes of the data segment are captured.
+ */
+static int
+pcap_add_pdu(struct iscsi_context *iscsi, int out,
+	     const struct pcap_part *parts, int nparts,
+	     size_t header_len, size_t wire_len)
+{
+	struct iscsi_pcap *pcap = iscsi->pcap;
+	size_t ip_len = pcap->ipv6 ? PCAP_IP6_SIZE : PCAP_IP4_SIZE;
+	size_t cap_len, pos = 0;
+	struct timeval tv;
+	int error;
+
+	if (pcap->fd != iscsi->fd) {
+		pcap_connection(iscsi, pcap);
+	}
+
+	cap_len = header_len + pcap->data_len;
+	if (cap_len < header_len || cap_len > wire_len) {
+		cap_len = wire_len;
+	}
+
+#if defined(WIN32)
+	win32_gettimeofday(&tv, NULL);
+#else
+	gettimeofday(&tv, NULL);
+#endif
+
+	while (pos < wire_len) {
+		size_t seg_len = wire_len - pos;
+		size_t seg_cap, rec_len;
+		unsigned char *rec, *ip, *tcp;
+		uint32_t u32;
+
+		if (seg_len > PCAP_SEGMENT_SIZE) {
+			seg_len = PCAP_SEGMENT_SIZE;
+		}
+		seg_cap = pos < cap_len ? cap_len - pos : 0;
+		if (seg_cap > seg_len) {
+			seg_cap = seg_len;
+		}
+		rec_len = PCAP_RECORD_SIZE + ip_len + PCAP_TCP_SIZE + seg_cap;
+
+		if (pcap->chunk == NULL ||
+		    pcap->chunk->len + rec_len > PCAP_CHUNK_SIZE) {
+			error = pcap_next_chunk(pcap);
+			if (error) {
+				ISCSI_LOG(iscsi, 1, "pcap capture to %s failed: %s",
+					  pcap->filename, strerror(error));
+				return -1;
+			}
+			if (pcap->chunk == NULL) {
+				/* the writer is behind */
+				iscsi->stats.pcap_dropped++;
+				break;
+			}
+		}
+
+		rec = &pcap->chunk->data[pcap->chunk->len];
+		ip  = rec + PCAP_RECORD_SIZE;
+		tcp = ip + ip_len;
+
+		u32 = tv.tv_sec;
+		memcpy(&rec[0], &u32, 4);
+		u32 = tv.tv_usec;
+		memcpy(&rec[4], &u32, 4);
+		u32 = ip_len + PCAP_TCP_SIZE + seg_cap;
+		memcpy(&rec[8], &u32, 4);
+		u32 = ip_len + PCAP_TCP_SIZE + seg_len;
+		memcpy(&rec[12], &u32, 4);
+
+		memset(ip, 0, ip_len + PCAP_TCP_SIZE);
+		if (pcap->ipv6) {
+			ip[0] = 0x60;
+			scsi_set_uint16(&ip[4], PCAP_TCP_SIZE + seg_len);
+			ip[6] = 6;
+			ip[7] = 64;
+			memcpy(&ip[8], out ? pcap->local_addr : pcap->remote_addr, 16);
+			memcpy(&ip[24], out ? pcap->remote_addr : pcap->local_addr, 16);
+		} else {
+			ip[0] = 0x45;
+			scsi_set_uint16(&ip[2], PCAP_IP4_SIZE + PCAP_TCP_SIZE + seg_len);
+			scsi_set_uint16(&ip[4], pcap->ip_id++);
+			ip[6] = 0x40;
+			ip[8] = 64;
+			ip[9] = 6;
+			memcpy(&ip[12], out ? pcap->local_addr : pcap->remote_addr, 4);
+			memcpy(&ip[16], out ? pcap->remote_addr : pcap->local_addr, 4);
+			pcap_ip_checksum(ip);
+		}
+
+		/* ports are kept in network byte order */
+		memcpy(&tcp[0], out ? &pcap->local_port : &pcap->remote_port, 2);
+		memcpy(&tcp[2], out ? &pcap->remote_port : &pcap->local_port, 2);
+		scsi_set_uint32(&tcp[4], out ? pcap->seq_out : pcap->seq_in);
+		scsi_set_uint32(&tcp[8], out ? pcap->seq_in : pcap->seq_out);
+		tcp[12] = (PCAP_TCP_SIZE / 4) << 4;
+		tcp[13] = 0x18;		/* PSH, ACK */
+		scsi_set_uint16(&tcp[14], 0xffff);
+
+		pcap_copy_pdu(tcp + PCAP_TCP_SIZE, parts, nparts, pos, seg_cap);
+
+		pcap->chunk->len += rec_len;
+		if (out) {
+			pcap->seq_out += seg_len;
+		} else {
+			pcap->seq_in += seg_len;
+		}
+		pos += seg_len;
+	}
+
+	/* keep the sequence numbers right for the PDUs that follow */
+	if (out) {
+		pcap->seq_out += wire_len - pos;
+	} else {
+		pcap->seq_in += wire_len - pos;
+	}
+	return 0;
+}
+
+void
+iscsi_pcap_pdu_out(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	struct pcap_part parts[2];
+	int nparts = 1;
+
+	parts[0].buf = pdu->outdata.data;
+	parts[0].len = pdu->outdata.size;
+	if (pdu->payload_len && iscsi->pcap->data_len) {
+		parts[1].buf = NULL;
+		parts[1].iov = iscsi_get_scsi_task_iovector_out(iscsi, pdu);
+		parts[1].offset = pdu->payload_offset;
+		parts[1].len = pdu->payload_len;
+		if (parts[1].iov != NULL) {
+			nparts++;
+		}
+	}
+
+	if (pcap_add_pdu(iscsi, 1, parts, nparts, ISCSI_HEADER_SIZE,
+			 pdu->outdata.size + ((pdu->payload_len + 3) & ~3)) != 0) {
+		iscsi_pcap_free(iscsi);
+	}
+}
+
+void
+iscsi_pcap_pdu_in(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
+{
+	struct pcap_part parts[2];
+	size_t data_size = iscsi_get_pdu_data_size(in->hdr);
+	size_t padding = iscsi_get_pdu_padding_size(in->hdr);
+	int nparts = 1;
+
+	parts[0].buf = in->hdr;
+	parts[0].len = ISCSI_HEADER_SIZE;
+	if (data_size && iscsi->pcap->data_len) {
+		if (in->data != NULL) {
+			parts[1].buf = in->data;
+			parts[1].len = data_size;
+			nparts++;
+		} else {
+			parts[1].buf = NULL;
+			parts[1].iov = iscsi_get_scsi_task_iovector_in(iscsi, in);
+			parts[1].offset = scsi_get_uint32(&in->hdr[40]);
+			parts[1].len = data_size;
+			if (parts[1].iov != NULL) {
+				nparts++;
+			}
+		}
+	}
+
+	if (pcap_add_pdu(iscsi, 0, parts, nparts, ISCSI_HEADER_SIZE,
+			 ISCSI_HEADER_SIZE + data_size + padding) != 0) {
+		iscsi_pcap_free(iscsi);
+	}
+}
+
+void
+iscsi_pcap_free(struct iscsi_context *iscsi)
+{
+	struct iscsi_pcap *pcap = iscsi->pcap;
+	struct pcap_chunk *chunk;
+
+	if (pcap == NULL) {
+		return;
+	}
+	iscsi->pcap = NULL;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&pcap->mutex);
+	if (pcap->chunk != NULL && pcap->chunk->len) {
+		ISCSI_LIST_ADD_END(&pcap->full, pcap->chunk);
+		pcap->chunk = NULL;
+	}
+	pcap->stop = 1;
+	pthread_cond_signal(&pcap->cond);
+	pthread_mutex_unlock(&pcap->mutex);
+	pthread_join(pcap->thread, NULL);
+	pthread_cond_destroy(&pcap->cond);
+	pthread_mutex_destroy(&pcap->mutex);
+
+	while ((chunk = pcap->spare) != NULL) {
+		ISCSI_LIST_REMOVE(&pcap->spare, chunk);
+		iscsi_mem_free(chunk);
+	}
+#else
+	if (pcap->chunk != NULL && pcap->file != NULL) {
+		pcap_write_chunk(pcap, pcap->chunk);
+	}
+#endif
+	iscsi_mem_free(pcap->chunk);
+
+	if (pcap->file != NULL) {
+		fclose(pcap->file);
+	}
+	iscsi_mem_free(pcap->filename);
+	iscsi_mem_free(pcap);
+}
+
+int
+iscsi_set_pcap_capture(struct iscsi_context *iscsi, const char *filename,
+		       uint32_t data_len, uint64_t max_file_size,
+		       int max_files)
+{
+	struct iscsi_pcap *pcap;
+	int error;
+
+	iscsi_pcap_free(iscsi);
+	if (filename == NULL) {
+		return 0;
+	}
+
+	pcap = iscsi_mem_malloc(sizeof(struct iscsi_pcap));
+	if (pcap == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"pcap capture");
+		return -1;
+	}
+	memset(pcap, 0, sizeof(struct iscsi_pcap));
+	pcap->fd = -1;
+	pcap->data_len = data_len;
+	pcap->max_file_size = max_file_size;
+	pcap->max_files = max_files;
+	pcap->filename = iscsi_mem_strdup(filename);
+	if (pcap->filename == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"pcap capture");
+		iscsi_mem_free(pcap);
+		return -1;
+	}
+
+	error = pcap_open_file(pcap);
+	if (error) {
+		iscsi_set_error(iscsi, "failed to open pcap file %s: %s",
+				filename, strerror(error));
+		iscsi_mem_free(pcap->filename);
+		iscsi_mem_free(pcap);
+		return -1;
+	}
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&pcap->mutex, NULL);
+	pthread_cond_init(&pcap->cond, NULL);
+	if (pthread_create(&pcap->thread, NULL, pcap_writer, pcap) != 0) {
+		iscsi_set_error(iscsi, "failed to start the pcap writer thread");
+		pthread_cond_destroy(&pcap->cond);
+		pthread_mutex_destroy(&pcap->mutex);
+		fclose(pcap->file);
+		iscsi_mem_free(pcap->filename);
+		iscsi_mem_free(pcap);
+		return -1;
+	}
+#else
+	pcap->chunk = iscsi_mem_malloc(sizeof(struct pcap_chunk));
+	if (pcap->chunk == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"pcap capture");
+		fclose(pcap->file);
+		iscsi_mem_free(pcap->filename);
+		iscsi_mem_free(pcap);
+		return -1;
+	}
+	pcap->chunk->len = 0;
+#endif
+
+	iscsi->pcap = pcap;
+	return 0;
+}
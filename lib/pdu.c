@@ -117,6 +117,64 @@ iscsi_allocate_pdu(struct iscsi_context *iscsi, enum iscsi_opcode opcode,
 	/* flags */
 	pdu->flags = flags;
 
+	if (iscsi->stats_latency) {
+		pdu->queued_ns = iscsi_clock_ns();
+	}
+
+	return pdu;
+}
+
+/*
+ * The headers of the PDUs sent for every SCSI command, with everything
+ * that is the same for all of them filled in. Those PDUs start out as a
+ * copy of a template and only the fields of the command are stored on
+ * top, rather than clearing a whole small allocation and then setting
+ * the fields one by one.
+ */
+void
+iscsi_init_pdu_templates(struct iscsi_context *iscsi)
+{
+	memset(iscsi->scsi_command_template, 0, ISCSI_RAW_HEADER_SIZE);
+	iscsi->scsi_command_template[0] = ISCSI_PDU_SCSI_REQUEST;
+
+	memset(iscsi->data_out_template, 0, ISCSI_RAW_HEADER_SIZE);
+	iscsi->data_out_template[0] = ISCSI_PDU_DATA_OUT;
+}
+
+struct iscsi_pdu *
+iscsi_allocate_pdu_from_template(struct iscsi_context *iscsi,
+				 const unsigned char *hdr,
+				 enum iscsi_opcode response_opcode,
+				 uint32_t itt, uint32_t flags)
+{
+	struct iscsi_pdu *pdu;
+
+	pdu = iscsi_szmalloc(iscsi, sizeof(struct iscsi_pdu));
+	if (pdu == NULL) {
+		iscsi_set_error(iscsi, "failed to allocate pdu");
+		return NULL;
+	}
+
+	/* the header digest, if any, is filled in by iscsi_queue_pdu() */
+	pdu->outdata.size = ISCSI_HEADER_SIZE;
+	pdu->outdata.data = iscsi_smalloc(iscsi, pdu->outdata.size);
+	if (pdu->outdata.data == NULL) {
+		iscsi_set_error(iscsi, "failed to allocate pdu header");
+		iscsi_sfree(iscsi, pdu);
+		return NULL;
+	}
+	memcpy(pdu->outdata.data, hdr, ISCSI_RAW_HEADER_SIZE);
+	pdu->response_opcode = response_opcode;
+
+	iscsi_set_be32(&pdu->outdata.data[16], itt);
+	pdu->itt = itt;
+
+	pdu->flags = flags;
+
+	if (iscsi->stats_latency) {
+		pdu->queued_ns = iscsi_clock_ns();
+	}
+
 	return pdu;
 }
 
@@ -514,6 +572,20 @@ iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
 					itt, opcode, pdu->response_opcode);
 			return -1;
 		}
+
+		/* The callback runs from the handlers below, so fill in the
+		 * timing before. Every PDU received for the task overwrites
+		 * response_ns, leaving the one that completes it.
+		 */
+		if (iscsi->stats_latency && pdu->scsi_cbdata.task != NULL) {
+			iscsi->timing_task = pdu->scsi_cbdata.task;
+			iscsi->timing_itt  = pdu->itt;
+			iscsi->task_timing.queued_ns      = pdu->queued_ns;
+			iscsi->task_timing.write_start_ns = pdu->write_start_ns;
+			iscsi->task_timing.written_ns     = pdu->sent_ns;
+			iscsi->task_timing.response_ns    = in->hdr_ns;
+		}
+
 		switch (opcode) {
 		case ISCSI_PDU_LOGIN_RESPONSE:
 			if (iscsi_process_login_reply(iscsi, pdu, in) != 0) {
@@ -595,6 +667,12 @@ iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
 		}
 
 		if (is_finished) {
+			if (iscsi->stats_latency && pdu->sent_ns && in->hdr_ns &&
+			    (pdu->outdata.data[0] & 0x3f) < ISCSI_STATS_LATENCY_OPCODES) {
+				iscsi_stats_latency_record(
+					&iscsi->stats.wire_to_response[pdu->outdata.data[0] & 0x3f],
+					in->hdr_ns - pdu->sent_ns);
+			}
 			ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
 			iscsi_free_pdu(iscsi, pdu);
 		}
@@ -607,13 +685,13 @@ iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
 void
 iscsi_pdu_set_itt(struct iscsi_pdu *pdu, uint32_t itt)
 {
-	scsi_set_uint32(&pdu->outdata.data[16], itt);
+	iscsi_set_be32(&pdu->outdata.data[16], itt);
 }
 
 void
 iscsi_pdu_set_ritt(struct iscsi_pdu *pdu, uint32_t ritt)
 {
-	scsi_set_uint32(&pdu->outdata.data[20], ritt);
+	iscsi_set_be32(&pdu->outdata.data[20], ritt);
 }
 
 void
@@ -631,38 +709,38 @@ iscsi_pdu_set_immediate(struct iscsi_pdu *pdu)
 void
 iscsi_pdu_set_ttt(struct iscsi_pdu *pdu, uint32_t ttt)
 {
-	scsi_set_uint32(&pdu->outdata.data[20], ttt);
+	iscsi_set_be32(&pdu->outdata.data[20], ttt);
 }
 
 void
 iscsi_pdu_set_cmdsn(struct iscsi_pdu *pdu, uint32_t cmdsn)
 {
-	scsi_set_uint32(&pdu->outdata.data[24], cmdsn);
+	iscsi_set_be32(&pdu->outdata.data[24], cmdsn);
 	pdu->cmdsn = cmdsn;
 }
 
 void
 iscsi_pdu_set_rcmdsn(struct iscsi_pdu *pdu, uint32_t rcmdsn)
 {
-	scsi_set_uint32(&pdu->outdata.data[32], rcmdsn);
+	iscsi_set_be32(&pdu->outdata.data[32], rcmdsn);
 }
 
 void
 iscsi_pdu_set_datasn(struct iscsi_pdu *pdu, uint32_t datasn)
 {
-	scsi_set_uint32(&pdu->outdata.data[36], datasn);
+	iscsi_set_be32(&pdu->outdata.data[36], datasn);
 }
 
 void
 iscsi_pdu_set_expstatsn(struct iscsi_pdu *pdu, uint32_t expstatsnsn)
 {
-	scsi_set_uint32(&pdu->outdata.data[28], expstatsnsn);
+	iscsi_set_be32(&pdu->outdata.data[28], expstatsnsn);
 }
 
 void
 iscsi_pdu_set_bufferoffset(struct iscsi_pdu *pdu, uint32_t bufferoffset)
 {
-	scsi_set_uint32(&pdu->outdata.data[40], bufferoffset);
+	iscsi_set_be32(&pdu->outdata.data[40], bufferoffset);
 }
 
 void
@@ -675,14 +753,14 @@ iscsi_pdu_set_cdb(struct iscsi_pdu *pdu, struct scsi_task *task)
 void
 iscsi_pdu_set_lun(struct iscsi_pdu *pdu, uint32_t lun)
 {
-	scsi_set_uint16(&pdu->outdata.data[8], lun);
+	iscsi_set_be16(&pdu->outdata.data[8], lun);
 }
 
 void
 iscsi_pdu_set_expxferlen(struct iscsi_pdu *pdu, uint32_t expxferlen)
 {
 	pdu->expxferlen = expxferlen;
-	scsi_set_uint32(&pdu->outdata.data[20], expxferlen);
+	iscsi_set_be32(&pdu->outdata.data[20], expxferlen);
 }
 
 void
@@ -691,6 +769,8 @@ iscsi_timeout_scan(struct iscsi_context *iscsi)
 	struct iscsi_pdu *pdu;
 	struct iscsi_pdu *next_pdu;
 	time_t t = time(NULL);
+	uint64_t timeouts = iscsi->stats.timeouts;
+	int i;
 
 	for (pdu = iscsi->outqueue; pdu; pdu = next_pdu) {
 		next_pdu = pdu->next;
@@ -704,6 +784,7 @@ iscsi_timeout_scan(struct iscsi_context *iscsi)
 			continue;
 		}
 		ISCSI_LIST_REMOVE(&iscsi->outqueue, pdu);
+		iscsi->stats.timeouts++;
 		iscsi_set_error(iscsi, "command timed out");
 		iscsi_dump_pdu_header(iscsi, pdu->outdata.data);
 		if (pdu->callback) {
@@ -724,6 +805,7 @@ iscsi_timeout_scan(struct iscsi_context *iscsi)
 			continue;
 		}
 		ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
+		iscsi->stats.timeouts++;
 		iscsi_set_error(iscsi, "command timed out");
 		iscsi_dump_pdu_header(iscsi, pdu->outdata.data);
 		if (pdu->callback) {
@@ -732,4 +814,32 @@ iscsi_timeout_scan(struct iscsi_context *iscsi)
 		}
 		iscsi_free_pdu(iscsi, pdu);
 	}
+	for (i = 0; i <= ISCSI_TASK_PRIORITY_HIGH; i++) {
+		for (pdu = iscsi->pendingqueue[i]; pdu; pdu = next_pdu) {
+			next_pdu = pdu->next;
+
+			if (pdu->scsi_timeout == 0) {
+				/* no timeout for this pdu */
+				continue;
+			}
+			if (t < pdu->scsi_timeout) {
+				/* not expired yet */
+				continue;
+			}
+			ISCSI_LIST_REMOVE(&iscsi->pendingqueue[i], pdu);
+			iscsi->stats.timeouts++;
+			iscsi_set_error(iscsi, "command timed out while "
+					"waiting for the CmdSN window");
+			if (pdu->callback) {
+				pdu->callback(iscsi, SCSI_STATUS_TIMEOUT,
+				              NULL, pdu->private_data);
+			}
+			iscsi_free_pdu(iscsi, pdu);
+		}
+	}
+	iscsi_stats_cmdsn_window(iscsi);
+
+	if (iscsi->stats.timeouts != timeouts) {
+		iscsi_log_ring_dump(iscsi, "command timed out");
+	}
 }
@@ -0,0 +1,445 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+/*
+ * Sequential read-ahead.
+ *
+ * The device is divided into chunks of chunk_blocks blocks. Once a
+ * reader has been seen to read sequentially, up to 'window' chunks
+ * following the current position are read asynchronously into a pool
+ * of buffers and subsequent reads are served from those buffers.
+ */
+enum ra_buffer_state {
+	RA_BUFFER_EMPTY = 0,
+	RA_BUFFER_IN_FLIGHT,
+	RA_BUFFER_VALID,
+	RA_BUFFER_FAILED
+};
+
+struct iscsi_readahead_buffer {
+	/* NULL once the read-ahead was destroyed with this read in flight */
+	struct iscsi_readahead *ra;
+	struct scsi_task *task;
+	enum ra_buffer_state state;
+	/* the chunk was invalidated while the read was in flight */
+	int stale;
+	uint64_t chunk;
+	uint32_t size;
+	unsigned char *data;
+	struct scsi_iovec iov;
+};
+
+struct iscsi_readahead {
+	struct iscsi_context *iscsi;
+	int lun;
+	uint32_t block_size;
+	uint64_t num_blocks;
+	uint32_t chunk_blocks;
+	uint64_t num_chunks;
+
+	/* where a sequential reader would continue reading */
+	uint64_t next_offset;
+	int sequential;
+
+	int window;
+	struct iscsi_readahead_buffer **buffers;
+
+	/* see iscsi_readahead_set_writeback() */
+	struct iscsi_writeback *wb;
+};
+
+/* Wait until the buffer is no longer in flight */
+static int
+ra_wait(struct iscsi_readahead *ra, struct iscsi_readahead_buffer *buf)
+{
+	while (buf->state == RA_BUFFER_IN_FLIGHT) {
+		if (iscsi_sync_poll(ra->iscsi, 1000) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+ra_read_cb(struct iscsi_context *iscsi, int status,
+	   void *command_data, void *private_data)
+{
+	struct iscsi_readahead_buffer *buf = private_data;
+	struct scsi_task *task = command_data;
+
+	if (buf->ra == NULL) {
+		/* the read-ahead was destroyed while this read was in
+		 * flight
+		 */
+		scsi_free_scsi_task(task);
+		iscsi_free(iscsi, buf->data);
+		iscsi_free(iscsi, buf);
+		return;
+	}
+	buf->task = NULL;
+	if (buf->stale) {
+		buf->state = RA_BUFFER_EMPTY;
+		buf->stale = 0;
+	} else if (status == SCSI_STATUS_GOOD &&
+		   task->residual_status != SCSI_RESIDUAL_UNDERFLOW) {
+		buf->state = RA_BUFFER_VALID;
+	} else {
+		/* a short read is read again directly */
+		buf->state = RA_BUFFER_FAILED;
+	}
+	scsi_free_scsi_task(task);
+}
+
+static struct iscsi_readahead_buffer *
+ra_find_buffer(struct iscsi_readahead *ra, uint64_t chunk)
+{
+	int i;
+
+	for (i = 0; i < ra->window; i++) {
+		struct iscsi_readahead_buffer *buf = ra->buffers[i];
+
+		if (buf->state != RA_BUFFER_EMPTY && !buf->stale
+		    && buf->chunk == chunk) {
+			return buf;
+		}
+	}
+	return NULL;
+}
+
+/* Start reading a chunk into a free buffer. Buffers holding chunks
+ * outside the window that starts at 'current', before it after the
+ * reader moved on or beyond it after a seek backwards, are no longer
+ * needed by a sequential reader and are reused.
+ */
+static void
+ra_issue(struct iscsi_readahead *ra, uint64_t chunk, uint64_t current)
+{
+	struct iscsi_readahead_buffer *buf = NULL;
+	struct scsi_task *task;
+	uint64_t lba;
+	uint32_t num_blocks;
+	int i;
+
+	for (i = 0; i < ra->window; i++) {
+		struct iscsi_readahead_buffer *b = ra->buffers[i];
+
+		if (b->state == RA_BUFFER_EMPTY) {
+			buf = b;
+			break;
+		}
+		if (b->state == RA_BUFFER_FAILED ||
+		    (b->state == RA_BUFFER_VALID &&
+		     (b->chunk < current ||
+		      b->chunk >= current + ra->window))) {
+			buf = b;
+		}
+	}
+	if (buf == NULL) {
+		return;
+	}
+
+	lba = chunk * ra->chunk_blocks;
+	num_blocks = ra->chunk_blocks;
+	if (lba + num_blocks > ra->num_blocks) {
+		num_blocks = ra->num_blocks - lba;
+	}
+
+	/* the target does not have the latest data for this chunk yet */
+	if (ra->wb != NULL &&
+	    iscsi_writeback_cached(ra->wb, lba * ra->block_size,
+				   (uint64_t)num_blocks * ra->block_size)) {
+		return;
+	}
+
+	buf->chunk = chunk;
+	buf->size  = num_blocks * ra->block_size;
+	buf->state = RA_BUFFER_IN_FLIGHT;
+
+	task = iscsi_read16_task(ra->iscsi, ra->lun, lba, buf->size,
+				 ra->block_size, 0, 0, 0, 0, 0,
+				 ra_read_cb, buf);
+	if (task == NULL) {
+		ISCSI_LOG(ra->iscsi, 1, "read-ahead of lba %llu failed: %s",
+			  (unsigned long long)lba, iscsi_get_error(ra->iscsi));
+		buf->state = RA_BUFFER_EMPTY;
+		return;
+	}
+	buf->task = task;
+	buf->iov.iov_base = buf->data;
+	buf->iov.iov_len  = buf->size;
+	scsi_task_set_iov_in(task, &buf->iov, 1);
+}
+
+/* Keep the window of chunks following 'current' in flight */
+static void
+ra_fill_window(struct iscsi_readahead *ra, uint64_t current)
+{
+	uint64_t chunk;
+
+	for (chunk = current; chunk < current + ra->window
+		     && chunk < ra->num_chunks; chunk++) {
+		if (ra_find_buffer(ra, chunk) == NULL) {
+			ra_issue(ra, chunk, current);
+		}
+	}
+}
+
+struct iscsi_readahead *
+iscsi_readahead_create(struct iscsi_context *iscsi, int lun,
+		       uint32_t block_size, uint64_t num_blocks,
+		       int window, uint32_t chunk_size)
+{
+	struct iscsi_readahead *ra;
+	int i;
+
+	if (block_size == 0 || window <= 0 ||
+	    chunk_size < block_size || chunk_size % block_size) {
+		iscsi_set_error(iscsi, "Invalid read-ahead parameters");
+		return NULL;
+	}
+
+	ra = iscsi_zmalloc(iscsi, sizeof(struct iscsi_readahead));
+	if (ra == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"read-ahead context");
+		return NULL;
+	}
+	ra->iscsi        = iscsi;
+	ra->lun          = lun;
+	ra->block_size   = block_size;
+	ra->num_blocks   = num_blocks;
+	ra->chunk_blocks = chunk_size / block_size;
+	ra->num_chunks   = (num_blocks + ra->chunk_blocks - 1)
+			   / ra->chunk_blocks;
+	ra->window       = window;
+	/* a first read at offset 0 is not sequential */
+	ra->next_offset  = UINT64_MAX;
+
+	ra->buffers = iscsi_zmalloc(iscsi, window
+				    * sizeof(struct iscsi_readahead_buffer *));
+	if (ra->buffers == NULL) {
+		goto oom;
+	}
+	for (i = 0; i < window; i++) {
+		ra->buffers[i] = iscsi_zmalloc(iscsi,
+				sizeof(struct iscsi_readahead_buffer));
+		if (ra->buffers[i] == NULL) {
+			goto oom;
+		}
+		ra->buffers[i]->ra   = ra;
+		ra->buffers[i]->data = iscsi_malloc(iscsi, chunk_size);
+		if (ra->buffers[i]->data == NULL) {
+			goto oom;
+		}
+	}
+
+	return ra;
+
+oom:
+	iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+			"read-ahead buffers");
+	iscsi_readahead_destroy(ra);
+	return NULL;
+}
+
+void
+iscsi_readahead_destroy(struct iscsi_readahead *ra)
+{
+	int i;
+
+	if (ra == NULL) {
+		return;
+	}
+
+	if (ra->buffers != NULL) {
+		for (i = 0; i < ra->window; i++) {
+			struct iscsi_readahead_buffer *buf = ra->buffers[i];
+
+			if (buf == NULL) {
+				continue;
+			}
+			/* the target may still be writing into the buffer */
+			if (buf->state == RA_BUFFER_IN_FLIGHT &&
+			    iscsi_scsi_cancel_task(ra->iscsi, buf->task) != 0) {
+				ra_wait(ra, buf);
+			}
+			/* Reads that are still in flight after that are
+			 * completed when the context is destroyed, the
+			 * callback frees the buffer then.
+			 */
+			if (buf->state == RA_BUFFER_IN_FLIGHT) {
+				buf->ra = NULL;
+				continue;
+			}
+			iscsi_free(ra->iscsi, buf->data);
+			iscsi_free(ra->iscsi, buf);
+		}
+		iscsi_free(ra->iscsi, ra->buffers);
+	}
+	iscsi_free(ra->iscsi, ra);
+}
+
+void
+iscsi_readahead_set_writeback(struct iscsi_readahead *ra,
+			      struct iscsi_writeback *wb)
+{
+	ra->wb = wb;
+}
+
+void
+iscsi_readahead_invalidate(struct iscsi_readahead *ra, uint64_t offset,
+			   uint64_t count)
+{
+	uint64_t chunk_bytes = (uint64_t)ra->chunk_blocks * ra->block_size;
+	uint64_t first, last;
+	int i;
+
+	if (count == 0) {
+		return;
+	}
+	first = offset / chunk_bytes;
+	last  = (offset + count - 1) / chunk_bytes;
+
+	for (i = 0; i < ra->window; i++) {
+		struct iscsi_readahead_buffer *buf = ra->buffers[i];
+
+		if (buf->state == RA_BUFFER_EMPTY
+		    || buf->chunk < first || buf->chunk > last) {
+			continue;
+		}
+		if (buf->state == RA_BUFFER_IN_FLIGHT) {
+			buf->stale = 1;
+		} else {
+			buf->state = RA_BUFFER_EMPTY;
+		}
+	}
+}
+
+int
+iscsi_readahead_read(struct iscsi_readahead *ra, uint64_t offset,
+		     unsigned char *buf, uint32_t count)
+{
+	uint64_t chunk_bytes = (uint64_t)ra->chunk_blocks * ra->block_size;
+	uint64_t size = ra->num_blocks * ra->block_size;
+	uint32_t done = 0;
+
+	if (offset >= size) {
+		return 0;
+	}
+	if (offset + count > size) {
+		count = size - offset;
+	}
+
+	if (ra->wb != NULL &&
+	    iscsi_writeback_flush_range(ra->wb, offset, count) != 0) {
+		return -1;
+	}
+
+	if (offset == ra->next_offset) {
+		ra->sequential++;
+	} else {
+		ra->sequential = 0;
+	}
+	ra->next_offset = offset + count;
+
+	while (done < count) {
+		uint64_t pos = offset + done;
+		uint64_t chunk = pos / chunk_bytes;
+		struct iscsi_readahead_buffer *rbuf;
+		uint32_t len;
+
+		/* only start reading ahead once the second sequential
+		 * read has been seen.
+		 */
+		if (ra->sequential) {
+			ra_fill_window(ra, chunk);
+		}
+
+		rbuf = ra_find_buffer(ra, chunk);
+		if (rbuf != NULL && ra_wait(ra, rbuf) != 0) {
+			return -1;
+		}
+		if (rbuf == NULL || rbuf->state != RA_BUFFER_VALID) {
+			struct scsi_task *task;
+			uint64_t lba = pos / ra->block_size;
+			uint64_t avail;
+			uint32_t num_blocks;
+
+			/* not covered by the read-ahead, read it directly */
+			if (rbuf != NULL) {
+				rbuf->state = RA_BUFFER_EMPTY;
+			}
+			len = count - done;
+			num_blocks = (pos % ra->block_size + len
+				      + ra->block_size - 1) / ra->block_size;
+			task = iscsi_read16_sync(ra->iscsi, ra->lun, lba,
+						 num_blocks * ra->block_size,
+						 ra->block_size,
+						 0, 0, 0, 0, 0);
+			if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+				iscsi_set_error(ra->iscsi, "read of lba %llu "
+						"failed",
+						(unsigned long long)lba);
+				scsi_free_scsi_task(task);
+				return -1;
+			}
+			/* the target may have sent less than was asked for */
+			avail = task->datain.size;
+			if (task->residual_status == SCSI_RESIDUAL_UNDERFLOW &&
+			    task->residual < (size_t)task->expxferlen &&
+			    task->expxferlen - task->residual < avail) {
+				avail = task->expxferlen - task->residual;
+			}
+			if (task->datain.data == NULL ||
+			    avail < pos % ra->block_size + len) {
+				iscsi_set_error(ra->iscsi, "short read of lba "
+						"%llu: %llu bytes",
+						(unsigned long long)lba,
+						(unsigned long long)avail);
+				scsi_free_scsi_task(task);
+				return -1;
+			}
+			memcpy(&buf[done],
+			       &task->datain.data[pos % ra->block_size], len);
+			scsi_free_scsi_task(task);
+			done += len;
+			break;
+		}
+
+		len = MIN(count - done,
+			  rbuf->size - (uint32_t)(pos % chunk_bytes));
+		memcpy(&buf[done], &rbuf->data[pos % chunk_bytes], len);
+		done += len;
+	}
+
+	if (ra->sequential) {
+		ra_fill_window(ra, (offset + count) / chunk_bytes);
+	}
+
+	return done;
+}
@@ -53,15 +53,12 @@
 #include <stdint.h>
 #include <errno.h>
 #include "slist.h"
+#include "iscsi.h"
+#include "iscsi-private.h"
 #include "scsi-lowlevel.h"
 
 void scsi_task_set_iov_out(struct scsi_task *task, struct scsi_iovec *iov, int niov);
 
-struct scsi_allocated_memory {
-	struct scsi_allocated_memory *next;
-	char buf[0];
-};
-
 void
 scsi_free_scsi_task(struct scsi_task *task)
 {
@@ -72,11 +69,15 @@ scsi_free_scsi_task(struct scsi_task *task)
 
 	while ((mem = task->mem)) {
 		   ISCSI_LIST_REMOVE(&task->mem, mem);
-		   free(mem);
+		   if (mem->free != NULL) {
+			   mem->free(task, mem);
+		   } else {
+			   iscsi_mem_free(mem);
+		   }
 	}
 
-	free(task->datain.data);
-	free(task);
+	iscsi_mem_free(task->datain.data);
+	iscsi_mem_free(task);
 }
 
 struct scsi_task *
@@ -84,7 +85,7 @@ scsi_create_task(int cdb_size, unsigned char *cdb, int xfer_dir, int expxferlen)
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -105,7 +106,7 @@ scsi_malloc(struct scsi_task *task, size_t size)
 {
 	struct scsi_allocated_memory *mem;
 
-	mem = malloc(sizeof(struct scsi_allocated_memory) + size);
+	mem = iscsi_mem_malloc(sizeof(struct scsi_allocated_memory) + size);
 	if (mem == NULL) {
 		return NULL;
 	}
@@ -378,7 +379,7 @@ scsi_cdb_testunitready(void)
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -401,7 +402,7 @@ scsi_cdb_sanitize(int immed, int ause, int sa, int param_len)
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -438,7 +439,7 @@ scsi_reportluns_cdb(int report_type, int alloc_len)
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -515,7 +516,7 @@ scsi_cdb_readcapacity10(int lba, int pmi)
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -550,7 +551,7 @@ scsi_cdb_readtoc(int msf, int format, int track_session, uint16_t alloc_len)
 		return NULL;
 	}
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -705,7 +706,7 @@ scsi_cdb_reserve6(void)
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -726,7 +727,7 @@ scsi_cdb_release6(void)
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -1113,7 +1114,7 @@ scsi_cdb_report_supported_opcodes(int rctd, int options, enum scsi_opcode opcode
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -1184,7 +1185,7 @@ scsi_cdb_inquiry(int evpd, int page_code, int alloc_len)
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -1529,7 +1530,7 @@ scsi_cdb_read6(uint32_t lba, uint32_t xferlen, int blocksize)
 		return NULL;
 	}
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -1564,7 +1565,7 @@ scsi_cdb_read10(uint32_t lba, uint32_t xferlen, int blocksize, int rdprotect, in
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -1607,7 +1608,7 @@ scsi_cdb_read12(uint32_t lba, uint32_t xferlen, int blocksize, int rdprotect, in
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -1650,7 +1651,7 @@ scsi_cdb_read16(uint64_t lba, uint32_t xferlen, int blocksize, int rdprotect, in
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -1694,7 +1695,7 @@ scsi_cdb_write10(uint32_t lba, uint32_t xferlen, int blocksize, int wrprotect, i
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -1737,7 +1738,7 @@ scsi_cdb_write12(uint32_t lba, uint32_t xferlen, int blocksize, int wrprotect, i
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -1780,7 +1781,7 @@ scsi_cdb_write16(uint64_t lba, uint32_t xferlen, int blocksize, int wrprotect, i
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -1824,7 +1825,7 @@ scsi_cdb_writeatomic16(uint64_t lba, uint32_t xferlen, int blocksize, int wrprot
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -1865,7 +1866,7 @@ scsi_cdb_orwrite(uint64_t lba, uint32_t xferlen, int blocksize, int wrprotect, i
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -1909,7 +1910,7 @@ scsi_cdb_compareandwrite(uint64_t lba, uint32_t xferlen, int blocksize, int wrpr
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -1952,7 +1953,7 @@ scsi_cdb_verify10(uint32_t lba, uint32_t xferlen, int vprotect, int dpo, int byt
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -1993,7 +1994,7 @@ scsi_cdb_verify12(uint32_t lba, uint32_t xferlen, int vprotect, int dpo, int byt
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -2034,7 +2035,7 @@ scsi_cdb_verify16(uint64_t lba, uint32_t xferlen, int vprotect, int dpo, int byt
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -2076,7 +2077,7 @@ scsi_cdb_unmap(int anchor, int group, uint16_t xferlen)
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -2110,7 +2111,7 @@ scsi_cdb_persistent_reserve_in(enum scsi_persistent_in_sa sa, uint16_t xferlen)
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -2145,7 +2146,7 @@ scsi_cdb_persistent_reserve_out(enum scsi_persistent_out_sa sa, enum scsi_persis
 	unsigned char *buf;
 	int xferlen;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL)
 		goto err;
 
@@ -2219,7 +2220,7 @@ scsi_cdb_writesame10(int wrprotect, int anchor, int unmap, uint32_t lba, int gro
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -2257,7 +2258,7 @@ scsi_cdb_writesame16(int wrprotect, int anchor, int unmap, uint64_t lba, int gro
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -2301,7 +2302,7 @@ scsi_cdb_modesense6(int dbd, enum scsi_modesense_page_control pc,
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -2337,7 +2338,7 @@ scsi_cdb_modesense10(int llbaa, int dbd, enum scsi_modesense_page_control pc,
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -2375,7 +2376,7 @@ scsi_cdb_modeselect6(int pf, int sp, int param_len)
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -2410,7 +2411,7 @@ scsi_cdb_modeselect10(int pf, int sp, int param_len)
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -2955,7 +2956,7 @@ scsi_cdb_startstopunit(int immed, int pcm, int pc, int no_flush, int loej, int s
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -2994,7 +2995,7 @@ scsi_cdb_preventallow(int prevent)
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -3019,7 +3020,7 @@ scsi_cdb_synchronizecache10(int lba, int num_blocks, int syncnv, int immed)
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -3051,7 +3052,7 @@ scsi_cdb_synchronizecache16(uint64_t lba, uint32_t num_blocks, int syncnv, int i
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -3084,7 +3085,7 @@ scsi_cdb_prefetch10(uint32_t lba, int num_blocks, int immed, int group)
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -3114,7 +3115,7 @@ scsi_cdb_prefetch16(uint64_t lba, int num_blocks, int immed, int group)
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -3146,7 +3147,7 @@ scsi_cdb_serviceactionin16(enum scsi_service_action_in sa, uint32_t xferlen)
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -3186,7 +3187,7 @@ scsi_cdb_get_lba_status(uint64_t starting_lba, uint32_t alloc_len)
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -3219,7 +3220,7 @@ scsi_cdb_writeverify10(uint32_t lba, uint32_t xferlen, int blocksize, int wrprot
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -3259,7 +3260,7 @@ scsi_cdb_writeverify12(uint32_t lba, uint32_t xferlen, int blocksize, int wrprot
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -3299,7 +3300,7 @@ scsi_cdb_writeverify16(uint64_t lba, uint32_t xferlen, int blocksize, int wrprot
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
@@ -3340,7 +3341,7 @@ scsi_cdb_extended_copy(int param_len)
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL)
 		return NULL;
 
@@ -3366,7 +3367,7 @@ scsi_cdb_receive_copy_results(enum scsi_copy_results_sa sa, int list_id, int xfe
 {
 	struct scsi_task *task;
 
-	task = malloc(sizeof(struct scsi_task));
+	task = iscsi_mem_malloc(sizeof(struct scsi_task));
 	if (task == NULL) {
 		return NULL;
 	}
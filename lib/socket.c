@@ -101,6 +101,30 @@ iscsi_add_to_outqueue(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 		iscsi_pdu_set_cmdsn(pdu, current->cmdsn);
 	}
 
+	/* High priority SCSI commands are queued right after the last
+	 * non DATA-OUT PDU. DATA-OUT PDUs do not carry a CmdSN on the wire
+	 * so the command can overtake the data trains of older commands
+	 * while all commands are still sent in CmdSN order.
+	 */
+	if (pdu->priority == ISCSI_TASK_PRIORITY_HIGH &&
+	    (pdu->outdata.data[0] & 0x3f) == ISCSI_PDU_SCSI_REQUEST) {
+		struct iscsi_pdu *insert = NULL;
+
+		for (; current != NULL; current = current->next) {
+			if ((current->outdata.data[0] & 0x3f) != ISCSI_PDU_DATA_OUT) {
+				insert = current;
+			}
+		}
+		if (insert == NULL) {
+			pdu->next = iscsi->outqueue;
+			iscsi->outqueue = pdu;
+		} else {
+			pdu->next = insert->next;
+			insert->next = pdu;
+		}
+		return;
+	}
+
 	do {
 		if (iscsi_serial32_compare(pdu->cmdsn, current->cmdsn) < 0 ||
 			(pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE && !(current->outdata.data[0] & ISCSI_PDU_IMMEDIATE))) {
@@ -432,6 +456,12 @@ iscsi_queue_length(struct iscsi_context *iscsi)
 	for (pdu = iscsi->waitpdu; pdu; pdu = pdu->next) {
 		i++;
 	}
+	for (pdu = iscsi->pendingqueue[ISCSI_TASK_PRIORITY_NORMAL]; pdu; pdu = pdu->next) {
+		i++;
+	}
+	for (pdu = iscsi->pendingqueue[ISCSI_TASK_PRIORITY_HIGH]; pdu; pdu = pdu->next) {
+		i++;
+	}
 	if (iscsi->is_connected == 0) {
 		i++;
 	}
@@ -448,6 +478,12 @@ iscsi_out_queue_length(struct iscsi_context *iscsi)
 	for (pdu = iscsi->outqueue; pdu; pdu = pdu->next) {
 		i++;
 	}
+	for (pdu = iscsi->pendingqueue[ISCSI_TASK_PRIORITY_NORMAL]; pdu; pdu = pdu->next) {
+		i++;
+	}
+	for (pdu = iscsi->pendingqueue[ISCSI_TASK_PRIORITY_HIGH]; pdu; pdu = pdu->next) {
+		i++;
+	}
 
 	return i;
 }
@@ -575,6 +611,13 @@ iscsi_read_from_socket(struct iscsi_context *iscsi)
 			return -1;
 		}
 		in->hdr_pos  += count;
+		if (in->hdr_pos == ISCSI_HEADER_SIZE) {
+			ISCSI_TRACE_IN_PDU(iscsi, pdu_header_received,
+					   ISCSI_TRACE_PDU_HEADER_RECEIVED, in);
+			if (iscsi->stats_latency) {
+				in->hdr_ns = iscsi_clock_ns();
+			}
+		}
 	}
 
 	if (in->hdr_pos < ISCSI_HEADER_SIZE) {
@@ -634,6 +677,16 @@ iscsi_read_from_socket(struct iscsi_context *iscsi)
 	if (in->data_pos < data_size) {
 		return 0;
 	}
+	if (data_size != 0) {
+		ISCSI_TRACE_IN_PDU(iscsi, pdu_data_placed,
+				   ISCSI_TRACE_PDU_DATA_PLACED, in);
+	}
+	if (iscsi->pcap) {
+		iscsi_pcap_pdu_in(iscsi, in);
+	}
+
+	iscsi->stats.pdus_in[in->hdr[0] & 0x3f]++;
+	iscsi->stats.bytes_in[in->hdr[0] & 0x3f] += ISCSI_HEADER_SIZE + data_size;
 
 	ISCSI_LIST_ADD_END(&iscsi->inqueue, in);
 	iscsi->incoming = NULL;
@@ -649,10 +702,57 @@ iscsi_read_from_socket(struct iscsi_context *iscsi)
 		iscsi_free_iscsi_in_pdu(iscsi, current);
 	}
 
+	/* the target might have opened the CmdSN window */
+	iscsi_dispatch_pending_commands(iscsi);
 
 	return 0;
 }
 
+static void
+iscsi_pdu_set_header_digest(struct iscsi_pdu *pdu)
+{
+	unsigned long crc;
+
+	crc = crc32c((char *)pdu->outdata.data, ISCSI_RAW_HEADER_SIZE);
+
+	pdu->outdata.data[ISCSI_RAW_HEADER_SIZE+3] = (crc >> 24)&0xff;
+	pdu->outdata.data[ISCSI_RAW_HEADER_SIZE+2] = (crc >> 16)&0xff;
+	pdu->outdata.data[ISCSI_RAW_HEADER_SIZE+1] = (crc >>  8)&0xff;
+	pdu->outdata.data[ISCSI_RAW_HEADER_SIZE+0] = (crc)      &0xff;
+}
+
+/*
+ * Advance a Data-Out PDU that carries a whole burst to its next segment:
+ * the next DataSN, buffer offset and length, and the F bit on the last
+ * one. Returns 0 when the burst has been sent completely.
+ */
+static int
+iscsi_data_out_next_segment(struct iscsi_context *iscsi,
+			    struct iscsi_pdu *pdu)
+{
+	pdu->payload_offset += pdu->payload_len;
+	if (pdu->payload_offset >= pdu->burst_end) {
+		return 0;
+	}
+	pdu->payload_len = MIN(pdu->segment_len,
+			       pdu->burst_end - pdu->payload_offset);
+
+	iscsi_pdu_set_pduflags(pdu,
+		pdu->payload_offset + pdu->payload_len == pdu->burst_end ?
+		ISCSI_PDU_SCSI_FINAL : 0);
+	iscsi_pdu_set_datasn(pdu, ++pdu->datasn);
+	iscsi_pdu_set_bufferoffset(pdu, pdu->payload_offset);
+	iscsi_set_be32(&pdu->outdata.data[4], pdu->payload_len);
+	iscsi_pdu_set_expstatsn(pdu, iscsi->statsn + 1);
+	if (iscsi->header_digest != ISCSI_HEADER_DIGEST_NONE) {
+		iscsi_pdu_set_header_digest(pdu);
+	}
+
+	pdu->outdata_written = 0;
+	pdu->payload_written = 0;
+	return 1;
+}
+
 static int
 iscsi_write_to_socket(struct iscsi_context *iscsi)
 {
@@ -730,6 +830,13 @@ iscsi_write_to_socket(struct iscsi_context *iscsi)
 						"socket :%d", errno);
 				return -1;
 			}
+			if (pdu->outdata_written == 0 && count > 0) {
+				ISCSI_TRACE_PDU(iscsi, pdu_first_byte,
+						ISCSI_TRACE_PDU_FIRST_BYTE, pdu);
+				if (iscsi->stats_latency) {
+					pdu->write_start_ns = iscsi_clock_ns();
+				}
+			}
 			pdu->outdata_written += count;
 		}
 		/* if we havent written the full header yet. */
@@ -785,6 +892,28 @@ iscsi_write_to_socket(struct iscsi_context *iscsi)
 		if (pdu->payload_written != total) {
 			return 0;
 		}
+		ISCSI_TRACE_PDU(iscsi, pdu_last_byte, ISCSI_TRACE_PDU_LAST_BYTE, pdu);
+		if (iscsi->pcap) {
+			iscsi_pcap_pdu_out(iscsi, pdu);
+		}
+		iscsi->stats.pdus_out[pdu->outdata.data[0] & 0x3f]++;
+		iscsi->stats.bytes_out[pdu->outdata.data[0] & 0x3f] += pdu->outdata.size + total;
+		if (iscsi->stats_latency) {
+			pdu->sent_ns = iscsi_clock_ns();
+			if ((pdu->outdata.data[0] & 0x3f) < ISCSI_STATS_LATENCY_OPCODES) {
+				iscsi_stats_latency_record(
+					&iscsi->stats.submit_to_wire[pdu->outdata.data[0] & 0x3f],
+					pdu->sent_ns - pdu->queued_ns);
+				iscsi_stats_latency_record(
+					&iscsi->stats.queue_wait[pdu->outdata.data[0] & 0x3f],
+					pdu->write_start_ns - pdu->queued_ns);
+			}
+		}
+		/* the rest of the burst goes out before anything else */
+		if (pdu->burst_end &&
+		    iscsi_data_out_next_segment(iscsi, pdu)) {
+			continue;
+		}
 		if (pdu->flags & ISCSI_PDU_CORK_WHEN_SENT) {
 			iscsi->is_corked = 1;
 		}
@@ -799,6 +928,8 @@ iscsi_write_to_socket(struct iscsi_context *iscsi)
 static int
 iscsi_service_reconnect_if_loggedin(struct iscsi_context *iscsi)
 {
+	iscsi_log_ring_dump(iscsi, iscsi_get_error(iscsi));
+
 	if (iscsi->is_loggedin) {
 		if (iscsi_reconnect(iscsi) == 0) {
 			return 0;
@@ -927,23 +1058,17 @@ iscsi_queue_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 	}
 
 	if (iscsi->header_digest != ISCSI_HEADER_DIGEST_NONE) {
-		unsigned long crc;
-
 		if (pdu->outdata.size < ISCSI_RAW_HEADER_SIZE + 4) {
 			iscsi_set_error(iscsi, "PDU too small (%u) to contain header digest",
 					(unsigned int) pdu->outdata.size);
 			return -1;
 		}
 
-		crc = crc32c((char *)pdu->outdata.data, ISCSI_RAW_HEADER_SIZE);
-
-		pdu->outdata.data[ISCSI_RAW_HEADER_SIZE+3] = (crc >> 24)&0xff;
-		pdu->outdata.data[ISCSI_RAW_HEADER_SIZE+2] = (crc >> 16)&0xff;
-		pdu->outdata.data[ISCSI_RAW_HEADER_SIZE+1] = (crc >>  8)&0xff;
-		pdu->outdata.data[ISCSI_RAW_HEADER_SIZE+0] = (crc)      &0xff;
+		iscsi_pdu_set_header_digest(pdu);
 	}
 
 	iscsi_add_to_outqueue(iscsi, pdu);
+	ISCSI_TRACE_PDU(iscsi, pdu_queued, ISCSI_TRACE_PDU_QUEUED, pdu);
 
 	return 0;
 }
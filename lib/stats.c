@@ -0,0 +1,238 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if defined(WIN32)
+#include <winsock2.h>
+#include "win32/win32_compat.h"
+#else
+#include <sys/time.h>
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+/*
+ * Per context counters, see iscsi_get_stats().
+ *
+ * The counters are updated inline where the PDUs are read, written and
+ * completed and cost no more than an increment. Only the latency
+ * histograms and the CmdSN window accounting need the time, and the
+ * latter only reads the clock when the window closes or opens again.
+ */
+
+uint64_t
+iscsi_clock_ns(void)
+{
+#if defined(HAVE_CLOCK_GETTIME)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+	struct timeval tv;
+
+#if defined(WIN32)
+	win32_gettimeofday(&tv, NULL);
+#else
+	gettimeofday(&tv, NULL);
+#endif
+	return tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
+#endif
+}
+
+void
+iscsi_stats_latency_record(struct iscsi_latency_histogram *h, uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	int i;
+
+	for (i = 0; i < ISCSI_STATS_LATENCY_BUCKETS - 1; i++) {
+		if (us < (1ULL << i)) {
+			break;
+		}
+	}
+	h->buckets[i]++;
+	h->count++;
+	h->sum_us += us;
+	if (us > h->max_us) {
+		h->max_us = us;
+	}
+}
+
+void
+iscsi_stats_scsi_status(struct iscsi_context *iscsi, int status)
+{
+	enum iscsi_stats_status s;
+
+	switch (status) {
+	case SCSI_STATUS_GOOD:
+		s = ISCSI_STATS_GOOD;
+		break;
+	case SCSI_STATUS_CHECK_CONDITION:
+		s = ISCSI_STATS_CHECK_CONDITION;
+		break;
+	case SCSI_STATUS_CONDITION_MET:
+		s = ISCSI_STATS_CONDITION_MET;
+		break;
+	case SCSI_STATUS_BUSY:
+		s = ISCSI_STATS_BUSY;
+		break;
+	case SCSI_STATUS_RESERVATION_CONFLICT:
+		s = ISCSI_STATS_RESERVATION_CONFLICT;
+		break;
+	case SCSI_STATUS_TASK_SET_FULL:
+		s = ISCSI_STATS_TASK_SET_FULL;
+		break;
+	case SCSI_STATUS_ACA_ACTIVE:
+		s = ISCSI_STATS_ACA_ACTIVE;
+		break;
+	case SCSI_STATUS_TASK_ABORTED:
+		s = ISCSI_STATS_TASK_ABORTED;
+		break;
+	case SCSI_STATUS_CANCELLED:
+		s = ISCSI_STATS_CANCELLED;
+		break;
+	case SCSI_STATUS_TIMEOUT:
+		s = ISCSI_STATS_TIMEOUT;
+		break;
+	default:
+		s = ISCSI_STATS_ERROR;
+		break;
+	}
+	iscsi->stats.scsi_status[s]++;
+}
+
+/*
+ * Called whenever commands may have been added to or removed from the
+ * pending queues. Commands only stay on them while the CmdSN window is
+ * closed.
+ */
+void
+iscsi_stats_cmdsn_window(struct iscsi_context *iscsi)
+{
+	int blocked = iscsi->pendingqueue[ISCSI_TASK_PRIORITY_NORMAL] != NULL ||
+		iscsi->pendingqueue[ISCSI_TASK_PRIORITY_HIGH] != NULL;
+
+	if (blocked && !iscsi->cmdsn_blocked_since) {
+		iscsi->cmdsn_blocked_since = iscsi_clock_ns();
+		iscsi->stats.cmdsn_blocked++;
+	} else if (!blocked && iscsi->cmdsn_blocked_since) {
+		iscsi->stats.cmdsn_blocked_us +=
+			(iscsi_clock_ns() - iscsi->cmdsn_blocked_since) / 1000;
+		iscsi->cmdsn_blocked_since = 0;
+	}
+}
+
+int
+iscsi_get_stats(struct iscsi_context *iscsi, struct iscsi_stats *stats)
+{
+	struct iscsi_pdu *pdu;
+	int i;
+
+	if (stats == NULL) {
+		iscsi_set_error(iscsi, "no buffer for the statistics");
+		return -1;
+	}
+
+	memcpy(stats, &iscsi->stats, sizeof(*stats));
+
+	stats->outqueue_depth = 0;
+	for (pdu = iscsi->outqueue; pdu; pdu = pdu->next) {
+		stats->outqueue_depth++;
+	}
+	stats->waitpdu_depth = 0;
+	for (pdu = iscsi->waitpdu; pdu; pdu = pdu->next) {
+		stats->waitpdu_depth++;
+	}
+	stats->pending_depth = 0;
+	for (i = 0; i <= ISCSI_TASK_PRIORITY_HIGH; i++) {
+		for (pdu = iscsi->pendingqueue[i]; pdu; pdu = pdu->next) {
+			stats->pending_depth++;
+		}
+	}
+
+	if (iscsi->cmdsn_blocked_since) {
+		stats->cmdsn_blocked_us +=
+			(iscsi_clock_ns() - iscsi->cmdsn_blocked_since) / 1000;
+	}
+	return 0;
+}
+
+void
+iscsi_reset_stats(struct iscsi_context *iscsi)
+{
+	memset(&iscsi->stats, 0, sizeof(iscsi->stats));
+	if (iscsi->cmdsn_blocked_since) {
+		iscsi->cmdsn_blocked_since = iscsi_clock_ns();
+	}
+}
+
+int
+iscsi_set_stats_latency(struct iscsi_context *iscsi, int enable)
+{
+	iscsi->stats_latency = enable ? 1 : 0;
+	return 0;
+}
+
+int
+iscsi_get_task_timing(struct iscsi_context *iscsi, struct scsi_task *task,
+		      struct scsi_task_timing *timing)
+{
+	/* the itt tells a task apart from a later one at the same address */
+	if (iscsi->timing_task != task || iscsi->timing_itt != task->itt) {
+		memset(timing, 0, sizeof(*timing));
+		return -1;
+	}
+	*timing = iscsi->task_timing;
+	return 0;
+}
+
+void
+iscsi_trace(struct iscsi_context *iscsi, enum iscsi_trace_point point,
+	    uint32_t itt, uint32_t sn, uint8_t opcode, uint32_t lun,
+	    uint32_t length, int status)
+{
+	struct iscsi_trace_event event;
+
+	event.point   = point;
+	event.time_ns = iscsi_clock_ns();
+	event.itt     = itt;
+	event.sn      = sn;
+	event.opcode  = opcode;
+	event.lun     = lun;
+	event.length  = length;
+	event.status  = status;
+
+	iscsi->trace_fn(iscsi, &event, iscsi->trace_private_data);
+}
+
+int
+iscsi_set_trace_callback(struct iscsi_context *iscsi, iscsi_trace_fn fn,
+			 void *private_data)
+{
+	iscsi->trace_fn           = fn;
+	iscsi->trace_private_data = private_data;
+	return 0;
+}
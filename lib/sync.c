@@ -47,28 +47,36 @@ struct iscsi_sync_state {
    struct scsi_task *task;
 };
 
-static void
-event_loop(struct iscsi_context *iscsi, struct iscsi_sync_state *state)
+/* Wait up to timeout ms for the socket to become ready and service it */
+int
+iscsi_sync_poll(struct iscsi_context *iscsi, int timeout)
 {
 	struct pollfd pfd;
+	short revents;
 	int ret;
 
-	while (state->finished == 0) {
-		short revents;
+	pfd.fd = iscsi_get_fd(iscsi);
+	pfd.events = iscsi_which_events(iscsi);
 
-		pfd.fd = iscsi_get_fd(iscsi);
-		pfd.events = iscsi_which_events(iscsi);
+	if ((ret = poll(&pfd, 1, timeout)) < 0) {
+		iscsi_set_error(iscsi, "Poll failed");
+		return -1;
+	}
+	revents = (ret == 0) ? 0 : pfd.revents;
+	if (iscsi_service(iscsi, revents) < 0) {
+		iscsi_set_error(iscsi,
+			"iscsi_service failed with : %s",
+			iscsi_get_error(iscsi));
+		return -1;
+	}
+	return 0;
+}
 
-		if ((ret = poll(&pfd, 1, 1000)) < 0) {
-			iscsi_set_error(iscsi, "Poll failed");
-			state->status = -1;
-			return;
-		}
-		revents = (ret == 0) ? 0 : pfd.revents;
-		if (iscsi_service(iscsi, revents) < 0) {
-			iscsi_set_error(iscsi,
-				"iscsi_service failed with : %s",
-				iscsi_get_error(iscsi));
+static void
+event_loop(struct iscsi_context *iscsi, struct iscsi_sync_state *state)
+{
+	while (state->finished == 0) {
+		if (iscsi_sync_poll(iscsi, 1000) != 0) {
 			state->status = -1;
 			return;
 		}
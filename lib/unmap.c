@@ -0,0 +1,430 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "slist.h"
+
+/*
+ * UNMAP batching.
+ *
+ * Ranges are collected until iscsi_unmap_batch_submit() is called. They
+ * are then sorted and merged into extents, the extents are cut into
+ * block descriptors that honour the Block Limits VPD and the descriptors
+ * are packed into as few UNMAP commands as possible, which are all sent
+ * in parallel. The callback for a range is invoked once every command
+ * that covers part of its extent has completed.
+ */
+
+/* the parameter list length of UNMAP is 16 bits */
+#define UNMAP_MAX_DESCRIPTORS ((0xffff - 8) / 16)
+
+struct unmap_range {
+	struct unmap_range *next;
+	uint64_t lba;
+	uint32_t num;
+	iscsi_command_cb cb;
+	void *private_data;
+};
+
+struct unmap_extent {
+	uint64_t lba;
+	uint64_t num;
+	int outstanding;
+	int status;
+	struct unmap_range *ranges;
+};
+
+/* all the commands created by one call to iscsi_unmap_batch_submit() */
+struct unmap_round {
+	int outstanding;
+	int num_extents;
+	struct unmap_extent *extents;
+};
+
+struct unmap_command {
+	struct unmap_round *round;
+	int first_extent;
+	int last_extent;
+};
+
+struct iscsi_unmap_batch {
+	struct iscsi_context *iscsi;
+	int lun;
+
+	uint32_t max_lbas;
+	uint32_t max_descriptors;
+	uint32_t granularity;
+	uint32_t alignment;
+
+	int num_ranges;
+	struct unmap_range *ranges;
+};
+
+static void
+unmap_complete_extent(struct iscsi_context *iscsi, struct unmap_extent *ext)
+{
+	struct unmap_range *range;
+
+	while ((range = ext->ranges) != NULL) {
+		ISCSI_LIST_REMOVE(&ext->ranges, range);
+		if (range->cb) {
+			range->cb(iscsi, ext->status, NULL, range->private_data);
+		}
+		iscsi_free(iscsi, range);
+	}
+}
+
+static void
+unmap_free_round(struct iscsi_context *iscsi, struct unmap_round *round)
+{
+	iscsi_free(iscsi, round->extents);
+	iscsi_free(iscsi, round);
+}
+
+static void
+unmap_cb(struct iscsi_context *iscsi, int status,
+	 void *command_data, void *private_data)
+{
+	struct unmap_command *cmd = private_data;
+	struct unmap_round *round = cmd->round;
+	struct scsi_task *task = command_data;
+	int i;
+
+	for (i = cmd->first_extent; i <= cmd->last_extent; i++) {
+		struct unmap_extent *ext = &round->extents[i];
+
+		if (status != SCSI_STATUS_GOOD &&
+		    ext->status == SCSI_STATUS_GOOD) {
+			ext->status = status;
+		}
+		if (--ext->outstanding == 0) {
+			unmap_complete_extent(iscsi, ext);
+		}
+	}
+	scsi_free_scsi_task(task);
+	iscsi_free(iscsi, cmd);
+
+	if (--round->outstanding == 0) {
+		unmap_free_round(iscsi, round);
+	}
+}
+
+static int
+unmap_range_compare(const void *a, const void *b)
+{
+	const struct unmap_range *ra = *(struct unmap_range * const *)a;
+	const struct unmap_range *rb = *(struct unmap_range * const *)b;
+
+	if (ra->lba < rb->lba) {
+		return -1;
+	}
+	return ra->lba > rb->lba;
+}
+
+/* Length of the next descriptor of an extent starting at lba. Where the
+ * descriptor has to be cut short, cut it on a granularity boundary.
+ */
+static uint32_t
+unmap_descriptor_len(struct iscsi_unmap_batch *batch, uint64_t lba,
+		     uint64_t num, uint32_t room)
+{
+	uint64_t len = MIN(num, room);
+
+	if (len < num && batch->granularity > 1) {
+		uint64_t end = lba + len;
+		uint64_t rem = (end + batch->granularity - batch->alignment)
+			       % batch->granularity;
+
+		if (len > rem) {
+			len -= rem;
+		}
+	}
+	return (uint32_t)len;
+}
+
+/* Send the descriptors for extents[first..last], starting at lba in the
+ * first extent.
+ */
+static int
+unmap_send(struct iscsi_unmap_batch *batch, struct unmap_round *round,
+	   struct unmap_list *list, int num_descriptors, int first, int last)
+{
+	struct unmap_command *cmd;
+	int i;
+
+	cmd = iscsi_malloc(batch->iscsi, sizeof(struct unmap_command));
+	if (cmd == NULL) {
+		iscsi_set_error(batch->iscsi, "Out-of-memory: failed to "
+				"allocate unmap command");
+		return -1;
+	}
+	cmd->round        = round;
+	cmd->first_extent = first;
+	cmd->last_extent  = last;
+
+	for (i = first; i <= last; i++) {
+		round->extents[i].outstanding++;
+	}
+	round->outstanding++;
+
+	if (iscsi_unmap_task(batch->iscsi, batch->lun, 0, 0, list,
+			     num_descriptors, unmap_cb, cmd) == NULL) {
+		for (i = first; i <= last; i++) {
+			round->extents[i].outstanding--;
+			round->extents[i].status = SCSI_STATUS_ERROR;
+		}
+		round->outstanding--;
+		iscsi_free(batch->iscsi, cmd);
+		return -1;
+	}
+	return 0;
+}
+
+struct iscsi_unmap_batch *
+iscsi_unmap_batch_create(struct iscsi_context *iscsi, int lun,
+			 struct scsi_inquiry_block_limits *inq)
+{
+	struct iscsi_unmap_batch *batch;
+	uint32_t max_lbas, max_descriptors, granularity, alignment;
+
+	if (inq != NULL) {
+		max_lbas        = inq->max_unmap;
+		max_descriptors = inq->max_unmap_bdc;
+		granularity     = inq->opt_unmap_gran;
+		alignment       = inq->ugavalid ? inq->unmap_gran_align : 0;
+	} else if (iscsi->block_limits.valid && lun == iscsi->lun) {
+		max_lbas        = iscsi->block_limits.max_unmap;
+		max_descriptors = iscsi->block_limits.max_unmap_bdc;
+		granularity     = iscsi->block_limits.opt_unmap_gran;
+		alignment       = iscsi->block_limits.ugavalid ?
+				  iscsi->block_limits.unmap_gran_align : 0;
+	} else {
+		max_lbas        = 0xffffffff;
+		max_descriptors = 0xffffffff;
+		granularity     = 0;
+		alignment       = 0;
+	}
+
+	if (max_lbas == 0 || max_descriptors == 0) {
+		iscsi_set_error(iscsi, "Device does not support UNMAP");
+		return NULL;
+	}
+
+	batch = iscsi_zmalloc(iscsi, sizeof(struct iscsi_unmap_batch));
+	if (batch == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"unmap batch");
+		return NULL;
+	}
+	batch->iscsi           = iscsi;
+	batch->lun             = lun;
+	batch->max_lbas        = max_lbas;
+	batch->max_descriptors = MIN(max_descriptors, UNMAP_MAX_DESCRIPTORS);
+	batch->granularity     = granularity;
+	batch->alignment       = granularity ? alignment % granularity : 0;
+
+	/* keep the per command limit a whole number of granules */
+	if (granularity > 1 && max_lbas != 0xffffffff &&
+	    max_lbas >= granularity) {
+		batch->max_lbas -= max_lbas % granularity;
+	}
+
+	return batch;
+}
+
+int
+iscsi_unmap_batch_add(struct iscsi_unmap_batch *batch, uint64_t lba,
+		      uint32_t num, iscsi_command_cb cb, void *private_data)
+{
+	struct unmap_range *range;
+
+	range = iscsi_malloc(batch->iscsi, sizeof(struct unmap_range));
+	if (range == NULL) {
+		iscsi_set_error(batch->iscsi, "Out-of-memory: failed to "
+				"allocate unmap range");
+		return -1;
+	}
+	range->lba          = lba;
+	range->num          = num;
+	range->cb           = cb;
+	range->private_data = private_data;
+
+	ISCSI_LIST_ADD(&batch->ranges, range);
+	batch->num_ranges++;
+
+	return 0;
+}
+
+int
+iscsi_unmap_batch_submit(struct iscsi_unmap_batch *batch)
+{
+	struct iscsi_context *iscsi = batch->iscsi;
+	struct unmap_range **sorted, *range;
+	struct unmap_round *round;
+	struct unmap_list *list;
+	int i, n, first, num_descriptors, ret = 0;
+	uint32_t lbas;
+
+	if (batch->ranges == NULL) {
+		return 0;
+	}
+
+	sorted = iscsi_malloc(iscsi, batch->num_ranges * sizeof(*sorted));
+	round = iscsi_zmalloc(iscsi, sizeof(struct unmap_round));
+	list = iscsi_malloc(iscsi, batch->max_descriptors * sizeof(*list));
+	if (round != NULL) {
+		round->extents = iscsi_zmalloc(iscsi, batch->num_ranges
+					       * sizeof(struct unmap_extent));
+	}
+	if (sorted == NULL || round == NULL || round->extents == NULL ||
+	    list == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"unmap batch");
+		if (round != NULL) {
+			iscsi_free(iscsi, round->extents);
+		}
+		iscsi_free(iscsi, round);
+		iscsi_free(iscsi, sorted);
+		iscsi_free(iscsi, list);
+		return -1;
+	}
+
+	for (n = 0; (range = batch->ranges) != NULL; n++) {
+		ISCSI_LIST_REMOVE(&batch->ranges, range);
+		sorted[n] = range;
+	}
+	batch->num_ranges = 0;
+	qsort(sorted, n, sizeof(*sorted), unmap_range_compare);
+
+	/* merge overlapping and adjacent ranges into extents */
+	for (i = 0; i < n; i++) {
+		struct unmap_extent *ext = &round->extents[round->num_extents];
+
+		range = sorted[i];
+		if (round->num_extents > 0 && range->lba <= ext[-1].lba
+		    + ext[-1].num) {
+			ext--;
+			ext->num = MAX(ext->lba + ext->num,
+				       range->lba + range->num) - ext->lba;
+		} else {
+			ext->lba    = range->lba;
+			ext->num    = range->num;
+			ext->status = SCSI_STATUS_GOOD;
+			round->num_extents++;
+		}
+		ISCSI_LIST_ADD(&ext->ranges, range);
+	}
+	iscsi_free(iscsi, sorted);
+
+	ISCSI_LOG(iscsi, 6, "unmap batch of %d ranges merged into %d extents",
+		  n, round->num_extents);
+
+	/* hold a reference of our own while the commands are sent */
+	round->outstanding = 1;
+
+	num_descriptors = 0;
+	lbas = 0;
+	first = 0;
+	for (i = 0; i < round->num_extents; i++) {
+		struct unmap_extent *ext = &round->extents[i];
+		uint64_t lba = ext->lba;
+		uint64_t num = ext->num;
+
+		while (num > 0) {
+			uint32_t len;
+
+			if (num_descriptors == 0) {
+				first = i;
+			}
+			len = unmap_descriptor_len(batch, lba, num,
+						   batch->max_lbas - lbas);
+			list[num_descriptors].lba = lba;
+			list[num_descriptors].num = len;
+			num_descriptors++;
+			lbas += len;
+			lba  += len;
+			num  -= len;
+
+			if (num_descriptors == (int)batch->max_descriptors
+			    || batch->max_lbas - lbas
+			       < MAX(batch->granularity, 1)) {
+				if (unmap_send(batch, round, list,
+					       num_descriptors, first, i)) {
+					ret = -1;
+				}
+				num_descriptors = 0;
+				lbas = 0;
+			}
+		}
+	}
+	if (num_descriptors > 0) {
+		if (unmap_send(batch, round, list, num_descriptors, first,
+			       round->num_extents - 1)) {
+			ret = -1;
+		}
+	}
+	iscsi_free(iscsi, list);
+
+	/* extents whose commands all failed to be sent, or that were
+	 * empty, complete right away.
+	 */
+	for (i = 0; i < round->num_extents; i++) {
+		if (round->extents[i].outstanding == 0) {
+			unmap_complete_extent(iscsi, &round->extents[i]);
+		}
+	}
+	if (--round->outstanding == 0) {
+		unmap_free_round(iscsi, round);
+	}
+
+	return ret;
+}
+
+int
+iscsi_unmap_batch_pending(struct iscsi_unmap_batch *batch)
+{
+	return batch->num_ranges;
+}
+
+void
+iscsi_unmap_batch_destroy(struct iscsi_unmap_batch *batch)
+{
+	struct unmap_range *range;
+
+	if (batch == NULL) {
+		return;
+	}
+
+	while ((range = batch->ranges) != NULL) {
+		ISCSI_LIST_REMOVE(&batch->ranges, range);
+		if (range->cb) {
+			range->cb(batch->iscsi, SCSI_STATUS_CANCELLED, NULL,
+				  range->private_data);
+		}
+		iscsi_free(batch->iscsi, range);
+	}
+	iscsi_free(batch->iscsi, batch);
+}
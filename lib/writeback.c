@@ -0,0 +1,468 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "slist.h"
+
+/*
+ * Write-back cache.
+ *
+ * Writes are copied into dirty extents that are kept sorted by LBA.
+ * A write that overlaps or is adjacent to existing extents is merged
+ * with them so that the extents are as large as possible. An extent is
+ * written to the target with a single WRITE16 once it reaches flush_size
+ * or when the cache holds more than max_dirty bytes.
+ *
+ * Extents that are being written are immutable and are kept on a
+ * separate list until the WRITE16 completes. An extent is never written
+ * while an older write to an overlapping range is still in flight, so
+ * writes to the same blocks reach the target in order.
+ */
+struct wb_extent {
+	struct wb_extent *next;
+	uint64_t lba;
+	uint32_t num_blocks;
+	unsigned char *data;
+	struct scsi_task *task;
+	struct iscsi_writeback *wb;
+};
+
+struct iscsi_writeback {
+	struct iscsi_context *iscsi;
+	int lun;
+	uint32_t block_size;
+	uint64_t num_blocks;
+
+	size_t max_dirty;
+	uint32_t flush_size;
+
+	/* bytes held by the cache, dirty and in flight */
+	size_t cached;
+
+	/* sorted by lba, never overlapping or adjacent */
+	struct wb_extent *dirty;
+	struct wb_extent *in_flight;
+
+	/* a write-back failed since the last iscsi_writeback_sync() */
+	int error;
+	uint64_t error_lba;
+};
+
+static int
+wb_overlaps(struct wb_extent *ext, uint64_t lba, uint64_t num_blocks)
+{
+	return ext->lba < lba + num_blocks && lba < ext->lba + ext->num_blocks;
+}
+
+static void
+wb_free_extent(struct iscsi_writeback *wb, struct wb_extent *ext)
+{
+	wb->cached -= (size_t)ext->num_blocks * wb->block_size;
+	iscsi_free(wb->iscsi, ext->data);
+	iscsi_free(wb->iscsi, ext);
+}
+
+static void
+wb_write_cb(struct iscsi_context *iscsi, int status,
+	    void *command_data _U_, void *private_data)
+{
+	struct wb_extent *ext = private_data;
+	struct iscsi_writeback *wb = ext->wb;
+
+	/* command_data is NULL when the task was cancelled */
+	scsi_free_scsi_task(ext->task);
+
+	if (wb == NULL) {
+		/* the cache was destroyed while this write was in flight */
+		iscsi_free(iscsi, ext->data);
+		iscsi_free(iscsi, ext);
+		return;
+	}
+	if (status != SCSI_STATUS_GOOD) {
+		ISCSI_LOG(wb->iscsi, 1, "write-back of %u blocks at lba %llu "
+			  "failed", ext->num_blocks,
+			  (unsigned long long)ext->lba);
+		if (!wb->error) {
+			wb->error     = 1;
+			wb->error_lba = ext->lba;
+		}
+	}
+
+	ISCSI_LIST_REMOVE(&wb->in_flight, ext);
+	wb_free_extent(wb, ext);
+}
+
+/* Wait until no write to the range is in flight */
+static int
+wb_wait_range(struct iscsi_writeback *wb, uint64_t lba, uint64_t num_blocks)
+{
+	struct wb_extent *ext;
+
+again:
+	for (ext = wb->in_flight; ext; ext = ext->next) {
+		if (wb_overlaps(ext, lba, num_blocks)) {
+			if (iscsi_sync_poll(wb->iscsi, 1000) != 0) {
+				return -1;
+			}
+			goto again;
+		}
+	}
+	return 0;
+}
+
+/* Remove a dirty extent from the cache and start writing it */
+static int
+wb_flush_extent(struct iscsi_writeback *wb, struct wb_extent *ext)
+{
+	ISCSI_LIST_REMOVE(&wb->dirty, ext);
+
+	if (wb_wait_range(wb, ext->lba, ext->num_blocks) == 0) {
+		ext->task = iscsi_write16_task(wb->iscsi, wb->lun, ext->lba,
+					       ext->data,
+					       ext->num_blocks * wb->block_size,
+					       wb->block_size, 0, 0, 0, 0, 0,
+					       wb_write_cb, ext);
+	}
+	if (ext->task == NULL) {
+		iscsi_set_error(wb->iscsi, "failed to send write-back of lba "
+				"%llu", (unsigned long long)ext->lba);
+		if (!wb->error) {
+			wb->error     = 1;
+			wb->error_lba = ext->lba;
+		}
+		wb_free_extent(wb, ext);
+		return -1;
+	}
+
+	ISCSI_LIST_ADD(&wb->in_flight, ext);
+	return 0;
+}
+
+struct iscsi_writeback *
+iscsi_writeback_create(struct iscsi_context *iscsi, int lun,
+		       uint32_t block_size, uint64_t num_blocks,
+		       size_t max_dirty, uint32_t flush_size)
+{
+	struct iscsi_writeback *wb;
+
+	if (block_size == 0 || flush_size < block_size ||
+	    max_dirty < flush_size) {
+		iscsi_set_error(iscsi, "Invalid write-back parameters");
+		return NULL;
+	}
+
+	wb = iscsi_zmalloc(iscsi, sizeof(struct iscsi_writeback));
+	if (wb == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"write-back context");
+		return NULL;
+	}
+	wb->iscsi      = iscsi;
+	wb->lun        = lun;
+	wb->block_size = block_size;
+	wb->num_blocks = num_blocks;
+	wb->max_dirty  = max_dirty;
+	wb->flush_size = flush_size;
+
+	return wb;
+}
+
+int
+iscsi_writeback_write(struct iscsi_writeback *wb, uint64_t offset,
+		      const unsigned char *buf, uint32_t count)
+{
+	struct wb_extent *ext, *next, *prev, *first = NULL;
+	uint64_t lba, end, start, last;
+	size_t old_size = 0;
+
+	if (offset % wb->block_size || count % wb->block_size) {
+		iscsi_set_error(wb->iscsi, "write-back writes must be block "
+				"aligned");
+		return -1;
+	}
+	lba = offset / wb->block_size;
+	end = lba + count / wb->block_size;
+	if (end > wb->num_blocks) {
+		iscsi_set_error(wb->iscsi, "write-back write beyond the end "
+				"of the LUN");
+		return -1;
+	}
+	if (count == 0) {
+		return 0;
+	}
+
+	/* Too large to be worth caching. Write it through, after anything
+	 * cached for the same range.
+	 */
+	if (count > wb->max_dirty / 2) {
+		struct scsi_task *task;
+
+		if (iscsi_writeback_flush_range(wb, offset, count) != 0) {
+			return -1;
+		}
+		task = iscsi_write16_sync(wb->iscsi, wb->lun, lba,
+					  discard_const(buf), count,
+					  wb->block_size, 0, 0, 0, 0, 0);
+		if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+			iscsi_set_error(wb->iscsi, "write of lba %llu failed",
+					(unsigned long long)lba);
+			scsi_free_scsi_task(task);
+			return -1;
+		}
+		scsi_free_scsi_task(task);
+		return count;
+	}
+
+	/* find the extents that overlap or are adjacent to the write */
+	start = lba;
+	last  = end;
+	prev  = NULL;
+	for (ext = wb->dirty; ext; ext = ext->next) {
+		if (ext->lba + ext->num_blocks < lba) {
+			prev = ext;
+			continue;
+		}
+		if (ext->lba > end) {
+			break;
+		}
+		if (first == NULL) {
+			first = ext;
+		}
+		start = MIN(start, ext->lba);
+		last  = MAX(last, ext->lba + ext->num_blocks);
+		old_size += (size_t)ext->num_blocks * wb->block_size;
+	}
+
+	if (first != NULL && first->lba == start) {
+		/* grow the first extent to cover the whole range */
+		unsigned char *data;
+
+		data = iscsi_realloc(wb->iscsi, first->data,
+				     (last - start) * wb->block_size);
+		if (data == NULL) {
+			iscsi_set_error(wb->iscsi, "Out-of-memory: failed to "
+					"grow write-back extent");
+			return -1;
+		}
+		first->data = data;
+		ext = first;
+		next = first->next;
+	} else {
+		ext = iscsi_zmalloc(wb->iscsi, sizeof(struct wb_extent));
+		if (ext == NULL) {
+			iscsi_set_error(wb->iscsi, "Out-of-memory: failed to "
+					"allocate write-back extent");
+			return -1;
+		}
+		ext->data = iscsi_malloc(wb->iscsi,
+					 (last - start) * wb->block_size);
+		if (ext->data == NULL) {
+			iscsi_free(wb->iscsi, ext);
+			iscsi_set_error(wb->iscsi, "Out-of-memory: failed to "
+					"allocate write-back extent");
+			return -1;
+		}
+		ext->wb = wb;
+		/* link it in where the merged extents start */
+		if (prev == NULL) {
+			ext->next = wb->dirty;
+			wb->dirty = ext;
+		} else {
+			ext->next = prev->next;
+			prev->next = ext;
+		}
+		next = ext->next;
+	}
+
+	/* fold the following extents into it */
+	while (next != NULL && next->lba < last) {
+		struct wb_extent *tmp = next;
+
+		memcpy(&ext->data[(tmp->lba - start) * wb->block_size],
+		       tmp->data, (size_t)tmp->num_blocks * wb->block_size);
+		next = tmp->next;
+		iscsi_free(wb->iscsi, tmp->data);
+		iscsi_free(wb->iscsi, tmp);
+	}
+	ext->next       = next;
+	ext->lba        = start;
+	ext->num_blocks = last - start;
+	memcpy(&ext->data[(lba - start) * wb->block_size], buf, count);
+
+	wb->cached += (size_t)ext->num_blocks * wb->block_size - old_size;
+
+	if ((size_t)ext->num_blocks * wb->block_size >= wb->flush_size) {
+		if (wb_flush_extent(wb, ext) != 0) {
+			return -1;
+		}
+	}
+
+	/* keep the memory that is held by the cache bounded */
+	while (wb->cached > wb->max_dirty) {
+		while (wb->dirty != NULL) {
+			if (wb_flush_extent(wb, wb->dirty) != 0) {
+				return -1;
+			}
+		}
+		if (wb->cached > wb->max_dirty &&
+		    iscsi_sync_poll(wb->iscsi, 1000) != 0) {
+			return -1;
+		}
+	}
+
+	/* reap any write-backs that have completed */
+	if (wb->in_flight != NULL && iscsi_sync_poll(wb->iscsi, 0) != 0) {
+		return -1;
+	}
+
+	return count;
+}
+
+int
+iscsi_writeback_flush_range(struct iscsi_writeback *wb, uint64_t offset,
+			    uint64_t count)
+{
+	struct wb_extent *ext, *next;
+	uint64_t lba, num_blocks;
+
+	if (count == 0) {
+		return 0;
+	}
+	lba = offset / wb->block_size;
+	num_blocks = (offset % wb->block_size + count + wb->block_size - 1)
+		     / wb->block_size;
+
+	for (ext = wb->dirty; ext; ext = next) {
+		next = ext->next;
+		if (wb_overlaps(ext, lba, num_blocks)) {
+			if (wb_flush_extent(wb, ext) != 0) {
+				return -1;
+			}
+		}
+	}
+
+	return wb_wait_range(wb, lba, num_blocks);
+}
+
+/* Is any of the byte range dirty in the cache or being written? */
+int
+iscsi_writeback_cached(struct iscsi_writeback *wb, uint64_t offset,
+		       uint64_t count)
+{
+	struct wb_extent *ext;
+	uint64_t lba, num_blocks;
+
+	if (count == 0) {
+		return 0;
+	}
+	lba = offset / wb->block_size;
+	num_blocks = (offset % wb->block_size + count + wb->block_size - 1)
+		     / wb->block_size;
+
+	for (ext = wb->dirty; ext; ext = ext->next) {
+		if (wb_overlaps(ext, lba, num_blocks)) {
+			return 1;
+		}
+	}
+	for (ext = wb->in_flight; ext; ext = ext->next) {
+		if (wb_overlaps(ext, lba, num_blocks)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int
+iscsi_writeback_sync(struct iscsi_writeback *wb)
+{
+	struct scsi_task *task;
+
+	while (wb->dirty != NULL) {
+		if (wb_flush_extent(wb, wb->dirty) != 0) {
+			break;
+		}
+	}
+	while (wb->in_flight != NULL) {
+		if (iscsi_sync_poll(wb->iscsi, 1000) != 0) {
+			return -1;
+		}
+	}
+
+	if (wb->error) {
+		iscsi_set_error(wb->iscsi, "write-back to lba %llu failed",
+				(unsigned long long)wb->error_lba);
+		wb->error = 0;
+		return -1;
+	}
+
+	task = iscsi_synchronizecache16_sync(wb->iscsi, wb->lun, 0, 0, 0, 0);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		iscsi_set_error(wb->iscsi, "SYNCHRONIZE CACHE16 failed");
+		scsi_free_scsi_task(task);
+		return -1;
+	}
+	scsi_free_scsi_task(task);
+
+	return 0;
+}
+
+int
+iscsi_writeback_destroy(struct iscsi_writeback *wb)
+{
+	struct wb_extent *ext;
+	int ret;
+
+	if (wb == NULL) {
+		return 0;
+	}
+
+	ret = iscsi_writeback_sync(wb);
+
+	/* only left over if the connection failed */
+	while ((ext = wb->dirty) != NULL) {
+		ISCSI_LIST_REMOVE(&wb->dirty, ext);
+		wb_free_extent(wb, ext);
+	}
+	while ((ext = wb->in_flight) != NULL) {
+		ret = -1;
+		if (iscsi_scsi_cancel_task(wb->iscsi, ext->task) == 0) {
+			continue;
+		}
+		/* being written, or split, wait for it to complete */
+		if (iscsi_sync_poll(wb->iscsi, 1000) != 0) {
+			break;
+		}
+	}
+	/* Writes that are still in flight after that are completed when
+	 * the context is destroyed, they must not touch the cache.
+	 */
+	for (ext = wb->in_flight; ext; ext = ext->next) {
+		ext->wb = NULL;
+	}
+
+	iscsi_free(wb->iscsi, wb);
+	return ret;
+}
@@ -0,0 +1,192 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/*
+ * Detection of all-zero buffers, see iscsi_set_zero_detect().
+ *
+ * Most blocks that are not zero have a non-zero byte right at the start
+ * so the first few bytes are checked one at a time before switching to
+ * the widest loads the compiler was told it may use. The main loop ORs
+ * four vectors together and only tests the result once per iteration.
+ */
+#define ZERO_PROBE_BYTES 16
+
+#if defined(__AVX2__)
+#define ZERO_VECTOR_BYTES 32
+
+static int
+zero_vector(const unsigned char *buf, size_t count)
+{
+	const __m256i *p = (const __m256i *)buf;
+	size_t i;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		__m256i v = _mm256_or_si256(
+				_mm256_or_si256(_mm256_load_si256(&p[i]),
+						_mm256_load_si256(&p[i + 1])),
+				_mm256_or_si256(_mm256_load_si256(&p[i + 2]),
+						_mm256_load_si256(&p[i + 3])));
+		if (!_mm256_testz_si256(v, v)) {
+			return 0;
+		}
+	}
+	for (; i < count; i++) {
+		__m256i v = _mm256_load_si256(&p[i]);
+
+		if (!_mm256_testz_si256(v, v)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+#elif defined(__SSE2__)
+#define ZERO_VECTOR_BYTES 16
+
+static int
+zero_vector(const unsigned char *buf, size_t count)
+{
+	const __m128i *p = (const __m128i *)buf;
+	const __m128i z = _mm_setzero_si128();
+	size_t i;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		__m128i v = _mm_or_si128(
+				_mm_or_si128(_mm_load_si128(&p[i]),
+					     _mm_load_si128(&p[i + 1])),
+				_mm_or_si128(_mm_load_si128(&p[i + 2]),
+					     _mm_load_si128(&p[i + 3])));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, z)) != 0xffff) {
+			return 0;
+		}
+	}
+	for (; i < count; i++) {
+		__m128i v = _mm_load_si128(&p[i]);
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, z)) != 0xffff) {
+			return 0;
+		}
+	}
+	return 1;
+}
+#elif defined(__ARM_NEON)
+#define ZERO_VECTOR_BYTES 16
+
+static int
+zero_vector(const unsigned char *buf, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		const unsigned char *b = &buf[i * 16];
+		uint8x16_t v = vorrq_u8(vorrq_u8(vld1q_u8(b),
+						 vld1q_u8(b + 16)),
+					vorrq_u8(vld1q_u8(b + 32),
+						 vld1q_u8(b + 48)));
+		uint64x2_t w = vreinterpretq_u64_u8(v);
+
+		if (vgetq_lane_u64(w, 0) | vgetq_lane_u64(w, 1)) {
+			return 0;
+		}
+	}
+	for (; i < count; i++) {
+		uint64x2_t w = vreinterpretq_u64_u8(vld1q_u8(&buf[i * 16]));
+
+		if (vgetq_lane_u64(w, 0) | vgetq_lane_u64(w, 1)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+#else
+#define ZERO_VECTOR_BYTES 8
+
+static int
+zero_vector(const unsigned char *buf, size_t count)
+{
+	const uint64_t *p = (const uint64_t *)buf;
+	size_t i;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		if (p[i] | p[i + 1] | p[i + 2] | p[i + 3]) {
+			return 0;
+		}
+	}
+	for (; i < count; i++) {
+		if (p[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+#endif
+
+int
+iscsi_is_zero(const unsigned char *buf, size_t len)
+{
+	size_t head, count;
+
+	head = MIN(len, ZERO_PROBE_BYTES);
+	while (head--) {
+		if (*buf++) {
+			return 0;
+		}
+		len--;
+	}
+
+	/* align the buffer for the vector loads */
+	head = (ZERO_VECTOR_BYTES - ((uintptr_t)buf % ZERO_VECTOR_BYTES))
+		% ZERO_VECTOR_BYTES;
+	head = MIN(head, len);
+	len -= head;
+	while (head--) {
+		if (*buf++) {
+			return 0;
+		}
+	}
+
+	count = len / ZERO_VECTOR_BYTES;
+	if (count && !zero_vector(buf, count)) {
+		return 0;
+	}
+	buf += count * ZERO_VECTOR_BYTES;
+	len -= count * ZERO_VECTOR_BYTES;
+
+	while (len--) {
+		if (*buf++) {
+			return 0;
+		}
+	}
+	return 1;
+}
@@ -540,6 +540,12 @@ wait_until_test_finished(struct iscsi_context *iscsi, struct iscsi_async_state *
                                 while ((pdu = iscsi->waitpdu)) {
                                         ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
                                 }
+                                while ((pdu = iscsi->pendingqueue[ISCSI_TASK_PRIORITY_NORMAL])) {
+                                        ISCSI_LIST_REMOVE(&iscsi->pendingqueue[ISCSI_TASK_PRIORITY_NORMAL], pdu);
+                                }
+                                while ((pdu = iscsi->pendingqueue[ISCSI_TASK_PRIORITY_HIGH])) {
+                                        ISCSI_LIST_REMOVE(&iscsi->pendingqueue[ISCSI_TASK_PRIORITY_HIGH], pdu);
+                                }
                                 return;
                         }
                         continue;
@@ -0,0 +1,277 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+#include "loopback-target.h"
+#include "loopback-client.h"
+
+int loopback_client_start_target(struct loopback_target *target,
+				 char *portal, size_t size)
+{
+	int port;
+
+	port = loopback_target_listen(target, "127.0.0.1", 0);
+	if (port < 0 || loopback_target_start(target) != 0) {
+		fprintf(stderr, "%s\n", loopback_target_get_error(target));
+		return -1;
+	}
+	snprintf(portal, size, "127.0.0.1:%d", port);
+	return 0;
+}
+
+struct iscsi_context *loopback_client_create(const char *initiator)
+{
+	struct iscsi_context *iscsi;
+
+	iscsi = iscsi_create_context(initiator);
+	if (iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		return NULL;
+	}
+	iscsi_set_targetname(iscsi, LOOPBACK_TARGET_IQN);
+	iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL);
+	iscsi_set_header_digest(iscsi, ISCSI_HEADER_DIGEST_NONE);
+	return iscsi;
+}
+
+int loopback_client_login(struct iscsi_context *iscsi, const char *portal)
+{
+	if (iscsi_full_connect_sync(iscsi, portal, 0) != 0) {
+		fprintf(stderr, "Login Failed. %s\n", iscsi_get_error(iscsi));
+		return -1;
+	}
+	return 0;
+}
+
+struct iscsi_context *loopback_client_connect(const char *initiator,
+					      const char *portal)
+{
+	struct iscsi_context *iscsi;
+
+	iscsi = loopback_client_create(initiator);
+	if (iscsi == NULL) {
+		return NULL;
+	}
+	if (loopback_client_login(iscsi, portal) != 0) {
+		iscsi_destroy_context(iscsi);
+		return NULL;
+	}
+	return iscsi;
+}
+
+void loopback_client_disconnect(struct iscsi_context *iscsi)
+{
+	if (iscsi == NULL) {
+		return;
+	}
+	iscsi_logout_sync(iscsi);
+	iscsi_destroy_context(iscsi);
+}
+
+int loopback_client_wait(struct iscsi_context *iscsi, const int *done,
+			 int count)
+{
+	while (*done < count) {
+		struct pollfd pfd;
+
+		pfd.fd = iscsi_get_fd(iscsi);
+		pfd.events = iscsi_which_events(iscsi);
+		if (poll(&pfd, 1, 1000) < 0) {
+			continue;
+		}
+		if (iscsi_service(iscsi, pfd.revents) < 0) {
+			fprintf(stderr, "iscsi_service failed with : %s\n",
+				iscsi_get_error(iscsi));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int loopback_client_self_check(struct iscsi_context *iscsi, int block_size)
+{
+	struct scsi_task *task;
+	uint32_t len = 64 * block_size;
+	unsigned char *buf;
+	uint32_t i;
+	int ret = -1;
+
+	buf = malloc(len);
+	if (buf == NULL) {
+		return -1;
+	}
+	for (i = 0; i < len; i++) {
+		buf[i] = i * 7 + (i >> 8);
+	}
+
+	task = iscsi_inquiry_sync(iscsi, 0, 0, 0, 64);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "Inquiry failed: %s\n",
+			iscsi_get_error(iscsi));
+		goto finished;
+	}
+	scsi_free_scsi_task(task);
+
+	task = iscsi_write16_sync(iscsi, 0, 0, buf, len, block_size,
+				  0, 0, 0, 0, 0);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "Write16 failed: %s\n",
+			iscsi_get_error(iscsi));
+		goto finished;
+	}
+	scsi_free_scsi_task(task);
+
+	task = iscsi_read16_sync(iscsi, 0, 0, len, block_size,
+				 0, 0, 0, 0, 0);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "Read16 failed: %s\n",
+			iscsi_get_error(iscsi));
+		goto finished;
+	}
+	if (task->datain.size != (int)len
+	    || memcmp(task->datain.data, buf, len)) {
+		fprintf(stderr, "Data read back differs from data written\n");
+		scsi_free_scsi_task(task);
+		goto finished;
+	}
+	scsi_free_scsi_task(task);
+	ret = 0;
+
+finished:
+	free(buf);
+	return ret;
+}
+
+struct io_run {
+	struct iscsi_context *iscsi;
+	const struct loopback_client_io *io;
+	unsigned char *buf;
+	uint64_t lba;
+	int queued;
+	int in_flight;
+	int err_cnt;
+};
+
+static int io_run_fill(struct io_run *run);
+
+static void io_run_cb(struct iscsi_context *iscsi, int status,
+		      void *command_data, void *private_data)
+{
+	struct io_run *run = private_data;
+	struct scsi_task *task = command_data;
+
+	run->in_flight--;
+	if (status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "I/O failed: %s\n", iscsi_get_error(iscsi));
+		run->err_cnt++;
+	} else if (run->io->check != NULL &&
+		   run->io->check(iscsi, task, run->io->private_data) != 0) {
+		run->err_cnt++;
+	}
+	scsi_free_scsi_task(task);
+	if (io_run_fill(run) != 0) {
+		run->err_cnt++;
+	}
+}
+
+static int io_run_fill(struct io_run *run)
+{
+	const struct loopback_client_io *io = run->io;
+	uint32_t len = io->blocks * io->block_size;
+
+	while (!run->err_cnt && run->queued < io->count
+	       && run->in_flight < io->queue_depth) {
+		struct scsi_task *task;
+
+		if (run->lba + io->blocks > io->num_blocks) {
+			run->lba = 0;
+		}
+		if (io->write) {
+			task = iscsi_write16_task(run->iscsi, 0, run->lba,
+						  run->buf, len, io->block_size,
+						  0, 0, 0, 0, 0, io_run_cb, run);
+		} else {
+			task = iscsi_read16_task(run->iscsi, 0, run->lba, len,
+						 io->block_size, 0, 0, 0, 0, 0,
+						 io_run_cb, run);
+		}
+		if (task == NULL) {
+			fprintf(stderr, "Failed to queue I/O: %s\n",
+				iscsi_get_error(run->iscsi));
+			return -1;
+		}
+		run->lba += io->blocks;
+		run->queued++;
+		run->in_flight++;
+	}
+	return 0;
+}
+
+int loopback_client_run_io(struct iscsi_context *iscsi,
+			   const struct loopback_client_io *io)
+{
+	struct io_run run;
+
+	memset(&run, 0, sizeof(run));
+	run.iscsi = iscsi;
+	run.io    = io;
+	if (io->write) {
+		run.buf = malloc(io->blocks * io->block_size);
+		if (run.buf == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			return -1;
+		}
+		memset(run.buf, 0xa5, io->blocks * io->block_size);
+	}
+
+	if (io_run_fill(&run) != 0) {
+		run.err_cnt++;
+	}
+	while (run.in_flight) {
+		struct pollfd pfd;
+
+		pfd.fd = iscsi_get_fd(iscsi);
+		pfd.events = iscsi_which_events(iscsi);
+		if (poll(&pfd, 1, 1000) < 0) {
+			continue;
+		}
+		if (iscsi_service(iscsi, pfd.revents) < 0) {
+			fprintf(stderr, "iscsi_service failed with : %s\n",
+				iscsi_get_error(iscsi));
+			run.err_cnt++;
+			/* the callbacks must not run once run is gone */
+			iscsi_scsi_cancel_all_tasks(iscsi);
+			break;
+		}
+	}
+	free(run.buf);
+	return run.err_cnt ? -1 : 0;
+}
@@ -0,0 +1,109 @@
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __loopback_client_h__
+#define __loopback_client_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The initiator side of the tests that run against the loopback target.
+ * The functions print what went wrong to stderr before they fail.
+ */
+struct iscsi_context;
+struct loopback_target;
+struct scsi_task;
+
+#define LOOPBACK_TARGET_IQN "iqn.2007-10.com.github:sahlberg:libiscsi:loopback"
+
+/*
+ * Listen on a free port of 127.0.0.1 and start serving. The portal to
+ * log in to is written to portal. Returns 0 on success.
+ */
+int loopback_client_start_target(struct loopback_target *target,
+				 char *portal, size_t size);
+
+/*
+ * Create a context for the loopback target without logging in, so that
+ * options that apply to the login can be set first.
+ */
+struct iscsi_context *loopback_client_create(const char *initiator);
+
+/*
+ * Log in to LUN 0 of the target at portal. Returns 0 on success.
+ */
+int loopback_client_login(struct iscsi_context *iscsi, const char *portal);
+
+/*
+ * Create a context and log in. Returns NULL on failure.
+ */
+struct iscsi_context *loopback_client_connect(const char *initiator,
+					      const char *portal);
+
+/*
+ * Log out and destroy the context.
+ */
+void loopback_client_disconnect(struct iscsi_context *iscsi);
+
+/*
+ * Service the context until *done has reached count. Returns 0 on
+ * success and -1 when the connection failed.
+ */
+int loopback_client_wait(struct iscsi_context *iscsi, const int *done,
+			 int count);
+
+/*
+ * Write a pattern to the start of the LUN through R2T, immediate or
+ * unsolicited data and read it back through Data-In, so that a broken
+ * target is noticed. Returns 0 on success.
+ */
+int loopback_client_self_check(struct iscsi_context *iscsi, int block_size);
+
+struct loopback_client_io {
+	int write;
+	uint32_t blocks;
+	int block_size;
+	/* the commands wrap around to LBA 0 here */
+	uint64_t num_blocks;
+	int queue_depth;
+	int count;
+	/*
+	 * Called with every task that completed before it is freed.
+	 * Returns non-zero when the task is not what was expected.
+	 */
+	int (*check)(struct iscsi_context *iscsi, struct scsi_task *task,
+		     void *private_data);
+	void *private_data;
+};
+
+/*
+ * Send io->count READ16 or WRITE16 of io->blocks blocks each from LBA 0
+ * on, with up to io->queue_depth of them in flight. Returns 0 when all
+ * of them completed with GOOD status and passed io->check.
+ */
+int loopback_client_run_io(struct iscsi_context *iscsi,
+			   const struct loopback_client_io *io);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __loopback_client_h__ */
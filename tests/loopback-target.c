@@ -0,0 +1,1632 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+#include "loopback-target.h"
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+#define LT_BHS_SIZE		48
+#define LT_CMDSN_WINDOW		1024
+#define LT_MAX_SEGMENT		(16 * 1024 * 1024)
+#define LT_MAX_TEXT		8192
+#define LT_NO_STATUS		((size_t)-1)
+
+/* opcodes, see RFC3720 10.2.1.2 */
+#define LT_NOP_OUT		0x00
+#define LT_SCSI_COMMAND		0x01
+#define LT_TASK_MGMT		0x02
+#define LT_LOGIN		0x03
+#define LT_TEXT			0x04
+#define LT_DATA_OUT		0x05
+#define LT_LOGOUT		0x06
+#define LT_NOP_IN		0x20
+#define LT_SCSI_RESPONSE	0x21
+#define LT_TASK_MGMT_RESPONSE	0x22
+#define LT_LOGIN_RESPONSE	0x23
+#define LT_TEXT_RESPONSE	0x24
+#define LT_DATA_IN		0x25
+#define LT_LOGOUT_RESPONSE	0x26
+#define LT_R2T			0x31
+
+#define LT_FINAL		0x80
+#define LT_IMMEDIATE		0x40
+#define LT_DATA_STATUS		0x01
+#define LT_RESIDUAL_OVERFLOW	0x04
+#define LT_RESIDUAL_UNDERFLOW	0x02
+
+struct loopback_target {
+	pthread_mutex_t mutex;
+	int refcount;
+
+	char iqn[256];
+	char error_string[256];
+
+	unsigned char *store;
+	uint64_t num_blocks;
+	int block_size;
+
+	uint32_t max_recv_data_segment_length;
+	uint32_t first_burst_length;
+	uint32_t max_burst_length;
+	int initial_r2t;
+	int immediate_data;
+	uint32_t response_delay;
+	uint32_t cmdsn_window;
+
+	/* reported in the Block Limits VPD and enforced for UNMAP */
+	uint32_t max_unmap_lbas;
+	uint32_t max_unmap_descriptors;
+	uint32_t unmap_granularity;
+	uint32_t unmap_alignment;
+	uint32_t max_write_same_length;
+
+	/* protected by mutex */
+	struct loopback_target_counters counters;
+
+	int listen_fd;
+	int accepting;
+	pthread_t accept_thread;
+};
+
+/*
+ * One or more PDUs that are ready to be written to the socket. If one of
+ * them carries status its StatSN, ExpCmdSN and MaxCmdSN are only filled in
+ * when it is sent so that StatSN stays in order even when some replies are
+ * delayed and others are not.
+ */
+struct lt_reply {
+	struct lt_reply *next;
+	uint64_t due;
+	size_t len;
+	size_t status_offset;
+	unsigned char *data;
+};
+
+/* a WRITE that is still waiting for data from the initiator */
+struct lt_write {
+	struct lt_write *next;
+	unsigned char hdr[LT_BHS_SIZE];
+	unsigned char *dst;
+	/* for commands other than WRITE the data is collected here and
+	 * acted on once all of it has arrived.
+	 */
+	unsigned char *param;
+	uint32_t len;
+	uint32_t received;
+	uint32_t burst_end;
+	uint32_t r2tsn;
+	/* DataSN of the last Data-Out of the current sequence */
+	int data_outs;
+	uint32_t datasn;
+};
+
+struct lt_conn {
+	struct loopback_target *target;
+	int fd;
+	int logged_in;
+	int discovery;
+	int tpgt_sent;
+	int mrdsl_sent;
+	int done;
+
+	uint32_t statsn;
+	uint32_t expcmdsn;
+	uint32_t next_ttt;
+
+	/* negotiated parameters */
+	uint32_t max_send_segment;
+	uint32_t first_burst_length;
+	uint32_t max_burst_length;
+	int initial_r2t;
+	int immediate_data;
+	uint32_t response_delay;
+	uint32_t cmdsn_window;
+
+	unsigned char *in;
+	size_t in_size;
+	size_t in_len;
+
+	/* replies to send right away and replies held for response_delay */
+	struct lt_reply *now, **now_tail;
+	struct lt_reply *delayed, **delayed_tail;
+
+	struct lt_write *writes;
+};
+
+static void
+lt_set_error(struct loopback_target *target, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(target->error_string, sizeof(target->error_string), fmt, ap);
+	va_end(ap);
+}
+
+const char *
+loopback_target_get_error(struct loopback_target *target)
+{
+	return target->error_string;
+}
+
+static uint64_t
+lt_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+struct loopback_target *
+loopback_target_create(const char *iqn, uint64_t num_blocks, int block_size)
+{
+	struct loopback_target *target;
+
+	target = calloc(1, sizeof(struct loopback_target));
+	if (target == NULL) {
+		return NULL;
+	}
+	target->store = calloc(num_blocks, block_size);
+	if (target->store == NULL) {
+		free(target);
+		return NULL;
+	}
+	pthread_mutex_init(&target->mutex, NULL);
+	target->refcount = 1;
+	strncpy(target->iqn, iqn, sizeof(target->iqn) - 1);
+	target->num_blocks = num_blocks;
+	target->block_size = block_size;
+
+	target->max_recv_data_segment_length = 262144;
+	target->first_burst_length           = 262144;
+	target->max_burst_length             = 16776192;
+	target->initial_r2t                  = 0;
+	target->immediate_data               = 1;
+	target->cmdsn_window                 = LT_CMDSN_WINDOW;
+	target->max_unmap_lbas               = 0xffffffff;
+	target->max_unmap_descriptors        = 0xffffffff;
+	target->listen_fd                    = -1;
+
+	return target;
+}
+
+static void
+lt_unref(struct loopback_target *target)
+{
+	int refcount;
+
+	pthread_mutex_lock(&target->mutex);
+	refcount = --target->refcount;
+	pthread_mutex_unlock(&target->mutex);
+
+	if (refcount) {
+		return;
+	}
+	pthread_mutex_destroy(&target->mutex);
+	free(target->store);
+	free(target);
+}
+
+void
+loopback_target_destroy(struct loopback_target *target)
+{
+	if (target->listen_fd != -1) {
+		/* wakes up the accept thread */
+		shutdown(target->listen_fd, SHUT_RDWR);
+		if (target->accepting) {
+			pthread_join(target->accept_thread, NULL);
+		}
+		close(target->listen_fd);
+	}
+	lt_unref(target);
+}
+
+void
+loopback_target_set_max_recv_data_segment_length(
+	struct loopback_target *target, uint32_t len)
+{
+	target->max_recv_data_segment_length = len;
+}
+
+void
+loopback_target_set_first_burst_length(struct loopback_target *target,
+				       uint32_t len)
+{
+	target->first_burst_length = len;
+}
+
+void
+loopback_target_set_max_burst_length(struct loopback_target *target,
+				     uint32_t len)
+{
+	target->max_burst_length = len;
+}
+
+void
+loopback_target_set_initial_r2t(struct loopback_target *target,
+				int initial_r2t)
+{
+	target->initial_r2t = !!initial_r2t;
+}
+
+void
+loopback_target_set_immediate_data(struct loopback_target *target,
+				   int immediate_data)
+{
+	target->immediate_data = !!immediate_data;
+}
+
+void
+loopback_target_set_response_delay(struct loopback_target *target,
+				   uint32_t usec)
+{
+	target->response_delay = usec;
+}
+
+void
+loopback_target_set_cmdsn_window(struct loopback_target *target,
+				 uint32_t window)
+{
+	target->cmdsn_window = window ? window : 1;
+}
+
+void
+loopback_target_set_unmap_limits(struct loopback_target *target,
+				 uint32_t max_lbas, uint32_t max_descriptors,
+				 uint32_t granularity, uint32_t alignment)
+{
+	target->max_unmap_lbas        = max_lbas;
+	target->max_unmap_descriptors = max_descriptors;
+	target->unmap_granularity     = granularity;
+	target->unmap_alignment       = alignment;
+}
+
+void
+loopback_target_set_max_write_same_length(struct loopback_target *target,
+					  uint32_t num_blocks)
+{
+	target->max_write_same_length = num_blocks;
+}
+
+void
+loopback_target_get_counters(struct loopback_target *target,
+			     struct loopback_target_counters *counters)
+{
+	pthread_mutex_lock(&target->mutex);
+	*counters = target->counters;
+	pthread_mutex_unlock(&target->mutex);
+}
+
+/*
+ * Replies
+ */
+static struct lt_reply *
+lt_reply_alloc(size_t len)
+{
+	struct lt_reply *reply;
+
+	reply = calloc(1, sizeof(struct lt_reply) + len);
+	if (reply == NULL) {
+		return NULL;
+	}
+	reply->data = (unsigned char *)(reply + 1);
+	reply->len = len;
+	reply->status_offset = LT_NO_STATUS;
+	return reply;
+}
+
+static void
+lt_queue(struct lt_conn *conn, struct lt_reply *reply, int delay)
+{
+	reply->next = NULL;
+	if (delay && conn->response_delay) {
+		reply->due = lt_now() + conn->response_delay;
+		*conn->delayed_tail = reply;
+		conn->delayed_tail = &reply->next;
+	} else {
+		*conn->now_tail = reply;
+		conn->now_tail = &reply->next;
+	}
+}
+
+static int
+lt_write_all(int fd, const unsigned char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t count = write(fd, buf, len);
+
+		if (count < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		buf += count;
+		len -= count;
+	}
+	return 0;
+}
+
+static int
+lt_send(struct lt_conn *conn, struct lt_reply *reply)
+{
+	int ret;
+
+	if (reply->status_offset != LT_NO_STATUS) {
+		unsigned char *hdr = &reply->data[reply->status_offset];
+
+		scsi_set_uint32(&hdr[24], conn->statsn++);
+		scsi_set_uint32(&hdr[28], conn->expcmdsn);
+		scsi_set_uint32(&hdr[32], conn->expcmdsn + conn->cmdsn_window - 1);
+	}
+	ret = lt_write_all(conn->fd, reply->data, reply->len);
+	free(reply);
+	return ret;
+}
+
+/* Send everything that is due. Returns -1 if the connection is gone. */
+static int
+lt_flush(struct lt_conn *conn)
+{
+	uint64_t now = 0;
+
+	while (conn->now != NULL) {
+		struct lt_reply *reply = conn->now;
+
+		conn->now = reply->next;
+		if (conn->now == NULL) {
+			conn->now_tail = &conn->now;
+		}
+		if (lt_send(conn, reply) != 0) {
+			return -1;
+		}
+	}
+	if (conn->delayed != NULL) {
+		now = lt_now();
+	}
+	while (conn->delayed != NULL && conn->delayed->due <= now) {
+		struct lt_reply *reply = conn->delayed;
+
+		conn->delayed = reply->next;
+		if (conn->delayed == NULL) {
+			conn->delayed_tail = &conn->delayed;
+		}
+		if (lt_send(conn, reply) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Fill in the fields every PDU from the target has. StatSN, ExpCmdSN and
+ * MaxCmdSN are filled in with the current values and are overwritten on
+ * sending for PDUs that carry status.
+ */
+static void
+lt_bhs(struct lt_conn *conn, unsigned char *hdr, int opcode, int flags,
+       const unsigned char *req, uint32_t dsl)
+{
+	memset(hdr, 0, LT_BHS_SIZE);
+	hdr[0] = opcode;
+	hdr[1] = flags;
+	scsi_set_uint32(&hdr[4], dsl);
+	memcpy(&hdr[16], &req[16], 4);
+	scsi_set_uint32(&hdr[24], conn->statsn);
+	scsi_set_uint32(&hdr[28], conn->expcmdsn);
+	scsi_set_uint32(&hdr[32], conn->expcmdsn + conn->cmdsn_window - 1);
+}
+
+static size_t
+lt_pad(size_t len)
+{
+	return (len + 3) & ~3;
+}
+
+/*
+ * Queue a single PDU that carries status with an optional data segment.
+ */
+static unsigned char *
+lt_queue_status(struct lt_conn *conn, int opcode, int flags,
+		const unsigned char *req, const void *data, uint32_t len,
+		int delay)
+{
+	struct lt_reply *reply;
+
+	reply = lt_reply_alloc(LT_BHS_SIZE + lt_pad(len));
+	if (reply == NULL) {
+		return NULL;
+	}
+	lt_bhs(conn, reply->data, opcode, flags, req, len);
+	if (len) {
+		memcpy(&reply->data[LT_BHS_SIZE], data, len);
+	}
+	reply->status_offset = 0;
+	lt_queue(conn, reply, delay);
+	return reply->data;
+}
+
+/*
+ * SCSI
+ */
+static int
+lt_scsi_response(struct lt_conn *conn, const unsigned char *req, int status,
+		 int key, int asc, int ascq)
+{
+	unsigned char sense[2 + 18];
+	unsigned char *hdr;
+	uint32_t len = 0;
+
+	if (status == SCSI_STATUS_CHECK_CONDITION) {
+		memset(sense, 0, sizeof(sense));
+		scsi_set_uint16(&sense[0], 18);
+		sense[2 + 0]  = 0x70;
+		sense[2 + 2]  = key;
+		sense[2 + 7]  = 10;
+		sense[2 + 12] = asc;
+		sense[2 + 13] = ascq;
+		len = sizeof(sense);
+	}
+	hdr = lt_queue_status(conn, LT_SCSI_RESPONSE, LT_FINAL, req,
+			      len ? sense : NULL, len, 1);
+	if (hdr == NULL) {
+		return -1;
+	}
+	hdr[3] = status;
+	return 0;
+}
+
+static int
+lt_check_condition(struct lt_conn *conn, const unsigned char *req, int key,
+		   int asc, int ascq)
+{
+	return lt_scsi_response(conn, req, SCSI_STATUS_CHECK_CONDITION, key,
+				asc, ascq);
+}
+
+static void
+lt_set_residual(unsigned char *hdr, uint32_t len, uint32_t edtl)
+{
+	if (len > edtl) {
+		hdr[1] |= LT_RESIDUAL_OVERFLOW;
+		scsi_set_uint32(&hdr[44], len - edtl);
+	} else if (len < edtl) {
+		hdr[1] |= LT_RESIDUAL_UNDERFLOW;
+		scsi_set_uint32(&hdr[44], edtl - len);
+	}
+}
+
+/*
+ * Return len bytes of data and GOOD status as a train of Data-In PDUs no
+ * larger than what the initiator can receive, with the status in the last
+ * one.
+ */
+static int
+lt_data_in(struct lt_conn *conn, const unsigned char *req,
+	   const unsigned char *data, uint32_t len)
+{
+	uint32_t edtl = scsi_get_uint32(&req[20]);
+	uint32_t xfer = MIN(len, edtl);
+	uint32_t seg = conn->max_send_segment;
+	uint32_t offset, count, datasn;
+	struct lt_reply *reply;
+	unsigned char *p;
+
+	if (xfer == 0) {
+		unsigned char *hdr;
+
+		hdr = lt_queue_status(conn, LT_SCSI_RESPONSE, LT_FINAL, req,
+				      NULL, 0, 1);
+		if (hdr == NULL) {
+			return -1;
+		}
+		lt_set_residual(hdr, len, edtl);
+		return 0;
+	}
+
+	count = (xfer + seg - 1) / seg;
+	reply = lt_reply_alloc(count * LT_BHS_SIZE + xfer + count * 3);
+	if (reply == NULL) {
+		return -1;
+	}
+
+	p = reply->data;
+	for (offset = 0, datasn = 0; offset < xfer; offset += seg, datasn++) {
+		uint32_t dsl = MIN(seg, xfer - offset);
+		int flags = 0;
+
+		if (offset + dsl == xfer) {
+			flags = LT_FINAL | LT_DATA_STATUS;
+			reply->status_offset = p - reply->data;
+		}
+		lt_bhs(conn, p, LT_DATA_IN, flags, req, dsl);
+		memcpy(&p[8], &req[8], 8);
+		scsi_set_uint32(&p[20], 0xffffffff);
+		scsi_set_uint32(&p[36], datasn);
+		scsi_set_uint32(&p[40], offset);
+		if (flags) {
+			lt_set_residual(p, len, edtl);
+		}
+		memcpy(&p[LT_BHS_SIZE], &data[offset], dsl);
+		p += LT_BHS_SIZE + lt_pad(dsl);
+	}
+	reply->len = p - reply->data;
+	lt_queue(conn, reply, 1);
+	return 0;
+}
+
+static int
+lt_inquiry(struct lt_conn *conn, const unsigned char *req,
+	   const unsigned char *cdb)
+{
+	struct loopback_target *target = conn->target;
+	unsigned char buf[64];
+	uint32_t len;
+
+	memset(buf, 0, sizeof(buf));
+	if (!(cdb[1] & 0x01)) {
+		if (cdb[2]) {
+			return lt_check_condition(conn, req,
+					SCSI_SENSE_ILLEGAL_REQUEST, 0x24, 0x00);
+		}
+		buf[2] = 0x05;
+		buf[3] = 0x02;
+		buf[4] = 36 - 5;
+		buf[7] = 0x02;
+		memcpy(&buf[8], "LIBISCSI", 8);
+		memcpy(&buf[16], "LOOPBACK TARGET ", 16);
+		memcpy(&buf[32], "0001", 4);
+		len = 36;
+	} else {
+		buf[1] = cdb[2];
+		switch (cdb[2]) {
+		case SCSI_INQUIRY_PAGECODE_SUPPORTED_VPD_PAGES:
+			buf[4] = SCSI_INQUIRY_PAGECODE_SUPPORTED_VPD_PAGES;
+			buf[5] = SCSI_INQUIRY_PAGECODE_UNIT_SERIAL_NUMBER;
+			buf[6] = SCSI_INQUIRY_PAGECODE_DEVICE_IDENTIFICATION;
+			buf[7] = SCSI_INQUIRY_PAGECODE_BLOCK_LIMITS;
+			buf[8] = SCSI_INQUIRY_PAGECODE_LOGICAL_BLOCK_PROVISIONING;
+			len = 9;
+			break;
+		case SCSI_INQUIRY_PAGECODE_UNIT_SERIAL_NUMBER:
+			memcpy(&buf[4], "0000000000000001", 16);
+			len = 20;
+			break;
+		case SCSI_INQUIRY_PAGECODE_DEVICE_IDENTIFICATION:
+			/* a vendor specific designator naming the target */
+			buf[4] = 0x02;
+			buf[5] = 0x00;
+			len = strlen(target->iqn);
+			if (len > sizeof(buf) - 8) {
+				len = sizeof(buf) - 8;
+			}
+			buf[7] = len;
+			memcpy(&buf[8], target->iqn, len);
+			len += 8;
+			break;
+		case SCSI_INQUIRY_PAGECODE_BLOCK_LIMITS:
+			scsi_set_uint32(&buf[20], target->max_unmap_lbas);
+			scsi_set_uint32(&buf[24], target->max_unmap_descriptors);
+			scsi_set_uint32(&buf[28], target->unmap_granularity);
+			if (target->unmap_granularity) {
+				scsi_set_uint32(&buf[32], 0x80000000
+						| target->unmap_alignment);
+			}
+			scsi_set_uint64(&buf[36], target->max_write_same_length);
+			len = 64;
+			break;
+		case SCSI_INQUIRY_PAGECODE_LOGICAL_BLOCK_PROVISIONING:
+			/* UNMAP and WRITE SAME16 with the UNMAP bit, unmapped
+			 * blocks read back as zero.
+			 */
+			buf[5] = 0x80 | 0x40 | 0x04;
+			len = 8;
+			break;
+		default:
+			return lt_check_condition(conn, req,
+					SCSI_SENSE_ILLEGAL_REQUEST, 0x24, 0x00);
+		}
+		scsi_set_uint16(&buf[2], len - 4);
+	}
+	return lt_data_in(conn, req, buf, MIN(len, scsi_get_uint16(&cdb[3])));
+}
+
+static int
+lt_read(struct lt_conn *conn, const unsigned char *req, uint64_t lba,
+	uint32_t num_blocks)
+{
+	struct loopback_target *target = conn->target;
+
+	if (lba > target->num_blocks || num_blocks > target->num_blocks - lba) {
+		return lt_check_condition(conn, req,
+				SCSI_SENSE_ILLEGAL_REQUEST, 0x21, 0x00);
+	}
+	return lt_data_in(conn, req, &target->store[lba * target->block_size],
+			  num_blocks * target->block_size);
+}
+
+/*
+ * UNMAP, with the parameter list already received. The blocks read back
+ * as zero afterwards.
+ */
+static int
+lt_unmap(struct lt_conn *conn, const unsigned char *req,
+	 const unsigned char *param, uint32_t len)
+{
+	struct loopback_target *target = conn->target;
+	uint32_t bddl, num_descriptors, i;
+	uint64_t blocks = 0, unaligned = 0;
+
+	if (len < 8) {
+		return lt_scsi_response(conn, req, SCSI_STATUS_GOOD, 0, 0, 0);
+	}
+	bddl = scsi_get_uint16(&param[2]);
+	if (bddl > len - 8) {
+		bddl = len - 8;
+	}
+	num_descriptors = bddl / 16;
+	if (num_descriptors > target->max_unmap_descriptors) {
+		return lt_check_condition(conn, req,
+				SCSI_SENSE_ILLEGAL_REQUEST, 0x26, 0x00);
+	}
+	for (i = 0; i < num_descriptors; i++) {
+		const unsigned char *d = &param[8 + i * 16];
+		uint64_t lba = scsi_get_uint64(&d[0]);
+		uint32_t num = scsi_get_uint32(&d[8]);
+
+		if (lba > target->num_blocks ||
+		    num > target->num_blocks - lba) {
+			return lt_check_condition(conn, req,
+					SCSI_SENSE_ILLEGAL_REQUEST, 0x21, 0x00);
+		}
+		blocks += num;
+		if (target->unmap_granularity &&
+		    (lba + target->unmap_granularity
+		     - target->unmap_alignment % target->unmap_granularity)
+		    % target->unmap_granularity) {
+			unaligned++;
+		}
+	}
+	if (blocks > target->max_unmap_lbas) {
+		return lt_check_condition(conn, req,
+				SCSI_SENSE_ILLEGAL_REQUEST, 0x26, 0x00);
+	}
+
+	for (i = 0; i < num_descriptors; i++) {
+		const unsigned char *d = &param[8 + i * 16];
+
+		memset(&target->store[scsi_get_uint64(&d[0])
+				      * target->block_size], 0,
+		       (size_t)scsi_get_uint32(&d[8]) * target->block_size);
+	}
+
+	pthread_mutex_lock(&target->mutex);
+	target->counters.unmap_commands++;
+	target->counters.unmap_descriptors += num_descriptors;
+	target->counters.unmap_blocks += blocks;
+	target->counters.unmap_unaligned += unaligned;
+	pthread_mutex_unlock(&target->mutex);
+
+	return lt_scsi_response(conn, req, SCSI_STATUS_GOOD, 0, 0, 0);
+}
+
+/*
+ * WRITE SAME16, with the block of data already received unless NDOB is
+ * set. Unmapping a block is the same as writing zeroes to it.
+ */
+static int
+lt_write_same(struct lt_conn *conn, const unsigned char *req,
+	      const unsigned char *param, uint32_t len)
+{
+	struct loopback_target *target = conn->target;
+	const unsigned char *cdb = &req[32];
+	uint64_t lba = scsi_get_uint64(&cdb[2]);
+	uint64_t num = scsi_get_uint32(&cdb[10]);
+	unsigned char *dst;
+	uint64_t i;
+
+	if (lba > target->num_blocks) {
+		return lt_check_condition(conn, req,
+				SCSI_SENSE_ILLEGAL_REQUEST, 0x21, 0x00);
+	}
+	if (num == 0) {
+		num = target->num_blocks - lba;
+	}
+	if (num > target->num_blocks - lba) {
+		return lt_check_condition(conn, req,
+				SCSI_SENSE_ILLEGAL_REQUEST, 0x21, 0x00);
+	}
+	if (target->max_write_same_length &&
+	    num > target->max_write_same_length) {
+		return lt_check_condition(conn, req,
+				SCSI_SENSE_ILLEGAL_REQUEST, 0x24, 0x00);
+	}
+	if (!(cdb[1] & 0x01) && len < (uint32_t)target->block_size) {
+		return lt_check_condition(conn, req,
+				SCSI_SENSE_ILLEGAL_REQUEST, 0x24, 0x00);
+	}
+
+	dst = &target->store[lba * target->block_size];
+	for (i = 0; i < num; i++) {
+		if (cdb[1] & 0x01) {
+			memset(dst, 0, target->block_size);
+		} else {
+			memcpy(dst, param, target->block_size);
+		}
+		dst += target->block_size;
+	}
+
+	pthread_mutex_lock(&target->mutex);
+	target->counters.write_same_commands++;
+	target->counters.write_same_blocks += num;
+	if (cdb[1] & 0x08) {
+		target->counters.write_same_unmap++;
+	}
+	pthread_mutex_unlock(&target->mutex);
+
+	return lt_scsi_response(conn, req, SCSI_STATUS_GOOD, 0, 0, 0);
+}
+
+/* act on the data-out of a command other than WRITE */
+static int
+lt_parameters(struct lt_conn *conn, const unsigned char *req,
+	      const unsigned char *param, uint32_t len)
+{
+	switch (req[32]) {
+	case SCSI_OPCODE_UNMAP:
+		return lt_unmap(conn, req, param, len);
+	case SCSI_OPCODE_WRITE_SAME16:
+		return lt_write_same(conn, req, param, len);
+	}
+	return lt_check_condition(conn, req, SCSI_SENSE_ILLEGAL_REQUEST,
+				  0x20, 0x00);
+}
+
+static int
+lt_write_done(struct lt_conn *conn, struct lt_write *w)
+{
+	struct lt_write **wp;
+	unsigned char *hdr;
+	uint32_t edtl = scsi_get_uint32(&w->hdr[20]);
+
+	for (wp = &conn->writes; *wp != w; wp = &(*wp)->next)
+		;
+	*wp = w->next;
+
+	if (w->param != NULL) {
+		int ret;
+
+		ret = lt_parameters(conn, w->hdr, w->param, w->len);
+		free(w->param);
+		free(w);
+		return ret;
+	}
+
+	hdr = lt_queue_status(conn, LT_SCSI_RESPONSE, LT_FINAL, w->hdr, NULL,
+			      0, 1);
+	if (hdr == NULL) {
+		free(w);
+		return -1;
+	}
+	lt_set_residual(hdr, w->len, edtl);
+	free(w);
+	return 0;
+}
+
+/*
+ * Called whenever a burst of data has arrived. Completes the write or
+ * asks for the next burst. Only one R2T is outstanding at a time.
+ */
+static int
+lt_write_progress(struct lt_conn *conn, struct lt_write *w)
+{
+	struct lt_reply *reply;
+	unsigned char *hdr;
+	uint32_t len;
+
+	if (w->received >= w->len) {
+		return lt_write_done(conn, w);
+	}
+	if (w->received < w->burst_end) {
+		return 0;
+	}
+
+	len = MIN(conn->max_burst_length, w->len - w->received);
+	reply = lt_reply_alloc(LT_BHS_SIZE);
+	if (reply == NULL) {
+		return -1;
+	}
+	hdr = reply->data;
+	lt_bhs(conn, hdr, LT_R2T, LT_FINAL, w->hdr, 0);
+	memcpy(&hdr[8], &w->hdr[8], 8);
+	scsi_set_uint32(&hdr[20], conn->next_ttt++);
+	scsi_set_uint32(&hdr[36], w->r2tsn++);
+	scsi_set_uint32(&hdr[40], w->received);
+	scsi_set_uint32(&hdr[44], len);
+	lt_queue(conn, reply, 0);
+
+	w->burst_end = w->received + len;
+	w->data_outs = 0;
+	return 0;
+}
+
+static void
+lt_write_data(struct lt_write *w, uint32_t offset, const unsigned char *data,
+	      uint32_t len)
+{
+	if (offset < w->len) {
+		memcpy(&w->dst[offset], data, MIN(len, w->len - offset));
+	}
+	w->received += len;
+}
+
+/*
+ * Receive len bytes of data-out into dst, from the immediate data of the
+ * command, unsolicited Data-Out and R2Ts. If param is set it is dst and
+ * is released once the command completes.
+ */
+static int
+lt_expect_data(struct lt_conn *conn, const unsigned char *req,
+	       const unsigned char *data, uint32_t dsl, unsigned char *dst,
+	       uint32_t len, unsigned char *param)
+{
+	uint32_t edtl = scsi_get_uint32(&req[20]);
+	struct lt_write *w;
+
+	w = calloc(1, sizeof(struct lt_write));
+	if (w == NULL) {
+		free(param);
+		return -1;
+	}
+	memcpy(w->hdr, req, LT_BHS_SIZE);
+	w->dst = dst;
+	w->param = param;
+	w->len = MIN(len, edtl);
+	w->next = conn->writes;
+	conn->writes = w;
+
+	lt_write_data(w, 0, data, dsl);
+	if (req[1] & LT_FINAL) {
+		/* no unsolicited Data-Out follows */
+		w->burst_end = w->received;
+	} else {
+		w->burst_end = MIN(conn->first_burst_length, edtl);
+	}
+	return lt_write_progress(conn, w);
+}
+
+static int
+lt_write(struct lt_conn *conn, const unsigned char *req,
+	 const unsigned char *data, uint32_t dsl, uint64_t lba,
+	 uint32_t num_blocks)
+{
+	struct loopback_target *target = conn->target;
+
+	if (lba > target->num_blocks || num_blocks > target->num_blocks - lba) {
+		return lt_check_condition(conn, req,
+				SCSI_SENSE_ILLEGAL_REQUEST, 0x21, 0x00);
+	}
+	return lt_expect_data(conn, req, data, dsl,
+			      &target->store[lba * target->block_size],
+			      num_blocks * target->block_size, NULL);
+}
+
+/* commands whose data-out is acted on once all of it has arrived */
+static int
+lt_parameter_list(struct lt_conn *conn, const unsigned char *req,
+		  const unsigned char *data, uint32_t dsl, uint32_t len)
+{
+	unsigned char *param;
+
+	if (len == 0) {
+		return lt_parameters(conn, req, NULL, 0);
+	}
+	param = calloc(1, len);
+	if (param == NULL) {
+		return -1;
+	}
+	return lt_expect_data(conn, req, data, dsl, param, len, param);
+}
+
+static int
+lt_data_out(struct lt_conn *conn, const unsigned char *req,
+	    const unsigned char *data, uint32_t dsl)
+{
+	uint32_t itt = scsi_get_uint32(&req[16]);
+	struct lt_write *w;
+
+	for (w = conn->writes; w != NULL; w = w->next) {
+		if (scsi_get_uint32(&w->hdr[16]) == itt) {
+			break;
+		}
+	}
+	if (w == NULL) {
+		/* data for a command that already failed */
+		return 0;
+	}
+
+	/* the data of a sequence must arrive in order and numbered */
+	if (scsi_get_uint32(&req[40]) != w->received ||
+	    (w->data_outs && scsi_get_uint32(&req[36]) != w->datasn + 1)) {
+		return -1;
+	}
+	w->datasn = scsi_get_uint32(&req[36]);
+	w->data_outs++;
+
+	lt_write_data(w, scsi_get_uint32(&req[40]), data, dsl);
+	if (req[1] & LT_FINAL) {
+		w->burst_end = w->received;
+		return lt_write_progress(conn, w);
+	}
+	return 0;
+}
+
+static int
+lt_scsi_command(struct lt_conn *conn, const unsigned char *req,
+		const unsigned char *data, uint32_t dsl)
+{
+	struct loopback_target *target = conn->target;
+	const unsigned char *cdb = &req[32];
+	unsigned char buf[32];
+	uint64_t last_lba = target->num_blocks - 1;
+	static const unsigned char lun0[8];
+
+	if (memcmp(&req[8], lun0, 8)) {
+		return lt_check_condition(conn, req,
+				SCSI_SENSE_ILLEGAL_REQUEST, 0x25, 0x00);
+	}
+
+	memset(buf, 0, sizeof(buf));
+	switch (cdb[0]) {
+	case SCSI_OPCODE_TESTUNITREADY:
+	case SCSI_OPCODE_SYNCHRONIZECACHE10:
+	case SCSI_OPCODE_SYNCHRONIZECACHE16:
+		return lt_scsi_response(conn, req, SCSI_STATUS_GOOD, 0, 0, 0);
+	case SCSI_OPCODE_INQUIRY:
+		return lt_inquiry(conn, req, cdb);
+	case SCSI_OPCODE_REPORTLUNS:
+		scsi_set_uint32(&buf[0], 8);
+		return lt_data_in(conn, req, buf,
+				  MIN(16, scsi_get_uint32(&cdb[6])));
+	case SCSI_OPCODE_READCAPACITY10:
+		scsi_set_uint32(&buf[0], MIN(last_lba, 0xffffffff));
+		scsi_set_uint32(&buf[4], target->block_size);
+		return lt_data_in(conn, req, buf, 8);
+	case SCSI_OPCODE_SERVICE_ACTION_IN:
+		if ((cdb[1] & 0x1f) != SCSI_READCAPACITY16) {
+			break;
+		}
+		scsi_set_uint64(&buf[0], last_lba);
+		scsi_set_uint32(&buf[8], target->block_size);
+		return lt_data_in(conn, req, buf,
+				  MIN(32, scsi_get_uint32(&cdb[10])));
+	case SCSI_OPCODE_READ10:
+		return lt_read(conn, req, scsi_get_uint32(&cdb[2]),
+			       scsi_get_uint16(&cdb[7]));
+	case SCSI_OPCODE_READ16:
+		return lt_read(conn, req, scsi_get_uint64(&cdb[2]),
+			       scsi_get_uint32(&cdb[10]));
+	case SCSI_OPCODE_WRITE10:
+		return lt_write(conn, req, data, dsl, scsi_get_uint32(&cdb[2]),
+				scsi_get_uint16(&cdb[7]));
+	case SCSI_OPCODE_WRITE16:
+		return lt_write(conn, req, data, dsl, scsi_get_uint64(&cdb[2]),
+				scsi_get_uint32(&cdb[10]));
+	case SCSI_OPCODE_UNMAP:
+		return lt_parameter_list(conn, req, data, dsl,
+					 scsi_get_uint16(&cdb[7]));
+	case SCSI_OPCODE_WRITE_SAME16:
+		return lt_parameter_list(conn, req, data, dsl,
+					 cdb[1] & 0x01 ? 0 : target->block_size);
+	}
+	return lt_check_condition(conn, req, SCSI_SENSE_ILLEGAL_REQUEST,
+				  0x20, 0x00);
+}
+
+/*
+ * Login and text negotiation
+ */
+static int
+lt_add_key(char *text, uint32_t *len, const char *fmt, ...)
+{
+	va_list ap;
+	int count;
+
+	va_start(ap, fmt);
+	count = vsnprintf(&text[*len], LT_MAX_TEXT - *len, fmt, ap);
+	va_end(ap);
+	if (count < 0 || (uint32_t)count >= LT_MAX_TEXT - *len) {
+		return -1;
+	}
+	*len += count + 1;
+	return 0;
+}
+
+static int
+lt_negotiate(struct lt_conn *conn, const char *key, const char *value,
+	     char *text, uint32_t *len, int *target_found)
+{
+	struct loopback_target *target = conn->target;
+	uint32_t num = strtoul(value, NULL, 10);
+
+	if (!strcmp(key, "InitiatorName") || !strcmp(key, "InitiatorAlias")) {
+		return 0;
+	}
+	if (!strcmp(key, "TargetName")) {
+		*target_found = !strcmp(value, target->iqn);
+		return 0;
+	}
+	if (!strcmp(key, "SessionType")) {
+		conn->discovery = !strcmp(value, "Discovery");
+		return 0;
+	}
+	if (!strcmp(key, "AuthMethod")) {
+		return lt_add_key(text, len, "AuthMethod=None");
+	}
+	if (!strcmp(key, "HeaderDigest") || !strcmp(key, "DataDigest")) {
+		return lt_add_key(text, len, "%s=None", key);
+	}
+	if (!strcmp(key, "MaxRecvDataSegmentLength")) {
+		/* declarative, ours is sent separately */
+		conn->max_send_segment = MIN(num,
+				target->max_recv_data_segment_length);
+		return 0;
+	}
+	if (!strcmp(key, "FirstBurstLength")) {
+		conn->first_burst_length = MIN(num, target->first_burst_length);
+		return lt_add_key(text, len, "%s=%u", key,
+				  conn->first_burst_length);
+	}
+	if (!strcmp(key, "MaxBurstLength")) {
+		conn->max_burst_length = MIN(num, target->max_burst_length);
+		return lt_add_key(text, len, "%s=%u", key,
+				  conn->max_burst_length);
+	}
+	if (!strcmp(key, "InitialR2T")) {
+		conn->initial_r2t = target->initial_r2t
+			|| strcmp(value, "No");
+		return lt_add_key(text, len, "%s=%s", key,
+				  conn->initial_r2t ? "Yes" : "No");
+	}
+	if (!strcmp(key, "ImmediateData")) {
+		conn->immediate_data = target->immediate_data
+			&& !strcmp(value, "Yes");
+		return lt_add_key(text, len, "%s=%s", key,
+				  conn->immediate_data ? "Yes" : "No");
+	}
+	if (!strcmp(key, "MaxOutstandingR2T") || !strcmp(key, "MaxConnections")) {
+		return lt_add_key(text, len, "%s=1", key);
+	}
+	if (!strcmp(key, "ErrorRecoveryLevel")) {
+		return lt_add_key(text, len, "%s=0", key);
+	}
+	if (!strcmp(key, "DataPDUInOrder")
+	    || !strcmp(key, "DataSequenceInOrder")) {
+		return lt_add_key(text, len, "%s=Yes", key);
+	}
+	if (!strcmp(key, "IFMarker") || !strcmp(key, "OFMarker")) {
+		return lt_add_key(text, len, "%s=No", key);
+	}
+	if (!strcmp(key, "DefaultTime2Wait")
+	    || !strcmp(key, "DefaultTime2Retain")) {
+		return lt_add_key(text, len, "%s=%s", key, value);
+	}
+	return lt_add_key(text, len, "%s=NotUnderstood", key);
+}
+
+static int
+lt_login(struct lt_conn *conn, const unsigned char *req,
+	 const unsigned char *data, uint32_t dsl)
+{
+	struct loopback_target *target = conn->target;
+	char text[LT_MAX_TEXT];
+	char key[LT_MAX_TEXT];
+	uint32_t len = 0, pos = 0;
+	int csg = (req[1] >> 2) & 0x03;
+	int nsg = req[1] & 0x03;
+	int transit = req[1] & LT_FINAL;
+	int target_found = 0, flags;
+	unsigned char *hdr;
+
+	if (conn->logged_in) {
+		return -1;
+	}
+	conn->expcmdsn = scsi_get_uint32(&req[24]);
+
+	while (pos < dsl) {
+		const char *kv = (const char *)&data[pos];
+		const char *end = memchr(kv, 0, dsl - pos);
+		const char *eq;
+
+		if (end == NULL || end == kv) {
+			break;
+		}
+		pos += end - kv + 1;
+		eq = strchr(kv, '=');
+		if (eq == NULL || eq - kv >= LT_MAX_TEXT) {
+			continue;
+		}
+		memcpy(key, kv, eq - kv);
+		key[eq - kv] = 0;
+		if (lt_negotiate(conn, key, eq + 1, text, &len,
+				 &target_found) != 0) {
+			return -1;
+		}
+	}
+
+	flags = csg << 2;
+	if (transit) {
+		flags |= LT_FINAL | nsg;
+	}
+
+	if (!conn->discovery && !target_found) {
+		hdr = lt_queue_status(conn, LT_LOGIN_RESPONSE, flags, req,
+				      NULL, 0, 0);
+		if (hdr == NULL) {
+			return -1;
+		}
+		/* target not found */
+		hdr[36] = 0x02;
+		hdr[37] = 0x03;
+		memcpy(&hdr[8], &req[8], 8);
+		conn->done = 1;
+		return 0;
+	}
+
+	if (!conn->tpgt_sent) {
+		if (lt_add_key(text, &len, "TargetPortalGroupTag=1") != 0) {
+			return -1;
+		}
+		conn->tpgt_sent = 1;
+	}
+	if (csg == 1 && !conn->mrdsl_sent) {
+		if (lt_add_key(text, &len, "MaxRecvDataSegmentLength=%u",
+			       target->max_recv_data_segment_length) != 0) {
+			return -1;
+		}
+		conn->mrdsl_sent = 1;
+	}
+
+	hdr = lt_queue_status(conn, LT_LOGIN_RESPONSE, flags, req, text, len,
+			      0);
+	if (hdr == NULL) {
+		return -1;
+	}
+	memcpy(&hdr[8], &req[8], 6);
+	if (transit && nsg == 3) {
+		scsi_set_uint16(&hdr[14], 1);
+		conn->logged_in = 1;
+	}
+	return 0;
+}
+
+static int
+lt_text(struct lt_conn *conn, const unsigned char *req,
+	const unsigned char *data, uint32_t dsl)
+{
+	struct loopback_target *target = conn->target;
+	char text[LT_MAX_TEXT];
+	char addr[INET6_ADDRSTRLEN];
+	struct sockaddr_storage ss;
+	socklen_t sslen = sizeof(ss);
+	uint32_t len = 0;
+	int port = 3260;
+	unsigned char *hdr;
+
+	strcpy(addr, "127.0.0.1");
+	if (getsockname(conn->fd, (struct sockaddr *)&ss, &sslen) == 0) {
+		if (ss.ss_family == AF_INET) {
+			struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+
+			inet_ntop(AF_INET, &sin->sin_addr, addr, sizeof(addr));
+			port = ntohs(sin->sin_port);
+		} else if (ss.ss_family == AF_INET6) {
+			struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+
+			inet_ntop(AF_INET6, &sin6->sin6_addr, addr,
+				  sizeof(addr));
+			port = ntohs(sin6->sin6_port);
+		}
+	}
+
+	if (dsl >= 12 && !memcmp(data, "SendTargets=", 12)) {
+		if (lt_add_key(text, &len, "TargetName=%s", target->iqn) != 0
+		    || lt_add_key(text, &len, strchr(addr, ':')
+				  ? "TargetAddress=[%s]:%d,1"
+				  : "TargetAddress=%s:%d,1",
+				  addr, port) != 0) {
+			return -1;
+		}
+	}
+
+	hdr = lt_queue_status(conn, LT_TEXT_RESPONSE, LT_FINAL, req, text, len,
+			      0);
+	if (hdr == NULL) {
+		return -1;
+	}
+	scsi_set_uint32(&hdr[20], 0xffffffff);
+	return 0;
+}
+
+static int
+lt_task_mgmt(struct lt_conn *conn, const unsigned char *req)
+{
+	uint32_t rtt = scsi_get_uint32(&req[20]);
+	struct lt_write **wp;
+
+	/* forget a write that is being aborted */
+	if ((req[1] & 0x7f) == 1) {
+		for (wp = &conn->writes; *wp != NULL; wp = &(*wp)->next) {
+			if (scsi_get_uint32(&(*wp)->hdr[16]) == rtt) {
+				struct lt_write *w = *wp;
+
+				*wp = w->next;
+				free(w);
+				break;
+			}
+		}
+	}
+	if (lt_queue_status(conn, LT_TASK_MGMT_RESPONSE, LT_FINAL, req, NULL,
+			    0, 0) == NULL) {
+		return -1;
+	}
+	return 0;
+}
+
+static int
+lt_process_pdu(struct lt_conn *conn, const unsigned char *req,
+	       const unsigned char *data, uint32_t dsl)
+{
+	int opcode = req[0] & 0x3f;
+	unsigned char *hdr;
+
+	if (opcode == LT_LOGIN) {
+		return lt_login(conn, req, data, dsl);
+	}
+	if (!conn->logged_in) {
+		return -1;
+	}
+	if (opcode != LT_DATA_OUT && !(req[0] & LT_IMMEDIATE)) {
+		conn->expcmdsn = scsi_get_uint32(&req[24]) + 1;
+	}
+
+	switch (opcode) {
+	case LT_NOP_OUT:
+		if (scsi_get_uint32(&req[16]) == 0xffffffff) {
+			return 0;
+		}
+		hdr = lt_queue_status(conn, LT_NOP_IN, LT_FINAL, req, data,
+				      dsl, 0);
+		if (hdr == NULL) {
+			return -1;
+		}
+		memcpy(&hdr[8], &req[8], 8);
+		scsi_set_uint32(&hdr[20], 0xffffffff);
+		return 0;
+	case LT_SCSI_COMMAND:
+		if (conn->discovery) {
+			return -1;
+		}
+		return lt_scsi_command(conn, req, data, dsl);
+	case LT_DATA_OUT:
+		return lt_data_out(conn, req, data, dsl);
+	case LT_TASK_MGMT:
+		return lt_task_mgmt(conn, req);
+	case LT_TEXT:
+		return lt_text(conn, req, data, dsl);
+	case LT_LOGOUT:
+		conn->done = 1;
+		if (lt_queue_status(conn, LT_LOGOUT_RESPONSE, LT_FINAL, req,
+				    NULL, 0, 0) == NULL) {
+			return -1;
+		}
+		return 0;
+	}
+	return -1;
+}
+
+/*
+ * Read whatever is available and process all complete PDUs.
+ * Returns 0 on EOF, -1 on error.
+ */
+static int
+lt_receive(struct lt_conn *conn)
+{
+	size_t pos = 0;
+	ssize_t count;
+
+	count = recv(conn->fd, &conn->in[conn->in_len],
+		     conn->in_size - conn->in_len, 0);
+	if (count <= 0) {
+		if (count < 0 && errno == EINTR) {
+			return 1;
+		}
+		return count;
+	}
+	conn->in_len += count;
+
+	while (conn->in_len - pos >= LT_BHS_SIZE) {
+		const unsigned char *hdr = &conn->in[pos];
+		uint32_t dsl = scsi_get_uint32(&hdr[4]) & 0x00ffffff;
+		size_t ahs = hdr[4] * 4;
+		size_t len = LT_BHS_SIZE + ahs + lt_pad(dsl);
+
+		if (dsl > LT_MAX_SEGMENT) {
+			return -1;
+		}
+		if (conn->in_len - pos < len) {
+			if (len > conn->in_size) {
+				unsigned char *in;
+
+				in = realloc(conn->in, len);
+				if (in == NULL) {
+					return -1;
+				}
+				conn->in = in;
+				conn->in_size = len;
+			}
+			break;
+		}
+		if (lt_process_pdu(conn, hdr, hdr + LT_BHS_SIZE + ahs,
+				   dsl) != 0) {
+			return -1;
+		}
+		pos += len;
+	}
+
+	conn->in_len -= pos;
+	if (conn->in_len) {
+		memmove(conn->in, &conn->in[pos], conn->in_len);
+	}
+	return 1;
+}
+
+int
+loopback_target_serve(struct loopback_target *target, int fd)
+{
+	struct lt_conn conn;
+	int ret = -1;
+
+	pthread_mutex_lock(&target->mutex);
+	target->refcount++;
+	pthread_mutex_unlock(&target->mutex);
+
+	memset(&conn, 0, sizeof(conn));
+	conn.target             = target;
+	conn.fd                 = fd;
+	conn.statsn             = 1;
+	conn.max_send_segment   = 8192;
+	conn.first_burst_length = 65536;
+	conn.max_burst_length   = 262144;
+	conn.initial_r2t        = 1;
+	conn.immediate_data     = 1;
+	conn.response_delay     = target->response_delay;
+	conn.cmdsn_window       = target->cmdsn_window;
+	conn.now_tail           = &conn.now;
+	conn.delayed_tail       = &conn.delayed;
+	conn.in_size            = LT_BHS_SIZE + 262144;
+	conn.in = malloc(conn.in_size);
+	if (conn.in == NULL) {
+		goto finished;
+	}
+
+	while (1) {
+		struct timeval tv, *tvp = NULL;
+		fd_set rfds;
+		int count;
+
+		if (conn.delayed != NULL) {
+			uint64_t now = lt_now();
+			uint64_t wait = 0;
+
+			if (conn.delayed->due > now) {
+				wait = conn.delayed->due - now;
+			}
+			tv.tv_sec  = wait / 1000000;
+			tv.tv_usec = wait % 1000000;
+			tvp = &tv;
+		}
+
+		FD_ZERO(&rfds);
+		FD_SET(fd, &rfds);
+		count = select(fd + 1, &rfds, NULL, NULL, tvp);
+		if (count < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if (count > 0) {
+			count = lt_receive(&conn);
+			if (count <= 0) {
+				break;
+			}
+		}
+		if (lt_flush(&conn) != 0) {
+			break;
+		}
+		if (conn.done && conn.delayed == NULL) {
+			ret = conn.logged_in ? 0 : -1;
+			break;
+		}
+	}
+
+finished:
+	while (conn.now != NULL) {
+		struct lt_reply *reply = conn.now;
+
+		conn.now = reply->next;
+		free(reply);
+	}
+	while (conn.delayed != NULL) {
+		struct lt_reply *reply = conn.delayed;
+
+		conn.delayed = reply->next;
+		free(reply);
+	}
+	while (conn.writes != NULL) {
+		struct lt_write *w = conn.writes;
+
+		conn.writes = w->next;
+		free(w);
+	}
+	free(conn.in);
+	close(fd);
+	lt_unref(target);
+	return ret;
+}
+
+/*
+ * Listening
+ */
+struct lt_accepted {
+	struct loopback_target *target;
+	int fd;
+};
+
+static void *
+lt_conn_thread(void *arg)
+{
+	struct lt_accepted *accepted = arg;
+
+	loopback_target_serve(accepted->target, accepted->fd);
+	lt_unref(accepted->target);
+	free(accepted);
+	return NULL;
+}
+
+static void *
+lt_accept_thread(void *arg)
+{
+	struct loopback_target *target = arg;
+
+	while (1) {
+		struct lt_accepted *accepted;
+		pthread_attr_t attr;
+		pthread_t thread;
+		int fd, one = 1;
+
+		fd = accept(target->listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			break;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		accepted = malloc(sizeof(struct lt_accepted));
+		if (accepted == NULL) {
+			close(fd);
+			continue;
+		}
+		accepted->target = target;
+		accepted->fd = fd;
+
+		/* the connection keeps the target alive until it is done */
+		pthread_mutex_lock(&target->mutex);
+		target->refcount++;
+		pthread_mutex_unlock(&target->mutex);
+
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (pthread_create(&thread, &attr, lt_conn_thread,
+				   accepted) != 0) {
+			close(fd);
+			free(accepted);
+			lt_unref(target);
+		}
+		pthread_attr_destroy(&attr);
+	}
+	return NULL;
+}
+
+int
+loopback_target_listen(struct loopback_target *target, const char *addr,
+		       int port)
+{
+	struct sockaddr_in sin;
+	socklen_t sinlen = sizeof(sin);
+	int fd, one = 1;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	if (inet_pton(AF_INET, addr, &sin.sin_addr) != 1) {
+		lt_set_error(target, "Invalid address %s", addr);
+		return -1;
+	}
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		lt_set_error(target, "Failed to create socket: %s",
+			     strerror(errno));
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0
+	    || listen(fd, 16) != 0
+	    || getsockname(fd, (struct sockaddr *)&sin, &sinlen) != 0) {
+		lt_set_error(target, "Failed to listen on %s:%d: %s", addr,
+			     port, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	target->listen_fd = fd;
+	return ntohs(sin.sin_port);
+}
+
+int
+loopback_target_start(struct loopback_target *target)
+{
+	if (target->listen_fd == -1) {
+		lt_set_error(target, "Target is not listening");
+		return -1;
+	}
+	if (pthread_create(&target->accept_thread, NULL, lt_accept_thread,
+			   target) != 0) {
+		lt_set_error(target, "Failed to create accept thread");
+		return -1;
+	}
+	target->accepting = 1;
+	return 0;
+}
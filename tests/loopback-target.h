@@ -0,0 +1,161 @@
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __loopback_target_h__
+#define __loopback_target_h__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A minimal in-memory iSCSI target that runs inside the process of the
+ * initiator. It exists so that the cost of the initiator can be measured
+ * without a network or a real target in the way.
+ *
+ * The target exports a single LUN 0 backed by memory and understands
+ * login (without authentication), text/SendTargets, NOP-Out, task
+ * management, logout and the SCSI commands TEST UNIT READY, INQUIRY,
+ * REPORT LUNS, READ CAPACITY 10/16, READ 10/16, WRITE 10/16, WRITE SAME16,
+ * UNMAP and SYNCHRONIZE CACHE 10/16. Reads are returned as Data-In PDUs with the
+ * status collapsed into the last one, writes are solicited with R2Ts.
+ *
+ * Every connection is served by its own thread doing blocking I/O.
+ * Concurrent writes from different connections to the same blocks are not
+ * serialized.
+ */
+struct loopback_target;
+
+/*
+ * What the initiator asked the target to do, for tests that check how
+ * commands were built.
+ */
+struct loopback_target_counters {
+	uint64_t unmap_commands;
+	uint64_t unmap_descriptors;
+	uint64_t unmap_blocks;
+	/* descriptors that do not start on an unmap granule */
+	uint64_t unmap_unaligned;
+	uint64_t write_same_commands;
+	uint64_t write_same_blocks;
+	/* WRITE SAME commands with the UNMAP bit set */
+	uint64_t write_same_unmap;
+};
+
+/*
+ * Create a target called iqn with a LUN of num_blocks blocks of
+ * block_size bytes. Returns NULL if the backing store can not be
+ * allocated.
+ */
+struct loopback_target *loopback_target_create(const char *iqn,
+					       uint64_t num_blocks,
+					       int block_size);
+
+/*
+ * Stop accepting connections and release the target. Connections that
+ * are still being served keep a reference and are not interrupted.
+ */
+void loopback_target_destroy(struct loopback_target *target);
+
+const char *loopback_target_get_error(struct loopback_target *target);
+
+/*
+ * Negotiation parameters. They only affect connections that log in after
+ * they are set.
+ *
+ * max_recv_data_segment_length is declared to the initiator and bounds
+ * both the Data-Out segments the initiator sends and the Data-In segments
+ * the target returns. first_burst_length and max_burst_length are offered
+ * to the initiator, who may lower them.
+ */
+void loopback_target_set_max_recv_data_segment_length(
+	struct loopback_target *target, uint32_t len);
+void loopback_target_set_first_burst_length(struct loopback_target *target,
+					    uint32_t len);
+void loopback_target_set_max_burst_length(struct loopback_target *target,
+					  uint32_t len);
+void loopback_target_set_initial_r2t(struct loopback_target *target,
+				     int initial_r2t);
+void loopback_target_set_immediate_data(struct loopback_target *target,
+					int immediate_data);
+
+/*
+ * Delay the status of every SCSI command by this many microseconds after
+ * it has been received (reads) or after its last data has been received
+ * (writes). Commands are still accepted while earlier ones are waiting, so
+ * the delay models the latency of the backend and not a queue depth of 1.
+ */
+void loopback_target_set_response_delay(struct loopback_target *target,
+					uint32_t usec);
+
+/*
+ * The number of commands the initiator may have outstanding, as set by
+ * MaxCmdSN. A small window makes the initiator hold commands back.
+ */
+void loopback_target_set_cmdsn_window(struct loopback_target *target,
+				      uint32_t window);
+
+/*
+ * The UNMAP limits reported in the Block Limits VPD. UNMAP commands with
+ * more than max_descriptors block descriptors or more than max_lbas
+ * blocks in total are failed with ILLEGAL REQUEST. Neither is limited by
+ * default.
+ */
+void loopback_target_set_unmap_limits(struct loopback_target *target,
+				      uint32_t max_lbas,
+				      uint32_t max_descriptors,
+				      uint32_t granularity,
+				      uint32_t alignment);
+
+/*
+ * The MAXIMUM WRITE SAME LENGTH reported in the Block Limits VPD. Longer
+ * WRITE SAME commands are failed with ILLEGAL REQUEST. 0, the default,
+ * means no limit.
+ */
+void loopback_target_set_max_write_same_length(struct loopback_target *target,
+					       uint32_t num_blocks);
+
+void loopback_target_get_counters(struct loopback_target *target,
+				  struct loopback_target_counters *counters);
+
+/*
+ * Listen on addr:port. Port 0 picks a free port. Returns the port that is
+ * listened on or -1 on error.
+ */
+int loopback_target_listen(struct loopback_target *target, const char *addr,
+			   int port);
+
+/*
+ * Start a thread that accepts connections on the listening socket and
+ * serves each of them from a thread of its own. Returns 0 on success.
+ */
+int loopback_target_start(struct loopback_target *target);
+
+/*
+ * Serve an already connected socket, for example one end of a
+ * socketpair(), from the calling thread until the initiator logs out or
+ * closes the connection. The socket is closed before returning.
+ * Returns 0 after a clean logout and -1 otherwise.
+ */
+int loopback_target_serve(struct loopback_target *target, int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __loopback_target_h__ */
@@ -0,0 +1,180 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+#include "loopback-target.h"
+#include "loopback-client.h"
+
+/*
+ * Log in, run reads and writes that wait for R2Ts, then reads into a
+ * buffer pool, and log out with an application allocator set. Check
+ * that all memory of the library went through it and was given back.
+ */
+
+const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:prog-allocator";
+
+#define ALLOC_TEST_BLOCKS (64 * 2048)
+
+/*
+ * An allocator that tags every block so that memory libiscsi allocated
+ * elsewhere, or frees twice, is caught, and that counts the live blocks.
+ */
+#define ALLOC_MAGIC 0x6c696273637369ULL
+
+struct alloc_state {
+	uint64_t mallocs;
+	uint64_t live;
+	uint64_t bad_frees;
+};
+
+static struct alloc_state alloc;
+
+union alloc_header {
+	uint64_t magic;
+	long double align;
+};
+
+static void *test_malloc(size_t size, void *private_data)
+{
+	struct alloc_state *a = private_data;
+	union alloc_header *h;
+
+	h = malloc(sizeof(*h) + size);
+	if (h == NULL) {
+		return NULL;
+	}
+	h->magic = ALLOC_MAGIC;
+	__atomic_add_fetch(&a->mallocs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&a->live, 1, __ATOMIC_RELAXED);
+	return h + 1;
+}
+
+static void test_free(void *ptr, void *private_data)
+{
+	struct alloc_state *a = private_data;
+	union alloc_header *h = (union alloc_header *)ptr - 1;
+
+	if (h->magic != ALLOC_MAGIC) {
+		__atomic_add_fetch(&a->bad_frees, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	h->magic = 0;
+	__atomic_sub_fetch(&a->live, 1, __ATOMIC_RELAXED);
+	free(h);
+}
+
+static void *test_realloc(void *ptr, size_t size, void *private_data)
+{
+	struct alloc_state *a = private_data;
+	union alloc_header *h;
+
+	if (ptr == NULL) {
+		return test_malloc(size, private_data);
+	}
+	h = (union alloc_header *)ptr - 1;
+	if (h->magic != ALLOC_MAGIC) {
+		__atomic_add_fetch(&a->bad_frees, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	h = realloc(h, sizeof(*h) + size);
+	if (h == NULL) {
+		return NULL;
+	}
+	return h + 1;
+}
+
+static int check_alloc(void)
+{
+	printf("allocator: %llu allocations, %llu not freed, "
+	       "%llu bad frees\n", (unsigned long long)alloc.mallocs,
+	       (unsigned long long)alloc.live,
+	       (unsigned long long)alloc.bad_frees);
+	if (alloc.mallocs == 0 || alloc.live || alloc.bad_frees) {
+		fprintf(stderr, "memory did not go through the allocator\n");
+		return -1;
+	}
+	return 0;
+}
+
+int main(void)
+{
+	struct loopback_target *target;
+	struct iscsi_context *iscsi;
+	struct loopback_client_io reads = {
+		0, 8, 512, ALLOC_TEST_BLOCKS, 32, 4096, NULL, NULL
+	};
+	struct loopback_client_io writes = {
+		1, 256, 512, ALLOC_TEST_BLOCKS, 32, 512, NULL, NULL
+	};
+	char portal[64];
+
+	if (iscsi_set_allocator(test_malloc, test_free, test_realloc,
+				&alloc) != 0) {
+		fprintf(stderr, "Failed to set the allocator\n");
+		exit(10);
+	}
+
+	target = loopback_target_create(LOOPBACK_TARGET_IQN,
+					ALLOC_TEST_BLOCKS, 512);
+	if (target == NULL) {
+		fprintf(stderr, "Failed to create target\n");
+		exit(10);
+	}
+	/* every write waits for R2Ts of at most 16 KiB */
+	loopback_target_set_initial_r2t(target, 1);
+	loopback_target_set_immediate_data(target, 0);
+	loopback_target_set_max_burst_length(target, 16384);
+	if (loopback_client_start_target(target, portal,
+					 sizeof(portal)) != 0) {
+		exit(10);
+	}
+
+	iscsi = loopback_client_connect(initiator, portal);
+	if (iscsi == NULL) {
+		exit(10);
+	}
+	if (loopback_client_self_check(iscsi, 512) != 0 ||
+	    loopback_client_run_io(iscsi, &reads) != 0 ||
+	    loopback_client_run_io(iscsi, &writes) != 0) {
+		exit(10);
+	}
+	if (iscsi_set_buffer_pool(iscsi, reads.blocks * 512, 64,
+				  ISCSI_BUFFER_POOL_DATA_IN) != 0) {
+		fprintf(stderr, "%s\n", iscsi_get_error(iscsi));
+		exit(10);
+	}
+	if (loopback_client_run_io(iscsi, &reads) != 0) {
+		exit(10);
+	}
+	loopback_client_disconnect(iscsi);
+	loopback_target_destroy(target);
+
+	if (check_alloc() != 0) {
+		exit(10);
+	}
+	return 0;
+}
@@ -0,0 +1,152 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+#include "loopback-target.h"
+#include "loopback-client.h"
+
+/*
+ * Set up a buffer pool for Data-In, check its buffers, and check that
+ * reads that fit in them are read into the pool.
+ */
+
+const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:prog-buffer-pool";
+
+#define POOL_TEST_BLOCKS	(64 * 2048)
+#define POOL_BUFFERS		64
+#define POOL_QUEUE_DEPTH	32
+
+/* the buffers of the buffer pool */
+static unsigned char *pool_start, *pool_end;
+static int num_pooled;
+
+/*
+ * Take all buffers of the pool, check that they are page aligned and
+ * do not overlap, and give them back.
+ */
+static int check_buffer_pool(struct iscsi_context *iscsi, int count)
+{
+	unsigned char **bufs;
+	size_t size = iscsi_buffer_size(iscsi);
+	int i, ret = -1;
+
+	bufs = calloc(count, sizeof(unsigned char *));
+	if (bufs == NULL) {
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		bufs[i] = iscsi_buffer_get(iscsi);
+		if (bufs[i] == NULL) {
+			fprintf(stderr, "buffer %d: %s\n", i,
+				iscsi_get_error(iscsi));
+			goto finished;
+		}
+		if ((uintptr_t)bufs[i] % 4096) {
+			fprintf(stderr, "buffer %d is not page aligned\n", i);
+			goto finished;
+		}
+		if (i && bufs[i] != bufs[i - 1] + size) {
+			fprintf(stderr, "buffer %d is not next to the "
+				"previous one\n", i);
+			goto finished;
+		}
+		memset(bufs[i], i, size);
+	}
+	if (iscsi_buffer_get(iscsi) != NULL) {
+		fprintf(stderr, "got more buffers than are in the pool\n");
+		goto finished;
+	}
+	pool_start = bufs[0];
+	pool_end   = bufs[count - 1] + size;
+	ret = 0;
+
+finished:
+	for (i = 0; i < count; i++) {
+		iscsi_buffer_put(iscsi, bufs[i]);
+	}
+	free(bufs);
+	return ret;
+}
+
+static int check_pooled(struct iscsi_context *iscsi _U_,
+			struct scsi_task *task, void *private_data _U_)
+{
+	if (task->datain.data < pool_start || task->datain.data >= pool_end) {
+		fprintf(stderr, "read was not read into the buffer pool\n");
+		return -1;
+	}
+	if (task->datain.size != task->expxferlen) {
+		fprintf(stderr, "short read into the buffer pool\n");
+		return -1;
+	}
+	num_pooled++;
+	return 0;
+}
+
+int main(void)
+{
+	struct loopback_target *target;
+	struct iscsi_context *iscsi;
+	/* there is always a free buffer for every read in flight */
+	struct loopback_client_io reads = {
+		0, 64, 512, POOL_TEST_BLOCKS, POOL_QUEUE_DEPTH, 4096,
+		check_pooled, NULL
+	};
+	char portal[64];
+
+	target = loopback_target_create(LOOPBACK_TARGET_IQN,
+					POOL_TEST_BLOCKS, 512);
+	if (target == NULL) {
+		fprintf(stderr, "Failed to create target\n");
+		exit(10);
+	}
+	/* every read is placed from several Data-In PDUs */
+	loopback_target_set_max_recv_data_segment_length(target, 8192);
+	if (loopback_client_start_target(target, portal,
+					 sizeof(portal)) != 0) {
+		exit(10);
+	}
+
+	iscsi = loopback_client_connect(initiator, portal);
+	if (iscsi == NULL) {
+		exit(10);
+	}
+	if (iscsi_set_buffer_pool(iscsi, reads.blocks * 512, POOL_BUFFERS,
+				  ISCSI_BUFFER_POOL_DATA_IN) != 0) {
+		fprintf(stderr, "%s\n", iscsi_get_error(iscsi));
+		exit(10);
+	}
+	if (check_buffer_pool(iscsi, POOL_BUFFERS) != 0 ||
+	    loopback_client_self_check(iscsi, 512) != 0 ||
+	    loopback_client_run_io(iscsi, &reads) != 0) {
+		exit(10);
+	}
+	printf("%d reads into the buffer pool\n", num_pooled);
+	loopback_client_disconnect(iscsi);
+	loopback_target_destroy(target);
+	return 0;
+}
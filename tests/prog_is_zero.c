@@ -0,0 +1,98 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "iscsi.h"
+#include "iscsi-private.h"
+
+/*
+ * Checks iscsi_is_zero() for every start offset within a cache line and
+ * every length up to a few vector loops, so that the byte probe, the
+ * alignment head, the vector loop and the tail are all hit at every
+ * boundary. For each case the buffer is checked all zero, with a single
+ * byte set at every position inside it, and with the bytes just outside
+ * of it set.
+ *
+ * This uses the internals of the library and is linked statically
+ * against it.
+ */
+
+#define MAX_START	64
+#define MAX_LEN		300
+
+int main(void)
+{
+	unsigned char *mem, *buf;
+	size_t start, len, i;
+	int errors = 0;
+
+	/* a guard byte on either side of the largest case */
+	mem = malloc(MAX_START + MAX_LEN + 128);
+	if (mem == NULL) {
+		fprintf(stderr, "Failed to allocate buffer\n");
+		return 10;
+	}
+	/* start on a 64 byte boundary so start is the misalignment */
+	buf = mem + 64 - (uintptr_t)mem % 64;
+	memset(mem, 0, MAX_START + MAX_LEN + 128);
+
+	for (start = 0; start < MAX_START; start++) {
+		for (len = 0; len <= MAX_LEN; len++) {
+			unsigned char *p = &buf[start];
+
+			p[-1] = 0xff;
+			p[len] = 0xff;
+			if (!iscsi_is_zero(p, len)) {
+				fprintf(stderr, "%zu zero bytes at offset %zu "
+					"are not zero\n", len, start);
+				errors++;
+			}
+			p[-1] = 0;
+			p[len] = 0;
+
+			for (i = 0; i < len; i++) {
+				p[i] = 0x80;
+				if (iscsi_is_zero(p, len)) {
+					fprintf(stderr, "byte %zu of %zu at "
+						"offset %zu is missed\n",
+						i, len, start);
+					errors++;
+				}
+				p[i] = 0;
+			}
+			if (errors > 10) {
+				free(mem);
+				return 10;
+			}
+		}
+	}
+	free(mem);
+
+	if (errors) {
+		return 10;
+	}
+	printf("iscsi_is_zero: all offsets and lengths are correct\n");
+	return 0;
+}
@@ -0,0 +1,177 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+#include "loopback-target.h"
+#include "loopback-client.h"
+
+/*
+ * Log a login and a few commands at the highest log level once directly
+ * and once through a log ring, and check that the messages come out the
+ * same. Then check that a small flight recorder keeps the last ones.
+ */
+
+const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:prog-log-ring";
+
+#define LOG_MESSAGES 4096
+
+/* these differ between two sessions, the local port is not the same */
+static int log_differs(const char *a, const char *b)
+{
+	if (!strncmp(a, "connection established", 22) &&
+	    !strncmp(b, "connection established", 22)) {
+		return 0;
+	}
+	return strcmp(a, b);
+}
+
+static char *log_messages[LOG_MESSAGES];
+static int num_log_messages;
+
+static void log_collect(int level _U_, const char *message)
+{
+	if (num_log_messages < LOG_MESSAGES) {
+		log_messages[num_log_messages++] = strdup(message);
+	}
+}
+
+static void log_clear(void)
+{
+	while (num_log_messages) {
+		free(log_messages[--num_log_messages]);
+	}
+}
+
+static int log_session(const char *portal, int entries,
+		       enum iscsi_log_ring_mode mode)
+{
+	struct iscsi_context *iscsi;
+	int ret = 0;
+
+	iscsi = loopback_client_create(initiator);
+	if (iscsi == NULL) {
+		return -1;
+	}
+	iscsi_set_log_fn(iscsi, log_collect);
+	if (entries && iscsi_set_log_ring(iscsi, entries, mode) != 0) {
+		fprintf(stderr, "iscsi_set_log_ring failed: %s\n",
+			iscsi_get_error(iscsi));
+		iscsi_destroy_context(iscsi);
+		return -1;
+	}
+	iscsi_set_log_level(iscsi, 10);
+	if (loopback_client_login(iscsi, portal) != 0 ||
+	    loopback_client_self_check(iscsi, 512) != 0) {
+		ret = -1;
+	}
+	iscsi_log_ring_drain(iscsi, 0);
+	iscsi_set_log_level(iscsi, 0);
+	loopback_client_disconnect(iscsi);
+	return ret;
+}
+
+static int check_log_ring(const char *portal)
+{
+	char *direct[LOG_MESSAGES];
+	int num_direct, i, ret = -1;
+
+	if (log_session(portal, 0, ISCSI_LOG_RING_DRAIN) != 0) {
+		return -1;
+	}
+	num_direct = num_log_messages;
+	memcpy(direct, log_messages, num_direct * sizeof(char *));
+	num_log_messages = 0;
+
+	if (log_session(portal, LOG_MESSAGES,
+			ISCSI_LOG_RING_DRAIN) != 0) {
+		goto finished;
+	}
+	if (num_log_messages != num_direct) {
+		fprintf(stderr, "%d messages through the ring, %d directly\n",
+			num_log_messages, num_direct);
+		goto finished;
+	}
+	for (i = 0; i < num_direct; i++) {
+		if (log_differs(log_messages[i], direct[i])) {
+			fprintf(stderr, "message %d differs:\n%s\n%s\n", i,
+				log_messages[i], direct[i]);
+			goto finished;
+		}
+	}
+	printf("%d log messages through the ring match\n", num_direct);
+	log_clear();
+
+	if (log_session(portal, 4,
+			ISCSI_LOG_RING_FLIGHT_RECORDER) != 0) {
+		goto finished;
+	}
+	if (num_log_messages != 4 || num_direct < 4) {
+		fprintf(stderr, "flight recorder kept %d messages\n",
+			num_log_messages);
+		goto finished;
+	}
+	for (i = 0; i < 4; i++) {
+		if (log_differs(log_messages[i],
+				direct[num_direct - 4 + i])) {
+			fprintf(stderr, "flight recorder message %d differs:"
+				"\n%s\n%s\n", i, log_messages[i],
+				direct[num_direct - 4 + i]);
+			goto finished;
+		}
+	}
+	printf("flight recorder kept the last 4 messages\n");
+	ret = 0;
+
+finished:
+	log_clear();
+	for (i = 0; i < num_direct; i++) {
+		free(direct[i]);
+	}
+	return ret;
+}
+
+int main(void)
+{
+	struct loopback_target *target;
+	char portal[64];
+
+	target = loopback_target_create(LOOPBACK_TARGET_IQN, 1024, 512);
+	if (target == NULL) {
+		fprintf(stderr, "Failed to create target\n");
+		exit(10);
+	}
+	if (loopback_client_start_target(target, portal,
+					 sizeof(portal)) != 0) {
+		exit(10);
+	}
+
+	if (check_log_ring(portal) != 0) {
+		exit(10);
+	}
+	loopback_target_destroy(target);
+	return 0;
+}
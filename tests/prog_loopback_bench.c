@@ -0,0 +1,387 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+#include "loopback-target.h"
+#include "loopback-client.h"
+
+/*
+ * Measures how many I/Os per second the initiator can drive against the
+ * in-process loopback target, and how much CPU the initiator thread uses
+ * for it. The target runs in threads of its own so its cost is not
+ * included in the CPU time that is reported.
+ *
+ * With --listen the program only runs the target so that other tools,
+ * such as iscsi-perf, can be pointed at it.
+ */
+
+const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:prog-loopback-bench";
+
+struct client_state {
+	struct iscsi_context *iscsi;
+	uint64_t num_blocks;
+	uint32_t blocks;
+	int block_size;
+	int queue_depth;
+	int write;
+	int random;
+	int in_flight;
+	int stop;
+	int err_cnt;
+	uint64_t pos;
+	uint64_t ios;
+	/* queue whole batches of commands and time building them */
+	int batch;
+	uint64_t batch_ns;
+	uint64_t batched;
+	unsigned char *buf;
+};
+
+void fill_queue(struct client_state *state);
+
+void io_cb(struct iscsi_context *iscsi, int status, void *command_data,
+	   void *private_data)
+{
+	struct client_state *state = private_data;
+	struct scsi_task *task = command_data;
+
+	state->in_flight--;
+	if (status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "I/O failed: %s\n", iscsi_get_error(iscsi));
+		state->err_cnt++;
+	}
+	scsi_free_scsi_task(task);
+	state->ios++;
+	fill_queue(state);
+}
+
+void fill_queue(struct client_state *state)
+{
+	struct timespec t0, t1;
+
+	if (state->batch) {
+		if (state->in_flight) {
+			return;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+	}
+	while (!state->stop && !state->err_cnt
+	       && state->in_flight < state->queue_depth) {
+		struct scsi_task *task;
+		uint64_t lba;
+
+		if (state->random) {
+			lba = (uint64_t)random() % (state->num_blocks
+						    / state->blocks);
+			lba *= state->blocks;
+		} else {
+			if (state->pos + state->blocks > state->num_blocks) {
+				state->pos = 0;
+			}
+			lba = state->pos;
+			state->pos += state->blocks;
+		}
+
+		if (state->write) {
+			task = iscsi_write16_task(state->iscsi, 0, lba,
+					state->buf,
+					state->blocks * state->block_size,
+					state->block_size, 0, 0, 0, 0, 0,
+					io_cb, state);
+		} else {
+			task = iscsi_read16_task(state->iscsi, 0, lba,
+					state->blocks * state->block_size,
+					state->block_size, 0, 0, 0, 0, 0,
+					io_cb, state);
+		}
+		if (task == NULL) {
+			fprintf(stderr, "Failed to queue I/O: %s\n",
+				iscsi_get_error(state->iscsi));
+			exit(10);
+		}
+		state->in_flight++;
+		state->batched += state->batch;
+	}
+	if (state->batch) {
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		state->batch_ns += (t1.tv_sec - t0.tv_sec) * 1000000000ULL
+			+ t1.tv_nsec - t0.tv_nsec;
+	}
+}
+
+static double timeval_seconds(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1000000.0;
+}
+
+static double timespec_seconds(const struct timespec *ts)
+{
+	return ts->tv_sec + ts->tv_nsec / 1000000000.0;
+}
+
+void usage(void)
+{
+	fprintf(stderr, "Usage: prog_loopback_bench [-q <queue-depth>] "
+		"[-b <blocks>] [-t <seconds>] [-w] [-r] [-s <size-mb>]\n"
+		"\t[-M <max-recv-data-segment-length>] "
+		"[-F <first-burst-length>] [-B <max-burst-length>]\n"
+		"\t[-I] [-N] [-d <response-delay-usec>] [-l <port>] [-C]\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct loopback_target *target;
+	struct client_state state;
+	struct scsi_task *task;
+	struct scsi_readcapacity16 *rc16;
+	struct timeval start, end;
+	struct timespec cpu_start, cpu_end;
+	char portal[64];
+	double elapsed, cpu;
+	int seconds = 5, size_mb = 256, listen_port = -1;
+	uint32_t mrdsl = 0, first_burst = 0, max_burst = 0, delay = 0;
+	int initial_r2t = 0, immediate_data = 1;
+	int port, c;
+
+	static struct option long_options[] = {
+		{"queue-depth",                  required_argument, NULL, 'q'},
+		{"blocks",                       required_argument, NULL, 'b'},
+		{"time",                         required_argument, NULL, 't'},
+		{"write",                        no_argument,       NULL, 'w'},
+		{"random",                       no_argument,       NULL, 'r'},
+		{"size",                         required_argument, NULL, 's'},
+		{"max-recv-data-segment-length", required_argument, NULL, 'M'},
+		{"first-burst-length",           required_argument, NULL, 'F'},
+		{"max-burst-length",             required_argument, NULL, 'B'},
+		{"initial-r2t",                  no_argument,       NULL, 'I'},
+		{"no-immediate-data",            no_argument,       NULL, 'N'},
+		{"delay",                        required_argument, NULL, 'd'},
+		{"listen",                       required_argument, NULL, 'l'},
+		{"construct",                    no_argument,       NULL, 'C'},
+		{0, 0, 0, 0}
+	};
+	int option_index;
+
+	memset(&state, 0, sizeof(state));
+	state.queue_depth = 32;
+	state.blocks      = 8;
+	state.block_size  = 512;
+
+	while ((c = getopt_long(argc, argv, "q:b:t:wrs:M:F:B:INd:l:C",
+				long_options, &option_index)) != -1) {
+		switch (c) {
+		case 'q':
+			state.queue_depth = atoi(optarg);
+			break;
+		case 'b':
+			state.blocks = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'w':
+			state.write = 1;
+			break;
+		case 'r':
+			state.random = 1;
+			break;
+		case 's':
+			size_mb = atoi(optarg);
+			break;
+		case 'M':
+			mrdsl = strtoul(optarg, NULL, 0);
+			break;
+		case 'F':
+			first_burst = strtoul(optarg, NULL, 0);
+			break;
+		case 'B':
+			max_burst = strtoul(optarg, NULL, 0);
+			break;
+		case 'I':
+			initial_r2t = 1;
+			break;
+		case 'N':
+			immediate_data = 0;
+			break;
+		case 'd':
+			delay = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			listen_port = atoi(optarg);
+			break;
+		case 'C':
+			state.batch = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || state.queue_depth < 1 || state.blocks < 1
+	    || seconds < 1 || size_mb < 1) {
+		usage();
+	}
+
+	target = loopback_target_create(LOOPBACK_TARGET_IQN,
+				(uint64_t)size_mb * 1024 * 1024
+				/ state.block_size, state.block_size);
+	if (target == NULL) {
+		fprintf(stderr, "Failed to create target\n");
+		exit(10);
+	}
+	if (mrdsl) {
+		loopback_target_set_max_recv_data_segment_length(target, mrdsl);
+	}
+	if (first_burst) {
+		loopback_target_set_first_burst_length(target, first_burst);
+	}
+	if (max_burst) {
+		loopback_target_set_max_burst_length(target, max_burst);
+	}
+	loopback_target_set_initial_r2t(target, initial_r2t);
+	loopback_target_set_immediate_data(target, immediate_data);
+	loopback_target_set_response_delay(target, delay);
+
+	port = loopback_target_listen(target, "127.0.0.1",
+				      listen_port >= 0 ? listen_port : 0);
+	if (port < 0 || loopback_target_start(target) != 0) {
+		fprintf(stderr, "%s\n", loopback_target_get_error(target));
+		exit(10);
+	}
+
+	if (listen_port >= 0) {
+		printf("Serving iscsi://127.0.0.1:%d/%s/0\n", port,
+		       LOOPBACK_TARGET_IQN);
+		fflush(stdout);
+		while (1) {
+			pause();
+		}
+	}
+
+	snprintf(portal, sizeof(portal), "127.0.0.1:%d", port);
+
+	state.iscsi = loopback_client_connect(initiator, portal);
+	if (state.iscsi == NULL) {
+		exit(10);
+	}
+
+	task = iscsi_readcapacity16_sync(state.iscsi, 0);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "failed to send readcapacity command\n");
+		exit(10);
+	}
+	rc16 = scsi_datain_unmarshall(task);
+	if (rc16 == NULL) {
+		fprintf(stderr, "failed to unmarshall readcapacity16 data\n");
+		exit(10);
+	}
+	state.num_blocks = rc16->returned_lba + 1;
+	scsi_free_scsi_task(task);
+	if (state.blocks > state.num_blocks) {
+		state.blocks = state.num_blocks;
+	}
+
+	if (loopback_client_self_check(state.iscsi, state.block_size) != 0) {
+		exit(10);
+	}
+
+	state.buf = malloc(state.blocks * state.block_size);
+	if (state.buf == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(10);
+	}
+	memset(state.buf, 0xa5, state.blocks * state.block_size);
+
+	gettimeofday(&start, NULL);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+
+	fill_queue(&state);
+	while (state.in_flight) {
+		struct pollfd pfd;
+
+		pfd.fd = iscsi_get_fd(state.iscsi);
+		pfd.events = iscsi_which_events(state.iscsi);
+		if (poll(&pfd, 1, 1000) < 0) {
+			continue;
+		}
+		if (iscsi_service(state.iscsi, pfd.revents) < 0) {
+			fprintf(stderr, "iscsi_service failed with : %s\n",
+				iscsi_get_error(state.iscsi));
+			exit(10);
+		}
+		if (!state.stop) {
+			gettimeofday(&end, NULL);
+			if (timeval_seconds(&end) - timeval_seconds(&start)
+			    >= seconds) {
+				state.stop = 1;
+			}
+		}
+	}
+
+	gettimeofday(&end, NULL);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+
+	if (state.err_cnt) {
+		exit(10);
+	}
+
+	elapsed = timeval_seconds(&end) - timeval_seconds(&start);
+	cpu = timespec_seconds(&cpu_end) - timespec_seconds(&cpu_start);
+	printf("%s %s, queue depth %d, %u blocks of %d bytes\n",
+	       state.random ? "random" : "sequential",
+	       state.write ? "writes" : "reads", state.queue_depth,
+	       state.blocks, state.block_size);
+	printf("%llu I/Os in %.2f seconds: %.0f IOPS, %.1f MB/s\n",
+	       (unsigned long long)state.ios, elapsed, state.ios / elapsed,
+	       state.ios * state.blocks * state.block_size
+	       / elapsed / 1024 / 1024);
+	printf("initiator used %.2f CPU seconds: %.0f IOPS per core, "
+	       "%.2f us per I/O\n", cpu, cpu > 0 ? state.ios / cpu : 0.0,
+	       state.ios ? cpu * 1000000 / state.ios : 0.0);
+
+	if (state.batch) {
+		printf("building and queuing commands: %.1f ns per command\n",
+		       state.batched ?
+		       (double)state.batch_ns / state.batched : 0.0);
+	}
+
+	loopback_client_disconnect(state.iscsi);
+	loopback_target_destroy(target);
+	free(state.buf);
+	return 0;
+}
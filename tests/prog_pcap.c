@@ -0,0 +1,255 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+#include "loopback-target.h"
+#include "loopback-client.h"
+
+/*
+ * Capture a run of reads with large Data-In PDUs, and a run of writes
+ * that wait for R2Ts, to the pcap file given on the command line and
+ * check each capture.
+ */
+
+const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:prog-pcap";
+
+#define PCAP_TEST_BLOCKS (64 * 2048)
+
+/*
+ * Read back a capture and follow the TCP sequence numbers of both
+ * directions. Every PDU has to start where the previous one ended.
+ *
+ * When PDUs were dropped the sequence numbers still count their bytes, so
+ * the capture may skip ahead to the start of a later PDU. The PDUs that
+ * were captured completely and the ones that were dropped then have to
+ * add up to the PDUs that went over the connection.
+ */
+static int check_pcap(const char *filename, int ios, uint64_t dropped,
+		      uint64_t total)
+{
+	FILE *f;
+	unsigned char hdr[24], rec[16], *pkt;
+	uint32_t magic, next[2] = { 0, 0 }, seq[2] = { 0, 0 };
+	unsigned char local_port[2];
+	uint64_t records = 0, pdus[2] = { 0, 0 }, commands = 0;
+	uint64_t partial = 0, complete;
+	int started[2] = { 0, 0 }, dir, ret = -1;
+
+	f = fopen(filename, "rb");
+	if (f == NULL) {
+		fprintf(stderr, "failed to open %s\n", filename);
+		return -1;
+	}
+	pkt = malloc(65536);
+	if (pkt == NULL || fread(hdr, sizeof(hdr), 1, f) != 1) {
+		fprintf(stderr, "no pcap file header\n");
+		goto finished;
+	}
+	memcpy(&magic, hdr, 4);
+	if (magic != 0xa1b2c3d4 || hdr[20] != 101) {
+		fprintf(stderr, "bad pcap file header\n");
+		goto finished;
+	}
+
+	while (fread(rec, sizeof(rec), 1, f) == 1) {
+		uint32_t incl_len, orig_len, s, len;
+		unsigned char *tcp, *data;
+
+		memcpy(&incl_len, &rec[8], 4);
+		memcpy(&orig_len, &rec[12], 4);
+		if (incl_len > 65536 || incl_len < 40 ||
+		    fread(pkt, incl_len, 1, f) != 1) {
+			fprintf(stderr, "truncated record %llu\n",
+				(unsigned long long)records);
+			goto finished;
+		}
+		records++;
+		if (pkt[0] != 0x45 || pkt[9] != 6) {
+			fprintf(stderr, "record %llu is not IPv4/TCP\n",
+				(unsigned long long)records);
+			goto finished;
+		}
+		tcp = &pkt[20];
+		data = &tcp[20];
+		len = orig_len - 40;
+		/* the capture starts with a command we sent */
+		if (records == 1) {
+			memcpy(local_port, &tcp[0], 2);
+		}
+		dir = memcmp(&tcp[0], local_port, 2) ? 1 : 0;
+		s = (tcp[4] << 24) | (tcp[5] << 16) | (tcp[6] << 8) | tcp[7];
+		if (!started[dir]) {
+			started[dir] = 1;
+			seq[dir] = next[dir] = s;
+		}
+		if (s != seq[dir]) {
+			if (!dropped || (int32_t)(s - seq[dir]) < 0) {
+				fprintf(stderr, "record %llu: seq %u, "
+					"expected %u\n",
+					(unsigned long long)records, s,
+					seq[dir]);
+				goto finished;
+			}
+			/* the rest of this PDU, or whole PDUs, are missing */
+			if (seq[dir] != next[dir]) {
+				partial++;
+			}
+			seq[dir] = next[dir] = s;
+		}
+		if (s == next[dir]) {
+			uint32_t dsl;
+
+			if (incl_len < 40 + 48) {
+				fprintf(stderr, "record %llu: no BHS\n",
+					(unsigned long long)records);
+				goto finished;
+			}
+			dsl = (data[5] << 16) | (data[6] << 8) | data[7];
+			next[dir] += 48 + ((dsl + 3) & ~3);
+			pdus[dir]++;
+			if (dir == 0 && (data[0] & 0x3f) == 0x01) {
+				commands++;
+			}
+		}
+		seq[dir] += len;
+	}
+	for (dir = 0; dir < 2; dir++) {
+		if (seq[dir] == next[dir]) {
+			continue;
+		}
+		if (!dropped) {
+			fprintf(stderr, "capture ends within a PDU\n");
+			goto finished;
+		}
+		partial++;
+	}
+
+	printf("pcap: %llu records, %llu PDUs sent, %llu received, "
+	       "%llu commands, %llu dropped\n", (unsigned long long)records,
+	       (unsigned long long)pdus[0], (unsigned long long)pdus[1],
+	       (unsigned long long)commands, (unsigned long long)dropped);
+	complete = pdus[0] + pdus[1] - partial;
+	if (complete + dropped != total) {
+		fprintf(stderr, "%llu PDUs captured and %llu dropped for %llu "
+			"PDUs on the wire\n", (unsigned long long)complete,
+			(unsigned long long)dropped, (unsigned long long)total);
+		goto finished;
+	}
+	if (!dropped && commands < (uint64_t)ios) {
+		fprintf(stderr, "%llu commands captured for %d I/Os\n",
+			(unsigned long long)commands, ios);
+		goto finished;
+	}
+	ret = 0;
+
+finished:
+	free(pkt);
+	fclose(f);
+	return ret;
+}
+
+/* PDUs sent and received */
+static uint64_t stats_pdus(const struct iscsi_stats *stats)
+{
+	uint64_t pdus = 0;
+	int i;
+
+	for (i = 0; i < ISCSI_STATS_OPCODES; i++) {
+		pdus += stats->pdus_out[i] + stats->pdus_in[i];
+	}
+	return pdus;
+}
+
+static int pcap_run(struct iscsi_context *iscsi, const char *filename,
+		    const struct loopback_client_io *io)
+{
+	struct iscsi_stats start, end;
+	int ret;
+
+	iscsi_get_stats(iscsi, &start);
+	if (iscsi_set_pcap_capture(iscsi, filename, ISCSI_PCAP_ALL_DATA,
+				   0, 0) != 0) {
+		fprintf(stderr, "%s\n", iscsi_get_error(iscsi));
+		return -1;
+	}
+	ret = loopback_client_run_io(iscsi, io);
+	iscsi_set_pcap_capture(iscsi, NULL, 0, 0, 0);
+	if (ret != 0) {
+		return -1;
+	}
+	iscsi_get_stats(iscsi, &end);
+	return check_pcap(filename, io->count,
+			  end.pcap_dropped - start.pcap_dropped,
+			  stats_pdus(&end) - stats_pdus(&start));
+}
+
+int main(int argc, char *argv[])
+{
+	struct loopback_target *target;
+	struct iscsi_context *iscsi;
+	struct loopback_client_io reads = {
+		0, 1024, 512, PCAP_TEST_BLOCKS, 32, 128, NULL, NULL
+	};
+	struct loopback_client_io writes = {
+		1, 256, 512, PCAP_TEST_BLOCKS, 32, 256, NULL, NULL
+	};
+	char portal[64];
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: prog_pcap <pcap-file>\n");
+		exit(1);
+	}
+
+	target = loopback_target_create(LOOPBACK_TARGET_IQN,
+					PCAP_TEST_BLOCKS, 512);
+	if (target == NULL) {
+		fprintf(stderr, "Failed to create target\n");
+		exit(10);
+	}
+	/* reads come back in Data-In PDUs of 256 KiB */
+	loopback_target_set_max_recv_data_segment_length(target, 262144);
+	/* every write waits for R2Ts of at most 16 KiB */
+	loopback_target_set_initial_r2t(target, 1);
+	loopback_target_set_immediate_data(target, 0);
+	loopback_target_set_max_burst_length(target, 16384);
+	if (loopback_client_start_target(target, portal,
+					 sizeof(portal)) != 0) {
+		exit(10);
+	}
+
+	iscsi = loopback_client_connect(initiator, portal);
+	if (iscsi == NULL) {
+		exit(10);
+	}
+	if (pcap_run(iscsi, argv[1], &reads) != 0 ||
+	    pcap_run(iscsi, argv[1], &writes) != 0) {
+		exit(10);
+	}
+	loopback_client_disconnect(iscsi);
+	loopback_target_destroy(target);
+	return 0;
+}
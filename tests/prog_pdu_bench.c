@@ -0,0 +1,236 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+/*
+ * Measures what it costs to build the headers of the SCSI Command and
+ * Data-Out PDUs, from a template as libiscsi does it and field by field
+ * into a cleared header as it was done before, and checks that both give
+ * the same header.
+ *
+ * This uses the internals of the library and is linked statically
+ * against it, see "make bench".
+ */
+
+const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:prog-pdu-bench";
+
+#define LUN        3
+#define TTT        0x11223344
+#define BURST      (1024 * 1024)
+#define SEGMENT    8192
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct iscsi_pdu *
+command_fields(struct iscsi_context *iscsi, struct scsi_task *task,
+	       uint32_t itt, uint32_t cmdsn)
+{
+	struct iscsi_pdu *pdu;
+
+	pdu = iscsi_allocate_pdu(iscsi, ISCSI_PDU_SCSI_REQUEST,
+				 ISCSI_PDU_SCSI_RESPONSE, itt, 0);
+	if (pdu == NULL) {
+		return NULL;
+	}
+	pdu->outdata.data[1] = ISCSI_PDU_SCSI_FINAL|ISCSI_PDU_SCSI_READ;
+	scsi_set_uint16(&pdu->outdata.data[8], LUN);
+	scsi_set_uint32(&pdu->outdata.data[20], task->expxferlen);
+	memset(&pdu->outdata.data[32], 0, 16);
+	memcpy(&pdu->outdata.data[32], task->cdb, task->cdb_size);
+	scsi_set_uint32(&pdu->outdata.data[24], cmdsn);
+	return pdu;
+}
+
+static struct iscsi_pdu *
+command_template(struct iscsi_context *iscsi, struct scsi_task *task,
+		 uint32_t itt, uint32_t cmdsn)
+{
+	struct iscsi_pdu *pdu;
+
+	pdu = iscsi_allocate_pdu_from_template(iscsi,
+			iscsi->scsi_command_template,
+			ISCSI_PDU_SCSI_RESPONSE, itt, 0);
+	if (pdu == NULL) {
+		return NULL;
+	}
+	iscsi_pdu_set_pduflags(pdu, ISCSI_PDU_SCSI_FINAL|ISCSI_PDU_SCSI_READ);
+	iscsi_pdu_set_lun(pdu, LUN);
+	iscsi_pdu_set_expxferlen(pdu, task->expxferlen);
+	memcpy(&pdu->outdata.data[32], task->cdb, task->cdb_size);
+	iscsi_pdu_set_cmdsn(pdu, cmdsn);
+	return pdu;
+}
+
+/* Build the Data-Out PDUs of one burst, freeing all but the last */
+static struct iscsi_pdu *
+data_out_fields(struct iscsi_context *iscsi, uint32_t itt)
+{
+	struct iscsi_pdu *pdu = NULL;
+	uint32_t offset;
+
+	for (offset = 0; offset < BURST; offset += SEGMENT) {
+		iscsi_free_pdu(iscsi, pdu);
+		pdu = iscsi_allocate_pdu(iscsi, ISCSI_PDU_DATA_OUT,
+					 ISCSI_PDU_NO_PDU, itt, 0);
+		if (pdu == NULL) {
+			return NULL;
+		}
+		pdu->outdata.data[1] = offset + SEGMENT == BURST ?
+			ISCSI_PDU_SCSI_FINAL : 0;
+		scsi_set_uint16(&pdu->outdata.data[8], LUN);
+		scsi_set_uint32(&pdu->outdata.data[20], TTT);
+		scsi_set_uint32(&pdu->outdata.data[36], offset / SEGMENT);
+		scsi_set_uint32(&pdu->outdata.data[40], offset);
+		scsi_set_uint32(&pdu->outdata.data[4], SEGMENT);
+	}
+	return pdu;
+}
+
+static struct iscsi_pdu *
+data_out_template(struct iscsi_context *iscsi, uint32_t itt)
+{
+	unsigned char hdr[ISCSI_RAW_HEADER_SIZE];
+	struct iscsi_pdu *pdu = NULL;
+	uint32_t offset;
+
+	memcpy(hdr, iscsi->data_out_template, ISCSI_RAW_HEADER_SIZE);
+	iscsi_set_be16(&hdr[8], LUN);
+	iscsi_set_be32(&hdr[20], TTT);
+
+	for (offset = 0; offset < BURST; offset += SEGMENT) {
+		iscsi_free_pdu(iscsi, pdu);
+		pdu = iscsi_allocate_pdu_from_template(iscsi, hdr,
+					ISCSI_PDU_NO_PDU, itt, 0);
+		if (pdu == NULL) {
+			return NULL;
+		}
+		iscsi_pdu_set_pduflags(pdu, offset + SEGMENT == BURST ?
+				       ISCSI_PDU_SCSI_FINAL : 0);
+		iscsi_pdu_set_datasn(pdu, offset / SEGMENT);
+		iscsi_pdu_set_bufferoffset(pdu, offset);
+		iscsi_set_be32(&pdu->outdata.data[4], SEGMENT);
+	}
+	return pdu;
+}
+
+int main(int argc, char *argv[])
+{
+	struct iscsi_context *iscsi;
+	struct scsi_task *task;
+	struct iscsi_pdu *a, *b;
+	uint64_t start, fields_ns, template_ns;
+	int iterations = 1000000, bursts;
+	int i, c;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: prog_pdu_bench [-n <iterations>]\n");
+			exit(1);
+		}
+	}
+	if (iterations < 1) {
+		exit(1);
+	}
+	bursts = iterations / (BURST / SEGMENT) + 1;
+
+	iscsi = iscsi_create_context(initiator);
+	if (iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		exit(10);
+	}
+	task = scsi_cdb_read16(0x123456789aULL, 64 * 512, 512, 0, 0, 0, 0, 0);
+	if (task == NULL) {
+		fprintf(stderr, "Failed to create task\n");
+		exit(10);
+	}
+
+	/* both ways must give the same headers */
+	a = command_fields(iscsi, task, 7, 9);
+	b = command_template(iscsi, task, 7, 9);
+	if (a == NULL || b == NULL ||
+	    memcmp(a->outdata.data, b->outdata.data, ISCSI_RAW_HEADER_SIZE)) {
+		fprintf(stderr, "SCSI Command headers differ\n");
+		exit(10);
+	}
+	iscsi_free_pdu(iscsi, a);
+	iscsi_free_pdu(iscsi, b);
+	a = data_out_fields(iscsi, 7);
+	b = data_out_template(iscsi, 7);
+	if (a == NULL || b == NULL ||
+	    memcmp(a->outdata.data, b->outdata.data, ISCSI_RAW_HEADER_SIZE)) {
+		fprintf(stderr, "Data-Out headers differ\n");
+		exit(10);
+	}
+	iscsi_free_pdu(iscsi, a);
+	iscsi_free_pdu(iscsi, b);
+
+	start = now_ns();
+	for (i = 0; i < iterations; i++) {
+		iscsi_free_pdu(iscsi, command_fields(iscsi, task, i, i));
+	}
+	fields_ns = now_ns() - start;
+	start = now_ns();
+	for (i = 0; i < iterations; i++) {
+		iscsi_free_pdu(iscsi, command_template(iscsi, task, i, i));
+	}
+	template_ns = now_ns() - start;
+	printf("SCSI Command: %.1f ns field by field, %.1f ns from the "
+	       "template\n", (double)fields_ns / iterations,
+	       (double)template_ns / iterations);
+
+	start = now_ns();
+	for (i = 0; i < bursts; i++) {
+		iscsi_free_pdu(iscsi, data_out_fields(iscsi, i));
+	}
+	fields_ns = now_ns() - start;
+	start = now_ns();
+	for (i = 0; i < bursts; i++) {
+		iscsi_free_pdu(iscsi, data_out_template(iscsi, i));
+	}
+	template_ns = now_ns() - start;
+	printf("Data-Out: %.1f ns field by field, %.1f ns from the "
+	       "template\n", (double)fields_ns / bursts / (BURST / SEGMENT),
+	       (double)template_ns / bursts / (BURST / SEGMENT));
+
+	scsi_free_scsi_task(task);
+	iscsi_destroy_context(iscsi);
+	return 0;
+}
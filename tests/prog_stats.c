@@ -0,0 +1,185 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+#include "loopback-target.h"
+#include "loopback-client.h"
+
+/*
+ * Run reads, and writes that wait for R2Ts, with the statistics enabled
+ * and check the counters of each run and the timestamps of every task.
+ */
+
+const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:prog-stats";
+
+#define STATS_TEST_BLOCKS (64 * 2048)
+
+/*
+ * Check the counters of iscsi_get_stats() against what was done, and
+ * print them together with the latencies.
+ */
+static int check_stats(struct iscsi_context *iscsi,
+		       const struct loopback_client_io *io)
+{
+	struct iscsi_stats stats;
+	uint64_t ios = io->count;
+	uint64_t bytes = ios * io->blocks * io->block_size;
+	uint64_t bytes_in = 0, bytes_out = 0;
+	const struct iscsi_latency_histogram *h;
+	int i;
+
+	if (iscsi_get_stats(iscsi, &stats) != 0) {
+		fprintf(stderr, "iscsi_get_stats failed: %s\n",
+			iscsi_get_error(iscsi));
+		return -1;
+	}
+	for (i = 0; i < ISCSI_STATS_OPCODES; i++) {
+		bytes_in += stats.bytes_in[i];
+		bytes_out += stats.bytes_out[i];
+	}
+
+	printf("%llu commands sent, %llu GOOD, %llu R2Ts, "
+	       "%llu bytes in, %llu bytes out\n",
+	       (unsigned long long)stats.pdus_out[0x01],
+	       (unsigned long long)stats.scsi_status[ISCSI_STATS_GOOD],
+	       (unsigned long long)stats.r2ts,
+	       (unsigned long long)bytes_in, (unsigned long long)bytes_out);
+	h = &stats.submit_to_wire[0x01];
+	printf("submit to wire: %llu, mean %.1f us, max %llu us\n",
+	       (unsigned long long)h->count,
+	       h->count ? (double)h->sum_us / h->count : 0.0,
+	       (unsigned long long)h->max_us);
+	h = &stats.queue_wait[0x01];
+	printf("  of which queued: %llu, mean %.1f us, max %llu us\n",
+	       (unsigned long long)h->count,
+	       h->count ? (double)h->sum_us / h->count : 0.0,
+	       (unsigned long long)h->max_us);
+	h = &stats.wire_to_response[0x01];
+	printf("wire to response: %llu, mean %.1f us, max %llu us\n",
+	       (unsigned long long)h->count,
+	       h->count ? (double)h->sum_us / h->count : 0.0,
+	       (unsigned long long)h->max_us);
+
+	if (stats.pdus_out[0x01] < ios ||
+	    stats.scsi_status[ISCSI_STATS_GOOD] < ios ||
+	    stats.wire_to_response[0x01].count < ios ||
+	    stats.submit_to_wire[0x01].count < stats.wire_to_response[0x01].count ||
+	    stats.queue_wait[0x01].count != stats.submit_to_wire[0x01].count ||
+	    stats.queue_wait[0x01].sum_us > stats.submit_to_wire[0x01].sum_us) {
+		fprintf(stderr, "command counters do not match the %llu I/Os\n",
+			(unsigned long long)ios);
+		return -1;
+	}
+	if (io->write ? bytes_out < bytes : bytes_in < bytes) {
+		fprintf(stderr, "byte counters do not match the %llu bytes "
+			"transferred\n", (unsigned long long)bytes);
+		return -1;
+	}
+	if (stats.waitpdu_depth || stats.outqueue_depth || stats.pending_depth) {
+		fprintf(stderr, "queues are not empty after the run\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int num_timed;
+
+static int check_timing(struct iscsi_context *iscsi, struct scsi_task *task,
+			void *private_data _U_)
+{
+	struct scsi_task_timing timing;
+
+	if (iscsi_get_task_timing(iscsi, task, &timing) != 0 ||
+	    timing.queued_ns == 0) {
+		fprintf(stderr, "task has no timestamps\n");
+		return -1;
+	}
+	if (timing.write_start_ns < timing.queued_ns ||
+	    timing.written_ns < timing.write_start_ns ||
+	    timing.response_ns < timing.written_ns) {
+		fprintf(stderr, "task timestamps are out of order\n");
+		return -1;
+	}
+	num_timed++;
+	return 0;
+}
+
+static int stats_run(struct iscsi_context *iscsi,
+		     const struct loopback_client_io *io)
+{
+	iscsi_reset_stats(iscsi);
+	iscsi_set_stats_latency(iscsi, 1);
+	num_timed = 0;
+	if (loopback_client_run_io(iscsi, io) != 0) {
+		return -1;
+	}
+	if (num_timed != io->count) {
+		fprintf(stderr, "%d of %d tasks had timestamps\n",
+			num_timed, io->count);
+		return -1;
+	}
+	return check_stats(iscsi, io);
+}
+
+int main(void)
+{
+	struct loopback_target *target;
+	struct iscsi_context *iscsi;
+	struct loopback_client_io reads = {
+		0, 8, 512, STATS_TEST_BLOCKS, 32, 4096, check_timing, NULL
+	};
+	struct loopback_client_io writes = {
+		1, 256, 512, STATS_TEST_BLOCKS, 32, 512, check_timing, NULL
+	};
+	char portal[64];
+
+	target = loopback_target_create(LOOPBACK_TARGET_IQN,
+					STATS_TEST_BLOCKS, 512);
+	if (target == NULL) {
+		fprintf(stderr, "Failed to create target\n");
+		exit(10);
+	}
+	/* every write waits for R2Ts of at most 16 KiB */
+	loopback_target_set_initial_r2t(target, 1);
+	loopback_target_set_immediate_data(target, 0);
+	loopback_target_set_max_burst_length(target, 16384);
+	if (loopback_client_start_target(target, portal,
+					 sizeof(portal)) != 0) {
+		exit(10);
+	}
+
+	iscsi = loopback_client_connect(initiator, portal);
+	if (iscsi == NULL) {
+		exit(10);
+	}
+	if (stats_run(iscsi, &reads) != 0 || stats_run(iscsi, &writes) != 0) {
+		exit(10);
+	}
+	loopback_client_disconnect(iscsi);
+	loopback_target_destroy(target);
+	return 0;
+}
@@ -0,0 +1,151 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+#include "loopback-target.h"
+#include "loopback-client.h"
+
+/*
+ * Queue NORMAL and HIGH priority commands while the target only allows
+ * one command at a time, and check the order they are dispatched in.
+ * With a window of one command they complete in that order too.
+ */
+
+const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:prog-task-priority";
+
+#define PRIORITY_TASKS 6
+
+static char priority_order[2 * PRIORITY_TASKS + 2];
+static int num_priority_done;
+
+static void priority_cb(struct iscsi_context *iscsi, int status,
+			void *command_data, void *private_data)
+{
+	struct scsi_task *task = command_data;
+
+	if (status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "command failed: %s\n",
+			iscsi_get_error(iscsi));
+		priority_order[num_priority_done++] = '!';
+	} else {
+		priority_order[num_priority_done++] =
+			(char)(intptr_t)private_data;
+	}
+	scsi_free_scsi_task(task);
+}
+
+static int priority_session(const char *portal, int limit,
+			    const char *expected)
+{
+	struct iscsi_context *iscsi;
+	int i, ret = -1;
+
+	iscsi = loopback_client_connect(initiator, portal);
+	if (iscsi == NULL) {
+		return -1;
+	}
+	if (iscsi_set_task_starvation_limit(iscsi, limit) != 0) {
+		goto failed;
+	}
+
+	/* the first NORMAL command takes the window, the rest wait */
+	memset(priority_order, 0, sizeof(priority_order));
+	num_priority_done = 0;
+	for (i = 0; i <= PRIORITY_TASKS; i++) {
+		if (iscsi_testunitready_task(iscsi, 0, priority_cb,
+					     (void *)(intptr_t)('a' + i))
+		    == NULL) {
+			goto failed;
+		}
+	}
+	iscsi_set_task_priority(iscsi, ISCSI_TASK_PRIORITY_HIGH);
+	for (i = 0; i < PRIORITY_TASKS; i++) {
+		if (iscsi_testunitready_task(iscsi, 0, priority_cb,
+					     (void *)(intptr_t)('A' + i))
+		    == NULL) {
+			goto failed;
+		}
+	}
+	iscsi_set_task_priority(iscsi, ISCSI_TASK_PRIORITY_NORMAL);
+
+	if (loopback_client_wait(iscsi, &num_priority_done,
+				 2 * PRIORITY_TASKS + 1) != 0) {
+		goto finished;
+	}
+	if (strcmp(priority_order, expected)) {
+		fprintf(stderr, "starvation limit %d: commands completed in "
+			"the order %s instead of %s\n", limit,
+			priority_order, expected);
+		goto finished;
+	}
+	printf("starvation limit %d: %s\n", limit, priority_order);
+	ret = 0;
+	goto finished;
+
+failed:
+	fprintf(stderr, "priority session failed: %s\n",
+		iscsi_get_error(iscsi));
+finished:
+	loopback_client_disconnect(iscsi);
+	return ret;
+}
+
+static int check_priority(const char *portal)
+{
+	/* one NORMAL command after every two HIGH ones */
+	if (priority_session(portal, 2, "aABbCDcEFdefg") != 0) {
+		return -1;
+	}
+	/* HIGH priority commands always go first */
+	if (priority_session(portal, 0, "aABCDEFbcdefg") != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+int main(void)
+{
+	struct loopback_target *target;
+	char portal[64];
+
+	target = loopback_target_create(LOOPBACK_TARGET_IQN, 1024, 512);
+	if (target == NULL) {
+		fprintf(stderr, "Failed to create target\n");
+		exit(10);
+	}
+	loopback_target_set_cmdsn_window(target, 1);
+	if (loopback_client_start_target(target, portal,
+					 sizeof(portal)) != 0) {
+		exit(10);
+	}
+
+	if (check_priority(portal) != 0) {
+		exit(10);
+	}
+	loopback_target_destroy(target);
+	return 0;
+}
@@ -0,0 +1,182 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+#include "loopback-target.h"
+#include "loopback-client.h"
+
+/*
+ * Run reads, and writes that wait for R2Ts, with a trace callback set
+ * and check the events of each run.
+ */
+
+const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:prog-trace";
+
+#define TRACE_TEST_BLOCKS (64 * 2048)
+
+/*
+ * Follow every SCSI command through the tracepoints and check that it is
+ * submitted, sent and completed in that order.
+ */
+#define TRACE_SLOTS 4096
+
+struct trace_state {
+	uint64_t events[ISCSI_TRACE_TASK_CALLBACK + 1];
+	struct {
+		uint32_t itt;
+		uint64_t submit_ns;
+		int sent;
+	} cmds[TRACE_SLOTS];
+	int errors;
+};
+
+static struct trace_state trace;
+
+static void trace_cb(struct iscsi_context *iscsi _U_,
+		     const struct iscsi_trace_event *event,
+		     void *private_data)
+{
+	struct trace_state *t = private_data;
+	int slot = event->itt % TRACE_SLOTS;
+
+	t->events[event->point]++;
+	switch (event->point) {
+	case ISCSI_TRACE_TASK_SUBMIT:
+		t->cmds[slot].itt = event->itt;
+		t->cmds[slot].submit_ns = event->time_ns;
+		t->cmds[slot].sent = 0;
+		break;
+	case ISCSI_TRACE_PDU_LAST_BYTE:
+		if (event->opcode == 0x01 && t->cmds[slot].itt == event->itt) {
+			t->cmds[slot].sent = 1;
+		}
+		break;
+	case ISCSI_TRACE_TASK_CALLBACK:
+		if (t->cmds[slot].itt != event->itt ||
+		    t->cmds[slot].submit_ns == 0 ||
+		    t->cmds[slot].submit_ns > event->time_ns ||
+		    (event->status == SCSI_STATUS_GOOD && !t->cmds[slot].sent)) {
+			fprintf(stderr, "itt %08x completed out of order\n",
+				event->itt);
+			t->errors++;
+		}
+		t->cmds[slot].submit_ns = 0;
+		break;
+	default:
+		break;
+	}
+}
+
+static int check_trace(const struct loopback_client_io *io)
+{
+	uint64_t *e = trace.events;
+	uint64_t ios = io->count;
+
+	printf("trace: %llu submitted, %llu queued, %llu first bytes, "
+	       "%llu last bytes, %llu headers, %llu data placed, "
+	       "%llu callbacks\n",
+	       (unsigned long long)e[ISCSI_TRACE_TASK_SUBMIT],
+	       (unsigned long long)e[ISCSI_TRACE_PDU_QUEUED],
+	       (unsigned long long)e[ISCSI_TRACE_PDU_FIRST_BYTE],
+	       (unsigned long long)e[ISCSI_TRACE_PDU_LAST_BYTE],
+	       (unsigned long long)e[ISCSI_TRACE_PDU_HEADER_RECEIVED],
+	       (unsigned long long)e[ISCSI_TRACE_PDU_DATA_PLACED],
+	       (unsigned long long)e[ISCSI_TRACE_TASK_CALLBACK]);
+
+	if (trace.errors) {
+		return -1;
+	}
+	if (e[ISCSI_TRACE_TASK_SUBMIT] != ios ||
+	    e[ISCSI_TRACE_TASK_CALLBACK] != ios ||
+	    e[ISCSI_TRACE_PDU_QUEUED] < ios ||
+	    e[ISCSI_TRACE_PDU_FIRST_BYTE] != e[ISCSI_TRACE_PDU_LAST_BYTE] ||
+	    e[ISCSI_TRACE_PDU_LAST_BYTE] < ios ||
+	    e[ISCSI_TRACE_PDU_HEADER_RECEIVED] < ios) {
+		fprintf(stderr, "trace events do not match the %llu I/Os\n",
+			(unsigned long long)ios);
+		return -1;
+	}
+	if (!io->write && e[ISCSI_TRACE_PDU_DATA_PLACED] < ios) {
+		fprintf(stderr, "no data placed for some of the reads\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int trace_run(struct iscsi_context *iscsi,
+		     const struct loopback_client_io *io)
+{
+	int ret;
+
+	memset(&trace, 0, sizeof(trace));
+	iscsi_set_trace_callback(iscsi, trace_cb, &trace);
+	ret = loopback_client_run_io(iscsi, io);
+	iscsi_set_trace_callback(iscsi, NULL, NULL);
+	if (ret != 0) {
+		return -1;
+	}
+	return check_trace(io);
+}
+
+int main(void)
+{
+	struct loopback_target *target;
+	struct iscsi_context *iscsi;
+	struct loopback_client_io reads = {
+		0, 8, 512, TRACE_TEST_BLOCKS, 32, 4096, NULL, NULL
+	};
+	struct loopback_client_io writes = {
+		1, 256, 512, TRACE_TEST_BLOCKS, 32, 512, NULL, NULL
+	};
+	char portal[64];
+
+	target = loopback_target_create(LOOPBACK_TARGET_IQN,
+					TRACE_TEST_BLOCKS, 512);
+	if (target == NULL) {
+		fprintf(stderr, "Failed to create target\n");
+		exit(10);
+	}
+	/* every write waits for R2Ts of at most 16 KiB */
+	loopback_target_set_initial_r2t(target, 1);
+	loopback_target_set_immediate_data(target, 0);
+	loopback_target_set_max_burst_length(target, 16384);
+	if (loopback_client_start_target(target, portal,
+					 sizeof(portal)) != 0) {
+		exit(10);
+	}
+
+	iscsi = loopback_client_connect(initiator, portal);
+	if (iscsi == NULL) {
+		exit(10);
+	}
+	if (trace_run(iscsi, &reads) != 0 || trace_run(iscsi, &writes) != 0) {
+		exit(10);
+	}
+	loopback_client_disconnect(iscsi);
+	loopback_target_destroy(target);
+	return 0;
+}
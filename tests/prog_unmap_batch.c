@@ -0,0 +1,267 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+#include "loopback-target.h"
+#include "loopback-client.h"
+
+/*
+ * Queue overlapping, adjacent and scattered UNMAP ranges in a batch
+ * against a target that limits UNMAP to 64 blocks and 4 descriptors in
+ * granules of 8 blocks aligned at block 4, and check how the batch was
+ * merged and cut into commands. All the extents start on a granule so
+ * every descriptor has to.
+ */
+
+const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:prog-unmap-batch";
+
+#define UNMAP_TEST_BLOCKS 1024
+
+static const struct {
+	uint64_t lba;
+	uint32_t num;
+} unmap_ranges[] = {
+	{604, 1}, {4, 10}, {612, 1}, {9, 11}, {620, 1}, {100, 150},
+	{628, 1}, {20, 4}, {636, 1}, {200, 100}, {644, 1}, {404, 3},
+	{412, 1}, {120, 30}
+};
+#define NUM_UNMAP_RANGES (int)(sizeof(unmap_ranges) / sizeof(unmap_ranges[0]))
+
+/*
+ * The merged extents are [4,24) [100,300) [404,407) [412,413) and six
+ * single blocks from 604. The first command takes [4,24) and cuts
+ * [100,300) on the granule boundary at 140, the next two take 64 blocks
+ * each, and the single blocks fill the rest four descriptors at a time.
+ */
+#define UNMAP_COMMANDS		6
+#define UNMAP_DESCRIPTORS	13
+#define UNMAP_BLOCKS		230
+
+static int unmap_status[NUM_UNMAP_RANGES];
+static int num_unmap_done;
+
+static void unmap_range_cb(struct iscsi_context *iscsi _U_, int status,
+			   void *command_data _U_, void *private_data)
+{
+	unmap_status[(intptr_t)private_data] = status;
+	num_unmap_done++;
+}
+
+static int unmap_is_unmapped(uint64_t lba)
+{
+	int i;
+
+	for (i = 0; i < NUM_UNMAP_RANGES; i++) {
+		if (lba >= unmap_ranges[i].lba &&
+		    lba < unmap_ranges[i].lba + unmap_ranges[i].num) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int check_unmap(struct loopback_target *target, const char *portal)
+{
+	struct loopback_target_counters counters;
+	struct iscsi_context *iscsi;
+	struct iscsi_unmap_batch *batch = NULL;
+	struct scsi_task *task = NULL;
+	unsigned char *buf;
+	uint64_t lba;
+	int i, ret = -1;
+
+	buf = malloc(UNMAP_TEST_BLOCKS * 512);
+	if (buf == NULL) {
+		fprintf(stderr, "Failed to allocate buffer\n");
+		return -1;
+	}
+	iscsi = loopback_client_create(initiator);
+	if (iscsi == NULL) {
+		free(buf);
+		return -1;
+	}
+	/* caches the Block Limits VPD that the batch picks the limits from */
+	iscsi_set_split_io(iscsi, 1, 0);
+	if (loopback_client_login(iscsi, portal) != 0) {
+		iscsi_destroy_context(iscsi);
+		free(buf);
+		return -1;
+	}
+
+	memset(buf, 0xa5, UNMAP_TEST_BLOCKS * 512);
+	task = iscsi_write16_sync(iscsi, 0, 0, buf, UNMAP_TEST_BLOCKS * 512,
+				  512, 0, 0, 0, 0, 0);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		goto failed;
+	}
+	scsi_free_scsi_task(task);
+	task = NULL;
+
+	batch = iscsi_unmap_batch_create(iscsi, 0, NULL);
+	if (batch == NULL) {
+		goto failed;
+	}
+
+	/* ranges that are never submitted are cancelled */
+	num_unmap_done = 0;
+	for (i = 0; i < 2; i++) {
+		if (iscsi_unmap_batch_add(batch, 900 + i, 1, unmap_range_cb,
+					  (void *)(intptr_t)i) != 0) {
+			goto failed;
+		}
+	}
+	if (iscsi_unmap_batch_pending(batch) != 2) {
+		fprintf(stderr, "%d ranges pending instead of 2\n",
+			iscsi_unmap_batch_pending(batch));
+		goto finished;
+	}
+	iscsi_unmap_batch_destroy(batch);
+	batch = NULL;
+	if (num_unmap_done != 2 || unmap_status[0] != SCSI_STATUS_CANCELLED
+	    || unmap_status[1] != SCSI_STATUS_CANCELLED) {
+		fprintf(stderr, "unsubmitted ranges were not cancelled\n");
+		goto finished;
+	}
+
+	batch = iscsi_unmap_batch_create(iscsi, 0, NULL);
+	if (batch == NULL) {
+		goto failed;
+	}
+	num_unmap_done = 0;
+	for (i = 0; i < NUM_UNMAP_RANGES; i++) {
+		unmap_status[i] = -1;
+		if (iscsi_unmap_batch_add(batch, unmap_ranges[i].lba,
+					  unmap_ranges[i].num, unmap_range_cb,
+					  (void *)(intptr_t)i) != 0) {
+			goto failed;
+		}
+	}
+	if (iscsi_unmap_batch_pending(batch) != NUM_UNMAP_RANGES) {
+		fprintf(stderr, "%d ranges pending instead of %d\n",
+			iscsi_unmap_batch_pending(batch), NUM_UNMAP_RANGES);
+		goto finished;
+	}
+	if (iscsi_unmap_batch_submit(batch) != 0) {
+		goto failed;
+	}
+	if (iscsi_unmap_batch_pending(batch) != 0) {
+		fprintf(stderr, "%d ranges pending after submit\n",
+			iscsi_unmap_batch_pending(batch));
+		goto finished;
+	}
+
+	if (loopback_client_wait(iscsi, &num_unmap_done,
+				 NUM_UNMAP_RANGES) != 0) {
+		goto finished;
+	}
+	for (i = 0; i < NUM_UNMAP_RANGES; i++) {
+		if (unmap_status[i] != SCSI_STATUS_GOOD) {
+			fprintf(stderr, "unmap of %d blocks at lba %llu "
+				"completed with status %d\n",
+				unmap_ranges[i].num,
+				(unsigned long long)unmap_ranges[i].lba,
+				unmap_status[i]);
+			goto finished;
+		}
+	}
+
+	loopback_target_get_counters(target, &counters);
+	if (counters.unmap_commands != UNMAP_COMMANDS ||
+	    counters.unmap_descriptors != UNMAP_DESCRIPTORS ||
+	    counters.unmap_blocks != UNMAP_BLOCKS) {
+		fprintf(stderr, "%llu commands with %llu descriptors for "
+			"%llu blocks instead of %d with %d for %d\n",
+			(unsigned long long)counters.unmap_commands,
+			(unsigned long long)counters.unmap_descriptors,
+			(unsigned long long)counters.unmap_blocks,
+			UNMAP_COMMANDS, UNMAP_DESCRIPTORS, UNMAP_BLOCKS);
+		goto finished;
+	}
+	if (counters.unmap_unaligned) {
+		fprintf(stderr, "%llu descriptors were not cut on a granule\n",
+			(unsigned long long)counters.unmap_unaligned);
+		goto finished;
+	}
+
+	task = iscsi_read16_sync(iscsi, 0, 0, UNMAP_TEST_BLOCKS * 512, 512,
+				 0, 0, 0, 0, 0);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD ||
+	    task->datain.size != UNMAP_TEST_BLOCKS * 512) {
+		goto failed;
+	}
+	for (lba = 0; lba < UNMAP_TEST_BLOCKS; lba++) {
+		unsigned char expected = unmap_is_unmapped(lba) ? 0 : 0xa5;
+
+		for (i = 0; i < 512; i++) {
+			if (task->datain.data[lba * 512 + i] != expected) {
+				fprintf(stderr, "block %llu was %sunmapped\n",
+					(unsigned long long)lba,
+					expected ? "" : "not ");
+				goto finished;
+			}
+		}
+	}
+	printf("unmap: %d ranges in %d commands with %d descriptors\n",
+	       NUM_UNMAP_RANGES, UNMAP_COMMANDS, UNMAP_DESCRIPTORS);
+	ret = 0;
+	goto finished;
+
+failed:
+	fprintf(stderr, "unmap session failed: %s\n", iscsi_get_error(iscsi));
+finished:
+	if (task != NULL) {
+		scsi_free_scsi_task(task);
+	}
+	iscsi_unmap_batch_destroy(batch);
+	loopback_client_disconnect(iscsi);
+	free(buf);
+	return ret;
+}
+
+int main(void)
+{
+	struct loopback_target *target;
+	char portal[64];
+
+	target = loopback_target_create(LOOPBACK_TARGET_IQN,
+					UNMAP_TEST_BLOCKS, 512);
+	if (target == NULL) {
+		fprintf(stderr, "Failed to create target\n");
+		exit(10);
+	}
+	loopback_target_set_unmap_limits(target, 64, 4, 8, 4);
+	if (loopback_client_start_target(target, portal,
+					 sizeof(portal)) != 0) {
+		exit(10);
+	}
+
+	if (check_unmap(target, portal) != 0) {
+		exit(10);
+	}
+	loopback_target_destroy(target);
+	return 0;
+}
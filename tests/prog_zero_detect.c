@@ -0,0 +1,190 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+#include "loopback-target.h"
+#include "loopback-client.h"
+
+/*
+ * Write a buffer with runs of zero blocks with zero detection enabled
+ * against a target that allows WRITE SAME16 of at most 16 blocks, read
+ * it back and check how the zero runs were sent. The blocks that are
+ * not zero have a single byte set, at a different place in each.
+ */
+
+const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:prog-zero-detect";
+
+#define ZERO_TEST_BLOCKS	128
+#define ZERO_MIN_BLOCKS		8
+#define ZERO_MAX_WRITE_SAME	16
+
+static const struct {
+	uint32_t start;
+	uint32_t num;
+} zero_runs[] = {
+	/* 16 + 16 + 5 */
+	{4, 37},
+	/* too short, written as data */
+	{42, 4},
+	/* 16 + 12 at the end of the write */
+	{100, 28}
+};
+#define NUM_ZERO_RUNS (int)(sizeof(zero_runs) / sizeof(zero_runs[0]))
+
+#define ZERO_WRITE_SAMES	5
+#define ZERO_WRITE_SAME_BLOCKS	(37 + 28)
+
+static int zero_block(uint32_t blk)
+{
+	int i;
+
+	for (i = 0; i < NUM_ZERO_RUNS; i++) {
+		if (blk >= zero_runs[i].start &&
+		    blk < zero_runs[i].start + zero_runs[i].num) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int check_zero_detect(struct loopback_target *target,
+			     const char *portal)
+{
+	struct loopback_target_counters counters;
+	struct iscsi_context *iscsi;
+	struct scsi_task *task = NULL;
+	unsigned char *buf;
+	uint32_t blk;
+	int ret = -1;
+
+	buf = malloc(ZERO_TEST_BLOCKS * 512);
+	if (buf == NULL) {
+		fprintf(stderr, "Failed to allocate buffer\n");
+		return -1;
+	}
+	iscsi = loopback_client_create(initiator);
+	if (iscsi == NULL) {
+		free(buf);
+		return -1;
+	}
+	if (iscsi_set_zero_detect(iscsi, ZERO_MIN_BLOCKS) != 0) {
+		goto failed;
+	}
+	if (loopback_client_login(iscsi, portal) != 0) {
+		goto finished;
+	}
+
+	/* start from blocks that are not zero */
+	memset(buf, 0xa5, ZERO_TEST_BLOCKS * 512);
+	task = iscsi_write16_sync(iscsi, 0, 0, buf, ZERO_TEST_BLOCKS * 512,
+				  512, 0, 0, 0, 0, 0);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		goto failed;
+	}
+	scsi_free_scsi_task(task);
+	task = NULL;
+
+	memset(buf, 0, ZERO_TEST_BLOCKS * 512);
+	for (blk = 0; blk < ZERO_TEST_BLOCKS; blk++) {
+		if (!zero_block(blk)) {
+			buf[blk * 512 + (blk * 37) % 512] = 0x01;
+		}
+	}
+	task = iscsi_write16_sync(iscsi, 0, 0, buf, ZERO_TEST_BLOCKS * 512,
+				  512, 0, 0, 0, 0, 0);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		goto failed;
+	}
+	scsi_free_scsi_task(task);
+
+	loopback_target_get_counters(target, &counters);
+	if (counters.write_same_commands != ZERO_WRITE_SAMES ||
+	    counters.write_same_blocks != ZERO_WRITE_SAME_BLOCKS ||
+	    counters.write_same_unmap != ZERO_WRITE_SAMES) {
+		fprintf(stderr, "%llu WRITE SAME16 for %llu blocks, %llu of "
+			"them unmapping, instead of %d for %d\n",
+			(unsigned long long)counters.write_same_commands,
+			(unsigned long long)counters.write_same_blocks,
+			(unsigned long long)counters.write_same_unmap,
+			ZERO_WRITE_SAMES, ZERO_WRITE_SAME_BLOCKS);
+		task = NULL;
+		goto finished;
+	}
+
+	task = iscsi_read16_sync(iscsi, 0, 0, ZERO_TEST_BLOCKS * 512, 512,
+				 0, 0, 0, 0, 0);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD ||
+	    task->datain.size != ZERO_TEST_BLOCKS * 512) {
+		goto failed;
+	}
+	for (blk = 0; blk < ZERO_TEST_BLOCKS; blk++) {
+		if (memcmp(&task->datain.data[blk * 512], &buf[blk * 512],
+			   512)) {
+			fprintf(stderr, "block %u reads back wrong\n", blk);
+			goto finished;
+		}
+	}
+	printf("zero detect: %d zero runs sent as %d WRITE SAME16\n",
+	       NUM_ZERO_RUNS, ZERO_WRITE_SAMES);
+	ret = 0;
+	goto finished;
+
+failed:
+	fprintf(stderr, "zero detect session failed: %s\n",
+		iscsi_get_error(iscsi));
+finished:
+	if (task != NULL) {
+		scsi_free_scsi_task(task);
+	}
+	loopback_client_disconnect(iscsi);
+	free(buf);
+	return ret;
+}
+
+int main(void)
+{
+	struct loopback_target *target;
+	char portal[64];
+
+	target = loopback_target_create(LOOPBACK_TARGET_IQN,
+					ZERO_TEST_BLOCKS, 512);
+	if (target == NULL) {
+		fprintf(stderr, "Failed to create target\n");
+		exit(10);
+	}
+	loopback_target_set_max_write_same_length(target, ZERO_MAX_WRITE_SAME);
+	if (loopback_client_start_target(target, portal,
+					 sizeof(portal)) != 0) {
+		exit(10);
+	}
+
+	if (check_zero_detect(target, portal) != 0) {
+		exit(10);
+	}
+	loopback_target_destroy(target);
+	return 0;
+}
@@ -0,0 +1,33 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Loopback target tests"
+
+if [ ! -x ./prog_loopback_bench ]; then
+    echo "prog_loopback_bench was not built, skipping"
+    exit 0
+fi
+
+echo -n "Test reads from the loopback target ... "
+./prog_loopback_bench -t 1 -b 64 -M 8192 > /dev/null || failure
+success
+
+echo -n "Test writes with immediate and unsolicited data ... "
+./prog_loopback_bench -t 1 -w -b 256 -M 8192 -F 16384 -B 32768 > /dev/null || failure
+success
+
+echo -n "Test writes with InitialR2T=Yes and ImmediateData=No ... "
+./prog_loopback_bench -t 1 -w -b 256 -I -N -B 16384 > /dev/null || failure
+success
+
+echo -n "Test writes sent as many Data-Out segments per burst ... "
+./prog_loopback_bench -t 1 -w -b 256 -M 4096 -F 65536 -B 65536 > /dev/null || failure
+./prog_loopback_bench -t 1 -w -b 256 -I -N -M 4096 -B 65536 > /dev/null || failure
+success
+
+echo -n "Test random reads with a response delay ... "
+./prog_loopback_bench -t 1 -r -d 200 > /dev/null || failure
+success
+
+exit 0
@@ -0,0 +1,16 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Task priority tests"
+
+if [ ! -x ./prog_task_priority ]; then
+    echo "prog_task_priority was not built, skipping"
+    exit 0
+fi
+
+echo -n "Test task priorities and the starvation limit ... "
+./prog_task_priority > /dev/null || failure
+success
+
+exit 0
@@ -0,0 +1,16 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Batched UNMAP tests"
+
+if [ ! -x ./prog_unmap_batch ]; then
+    echo "prog_unmap_batch was not built, skipping"
+    exit 0
+fi
+
+echo -n "Test batched UNMAP against the Block Limits ... "
+./prog_unmap_batch > /dev/null || failure
+success
+
+exit 0
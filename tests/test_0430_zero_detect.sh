@@ -0,0 +1,16 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Zero detection tests"
+
+if [ ! -x ./prog_zero_detect ]; then
+    echo "prog_zero_detect was not built, skipping"
+    exit 0
+fi
+
+echo -n "Test zero runs in writes sent as WRITE SAME16 ... "
+./prog_zero_detect > /dev/null || failure
+success
+
+exit 0
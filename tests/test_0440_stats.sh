@@ -0,0 +1,16 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Statistics tests"
+
+if [ ! -x ./prog_stats ]; then
+    echo "prog_stats was not built, skipping"
+    exit 0
+fi
+
+echo -n "Test statistics counters for reads and writes with R2Ts ... "
+./prog_stats > /dev/null || failure
+success
+
+exit 0
@@ -0,0 +1,16 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Tracepoint tests"
+
+if [ ! -x ./prog_trace ]; then
+    echo "prog_trace was not built, skipping"
+    exit 0
+fi
+
+echo -n "Test tracepoints for reads and writes with R2Ts ... "
+./prog_trace > /dev/null || failure
+success
+
+exit 0
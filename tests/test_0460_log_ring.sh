@@ -0,0 +1,16 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Log ring tests"
+
+if [ ! -x ./prog_log_ring ]; then
+    echo "prog_log_ring was not built, skipping"
+    exit 0
+fi
+
+echo -n "Test deferred logging through a log ring ... "
+./prog_log_ring > /dev/null || failure
+success
+
+exit 0
@@ -0,0 +1,17 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "pcap capture tests"
+
+if [ ! -x ./prog_pcap ]; then
+    echo "prog_pcap was not built, skipping"
+    exit 0
+fi
+
+echo -n "Test pcap capture of reads and writes with R2Ts ... "
+./prog_pcap loopback.pcap > /dev/null || failure
+rm -f loopback.pcap
+success
+
+exit 0
@@ -0,0 +1,16 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Application allocator tests"
+
+if [ ! -x ./prog_allocator ]; then
+    echo "prog_allocator was not built, skipping"
+    exit 0
+fi
+
+echo -n "Test an application allocator for reads, writes and a buffer pool ... "
+./prog_allocator > /dev/null || failure
+success
+
+exit 0
@@ -0,0 +1,16 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Buffer pool tests"
+
+if [ ! -x ./prog_buffer_pool ]; then
+    echo "prog_buffer_pool was not built, skipping"
+    exit 0
+fi
+
+echo -n "Test reads into a buffer pool ... "
+./prog_buffer_pool > /dev/null || failure
+success
+
+exit 0
@@ -0,0 +1,11 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Zero detection tests"
+
+echo -n "Test zero detection at every offset and length ... "
+./prog_is_zero > /dev/null || failure
+success
+
+exit 0
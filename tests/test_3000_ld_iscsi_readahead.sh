@@ -0,0 +1,47 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "ld_iscsi read-ahead benchmark"
+
+LD_ISCSI=../examples/ld_iscsi.so
+if [ ! -f ${LD_ISCSI} ]; then
+    echo "ld_iscsi.so not built, skipping"
+    exit 0
+fi
+
+TEST_TMP=`pwd`/ld_iscsi.out
+
+now() {
+    date +%s.%N
+}
+
+# copy the LUN through ld_iscsi in small reads, like cp does
+copy_lun() {
+    START=`now`
+    LD_PRELOAD=${LD_ISCSI} dd if=${TGTURL} of=${TEST_TMP} bs=16k 2>/dev/null || return 1
+    END=`now`
+    echo "$START $END" | awk '{ printf "%.1f MB/s ", 100 / ($2 - $1) }'
+    cmp -s ${TGTLUN} ${TEST_TMP}
+}
+
+start_target
+create_lun
+dd if=/dev/urandom of=${TGTLUN} bs=1M count=100 conv=notrunc 2>/dev/null
+
+echo -n "Copy LUN without read-ahead ... "
+copy_lun || failure
+success
+
+echo -n "Copy LUN with read-ahead of 8 x 256kb ... "
+LD_ISCSI_READAHEAD=8 LD_ISCSI_READAHEAD_SIZE=262144 copy_lun || failure
+success
+
+echo -n "Copy LUN with read-ahead of 32 x 64kb ... "
+LD_ISCSI_READAHEAD=32 LD_ISCSI_READAHEAD_SIZE=65536 copy_lun || failure
+success
+
+shutdown_target
+delete_lun
+
+exit 0
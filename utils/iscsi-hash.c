@@ -0,0 +1,663 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <poll.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+
+/*
+ * Reads a LUN over several sessions and hashes it in fixed size chunks
+ * on a pool of worker threads. The main thread only drives the iSCSI
+ * sessions, so reading and hashing overlap and whichever of the network
+ * or the CPUs is slower is kept busy. The hashes are written to a
+ * manifest that a later run can be compared against.
+ */
+
+const char *initiator = "iqn.2010-11.libiscsi:iscsi-hash";
+
+struct chunk {
+	struct chunk *next;
+	struct hash_client *client;
+	uint64_t index;
+	uint32_t size;
+	unsigned char *buf;
+	struct scsi_iovec iov;
+};
+
+struct session {
+	struct iscsi_context *iscsi;
+	int in_flight;
+};
+
+struct hash_client {
+	struct session *sessions;
+	int num_sessions;
+	int max_in_flight;
+	int lun;
+	int blocksize;
+	uint64_t num_blocks;
+	uint32_t chunk_blocks;
+	uint64_t num_chunks;
+	uint64_t next_chunk;
+	uint64_t chunks_done;
+	int next_session;
+	int err_cnt;
+
+	uint64_t *hashes;
+
+	/* buffers that are not being read into or hashed */
+	struct chunk *free_chunks;
+
+	/* read chunks waiting for a worker, and the ones that have
+	 * been hashed and whose buffers can be reused.
+	 */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct chunk *work;
+	struct chunk **work_tail;
+	struct chunk *hashed;
+	int shutdown;
+	int wakeup[2];
+};
+
+/*
+ * XXH64, see https://github.com/Cyan4973/xxHash
+ */
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+/* XXH64 is defined on little endian lanes, whatever the host is. The
+ * compiler turns these into a single load on little endian hosts.
+ */
+static inline uint32_t read32le(const unsigned char *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8)
+		| ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t read64le(const unsigned char *p)
+{
+	return (uint64_t)read32le(p) | ((uint64_t)read32le(p + 4) << 32);
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh64_round(0, val);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+static uint64_t xxh64(const unsigned char *p, size_t len, uint64_t seed)
+{
+	const unsigned char *end = p + len;
+	uint64_t h;
+
+	if (len >= 32) {
+		uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+		uint64_t v2 = seed + PRIME64_2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - PRIME64_1;
+
+		do {
+			v1 = xxh64_round(v1, read64le(p));
+			v2 = xxh64_round(v2, read64le(p + 8));
+			v3 = xxh64_round(v3, read64le(p + 16));
+			v4 = xxh64_round(v4, read64le(p + 24));
+			p += 32;
+		} while (p + 32 <= end);
+
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12)
+			+ rotl64(v4, 18);
+		h = xxh64_merge(h, v1);
+		h = xxh64_merge(h, v2);
+		h = xxh64_merge(h, v3);
+		h = xxh64_merge(h, v4);
+	} else {
+		h = seed + PRIME64_5;
+	}
+	h += len;
+
+	while (p + 8 <= end) {
+		h ^= xxh64_round(0, read64le(p));
+		h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+		p += 8;
+	}
+	if (p + 4 <= end) {
+		h ^= (uint64_t)read32le(p) * PRIME64_1;
+		h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+	}
+	while (p < end) {
+		h ^= (*p) * PRIME64_5;
+		h = rotl64(h, 11) * PRIME64_1;
+		p++;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+static void *worker(void *arg)
+{
+	struct hash_client *client = arg;
+	struct chunk *chunk;
+
+	pthread_mutex_lock(&client->mutex);
+	for (;;) {
+		while (client->work == NULL && !client->shutdown) {
+			pthread_cond_wait(&client->cond, &client->mutex);
+		}
+		if (client->work == NULL) {
+			break;
+		}
+		chunk = client->work;
+		client->work = chunk->next;
+		if (client->work == NULL) {
+			client->work_tail = &client->work;
+		}
+		pthread_mutex_unlock(&client->mutex);
+
+		/* every chunk has its own slot, so no locking is needed */
+		client->hashes[chunk->index] = xxh64(chunk->buf, chunk->size,
+						     chunk->index);
+
+		pthread_mutex_lock(&client->mutex);
+		chunk->next = client->hashed;
+		client->hashed = chunk;
+		if (write(client->wakeup[1], "", 1) < 0) {
+			/* the pipe is full, the main thread is awake anyway */
+		}
+	}
+	pthread_mutex_unlock(&client->mutex);
+	return NULL;
+}
+
+void fill_read_queue(struct hash_client *client);
+
+void read_cb(struct iscsi_context *iscsi, int status, void *command_data,
+	     void *private_data)
+{
+	struct chunk *chunk = private_data;
+	struct hash_client *client = chunk->client;
+	struct scsi_task *task = command_data;
+	int i;
+
+	for (i = 0; i < client->num_sessions; i++) {
+		if (client->sessions[i].iscsi == iscsi) {
+			client->sessions[i].in_flight--;
+		}
+	}
+
+	if (status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "Read16 of chunk %" PRIu64 " failed with %s\n",
+			chunk->index, iscsi_get_error(iscsi));
+		client->err_cnt++;
+		chunk->next = client->free_chunks;
+		client->free_chunks = chunk;
+		scsi_free_scsi_task(task);
+		return;
+	}
+	scsi_free_scsi_task(task);
+
+	pthread_mutex_lock(&client->mutex);
+	chunk->next = NULL;
+	*client->work_tail = chunk;
+	client->work_tail = &chunk->next;
+	pthread_cond_signal(&client->cond);
+	pthread_mutex_unlock(&client->mutex);
+
+	fill_read_queue(client);
+}
+
+/* Spread the reads over the sessions that have room for more */
+void fill_read_queue(struct hash_client *client)
+{
+	while (client->free_chunks != NULL && !client->err_cnt
+	       && client->next_chunk < client->num_chunks) {
+		struct session *session = NULL;
+		struct chunk *chunk;
+		struct scsi_task *task;
+		uint64_t lba;
+		int i;
+
+		for (i = 0; i < client->num_sessions; i++) {
+			struct session *s = &client->sessions[
+				(client->next_session + i) % client->num_sessions];
+
+			if (s->in_flight < client->max_in_flight) {
+				session = s;
+				break;
+			}
+		}
+		if (session == NULL) {
+			return;
+		}
+		client->next_session = (client->next_session + i + 1)
+			% client->num_sessions;
+
+		chunk = client->free_chunks;
+		client->free_chunks = chunk->next;
+
+		chunk->index = client->next_chunk++;
+		lba = chunk->index * client->chunk_blocks;
+		chunk->size = client->chunk_blocks;
+		if (lba + chunk->size > client->num_blocks) {
+			chunk->size = client->num_blocks - lba;
+		}
+		chunk->size *= client->blocksize;
+
+		task = iscsi_read16_task(session->iscsi, client->lun, lba,
+					 chunk->size, client->blocksize,
+					 0, 0, 0, 0, 0, read_cb, chunk);
+		if (task == NULL) {
+			fprintf(stderr, "failed to send read16 command\n");
+			exit(10);
+		}
+		chunk->iov.iov_base = chunk->buf;
+		chunk->iov.iov_len  = chunk->size;
+		scsi_task_set_iov_in(task, &chunk->iov, 1);
+		session->in_flight++;
+	}
+}
+
+/* Take back the buffers of the chunks the workers are done with */
+static void collect_hashed(struct hash_client *client)
+{
+	struct chunk *chunk;
+	char buf[64];
+
+	while (read(client->wakeup[0], buf, sizeof(buf)) > 0)
+		;
+
+	pthread_mutex_lock(&client->mutex);
+	while ((chunk = client->hashed) != NULL) {
+		client->hashed = chunk->next;
+		chunk->next = client->free_chunks;
+		client->free_chunks = chunk;
+		client->chunks_done++;
+	}
+	pthread_mutex_unlock(&client->mutex);
+}
+
+static int write_manifest(struct hash_client *client, const char *file)
+{
+	FILE *fh;
+	uint64_t i;
+
+	fh = strcmp(file, "-") ? fopen(file, "w") : stdout;
+	if (fh == NULL) {
+		fprintf(stderr, "failed to open %s\n", file);
+		return -1;
+	}
+	fprintf(fh, "# iscsi-hash blocksize %d blocks %" PRIu64
+		" chunk %" PRIu32 "\n", client->blocksize, client->num_blocks,
+		client->chunk_blocks);
+	for (i = 0; i < client->num_chunks; i++) {
+		fprintf(fh, "%" PRIu64 " %016" PRIx64 "\n",
+			i * client->chunk_blocks, client->hashes[i]);
+	}
+	if (fh != stdout) {
+		fclose(fh);
+	}
+	return 0;
+}
+
+/* Compare the hashes with an earlier manifest. Returns the number of
+ * chunks that differ or -1 if the manifests can not be compared.
+ */
+static int64_t diff_manifest(struct hash_client *client, const char *file)
+{
+	FILE *fh;
+	char line[256];
+	int blocksize;
+	uint64_t num_blocks, lba, hash, i = 0;
+	uint32_t chunk_blocks;
+	int64_t differ = 0;
+
+	fh = fopen(file, "r");
+	if (fh == NULL) {
+		fprintf(stderr, "failed to open %s\n", file);
+		return -1;
+	}
+	if (fgets(line, sizeof(line), fh) == NULL
+	    || sscanf(line, "# iscsi-hash blocksize %d blocks %" SCNu64
+		      " chunk %" SCNu32, &blocksize, &num_blocks,
+		      &chunk_blocks) != 3) {
+		fprintf(stderr, "%s is not an iscsi-hash manifest\n", file);
+		fclose(fh);
+		return -1;
+	}
+	if (blocksize != client->blocksize
+	    || chunk_blocks != client->chunk_blocks) {
+		fprintf(stderr, "%s was made with a different block or chunk "
+			"size\n", file);
+		fclose(fh);
+		return -1;
+	}
+	if (num_blocks != client->num_blocks) {
+		printf("size differs: %" PRIu64 " blocks, was %" PRIu64 "\n",
+		       client->num_blocks, num_blocks);
+		differ++;
+	}
+
+	while (fgets(line, sizeof(line), fh) != NULL) {
+		if (sscanf(line, "%" SCNu64 " %" SCNx64, &lba, &hash) != 2) {
+			continue;
+		}
+		i = lba / client->chunk_blocks;
+		if (i >= client->num_chunks) {
+			break;
+		}
+		if (client->hashes[i] != hash) {
+			uint64_t end = lba + client->chunk_blocks;
+
+			if (end > client->num_blocks) {
+				end = client->num_blocks;
+			}
+			printf("lba %" PRIu64 "-%" PRIu64 " differs\n",
+			       lba, end - 1);
+			differ++;
+		}
+	}
+	fclose(fh);
+	return differ;
+}
+
+void usage(void)
+{
+	fprintf(stderr, "Usage: iscsi-hash [-i <initiator-name>] "
+		"[-s <sessions>] [-m <max_requests>] [-c <chunk_size>] "
+		"[-t <threads>] [-o <manifest>] [-d <old_manifest>] <LUN>\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	char *url = NULL;
+	const char *manifest = NULL, *old_manifest = NULL;
+	struct iscsi_url *iscsi_url;
+	struct scsi_task *task;
+	struct scsi_readcapacity16 *rc16;
+	struct hash_client client;
+	struct pollfd *pfd;
+	pthread_t *threads;
+	int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int num_buffers, chunk_size = 1024 * 1024;
+	int c, i, ret = 0;
+
+	static struct option long_options[] = {
+		{"initiator-name", required_argument,    NULL,        'i'},
+		{"sessions",       required_argument,    NULL,        's'},
+		{"max",            required_argument,    NULL,        'm'},
+		{"chunk-size",     required_argument,    NULL,        'c'},
+		{"threads",        required_argument,    NULL,        't'},
+		{"output",         required_argument,    NULL,        'o'},
+		{"diff",           required_argument,    NULL,        'd'},
+		{0, 0, 0, 0}
+	};
+	int option_index;
+
+	memset(&client, 0, sizeof(client));
+	client.num_sessions = 1;
+	client.max_in_flight = 16;
+
+	while ((c = getopt_long(argc, argv, "i:s:m:c:t:o:d:", long_options,
+			&option_index)) != -1) {
+		switch (c) {
+		case 'i':
+			initiator = optarg;
+			break;
+		case 's':
+			client.num_sessions = atoi(optarg);
+			break;
+		case 'm':
+			client.max_in_flight = atoi(optarg);
+			break;
+		case 'c':
+			chunk_size = atoi(optarg);
+			break;
+		case 't':
+			num_threads = atoi(optarg);
+			break;
+		case 'o':
+			manifest = optarg;
+			break;
+		case 'd':
+			old_manifest = optarg;
+			break;
+		default:
+			fprintf(stderr, "Unrecognized option '%c'\n\n", c);
+			usage();
+		}
+	}
+
+	if (optind != argc - 1) usage();
+	url = argv[optind];
+
+	if (client.num_sessions < 1 || client.max_in_flight < 1
+	    || num_threads < 1 || chunk_size <= 0) {
+		usage();
+	}
+	if (manifest == NULL && old_manifest == NULL) {
+		manifest = "-";
+	}
+
+	client.sessions = calloc(client.num_sessions, sizeof(struct session));
+	pfd = calloc(client.num_sessions + 1, sizeof(struct pollfd));
+	if (client.sessions == NULL || pfd == NULL) {
+		fprintf(stderr, "Out of Memory\n");
+		exit(10);
+	}
+
+	for (i = 0; i < client.num_sessions; i++) {
+		struct iscsi_context *iscsi;
+
+		iscsi = iscsi_create_context(initiator);
+		if (iscsi == NULL) {
+			fprintf(stderr, "Failed to create context\n");
+			exit(10);
+		}
+		iscsi_url = iscsi_parse_full_url(iscsi, url);
+		if (iscsi_url == NULL) {
+			fprintf(stderr, "Failed to parse URL: %s\n",
+				iscsi_get_error(iscsi));
+			exit(10);
+		}
+		iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL);
+		iscsi_set_header_digest(iscsi, ISCSI_HEADER_DIGEST_NONE_CRC32C);
+		if (iscsi_full_connect_sync(iscsi, iscsi_url->portal,
+					    iscsi_url->lun) != 0) {
+			fprintf(stderr, "Login Failed. %s\n",
+				iscsi_get_error(iscsi));
+			exit(10);
+		}
+		client.lun = iscsi_url->lun;
+		iscsi_destroy_url(iscsi_url);
+		client.sessions[i].iscsi = iscsi;
+	}
+
+	task = iscsi_readcapacity16_sync(client.sessions[0].iscsi, client.lun);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "failed to send readcapacity command\n");
+		exit(10);
+	}
+	rc16 = scsi_datain_unmarshall(task);
+	if (rc16 == NULL) {
+		fprintf(stderr, "failed to unmarshall readcapacity16 data\n");
+		exit(10);
+	}
+	client.blocksize  = rc16->block_length;
+	client.num_blocks = rc16->returned_lba + 1;
+	scsi_free_scsi_task(task);
+
+	if (chunk_size < client.blocksize) {
+		chunk_size = client.blocksize;
+	}
+	client.chunk_blocks = chunk_size / client.blocksize;
+	client.num_chunks = (client.num_blocks + client.chunk_blocks - 1)
+		/ client.chunk_blocks;
+	client.hashes = calloc(client.num_chunks, sizeof(uint64_t));
+	if (client.hashes == NULL) {
+		fprintf(stderr, "Out of Memory\n");
+		exit(10);
+	}
+
+	/* enough buffers to keep every session busy while the workers
+	 * hash the ones that have been read.
+	 */
+	num_buffers = client.num_sessions * client.max_in_flight
+		+ 2 * num_threads;
+	for (i = 0; i < num_buffers; i++) {
+		struct chunk *chunk = calloc(1, sizeof(struct chunk));
+
+		if (chunk == NULL ||
+		    (chunk->buf = malloc(client.chunk_blocks
+					 * client.blocksize)) == NULL) {
+			fprintf(stderr, "Out of Memory\n");
+			exit(10);
+		}
+		chunk->client = &client;
+		chunk->next = client.free_chunks;
+		client.free_chunks = chunk;
+	}
+
+	pthread_mutex_init(&client.mutex, NULL);
+	pthread_cond_init(&client.cond, NULL);
+	client.work_tail = &client.work;
+	if (pipe(client.wakeup) != 0) {
+		fprintf(stderr, "failed to create pipe\n");
+		exit(10);
+	}
+	fcntl(client.wakeup[0], F_SETFL, O_NONBLOCK);
+	fcntl(client.wakeup[1], F_SETFL, O_NONBLOCK);
+
+	threads = calloc(num_threads, sizeof(pthread_t));
+	if (threads == NULL) {
+		fprintf(stderr, "Out of Memory\n");
+		exit(10);
+	}
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&threads[i], NULL, worker, &client) != 0) {
+			fprintf(stderr, "failed to create thread\n");
+			exit(10);
+		}
+	}
+
+	fill_read_queue(&client);
+
+	while (client.chunks_done < client.num_chunks && !client.err_cnt) {
+		for (i = 0; i < client.num_sessions; i++) {
+			pfd[i].fd = iscsi_get_fd(client.sessions[i].iscsi);
+			pfd[i].events = iscsi_which_events(client.sessions[i].iscsi);
+		}
+		pfd[i].fd = client.wakeup[0];
+		pfd[i].events = POLLIN;
+
+		if (poll(pfd, client.num_sessions + 1, -1) < 0) {
+			continue;
+		}
+		for (i = 0; i < client.num_sessions; i++) {
+			if (iscsi_service(client.sessions[i].iscsi,
+					  pfd[i].revents) < 0) {
+				fprintf(stderr, "iscsi_service failed with : %s\n",
+					iscsi_get_error(client.sessions[i].iscsi));
+				client.err_cnt++;
+			}
+		}
+		if (pfd[i].revents) {
+			collect_hashed(&client);
+			fill_read_queue(&client);
+		}
+	}
+
+	pthread_mutex_lock(&client.mutex);
+	client.shutdown = 1;
+	pthread_cond_broadcast(&client.cond);
+	pthread_mutex_unlock(&client.mutex);
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	if (client.err_cnt) {
+		fprintf(stderr, "ABORTED!\n");
+		ret = 10;
+	} else {
+		if (manifest && write_manifest(&client, manifest) != 0) {
+			ret = 10;
+		}
+		if (old_manifest) {
+			int64_t differ = diff_manifest(&client, old_manifest);
+
+			if (differ < 0) {
+				ret = 10;
+			} else if (differ > 0 && ret == 0) {
+				ret = 1;
+			}
+		}
+	}
+
+	for (i = 0; i < client.num_sessions; i++) {
+		if (!client.err_cnt) {
+			iscsi_logout_sync(client.sessions[i].iscsi);
+		}
+		iscsi_destroy_context(client.sessions[i].iscsi);
+	}
+	while (client.free_chunks != NULL) {
+		struct chunk *chunk = client.free_chunks;
+
+		client.free_chunks = chunk->next;
+		free(chunk->buf);
+		free(chunk);
+	}
+	free(client.hashes);
+	free(client.sessions);
+	free(threads);
+	free(pfd);
+
+	return ret;
+}
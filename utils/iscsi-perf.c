@@ -15,6 +15,10 @@
    You should have received a copy of the GNU General Public License
    along with this program; if not, see <http://www.gnu.org/licenses/>.
 */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -29,6 +33,12 @@
 #include <time.h>
 #include <signal.h>
 #include <unistd.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
 #include "iscsi.h"
 #include "scsi-lowlevel.h"
 
@@ -41,40 +51,216 @@
 #define NOP_INTERVAL 5
 #define MAX_NOP_FAILURES 3
 
+/*
+ * With --verify every block that is written starts with a stamp of
+ * PATTERN_MAGIC, its lba and a generation number, followed by data from a
+ * PRNG seeded from the lba and generation, so that any block can be
+ * checked on its own when it is read back.
+ */
+#define PATTERN_MAGIC 0x6672702d69637369ULL
+#define PATTERN_HDR_WORDS 3
+#define MAX_VERIFY_REPORTS 10
+
+enum rw_mode {
+	RW_READ,
+	RW_WRITE,
+	RW_RANDRW
+};
+
+/*
+ * Completion latencies are kept in log-linear histograms in the style of
+ * HdrHistogram: every power of two is split into HIST_SUB linear buckets,
+ * so a recorded value is off by less than 1/HIST_SUB (about 3%) from the
+ * true one, and recording never allocates.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((65 - HIST_SUB_BITS) * HIST_SUB)
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+/* one line of the per-second time series */
+struct sample {
+	double t;
+	uint64_t iops;
+	uint64_t bytes;
+	uint64_t p50;
+	uint64_t p99;
+	uint64_t p999;
+	uint64_t max;
+};
+
+/*
+ * One point of a --sweep, the queue depth beyond which the IOPS grow by
+ * less than KNEE_GAIN is marked as the knee of the curve.
+ */
+#define KNEE_GAIN 1.05
+
+struct point {
+	int depth;
+	int blocks;
+	int knee;
+	double secs;
+	uint64_t ios;
+	uint64_t bytes;
+	uint64_t p50;
+	uint64_t p90;
+	uint64_t p99;
+	uint64_t p999;
+	uint64_t max;
+	uint64_t mean;
+};
+
+struct sweep {
+	int warmup;
+	int window;
+	struct point *points;
+	int num_points;
+	int cur;
+	int measuring;
+	uint64_t start_ns;
+	uint64_t start_ios;
+	uint64_t start_bytes;
+	struct histogram lat;
+};
+
 const char *initiator = "iqn.2010-11.libiscsi:iscsi-perf";
-int proc_alarm = 0;
+volatile int alarm_gen = 0;
+/* the slots and buffers allocated, queue_depth and blocks_per_io are in use */
 int max_in_flight = 32;
+int max_blocks_per_io;
+int queue_depth;
 int blocks_per_io = 8;
 uint64_t runtime = 0;
-uint64_t finished = 0;
+volatile int finished = 0;
+volatile int aborted = 0;
+
+struct client;
+
+/* one slot per request that can be in flight */
+struct io {
+	struct io *next;
+	struct client *client;
+	struct scsi_iovec iov;
+	uint64_t lba;
+	int num_blocks;
+	int write;
+	/* with --verify, the write has not completed yet */
+	int writing;
+	/* this is the read-back of a write with generation gen */
+	int verify;
+	uint64_t gen;
+	uint64_t submit_ns;
+};
 
+struct worker;
+
+/* one session, it is only ever touched by the worker that owns it */
 struct client {
-	int finished;
+	int index;
+	const char *url;
+	struct worker *worker;
 	int in_flight;
 	int random;
 	int random_blocks;
+	enum rw_mode rw;
+	int rwmix_read;
+	int fua;
+	int dpo;
+	int verify;
 
 	struct iscsi_context *iscsi;
-	struct scsi_iovec perf_iov;
+	struct io *ios;
+	struct io *free_ios;
+	uint64_t gen;
 
 	int lun;
 	int blocksize;
+	/* the session does I/O to num_blocks blocks from lba start */
+	uint64_t start;
 	uint64_t num_blocks;
 	uint64_t pos;
-	uint64_t last_ns;
-	uint64_t first_ns;
+	uint64_t rng;
 	uint64_t iops;
-	uint64_t last_iops;
 	uint64_t bytes;
-	uint64_t last_bytes;
 
 	int ignore_errors;
 	int max_reconnects;
 	int busy_cnt;
 	int err_cnt;
 	int retry_cnt;
+
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t verified;
+	uint64_t verify_errors;
+
+	/* latencies of reads and writes, and of all I/O in this second */
+	struct histogram lat[2];
+	struct histogram interval;
+};
+
+/*
+ * A worker drives the sessions it owns from an event loop of its own. With
+ * more than one worker every one of them runs in a thread and the main
+ * thread only reports, holding the mutex of a worker while it reads the
+ * counters of its sessions.
+ */
+struct worker {
+	int index;
+	int cpu;
+	int alarm_seen;
+	volatile int done;
+	struct client **clients;
+	int num_clients;
+#ifdef HAVE_PTHREAD
+	pthread_t thread;
+	pthread_mutex_t mutex;
+#endif
+};
+
+/* what is reported once a second, summed over all sessions */
+struct report {
+	uint64_t first_ns;
+	uint64_t last_ns;
+	uint64_t last_iops;
+	uint64_t last_bytes;
+	struct histogram interval;
+	struct sample *samples;
+	int num_samples;
+	int max_samples;
 };
 
+struct client **clients;
+int num_clients = 1;
+struct worker *workers;
+int num_workers = 1;
+int threaded = 0;
+struct report report;
+struct sweep sweep;
+
+static void worker_lock(struct worker *w _U_) {
+#ifdef HAVE_PTHREAD
+	if (threaded) {
+		pthread_mutex_lock(&w->mutex);
+	}
+#endif
+}
+
+static void worker_unlock(struct worker *w _U_) {
+#ifdef HAVE_PTHREAD
+	if (threaded) {
+		pthread_mutex_unlock(&w->mutex);
+	}
+#endif
+}
+
 uint64_t get_clock_ns(void) {
 	int res;
 	uint64_t ns;
@@ -95,104 +281,674 @@ uint64_t get_clock_ns(void) {
 	return ns;
 }
 
-void fill_read_queue(struct client *client);
+void fill_queue(struct client *client);
+
+static int hist_index(uint64_t v) {
+	int msb;
+
+	if (v < 2 * HIST_SUB) {
+		return v;
+	}
+#if defined(__GNUC__)
+	msb = 63 - __builtin_clzll(v);
+#else
+	for (msb = 0; v >> (msb + 1); msb++)
+		;
+#endif
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB + (int)(v >> (msb - HIST_SUB_BITS)) - HIST_SUB;
+}
+
+/* the lowest value that is recorded in bucket idx */
+static uint64_t hist_value(int idx) {
+	if (idx < 2 * HIST_SUB) {
+		return idx;
+	}
+	return (uint64_t)(HIST_SUB + idx % HIST_SUB) << (idx / HIST_SUB - 1);
+}
+
+void hist_record(struct histogram *h, uint64_t v) {
+	if (!h->count || v < h->min) {
+		h->min = v;
+	}
+	if (v > h->max) {
+		h->max = v;
+	}
+	h->count++;
+	h->sum += v;
+	h->buckets[hist_index(v)]++;
+}
+
+void hist_merge(struct histogram *dst, const struct histogram *src) {
+	int i;
+
+	if (!src->count) {
+		return;
+	}
+	if (!dst->count || src->min < dst->min) {
+		dst->min = src->min;
+	}
+	if (src->max > dst->max) {
+		dst->max = src->max;
+	}
+	dst->count += src->count;
+	dst->sum += src->sum;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		dst->buckets[i] += src->buckets[i];
+	}
+}
+
+/* the value below which pct percent of the recorded values fall */
+uint64_t hist_percentile(const struct histogram *h, double pct) {
+	uint64_t want, seen = 0;
+	int i;
+
+	if (!h->count) {
+		return 0;
+	}
+	want = (uint64_t)(pct / 100.0 * h->count + 0.5);
+	if (want < 1) {
+		want = 1;
+	}
+	for (i = 0; i < HIST_BUCKETS - 1; i++) {
+		seen += h->buckets[i];
+		if (seen >= want) {
+			break;
+		}
+	}
+	if (hist_value(i + 1) - 1 < h->max) {
+		return hist_value(i + 1) - 1;
+	}
+	return h->max;
+}
+
+static double us(uint64_t ns) {
+	return ns / 1000.0;
+}
+
+static inline uint64_t xorshift64s(uint64_t *s) {
+	*s ^= *s >> 12;
+	*s ^= *s << 25;
+	*s ^= *s >> 27;
+	return *s * 2685821657736338717ULL;
+}
+
+static uint64_t pattern_seed(uint64_t lba, uint64_t gen) {
+	return (lba * 0x9e3779b97f4a7c15ULL) ^ gen ^ 1;
+}
+
+void stamp_blocks(struct client *client, struct io *io) {
+	uint64_t *p = io->iov.iov_base;
+	int words = client->blocksize / 8;
+	int i, j;
+
+	for (i = 0; i < io->num_blocks; i++, p += words) {
+		uint64_t s = pattern_seed(io->lba + i, io->gen);
+
+		p[0] = PATTERN_MAGIC;
+		p[1] = io->lba + i;
+		p[2] = io->gen;
+		for (j = PATTERN_HDR_WORDS; j < words; j++) {
+			p[j] = xorshift64s(&s);
+		}
+	}
+}
+
+/*
+ * Check the stamp of every block that was read. Blocks without a stamp
+ * are only an error when we know that we wrote them (min_gen != 0).
+ * A newer generation than the one we wrote is fine, another request may
+ * have overwritten the block in the meantime.
+ */
+void check_blocks(struct client *client, struct io *io, uint64_t min_gen) {
+	uint64_t *p = io->iov.iov_base;
+	int words = client->blocksize / 8;
+	int i, j;
+
+	for (i = 0; i < io->num_blocks; i++, p += words) {
+		uint64_t lba = io->lba + i;
+		const char *error = NULL;
+		uint64_t s;
+
+		if (p[0] != PATTERN_MAGIC) {
+			if (!min_gen) {
+				continue;
+			}
+			error = "block is not stamped";
+		} else if (p[1] != lba) {
+			error = "block is stamped with a different lba";
+		} else if (p[2] < min_gen) {
+			error = "block holds data of an older write";
+		} else {
+			s = pattern_seed(lba, p[2]);
+			for (j = PATTERN_HDR_WORDS; j < words; j++) {
+				if (p[j] != xorshift64s(&s)) {
+					error = "block data is corrupt";
+					break;
+				}
+			}
+		}
+		client->verified++;
+		if (error == NULL) {
+			continue;
+		}
+		if (client->verify_errors++ < MAX_VERIFY_REPORTS) {
+			fprintf(stderr, "\nverify failed at lba %" PRIu64 ": %s\n", lba, error);
+		}
+		if (!client->ignore_errors) {
+			client->err_cnt++;
+		}
+	}
+}
+
+void add_sample(uint64_t now, uint64_t iops, uint64_t bytes) {
+	struct sample *sample;
+
+	if (report.num_samples == report.max_samples) {
+		int max_samples = report.max_samples ? 2 * report.max_samples : 64;
+
+		sample = realloc(report.samples, max_samples * sizeof(struct sample));
+		if (sample == NULL) {
+			fprintf(stderr, "Out of Memory\n");
+			exit(10);
+		}
+		report.samples = sample;
+		report.max_samples = max_samples;
+	}
+	sample = &report.samples[report.num_samples++];
+	sample->t     = (now - report.first_ns) / 1000000000.0;
+	sample->iops  = 1000000000ULL * (iops - report.last_iops) / (now - report.last_ns);
+	sample->bytes = 1000000000ULL * (bytes - report.last_bytes) / (now - report.last_ns);
+	sample->p50   = hist_percentile(&report.interval, 50);
+	sample->p99   = hist_percentile(&report.interval, 99);
+	sample->p999  = hist_percentile(&report.interval, 99.9);
+	sample->max   = report.interval.max;
+
+	memset(&report.interval, 0, sizeof(report.interval));
+}
+
+void sweep_start_point(uint64_t now) {
+	queue_depth = sweep.points[sweep.cur].depth;
+	blocks_per_io = sweep.points[sweep.cur].blocks;
+	sweep.measuring = 0;
+	sweep.start_ns = now;
+}
+
+/*
+ * Move the sweep along, once a second and with the workers locked. Every
+ * point first runs for the warm-up window and then for the measurement
+ * window, the I/O of the point before that is still in flight only
+ * counts towards the warm-up.
+ */
+void sweep_step(uint64_t now, uint64_t ios, uint64_t bytes) {
+	struct point *p = &sweep.points[sweep.cur];
+
+	if (!sweep.measuring) {
+		if (now - sweep.start_ns < sweep.warmup * 1000000000ULL) {
+			return;
+		}
+		sweep.measuring = 1;
+		sweep.start_ns = now;
+		sweep.start_ios = ios;
+		sweep.start_bytes = bytes;
+		memset(&sweep.lat, 0, sizeof(sweep.lat));
+		return;
+	}
+
+	hist_merge(&sweep.lat, &report.interval);
+	if (now - sweep.start_ns < sweep.window * 1000000000ULL) {
+		return;
+	}
+	p->secs  = (now - sweep.start_ns) / 1000000000.0;
+	p->ios   = ios - sweep.start_ios;
+	p->bytes = bytes - sweep.start_bytes;
+	p->p50   = hist_percentile(&sweep.lat, 50);
+	p->p90   = hist_percentile(&sweep.lat, 90);
+	p->p99   = hist_percentile(&sweep.lat, 99);
+	p->p999  = hist_percentile(&sweep.lat, 99.9);
+	p->max   = sweep.lat.max;
+	p->mean  = sweep.lat.count ? sweep.lat.sum / sweep.lat.count : 0;
+
+	if (++sweep.cur == sweep.num_points) {
+		finished = 1;
+		return;
+	}
+	sweep_start_point(now);
+}
 
-void progress(struct client *client) {
+/*
+ * Called from the completion callback when there is a single worker and
+ * from the main thread otherwise.
+ */
+void progress(void) {
 	uint64_t now = get_clock_ns();
-	if (now - client->last_ns < 1000000000ULL) return;
+	uint64_t iops = 0, bytes = 0;
+	int in_flight = 0, busy_cnt = 0;
+	int i;
+
+	if (now - report.last_ns < 1000000000ULL) return;
+
+	for (i = 0; i < num_workers; i++) {
+		worker_lock(&workers[i]);
+	}
+	for (i = 0; i < num_clients; i++) {
+		struct client *client = clients[i];
+
+		iops += client->iops;
+		bytes += client->bytes;
+		in_flight += client->in_flight;
+		busy_cnt += client->busy_cnt;
+		hist_merge(&report.interval, &client->interval);
+		memset(&client->interval, 0, sizeof(client->interval));
+	}
+	if (sweep.num_points && sweep.cur < sweep.num_points) {
+		sweep_step(now, iops, bytes);
+	}
+	for (i = 0; i < num_workers; i++) {
+		worker_unlock(&workers[i]);
+	}
 
-	uint64_t _runtime = (now - client->first_ns) / 1000000000ULL;
+	uint64_t _runtime = (now - report.first_ns) / 1000000000ULL;
 	if (runtime) _runtime = runtime - _runtime;
 
 	printf ("\r");
-	uint64_t aiops = 1000000000.0 * (client->iops) / (now - client->first_ns);
-	uint64_t ambps = 1000000000.0 * (client->bytes) / (now - client->first_ns);
+	uint64_t aiops = 1000000000.0 * iops / (now - report.first_ns);
+	uint64_t ambps = 1000000000.0 * bytes / (now - report.first_ns);
 	if (!_runtime) {
 		finished = 1;
-		printf ("iops average %" PRIu64 " (%" PRIu64 " MB/s)                                                        ", aiops, (aiops * blocks_per_io * client->blocksize) >> 20);
+		printf ("iops average %" PRIu64 " (%" PRIu64 " MB/s)                                                        ", aiops, ambps >> 20);
 	} else {
-		uint64_t iops = 1000000000ULL * (client->iops - client->last_iops) / (now - client->last_ns);
-		uint64_t mbps = 1000000000ULL * (client->bytes - client->last_bytes) / (now - client->last_ns);
+		uint64_t ciops = 1000000000ULL * (iops - report.last_iops) / (now - report.last_ns);
+		uint64_t mbps = 1000000000ULL * (bytes - report.last_bytes) / (now - report.last_ns);
 		printf ("%02" PRIu64 ":%02" PRIu64 ":%02" PRIu64 " - ", _runtime / 3600, (_runtime % 3600) / 60, _runtime % 60);
-		printf ("lba %" PRIu64 ", iops current %" PRIu64 " (%" PRIu64 " MB/s), ", client->pos, iops, mbps >> 20);
-		printf ("iops average %" PRIu64 " (%" PRIu64 " MB/s), in_flight %d, busy %d        ", aiops, ambps >> 20, client->in_flight, client->busy_cnt);
+		if (sweep.num_points && sweep.cur < sweep.num_points) {
+			printf ("point %d/%d qd %d blocks %d %s, ", sweep.cur + 1, sweep.num_points,
+			        queue_depth, blocks_per_io, sweep.measuring ? "measuring" : "warm-up");
+		}
+		if (num_clients == 1) {
+			printf ("lba %" PRIu64 ", ", clients[0]->start + clients[0]->pos);
+		}
+		printf ("iops current %" PRIu64 " (%" PRIu64 " MB/s), ", ciops, mbps >> 20);
+		printf ("iops average %" PRIu64 " (%" PRIu64 " MB/s), in_flight %d, busy %d, ", aiops, ambps >> 20, in_flight, busy_cnt);
+		printf ("latency p50 %.0f p99 %.0f p99.9 %.0f max %.0f us        ",
+		        us(hist_percentile(&report.interval, 50)), us(hist_percentile(&report.interval, 99)),
+		        us(hist_percentile(&report.interval, 99.9)), us(report.interval.max));
 	}
 	fflush(stdout);
-	client->last_ns = now;
-	client->last_iops = client->iops;
-	client->last_bytes = client->bytes;
+	add_sample(now, iops, bytes);
+	report.last_ns = now;
+	report.last_iops = iops;
+	report.last_bytes = bytes;
 }
 
-void cb(struct iscsi_context *iscsi _U_, int status, void *command_data, void *private_data)
+/* the counters and latencies of all sessions, for the final report */
+void sum_clients(struct client *total) {
+	int i;
+
+	memset(total, 0, sizeof(*total));
+	total->rw = clients[0]->rw;
+	total->random = clients[0]->random;
+	total->rwmix_read = clients[0]->rwmix_read;
+	total->verify = clients[0]->verify;
+	total->blocksize = clients[0]->blocksize;
+	for (i = 0; i < num_clients; i++) {
+		struct client *client = clients[i];
+
+		total->iops += client->iops;
+		total->bytes += client->bytes;
+		total->reads += client->reads;
+		total->writes += client->writes;
+		total->verified += client->verified;
+		total->verify_errors += client->verify_errors;
+		total->busy_cnt += client->busy_cnt;
+		total->err_cnt += client->err_cnt;
+		hist_merge(&total->lat[0], &client->lat[0]);
+		hist_merge(&total->lat[1], &client->lat[1]);
+	}
+}
+
+static const char *rw_name(struct client *client) {
+	switch (client->rw) {
+	case RW_WRITE:
+		return "write";
+	case RW_RANDRW:
+		return "randrw";
+	default:
+		return "read";
+	}
+}
+
+void print_latency(struct client *client) {
+	static const char *names[] = { "read", "write", "all" };
+	static struct histogram all;
+	const struct histogram *h;
+	int i;
+
+	memset(&all, 0, sizeof(all));
+	hist_merge(&all, &client->lat[0]);
+	hist_merge(&all, &client->lat[1]);
+	if (!all.count) {
+		return;
+	}
+
+	printf("\nlatency (us)       min       p50       p90       p99     p99.9    p99.99       max      mean\n");
+	for (i = 0; i < 3; i++) {
+		h = i < 2 ? &client->lat[i] : &all;
+		if (!h->count || (i == 2 && (!client->lat[0].count || !client->lat[1].count))) {
+			continue;
+		}
+		printf("%-12s %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", names[i],
+		       us(h->min), us(hist_percentile(h, 50)), us(hist_percentile(h, 90)),
+		       us(hist_percentile(h, 99)), us(hist_percentile(h, 99.9)),
+		       us(hist_percentile(h, 99.99)), us(h->max), us(h->sum / h->count));
+	}
+}
+
+void print_sessions(uint64_t elapsed_ns) {
+	double secs = elapsed_ns / 1000000000.0;
+	struct histogram all;
+	int i;
+
+	printf("\nsession thread  cpu        ios      iops     MB/s   p50 us   p99 us   max us  url\n");
+	for (i = 0; i < num_clients; i++) {
+		struct client *client = clients[i];
+
+		memset(&all, 0, sizeof(all));
+		hist_merge(&all, &client->lat[0]);
+		hist_merge(&all, &client->lat[1]);
+		printf("%7d %6d %4d %10" PRIu64 " %9.0f %8.1f %8.1f %8.1f %8.1f  %s\n",
+		       client->index, client->worker->index, client->worker->cpu, client->iops,
+		       secs > 0 ? client->iops / secs : 0.0,
+		       secs > 0 ? client->bytes / secs / 1048576 : 0.0,
+		       us(hist_percentile(&all, 50)), us(hist_percentile(&all, 99)),
+		       us(all.max), client->url);
+	}
+}
+
+static double point_iops(const struct point *p) {
+	return p->secs > 0 ? p->ios / p->secs : 0.0;
+}
+
+static double point_mbps(const struct point *p) {
+	return p->secs > 0 ? p->bytes / p->secs / 1048576 : 0.0;
+}
+
+/*
+ * The knee of every transfer size is the lowest queue depth that gets
+ * within KNEE_GAIN of the best IOPS of that transfer size, deeper queues
+ * only add latency.
+ */
+void sweep_knees(void) {
+	int first, last, i;
+	double best;
+
+	for (first = 0; first < sweep.cur; first = last) {
+		best = 0;
+		for (last = first; last < sweep.cur && sweep.points[last].blocks == sweep.points[first].blocks; last++) {
+			if (point_iops(&sweep.points[last]) > best) {
+				best = point_iops(&sweep.points[last]);
+			}
+		}
+		for (i = first; i < last; i++) {
+			if (point_iops(&sweep.points[i]) * KNEE_GAIN >= best) {
+				sweep.points[i].knee = 1;
+				break;
+			}
+		}
+	}
+}
+
+void print_sweep(void) {
+	int i;
+
+	printf("\n   qd   blocks      iops     MB/s   p50 us   p90 us   p99 us p99.9 us   max us  mean us\n");
+	for (i = 0; i < sweep.cur; i++) {
+		struct point *p = &sweep.points[i];
+
+		printf("%5d %8d %9.0f %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f%s\n",
+		       p->depth, p->blocks, point_iops(p), point_mbps(p),
+		       us(p->p50), us(p->p90), us(p->p99), us(p->p999), us(p->max), us(p->mean),
+		       p->knee ? "  <- knee" : "");
+	}
+}
+
+void csv_sweep(FILE *f, int blocksize) {
+	int i;
+
+	fprintf(f, "queue_depth,blocks,bytes_per_io,iops,mbps,p50_us,p90_us,p99_us,p99.9_us,max_us,mean_us,knee\n");
+	for (i = 0; i < sweep.cur; i++) {
+		struct point *p = &sweep.points[i];
+
+		fprintf(f, "%d,%d,%d,%.0f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%d\n",
+		        p->depth, p->blocks, p->blocks * blocksize, point_iops(p), point_mbps(p),
+		        us(p->p50), us(p->p90), us(p->p99), us(p->p999), us(p->max), us(p->mean),
+		        p->knee);
+	}
+}
+
+void json_histogram(FILE *f, const struct histogram *h) {
+	fprintf(f, "{ \"count\": %" PRIu64 ", \"min\": %.1f, \"mean\": %.1f, "
+	        "\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p99.9\": %.1f, "
+	        "\"p99.99\": %.1f, \"max\": %.1f }",
+	        h->count, us(h->min), h->count ? us(h->sum / h->count) : 0.0,
+	        us(hist_percentile(h, 50)), us(hist_percentile(h, 90)),
+	        us(hist_percentile(h, 99)), us(hist_percentile(h, 99.9)),
+	        us(hist_percentile(h, 99.99)), us(h->max));
+}
+
+/*
+ * The whole run as one JSON document, latencies in microseconds and a
+ * sample per second.
+ */
+void json_report(struct client *client, FILE *f, uint64_t elapsed_ns) {
+	double secs = elapsed_ns / 1000000000.0;
+	int i;
+
+	fprintf(f, "{\n");
+	fprintf(f, "  \"version\": \"%s\",\n", PERF_VERSION);
+	fprintf(f, "  \"rw\": \"%s\",\n", rw_name(client));
+	fprintf(f, "  \"random\": %s,\n", client->random ? "true" : "false");
+	fprintf(f, "  \"rwmix_read\": %d,\n", client->rwmix_read);
+	fprintf(f, "  \"sessions\": %d,\n", num_clients);
+	fprintf(f, "  \"threads\": %d,\n", num_workers);
+	fprintf(f, "  \"queue_depth\": %d,\n", max_in_flight);
+	fprintf(f, "  \"blocks_per_io\": %d,\n", blocks_per_io);
+	fprintf(f, "  \"blocksize\": %d,\n", client->blocksize);
+	fprintf(f, "  \"runtime\": %.3f,\n", secs);
+	fprintf(f, "  \"ios\": %" PRIu64 ",\n", client->iops);
+	fprintf(f, "  \"reads\": %" PRIu64 ",\n", client->reads);
+	fprintf(f, "  \"writes\": %" PRIu64 ",\n", client->writes);
+	fprintf(f, "  \"bytes\": %" PRIu64 ",\n", client->bytes);
+	fprintf(f, "  \"iops\": %.0f,\n", secs > 0 ? client->iops / secs : 0.0);
+	fprintf(f, "  \"mbps\": %.1f,\n", secs > 0 ? client->bytes / secs / 1048576 : 0.0);
+	fprintf(f, "  \"busy\": %d,\n", client->busy_cnt);
+	fprintf(f, "  \"verify_errors\": %" PRIu64 ",\n", client->verify_errors);
+	fprintf(f, "  \"latency_us\": {\n    \"read\": ");
+	json_histogram(f, &client->lat[0]);
+	fprintf(f, ",\n    \"write\": ");
+	json_histogram(f, &client->lat[1]);
+	fprintf(f, "\n  },\n");
+	fprintf(f, "  \"per_session\": [");
+	for (i = 0; i < num_clients; i++) {
+		struct client *c = clients[i];
+
+		fprintf(f, "%s\n    { \"session\": %d, \"url\": \"%s\", \"thread\": %d, \"cpu\": %d, "
+		        "\"ios\": %" PRIu64 ", \"bytes\": %" PRIu64 ", \"iops\": %.0f, \"mbps\": %.1f,\n"
+		        "      \"latency_us\": { \"read\": ",
+		        i ? "," : "", c->index, c->url, c->worker->index, c->worker->cpu,
+		        c->iops, c->bytes, secs > 0 ? c->iops / secs : 0.0,
+		        secs > 0 ? c->bytes / secs / 1048576 : 0.0);
+		json_histogram(f, &c->lat[0]);
+		fprintf(f, ",\n        \"write\": ");
+		json_histogram(f, &c->lat[1]);
+		fprintf(f, " } }");
+	}
+	fprintf(f, "\n  ],\n");
+	if (sweep.num_points) {
+		fprintf(f, "  \"sweep\": [");
+		for (i = 0; i < sweep.cur; i++) {
+			struct point *p = &sweep.points[i];
+
+			fprintf(f, "%s\n    { \"queue_depth\": %d, \"blocks\": %d, \"iops\": %.0f, \"mbps\": %.1f, "
+			        "\"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, \"p99.9_us\": %.1f, "
+			        "\"max_us\": %.1f, \"mean_us\": %.1f, \"knee\": %s }",
+			        i ? "," : "", p->depth, p->blocks, point_iops(p), point_mbps(p),
+			        us(p->p50), us(p->p90), us(p->p99), us(p->p999), us(p->max), us(p->mean),
+			        p->knee ? "true" : "false");
+		}
+		fprintf(f, "\n  ],\n");
+	}
+	fprintf(f, "  \"intervals\": [");
+	for (i = 0; i < report.num_samples; i++) {
+		struct sample *sample = &report.samples[i];
+
+		fprintf(f, "%s\n    { \"t\": %.3f, \"iops\": %" PRIu64 ", \"mbps\": %.1f, "
+		        "\"p50_us\": %.1f, \"p99_us\": %.1f, \"p99.9_us\": %.1f, \"max_us\": %.1f }",
+		        i ? "," : "", sample->t, sample->iops, sample->bytes / 1048576.0,
+		        us(sample->p50), us(sample->p99), us(sample->p999), us(sample->max));
+	}
+	fprintf(f, "\n  ]\n}\n");
+}
+
+void submit_io(struct client *client, struct io *io);
+
+/*
+ * With --verify a write must not overlap a write that is still in flight.
+ * The target may complete the two in either order, and the read-back of
+ * the newer one would then find the data of the older one.
+ */
+static int write_in_flight(struct client *client, uint64_t lba, int num_blocks)
 {
-	struct client *client = (struct client *)private_data;
-	struct scsi_task *task = command_data, *task2 = NULL;
-	struct scsi_read16_cdb *read16_cdb = NULL;
+	int i;
 
-	read16_cdb = scsi_cdb_unmarshall(task, SCSI_OPCODE_READ16);
-	if (read16_cdb == NULL) {
-		fprintf(stderr, "Failed to unmarshall READ16 CDB.\n");
-		client->err_cnt++;
-		goto out;
+	for (i = 0; i < max_in_flight; i++) {
+		struct io *io = &client->ios[i];
+
+		if (io->writing && io->lba < lba + num_blocks
+		    && lba < io->lba + io->num_blocks) {
+			return 1;
+		}
 	}
+	return 0;
+}
 
-	if (status == SCSI_STATUS_BUSY ||
-		(status == SCSI_STATUS_CHECK_CONDITION && task->sense.key == SCSI_SENSE_UNIT_ATTENTION)) {
+void cb(struct iscsi_context *iscsi _U_, int status, void *command_data, void *private_data)
+{
+	struct io *io = private_data;
+	struct client *client = io->client;
+	struct scsi_task *task = command_data;
+	int retry = status == SCSI_STATUS_BUSY ||
+		(status == SCSI_STATUS_CHECK_CONDITION && task->sense.key == SCSI_SENSE_UNIT_ATTENTION);
+
+	scsi_free_scsi_task(task);
+
+	if (retry) {
 		if (client->retry_cnt++ > 4 * max_in_flight) {
 			fprintf(stderr, "maxium number of command retries reached...\n");
 			client->err_cnt++;
-			goto out;
-		}
-		task2 = iscsi_read16_task(client->iscsi,
-								client->lun, read16_cdb->lba,
-								read16_cdb->transfer_length * client->blocksize,
-								client->blocksize, 0, 0, 0, 0, 0,
-								cb, client);
-		if (task2 == NULL) {
-			fprintf(stderr, "failed to send read16 command\n");
-			client->err_cnt++;
+			return;
 		}
-		scsi_task_set_iov_in(task2, &client->perf_iov, 1);
 		if (status == SCSI_STATUS_BUSY) {
 			client->busy_cnt++;
 		}
-	} else if (status == SCSI_STATUS_CANCELLED) {
+		submit_io(client, io);
+		return;
+	}
+	io->writing = 0;
+
+	if (status == SCSI_STATUS_CANCELLED) {
 		client->err_cnt++;
 	} else if (status == SCSI_STATUS_GOOD) {
 		client->retry_cnt = 0;
-		client->bytes += read16_cdb->transfer_length * client->blocksize;
+		if (!io->verify) {
+			uint64_t ns = get_clock_ns() - io->submit_ns;
+
+			hist_record(&client->interval, ns);
+			hist_record(&client->lat[io->write], ns);
+		}
+		if (io->write) {
+			client->writes++;
+			client->bytes += io->num_blocks * client->blocksize;
+			if (client->verify) {
+				/* read it back before the slot is reused */
+				io->write = 0;
+				io->verify = 1;
+				submit_io(client, io);
+				return;
+			}
+		} else if (io->verify) {
+			check_blocks(client, io, io->gen);
+		} else {
+			client->reads++;
+			client->bytes += io->num_blocks * client->blocksize;
+			if (client->verify) {
+				check_blocks(client, io, 0);
+			}
+		}
 	} else {
-		fprintf(stderr, "Read16 failed with %s\n", iscsi_get_error(iscsi));
+		fprintf(stderr, "%s16 failed with %s\n", io->write ? "Write" : "Read", iscsi_get_error(iscsi));
 		if (!client->ignore_errors) {
 			client->err_cnt++;
 		}
 	}
 
-out:
-	scsi_free_scsi_task(task);
-	
+	io->next = client->free_ios;
+	client->free_ios = io;
+
 	if (!client->err_cnt) {
-		progress(client);
+		if (!threaded) {
+			progress();
+		}
 		client->iops++;
 		client->in_flight--;
-		fill_read_queue(client);
+		fill_queue(client);
 	}
 }
 
+void submit_io(struct client *client, struct io *io)
+{
+	struct scsi_task *task;
+	uint32_t len = io->num_blocks * client->blocksize;
+
+	if (io->write) {
+		task = iscsi_write16_task(client->iscsi,
+								client->lun, io->lba,
+								io->iov.iov_base, len,
+								client->blocksize, 0, client->dpo,
+								client->fua, 0, 0,
+								cb, io);
+	} else {
+		task = iscsi_read16_task(client->iscsi,
+								client->lun, io->lba,
+								len,
+								client->blocksize, 0, client->dpo,
+								client->fua, 0, 0,
+								cb, io);
+		if (task != NULL) {
+			scsi_task_set_iov_in(task, &io->iov, 1);
+		}
+	}
+	if (task == NULL) {
+		fprintf(stderr, "failed to send %s16 command\n", io->write ? "write" : "read");
+		iscsi_destroy_context(client->iscsi);
+		exit(10);
+	}
+}
 
-void fill_read_queue(struct client *client)
+void fill_queue(struct client *client)
 {
 	int num_blocks;
 
 	if (finished) return;
 
 	if (client->pos >= client->num_blocks) client->pos = 0;
-	while(client->in_flight < max_in_flight && client->pos < client->num_blocks) {
-		struct scsi_task *task;
+	while(client->in_flight < queue_depth && client->pos < client->num_blocks) {
+		struct io *io = client->free_ios;
+
+		client->free_ios = io->next;
 		client->in_flight++;
 
 		if (client->random) {
-			client->pos = rand() % client->num_blocks;
+			client->pos = xorshift64s(&client->rng) % client->num_blocks;
 		}
 
 		num_blocks = client->num_blocks - client->pos;
@@ -201,51 +957,318 @@ void fill_read_queue(struct client *client)
 		}
 		
 		if (client->random_blocks) {
-			num_blocks = rand() % num_blocks + 1;
+			num_blocks = xorshift64s(&client->rng) % num_blocks + 1;
 		}
 
-		task = iscsi_read16_task(client->iscsi,
-								client->lun, client->pos,
-								num_blocks * client->blocksize,
-								client->blocksize, 0, 0, 0, 0, 0,
-								cb, client);
-		if (task == NULL) {
-			fprintf(stderr, "failed to send read16 command\n");
-			iscsi_destroy_context(client->iscsi);
-			exit(10);
+		io->lba = client->start + client->pos;
+		io->num_blocks = num_blocks;
+		io->verify = 0;
+		switch (client->rw) {
+		case RW_READ:
+			io->write = 0;
+			break;
+		case RW_WRITE:
+			io->write = 1;
+			break;
+		case RW_RANDRW:
+			io->write = (int)(xorshift64s(&client->rng) % 100) >= client->rwmix_read;
+			break;
+		}
+		if (io->write && client->verify) {
+			if (write_in_flight(client, io->lba, num_blocks)) {
+				/* try again once a request has completed */
+				io->next = client->free_ios;
+				client->free_ios = io;
+				client->in_flight--;
+				break;
+			}
+			io->writing = 1;
+		}
+		if (io->write) {
+			io->gen = client->gen++;
+			stamp_blocks(client, io);
 		}
-		scsi_task_set_iov_in(task, &client->perf_iov, 1);
+
+		io->submit_ns = get_clock_ns();
+		submit_io(client, io);
 		client->pos += num_blocks;
 	}
 }
 
 void usage(void) {
-	fprintf(stderr,"Usage: iscsi-perf [-i <initiator-name>] [-m <max_requests>] [-b blocks_per_request] [-t timeout] [-r|--random] [-n|--ignore-errors] [-x <max_reconnects>] <LUN>\n");
+	fprintf(stderr,"Usage: iscsi-perf [-i <initiator-name>] [-m <max_requests>] [-b blocks_per_request] [-t timeout] [-r|--random] [-n|--ignore-errors] [-x <max_reconnects>]\n"
+	               "                  [-w|--rw=read|write|randrw] [-M|--rwmix=<read percentage>] [-V|--verify] [-F|--fua] [-D|--dpo]\n"
+	               "                  [-j|--json=<file>] [-S|--sessions=<n>] [-T|--threads=<n>] [-C|--cpus=<list>]\n"
+	               "                  [-s|--sweep] [-d|--sweep-depths=<list>] [-B|--sweep-blocks=<list>] [-u|--warmup=<s>]\n"
+	               "                  [-W|--window=<s>] [-c|--csv=<file>] <LUN> [<LUN>...]\n"
+	               "  --rw=randrw issues a random mix of reads and writes at random offsets, by default half of them reads.\n"
+	               "  --verify stamps every block written with its lba, reads written blocks back and checks the stamp\n"
+	               "  of every block read. Without it writes destroy data on the LUN all the same.\n"
+	               "  --json writes the results, latency percentiles and a per second time series to <file>,\n"
+	               "  or to stdout if <file> is -, in which case all other output goes to stderr.\n"
+	               "  --sessions logs in n times, spreading the sessions over the LUNs given round robin. Sessions\n"
+	               "  to the same LUN each get a slice of it. --threads runs them from n event loops in threads of\n"
+	               "  their own, --cpus binds the threads round robin to the cpus in <list>, e.g. 0-3,8.\n"
+	               "  --sweep measures every combination of the queue depths and transfer sizes in blocks given by\n"
+	               "  --sweep-depths (powers of two up to -m) and --sweep-blocks (-b) on the same login, each for\n"
+	               "  --warmup (2) and then --window (5) seconds, and prints a table and a CSV of the results,\n"
+	               "  the CSV to <file> if --csv is given.\n");
 	exit(1);
 }
 
 void sig_handler (int signum ) {
+	int i;
+
 	if (signum == SIGALRM) {
-		if (proc_alarm) {
-			fprintf(stderr, "\n\nABORT: Last alarm was not processed.\n");
-			exit(10);
+		for (i = 0; i < num_workers; i++) {
+			if (!workers[i].done && workers[i].alarm_seen != alarm_gen) {
+				fprintf(stderr, "\n\nABORT: Last alarm was not processed.\n");
+				exit(10);
+			}
 		}
-		proc_alarm = 1;
+		alarm_gen++;
 		alarm(NOP_INTERVAL);
 	} else {
 		finished++;
 	}
 }
 
-int main(int argc, char *argv[])
-{
-	char *url = NULL;
+static int cmp_int(const void *a, const void *b) {
+	return *(const int *)a - *(const int *)b;
+}
+
+/* parse a list of numbers like 0-3,8 */
+int parse_list(const char *str, int **cpus) {
+	int num = 0, first, last;
+	char *end;
+
+	*cpus = NULL;
+	while (*str) {
+		first = last = strtol(str, &end, 10);
+		if (end == str || first < 0) {
+			return -1;
+		}
+		if (*end == '-') {
+			str = end + 1;
+			last = strtol(str, &end, 10);
+			if (end == str || last < first) {
+				return -1;
+			}
+		}
+		for (; first <= last; first++) {
+			*cpus = realloc(*cpus, (num + 1) * sizeof(int));
+			if (*cpus == NULL) {
+				return -1;
+			}
+			(*cpus)[num++] = first;
+		}
+		if (*end == ',') {
+			end++;
+		} else if (*end) {
+			return -1;
+		}
+		str = end;
+	}
+	return num;
+}
+
+void pin_worker(struct worker *w) {
+#ifdef HAVE_SCHED_SETAFFINITY
+	cpu_set_t set;
+
+	if (w->cpu < 0) {
+		return;
+	}
+	CPU_ZERO(&set);
+	CPU_SET(w->cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+		fprintf(stderr, "failed to bind thread %d to cpu %d\n", w->index, w->cpu);
+	}
+#endif
+}
+
+/*
+ * The buffers of a session are allocated and touched by the worker that
+ * uses them after it has been bound to its cpu, so that the kernel places
+ * them on the NUMA node of that cpu.
+ */
+void alloc_ios(struct client *client) {
+	int i;
+
+	client->ios = calloc(max_in_flight, sizeof(struct io));
+	if (!client->ios) {
+		fprintf(stderr, "Out of Memory\n");
+		exit(10);
+	}
+	for (i = 0; i < max_in_flight; i++) {
+		struct io *io = &client->ios[i];
+
+		io->client = client;
+		io->iov.iov_base = malloc(max_blocks_per_io * client->blocksize);
+		if (!io->iov.iov_base) {
+			fprintf(stderr, "Out of Memory\n");
+			exit(10);
+		}
+		memset(io->iov.iov_base, 0, max_blocks_per_io * client->blocksize);
+		io->iov.iov_len = max_blocks_per_io * client->blocksize;
+		io->next = client->free_ios;
+		client->free_ios = io;
+	}
+}
+
+void keep_alive(struct client *client) {
+	if (iscsi_get_nops_in_flight(client->iscsi) > MAX_NOP_FAILURES) {
+		iscsi_reconnect(client->iscsi);
+	} else {
+		iscsi_nop_out_async(client->iscsi, NULL, NULL, 0, NULL);
+	}
+	if (!iscsi_get_nops_in_flight(client->iscsi)) {
+		finished = 0;
+	}
+}
+
+void *worker_run(void *arg) {
+	struct worker *w = arg;
+	struct pollfd *pfd;
+	int i, active;
+
+	pin_worker(w);
+
+	pfd = calloc(w->num_clients, sizeof(struct pollfd));
+	if (pfd == NULL) {
+		fprintf(stderr, "Out of Memory\n");
+		exit(10);
+	}
+	for (i = 0; i < w->num_clients; i++) {
+		alloc_ios(w->clients[i]);
+	}
+
+	worker_lock(w);
+	for (i = 0; i < w->num_clients; i++) {
+		fill_queue(w->clients[i]);
+	}
+	while (!aborted && finished < 2) {
+		if (w->alarm_seen != alarm_gen) {
+			w->alarm_seen = alarm_gen;
+			for (i = 0; i < w->num_clients; i++) {
+				if (w->clients[i]->in_flight) {
+					keep_alive(w->clients[i]);
+				}
+			}
+		}
+
+		active = 0;
+		for (i = 0; i < w->num_clients; i++) {
+			struct client *client = w->clients[i];
+
+			if (client->err_cnt) {
+				aborted = 1;
+			}
+			pfd[i].fd = -1;
+			pfd[i].events = 0;
+			if (!client->in_flight) {
+				continue;
+			}
+			active++;
+			/* no events means try again in a second */
+			pfd[i].events = iscsi_which_events(client->iscsi);
+			if (pfd[i].events) {
+				pfd[i].fd = iscsi_get_fd(client->iscsi);
+			}
+		}
+		if (!active || aborted) {
+			break;
+		}
+
+		worker_unlock(w);
+		if (poll(pfd, w->num_clients, 1000) <= 0) {
+			worker_lock(w);
+			continue;
+		}
+		worker_lock(w);
+
+		for (i = 0; i < w->num_clients; i++) {
+			struct client *client = w->clients[i];
+
+			if (!pfd[i].revents) {
+				continue;
+			}
+			if (iscsi_service(client->iscsi, pfd[i].revents) < 0) {
+				fprintf(stderr, "iscsi_service failed with : %s\n", iscsi_get_error(client->iscsi));
+				client->err_cnt++;
+			}
+		}
+	}
+	worker_unlock(w);
+
+	free(pfd);
+	w->done = 1;
+	return NULL;
+}
+
+void connect_session(struct client *client) {
 	struct iscsi_url *iscsi_url;
 	struct scsi_task *task;
 	struct scsi_readcapacity16 *rc16;
+
+	client->iscsi = iscsi_create_context(initiator);
+	if (client->iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		exit(10);
+	}
+
+	iscsi_url = iscsi_parse_full_url(client->iscsi, client->url);
+	if (iscsi_url == NULL) {
+		fprintf(stderr, "Failed to parse URL: %s\n",
+			iscsi_get_error(client->iscsi));
+		exit(10);
+	}
+
+	iscsi_set_session_type(client->iscsi, ISCSI_SESSION_NORMAL);
+	iscsi_set_header_digest(client->iscsi, ISCSI_HEADER_DIGEST_NONE_CRC32C);
+
+	if (iscsi_full_connect_sync(client->iscsi, iscsi_url->portal, iscsi_url->lun) != 0) {
+		fprintf(stderr, "Login Failed. %s\n", iscsi_get_error(client->iscsi));
+		iscsi_destroy_url(iscsi_url);
+		iscsi_destroy_context(client->iscsi);
+		exit(10);
+	}
+
+	printf("connected to %s\n", client->url);
+
+	client->lun = iscsi_url->lun;
+	iscsi_destroy_url(iscsi_url);
+
+	task = iscsi_readcapacity16_sync(client->iscsi, client->lun);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "failed to send readcapacity command\n");
+		exit(10);
+	}
+
+	rc16 = scsi_datain_unmarshall(task);
+	if (rc16 == NULL) {
+		fprintf(stderr, "failed to unmarshall readcapacity16 data\n");
+		exit(10);
+	}
+
+	client->blocksize  = rc16->block_length;
+	client->num_blocks  = rc16->returned_lba + 1;
+
+	scsi_free_scsi_task(task);
+
+	if (client->blocksize % 8 || client->blocksize < PATTERN_HDR_WORDS * 8) {
+		fprintf(stderr, "unsupported blocksize %d\n", client->blocksize);
+		exit(10);
+	}
+
+	iscsi_set_reconnect_max_retries(client->iscsi, client->max_reconnects);
+}
+
+int main(int argc, char *argv[])
+{
 	int c;
-	struct pollfd pfd[1];
-	struct client client;
+	struct client tmpl, total;
+	struct client *client;
 
 	static struct option long_options[] = {
 		{"initiator-name", required_argument,    NULL,        'i'},
@@ -255,18 +1278,44 @@ int main(int argc, char *argv[])
 		{"random",         no_argument,          NULL,        'r'},
 		{"random-blocks",  no_argument,          NULL,        'R'},
 		{"ignore-errors",  no_argument,          NULL,        'n'},
+		{"rw",             required_argument,    NULL,        'w'},
+		{"rwmix",          required_argument,    NULL,        'M'},
+		{"verify",         no_argument,          NULL,        'V'},
+		{"fua",            no_argument,          NULL,        'F'},
+		{"dpo",            no_argument,          NULL,        'D'},
+		{"json",           required_argument,    NULL,        'j'},
+		{"sessions",       required_argument,    NULL,        'S'},
+		{"threads",        required_argument,    NULL,        'T'},
+		{"cpus",           required_argument,    NULL,        'C'},
+		{"sweep",          no_argument,          NULL,        's'},
+		{"sweep-depths",   required_argument,    NULL,        'd'},
+		{"sweep-blocks",   required_argument,    NULL,        'B'},
+		{"warmup",         required_argument,    NULL,        'u'},
+		{"window",         required_argument,    NULL,        'W'},
+		{"csv",            required_argument,    NULL,        'c'},
 		{0, 0, 0, 0}
 	};
 	int option_index;
-
-	memset(&client, 0, sizeof(client));
-	client.max_reconnects = -1;
-
-	srand(time(NULL));
-	
-	printf("iscsi-perf version %s - (c) 2014-2015 by Peter Lieven <pl@ĸamp.de>\n\n", PERF_VERSION);
-
-	while ((c = getopt_long(argc, argv, "i:m:b:t:nrRx:", long_options,
+	int i, j;
+	const char *json_file = NULL;
+	FILE *json = NULL;
+	int *cpus = NULL;
+	int num_cpus = 0;
+	int do_sweep = 0;
+	int *depths = NULL, *sizes = NULL;
+	int num_depths = 0, num_sizes = 0;
+	const char *csv_file = NULL;
+	int num_urls;
+	uint64_t elapsed_ns;
+	const char *per;
+
+	memset(&tmpl, 0, sizeof(tmpl));
+	sweep.warmup = 2;
+	sweep.window = 5;
+	tmpl.max_reconnects = -1;
+	tmpl.rwmix_read = 50;
+
+	while ((c = getopt_long(argc, argv, "i:m:b:t:nrRx:w:M:VFDj:S:T:C:sd:B:u:W:c:", long_options,
 			&option_index)) != -1) {
 		switch (c) {
 		case 'i':
@@ -282,16 +1331,97 @@ int main(int argc, char *argv[])
 			blocks_per_io = atoi(optarg);
 			break;
 		case 'n':
-			client.ignore_errors = 1;
+			tmpl.ignore_errors = 1;
 			break;
 		case 'r':
-			client.random = 1;
+			tmpl.random = 1;
 			break;
 		case 'R':
-			client.random_blocks = 1;
+			tmpl.random_blocks = 1;
 			break;
 		case 'x':
-			client.max_reconnects = atoi(optarg);
+			tmpl.max_reconnects = atoi(optarg);
+			break;
+		case 'w':
+			if (!strcmp(optarg, "read")) {
+				tmpl.rw = RW_READ;
+			} else if (!strcmp(optarg, "write")) {
+				tmpl.rw = RW_WRITE;
+			} else if (!strcmp(optarg, "randrw")) {
+				tmpl.rw = RW_RANDRW;
+				tmpl.random = 1;
+			} else {
+				fprintf(stderr, "Unknown --rw mode '%s'\n\n", optarg);
+				usage();
+			}
+			break;
+		case 'M':
+			tmpl.rwmix_read = atoi(optarg);
+			if (tmpl.rwmix_read < 0 || tmpl.rwmix_read > 100) {
+				usage();
+			}
+			break;
+		case 'V':
+			tmpl.verify = 1;
+			break;
+		case 'F':
+			tmpl.fua = 1;
+			break;
+		case 'D':
+			tmpl.dpo = 1;
+			break;
+		case 'j':
+			json_file = optarg;
+			break;
+		case 'S':
+			num_clients = atoi(optarg);
+			if (num_clients < 1) {
+				usage();
+			}
+			break;
+		case 'T':
+			num_workers = atoi(optarg);
+			if (num_workers < 1) {
+				usage();
+			}
+			break;
+		case 'C':
+			num_cpus = parse_list(optarg, &cpus);
+			if (num_cpus <= 0) {
+				fprintf(stderr, "Invalid cpu list '%s'\n\n", optarg);
+				usage();
+			}
+			break;
+		case 's':
+			do_sweep = 1;
+			break;
+		case 'd':
+			do_sweep = 1;
+			num_depths = parse_list(optarg, &depths);
+			if (num_depths <= 0) {
+				fprintf(stderr, "Invalid list of queue depths '%s'\n\n", optarg);
+				usage();
+			}
+			break;
+		case 'B':
+			do_sweep = 1;
+			num_sizes = parse_list(optarg, &sizes);
+			if (num_sizes <= 0) {
+				fprintf(stderr, "Invalid list of transfer sizes '%s'\n\n", optarg);
+				usage();
+			}
+			break;
+		case 'u':
+			sweep.warmup = atoi(optarg);
+			break;
+		case 'W':
+			sweep.window = atoi(optarg);
+			if (sweep.window < 1) {
+				usage();
+			}
+			break;
+		case 'c':
+			csv_file = optarg;
 			break;
 		default:
 			fprintf(stderr, "Unrecognized option '%c'\n\n", c);
@@ -299,79 +1429,184 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (optind != argc -1 ) usage();
+	if (optind >= argc) usage();
+	num_urls = argc - optind;
 
-	if (argv[optind] != NULL) {
-		url = strdup(argv[optind]);
+	if (do_sweep) {
+		if (!num_depths) {
+			for (i = 1; i < 2 * max_in_flight; i *= 2) {
+				depths = realloc(depths, (num_depths + 1) * sizeof(int));
+				depths[num_depths++] = i < max_in_flight ? i : max_in_flight;
+			}
+		}
+		if (!num_sizes) {
+			sizes = malloc(sizeof(int));
+			sizes[num_sizes++] = blocks_per_io;
+		}
+		if (depths == NULL || sizes == NULL) {
+			fprintf(stderr, "Out of Memory\n");
+			exit(10);
+		}
+		qsort(depths, num_depths, sizeof(int), cmp_int);
+		qsort(sizes, num_sizes, sizeof(int), cmp_int);
+		if (depths[0] < 1 || sizes[0] < 1) {
+			usage();
+		}
+		sweep.points = calloc(num_depths * num_sizes, sizeof(struct point));
+		if (sweep.points == NULL) {
+			fprintf(stderr, "Out of Memory\n");
+			exit(10);
+		}
+		for (i = 0; i < num_sizes; i++) {
+			for (j = 0; j < num_depths; j++) {
+				sweep.points[sweep.num_points].depth = depths[j];
+				sweep.points[sweep.num_points++].blocks = sizes[i];
+			}
+		}
+		max_in_flight = depths[num_depths - 1];
+		blocks_per_io = sizes[num_sizes - 1];
+		/* the sweep ends the run */
+		runtime = 0;
 	}
+	queue_depth = max_in_flight;
+	max_blocks_per_io = blocks_per_io;
 
-	if (url == NULL) usage();
-
-	client.iscsi = iscsi_create_context(initiator);
-	if (client.iscsi == NULL) {
-		fprintf(stderr, "Failed to create context\n");
-		exit(10);
+	if (num_workers > num_clients) {
+		num_workers = num_clients;
 	}
-
-	iscsi_url = iscsi_parse_full_url(client.iscsi, url);
-	if (iscsi_url == NULL) {
-		fprintf(stderr, "Failed to parse URL: %s\n",
-			iscsi_get_error(client.iscsi));
+#ifndef HAVE_PTHREAD
+	if (num_workers > 1) {
+		fprintf(stderr, "iscsi-perf was built without thread support\n");
 		exit(10);
 	}
-
-	iscsi_set_session_type(client.iscsi, ISCSI_SESSION_NORMAL);
-	iscsi_set_header_digest(client.iscsi, ISCSI_HEADER_DIGEST_NONE_CRC32C);
-
-	if (iscsi_full_connect_sync(client.iscsi, iscsi_url->portal, iscsi_url->lun) != 0) {
-		fprintf(stderr, "Login Failed. %s\n", iscsi_get_error(client.iscsi));
-		iscsi_destroy_url(iscsi_url);
-		iscsi_destroy_context(client.iscsi);
+#endif
+#ifndef HAVE_SCHED_SETAFFINITY
+	if (num_cpus) {
+		fprintf(stderr, "binding threads to cpus is not supported on this platform\n");
 		exit(10);
 	}
+#endif
 
-	printf("connected to %s\n", url);
-	free(url);
+	if (json_file != NULL) {
+		if (!strcmp(json_file, "-")) {
+			/* keep stdout for the JSON document */
+			json = fdopen(dup(1), "w");
+			dup2(2, 1);
+		} else {
+			json = fopen(json_file, "w");
+		}
+		if (json == NULL) {
+			fprintf(stderr, "Failed to open %s\n", json_file);
+			exit(10);
+		}
+	}
 
-	client.lun = iscsi_url->lun;
-	iscsi_destroy_url(iscsi_url);
+	printf("iscsi-perf version %s - (c) 2014-2015 by Peter Lieven <pl@ĸamp.de>\n\n", PERF_VERSION);
 
-	task = iscsi_readcapacity16_sync(client.iscsi, client.lun);
-	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
-		fprintf(stderr, "failed to send readcapacity command\n");
+	clients = calloc(num_clients, sizeof(struct client *));
+	workers = calloc(num_workers, sizeof(struct worker));
+	if (clients == NULL || workers == NULL) {
+		fprintf(stderr, "Out of Memory\n");
 		exit(10);
 	}
-
-	rc16 = scsi_datain_unmarshall(task);
-	if (rc16 == NULL) {
-		fprintf(stderr, "failed to unmarshall readcapacity16 data\n");
-		exit(10);
+	for (i = 0; i < num_workers; i++) {
+		workers[i].index = i;
+		workers[i].cpu = num_cpus ? cpus[i % num_cpus] : -1;
+		workers[i].clients = calloc(num_clients / num_workers + 1, sizeof(struct client *));
+		if (workers[i].clients == NULL) {
+			fprintf(stderr, "Out of Memory\n");
+			exit(10);
+		}
 	}
 
-	client.blocksize  = rc16->block_length;
-	client.num_blocks  = rc16->returned_lba + 1;
+	/* so that stamps of earlier runs count as older data */
+	tmpl.gen = (uint64_t)time(NULL) << 24;
 
-	scsi_free_scsi_task(task);
+	for (i = 0; i < num_clients; i++) {
+		/* sessions are allocated one by one so that they do not share cache lines */
+		client = malloc(sizeof(struct client));
+		if (client == NULL) {
+			fprintf(stderr, "Out of Memory\n");
+			exit(10);
+		}
+		*client = tmpl;
+		client->index = i;
+		client->url = argv[optind + i % num_urls];
+		client->rng = pattern_seed(i, time(NULL));
+		client->worker = &workers[i % num_workers];
+		client->worker->clients[client->worker->num_clients++] = client;
+		clients[i] = client;
+
+		connect_session(client);
+
+		if (i < num_urls) {
+			printf("capacity is %" PRIu64 " blocks or %" PRIu64 " byte (%" PRIu64 " MB)\n", client->num_blocks, client->num_blocks * client->blocksize,
+			       (client->num_blocks * client->blocksize) >> 20);
+		}
+	}
 
-	client.perf_iov.iov_base = malloc(blocks_per_io * client.blocksize);
-	if (!client.perf_iov.iov_base) {
-		fprintf(stderr, "Out of Memory\n");
-		exit(10);
+	/*
+	 * Sessions to the same LUN each get a slice of it, so that they do
+	 * not all read the same blocks and do not overwrite each other's
+	 * stamps.
+	 */
+	for (i = 0; i < num_clients; i++) {
+		int slice = 0, slices = 0;
+		uint64_t num_blocks = clients[i]->num_blocks;
+
+		client = clients[i];
+		for (j = 0; j < num_clients; j++) {
+			if (!strcmp(clients[j]->url, client->url)) {
+				if (j < i) {
+					slice++;
+				}
+				slices++;
+			}
+		}
+		client->start = num_blocks * slice / slices;
+		client->num_blocks = num_blocks * (slice + 1) / slices - client->start;
+		if (!client->num_blocks) {
+			fprintf(stderr, "too many sessions for %s\n", client->url);
+			exit(10);
+		}
 	}
-	client.perf_iov.iov_len = blocks_per_io * client.blocksize;
 
-	printf("capacity is %" PRIu64 " blocks or %" PRIu64 " byte (%" PRIu64 " MB)\n", client.num_blocks, client.num_blocks * client.blocksize,
-	                                                        (client.num_blocks * client.blocksize) >> 20);
+	client = clients[0];
+	if (num_clients > 1) {
+		printf("%d sessions to %d LUNs on %d threads\n", num_clients, num_urls < num_clients ? num_urls : num_clients, num_workers);
+	}
 
-	printf("performing %s READ with %d parallel requests\n", client.random ? "RANDOM" : "SEQUENTIAL", max_in_flight);
+	per = num_clients > 1 ? " per session" : "";
+	switch (client->rw) {
+	case RW_READ:
+		printf("performing %s READ with %d parallel requests%s\n", client->random ? "RANDOM" : "SEQUENTIAL", max_in_flight, per);
+		break;
+	case RW_WRITE:
+		printf("performing %s WRITE with %d parallel requests%s\n", client->random ? "RANDOM" : "SEQUENTIAL", max_in_flight, per);
+		break;
+	case RW_RANDRW:
+		printf("performing RANDOM READ/WRITE (%d%% reads) with %d parallel requests%s\n", client->rwmix_read, max_in_flight, per);
+		break;
+	}
+	if (client->fua || client->dpo) {
+		printf("with%s%s set\n", client->fua ? " FUA" : "", client->dpo ? " DPO" : "");
+	}
+	if (client->verify) {
+		printf("verifying stamped blocks\n");
+	}
 
-	if (client.random_blocks) {
-		printf("RANDOM transfer size of 1 - %d blocks (%d - %d byte)\n", blocks_per_io, client.blocksize, blocks_per_io * client.blocksize);
+	if (client->random_blocks) {
+		printf("RANDOM transfer size of 1 - %d blocks (%d - %d byte)\n", blocks_per_io, client->blocksize, blocks_per_io * client->blocksize);
 	} else {
-		printf("FIXED transfer size of %d blocks (%d byte)\n", blocks_per_io, blocks_per_io * client.blocksize);
+		printf("FIXED transfer size of %d blocks (%d byte)\n", blocks_per_io, blocks_per_io * client->blocksize);
 	}
 
-	if (runtime) {
+	if (sweep.num_points) {
+		printf("sweeping %d queue depths up to %d and %d transfer sizes up to %d blocks, "
+		       "%d s warm-up and %d s measurement per point.\n",
+		       num_depths, max_in_flight, num_sizes, max_blocks_per_io, sweep.warmup, sweep.window);
+		printf("will run for about %d seconds.\n", sweep.num_points * (sweep.warmup + sweep.window + 1));
+	} else if (runtime) {
 		printf("will run for %" PRIu64 " seconds.\n", runtime);
 	} else {
 		printf("infinite runtime - press CTRL-C to abort.\n");
@@ -388,58 +1623,107 @@ int main(int argc, char *argv[])
 
 	printf("\n");
 
-	client.first_ns = client.last_ns = get_clock_ns();
-
-	iscsi_set_reconnect_max_retries(client.iscsi, client.max_reconnects);
-
-	fill_read_queue(&client);
+	report.first_ns = report.last_ns = get_clock_ns();
+	if (sweep.num_points) {
+		sweep_start_point(report.first_ns);
+	}
 
 	alarm(NOP_INTERVAL);
 
-	while (client.in_flight && !client.err_cnt && finished < 2) {
-		pfd[0].fd = iscsi_get_fd(client.iscsi);
-		pfd[0].events = iscsi_which_events(client.iscsi);
-
-		if (proc_alarm) {
-			if (iscsi_get_nops_in_flight(client.iscsi) > MAX_NOP_FAILURES) {
-				iscsi_reconnect(client.iscsi);
-			} else {
-				iscsi_nop_out_async(client.iscsi, NULL, NULL, 0, NULL);
+	if (num_workers == 1) {
+		worker_run(&workers[0]);
+	} else {
+#ifdef HAVE_PTHREAD
+		threaded = 1;
+		for (i = 0; i < num_workers; i++) {
+			pthread_mutex_init(&workers[i].mutex, NULL);
+			if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0) {
+				fprintf(stderr, "Failed to create thread\n");
+				exit(10);
 			}
-			if (!iscsi_get_nops_in_flight(client.iscsi)) {
-				finished = 0;
+		}
+		for (i = 0; i < num_workers; i++) {
+			while (!workers[i].done) {
+				usleep(100000);
+				progress();
 			}
-			proc_alarm = 0;
 		}
-
-		if (!pfd[0].events) {
-			sleep(1);
-			continue;
+		for (i = 0; i < num_workers; i++) {
+			pthread_join(workers[i].thread, NULL);
+			pthread_mutex_destroy(&workers[i].mutex);
 		}
+		threaded = 0;
+#endif
+	}
 
-		if (poll(&pfd[0], 1, -1) < 0) {
-			continue;
+	alarm(0);
+	elapsed_ns = get_clock_ns() - report.first_ns;
+
+	progress();
+
+	sum_clients(&total);
+	printf("\n\nreads %" PRIu64 ", writes %" PRIu64, total.reads, total.writes);
+	if (total.verify) {
+		printf(", blocks verified %" PRIu64 ", verify errors %" PRIu64, total.verified, total.verify_errors);
+	}
+	printf("\n");
+	print_latency(&total);
+	if (num_clients > 1) {
+		print_sessions(elapsed_ns);
+	}
+	if (sweep.num_points) {
+		FILE *csv = stdout;
+
+		sweep_knees();
+		print_sweep();
+		if (csv_file != NULL) {
+			csv = fopen(csv_file, "w");
+			if (csv == NULL) {
+				fprintf(stderr, "Failed to open %s\n", csv_file);
+			}
+		} else {
+			printf("\n");
 		}
-		if (iscsi_service(client.iscsi, pfd[0].revents) < 0) {
-			fprintf(stderr, "iscsi_service failed with : %s\n", iscsi_get_error(client.iscsi));
-			break;
+		if (csv != NULL) {
+			csv_sweep(csv, clients[0]->blocksize);
+		}
+		if (csv != NULL && csv != stdout) {
+			fclose(csv);
 		}
 	}
-	
-	alarm(0);
 
-	progress(&client);
-	
-	if (!client.err_cnt && finished < 2) {
-		printf ("\n\nfinished.\n");
-		iscsi_logout_sync(client.iscsi);
+	if (json != NULL) {
+		json_report(&total, json, elapsed_ns);
+		fclose(json);
+	}
+
+	if (!total.err_cnt && finished < 2) {
+		printf ("\nfinished.\n");
 	} else {
 		printf ("\nABORTED!\n");
 	}
-	iscsi_destroy_context(client.iscsi);
-
-	free(client.perf_iov.iov_base);
-
-	return client.err_cnt ? 1 : 0;
+	for (i = 0; i < num_clients; i++) {
+		client = clients[i];
+		if (!total.err_cnt && finished < 2) {
+			iscsi_logout_sync(client->iscsi);
+		}
+		iscsi_destroy_context(client->iscsi);
+		for (j = 0; j < max_in_flight; j++) {
+			free(client->ios[j].iov.iov_base);
+		}
+		free(client->ios);
+		free(client);
+	}
+	for (i = 0; i < num_workers; i++) {
+		free(workers[i].clients);
+	}
+	free(workers);
+	free(clients);
+	free(cpus);
+	free(depths);
+	free(sizes);
+	free(sweep.points);
+	free(report.samples);
+
+	return total.err_cnt ? 1 : 0;
 }
-
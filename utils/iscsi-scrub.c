@@ -0,0 +1,321 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by agent <agent@local>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <poll.h>
+#include <getopt.h>
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+
+/*
+ * Checks that every block of a LUN can be read by the target without
+ * transferring any data, using VERIFY16 with BYTCHK=0.
+ *
+ * The LUN is verified in large chunks at a high queue depth. A chunk that
+ * fails with a MEDIUM or HARDWARE ERROR is split into NARROW_PARTS parts
+ * that are verified again, until the failing blocks have been narrowed
+ * down to single LBAs. The narrowed ranges are verified before the scan
+ * moves on so that the bad blocks are reported in order.
+ */
+#define NARROW_PARTS 8
+
+const char *initiator = "iqn.2010-11.libiscsi:iscsi-scrub";
+int max_in_flight = 16;
+uint32_t blocks_per_io = 16384;
+
+struct range {
+	struct range *next;
+	uint64_t lba;
+	uint32_t num_blocks;
+};
+
+struct client {
+	struct iscsi_context *iscsi;
+	int lun;
+	int blocksize;
+	uint64_t num_blocks;
+	uint64_t pos;
+	int in_flight;
+	int progress;
+	int err_cnt;
+
+	/* ranges that have to be verified again in smaller parts */
+	struct range *narrow;
+
+	uint64_t verified;
+	uint64_t bad_blocks;
+	/* the last run of bad blocks, printed once it ends */
+	uint64_t bad_lba;
+	uint64_t bad_num;
+};
+
+static void flush_bad(struct client *client)
+{
+	if (client->bad_num) {
+		printf("\rbad blocks: lba %" PRIu64 "-%" PRIu64 "            \n",
+		       client->bad_lba, client->bad_lba + client->bad_num - 1);
+	}
+	client->bad_num = 0;
+}
+
+static void report_bad(struct client *client, uint64_t lba)
+{
+	client->bad_blocks++;
+	if (client->bad_num && client->bad_lba + client->bad_num == lba) {
+		client->bad_num++;
+		return;
+	}
+	flush_bad(client);
+	client->bad_lba = lba;
+	client->bad_num = 1;
+}
+
+void fill_queue(struct client *client);
+
+void verify_cb(struct iscsi_context *iscsi, int status, void *command_data,
+	       void *private_data)
+{
+	struct client *client = private_data;
+	struct scsi_task *task = command_data;
+	uint64_t lba = scsi_get_uint64(&task->cdb[2]);
+	uint32_t num_blocks = scsi_get_uint32(&task->cdb[10]);
+
+	client->in_flight--;
+
+	if (status == SCSI_STATUS_GOOD) {
+		client->verified += num_blocks;
+	} else if (status == SCSI_STATUS_CHECK_CONDITION
+		   && (task->sense.key == SCSI_SENSE_MEDIUM_ERROR
+		       || task->sense.key == SCSI_SENSE_HARDWARE_ERROR)) {
+		if (num_blocks == 1) {
+			client->verified++;
+			report_bad(client, lba);
+		} else {
+			uint32_t part = (num_blocks + NARROW_PARTS - 1)
+				/ NARROW_PARTS;
+			struct range **rp = &client->narrow;
+			uint64_t end = lba + num_blocks;
+
+			/* keep the narrowed ranges sorted by lba */
+			while (*rp && (*rp)->lba < lba) {
+				rp = &(*rp)->next;
+			}
+			for (; lba < end; lba += part) {
+				struct range *r = malloc(sizeof(struct range));
+
+				if (r == NULL) {
+					fprintf(stderr, "Out of Memory\n");
+					exit(10);
+				}
+				r->lba = lba;
+				r->num_blocks = part;
+				if (r->num_blocks > end - lba) {
+					r->num_blocks = end - lba;
+				}
+				r->next = *rp;
+				*rp = r;
+				rp = &r->next;
+			}
+		}
+	} else {
+		fprintf(stderr, "\nVerify16 of lba %" PRIu64 " failed with %s\n",
+			lba, iscsi_get_error(iscsi));
+		client->err_cnt++;
+	}
+	scsi_free_scsi_task(task);
+
+	if (client->progress) {
+		printf("\r%" PRIu64 " of %" PRIu64 " blocks verified, %" PRIu64
+		       " bad", client->verified, client->num_blocks,
+		       client->bad_blocks);
+		fflush(stdout);
+	}
+	fill_queue(client);
+}
+
+void fill_queue(struct client *client)
+{
+	while (client->in_flight < max_in_flight && !client->err_cnt) {
+		struct scsi_task *task;
+		uint64_t lba;
+		uint32_t num_blocks;
+
+		if (client->narrow != NULL) {
+			struct range *r = client->narrow;
+
+			client->narrow = r->next;
+			lba = r->lba;
+			num_blocks = r->num_blocks;
+			free(r);
+		} else if (client->pos < client->num_blocks) {
+			lba = client->pos;
+			num_blocks = blocks_per_io;
+			if (num_blocks > client->num_blocks - client->pos) {
+				num_blocks = client->num_blocks - client->pos;
+			}
+			client->pos += num_blocks;
+		} else {
+			return;
+		}
+
+		task = iscsi_verify16_task(client->iscsi, client->lun, NULL,
+					   num_blocks * client->blocksize, lba,
+					   0, 1, 0, client->blocksize,
+					   verify_cb, client);
+		if (task == NULL) {
+			fprintf(stderr, "failed to send verify16 command: %s\n",
+				iscsi_get_error(client->iscsi));
+			exit(10);
+		}
+		client->in_flight++;
+	}
+}
+
+void usage(void)
+{
+	fprintf(stderr, "Usage: iscsi-scrub [-i <initiator-name>] "
+		"[-m <max_requests>] [-b <blocks_per_request>] [-p] <LUN>\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct iscsi_url *iscsi_url;
+	struct scsi_task *task;
+	struct scsi_readcapacity16 *rc16;
+	struct pollfd pfd[1];
+	struct client client;
+	int c;
+
+	static struct option long_options[] = {
+		{"initiator-name", required_argument,    NULL,        'i'},
+		{"max",            required_argument,    NULL,        'm'},
+		{"blocks",         required_argument,    NULL,        'b'},
+		{"progress",       no_argument,          NULL,        'p'},
+		{0, 0, 0, 0}
+	};
+	int option_index;
+
+	memset(&client, 0, sizeof(client));
+
+	while ((c = getopt_long(argc, argv, "i:m:b:p", long_options,
+			&option_index)) != -1) {
+		switch (c) {
+		case 'i':
+			initiator = optarg;
+			break;
+		case 'm':
+			max_in_flight = atoi(optarg);
+			break;
+		case 'b':
+			blocks_per_io = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			client.progress = 1;
+			break;
+		default:
+			fprintf(stderr, "Unrecognized option '%c'\n\n", c);
+			usage();
+		}
+	}
+
+	if (optind != argc - 1 || max_in_flight < 1 || blocks_per_io < 1) {
+		usage();
+	}
+
+	client.iscsi = iscsi_create_context(initiator);
+	if (client.iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		exit(10);
+	}
+	iscsi_url = iscsi_parse_full_url(client.iscsi, argv[optind]);
+	if (iscsi_url == NULL) {
+		fprintf(stderr, "Failed to parse URL: %s\n",
+			iscsi_get_error(client.iscsi));
+		exit(10);
+	}
+	iscsi_set_session_type(client.iscsi, ISCSI_SESSION_NORMAL);
+	iscsi_set_header_digest(client.iscsi, ISCSI_HEADER_DIGEST_NONE_CRC32C);
+	if (iscsi_full_connect_sync(client.iscsi, iscsi_url->portal,
+				    iscsi_url->lun) != 0) {
+		fprintf(stderr, "Login Failed. %s\n",
+			iscsi_get_error(client.iscsi));
+		iscsi_destroy_url(iscsi_url);
+		iscsi_destroy_context(client.iscsi);
+		exit(10);
+	}
+	client.lun = iscsi_url->lun;
+	iscsi_destroy_url(iscsi_url);
+
+	task = iscsi_readcapacity16_sync(client.iscsi, client.lun);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "failed to send readcapacity command\n");
+		exit(10);
+	}
+	rc16 = scsi_datain_unmarshall(task);
+	if (rc16 == NULL) {
+		fprintf(stderr, "failed to unmarshall readcapacity16 data\n");
+		exit(10);
+	}
+	client.blocksize  = rc16->block_length;
+	client.num_blocks = rc16->returned_lba + 1;
+	scsi_free_scsi_task(task);
+
+	if ((uint64_t)blocks_per_io * client.blocksize > 0xffffffff) {
+		blocks_per_io = 0xffffffff / client.blocksize;
+	}
+
+	fill_queue(&client);
+
+	while (client.in_flight && !client.err_cnt) {
+		pfd[0].fd = iscsi_get_fd(client.iscsi);
+		pfd[0].events = iscsi_which_events(client.iscsi);
+
+		if (poll(&pfd[0], 1, -1) < 0) {
+			continue;
+		}
+		if (iscsi_service(client.iscsi, pfd[0].revents) < 0) {
+			fprintf(stderr, "iscsi_service failed with : %s\n",
+				iscsi_get_error(client.iscsi));
+			client.err_cnt++;
+		}
+	}
+
+	flush_bad(&client);
+
+	if (client.err_cnt) {
+		printf("\nABORTED!\n");
+	} else {
+		printf("\n%" PRIu64 " blocks verified, %" PRIu64
+		       " bad blocks\n", client.verified, client.bad_blocks);
+		iscsi_logout_sync(client.iscsi);
+	}
+	iscsi_destroy_context(client.iscsi);
+
+	if (client.err_cnt) {
+		return 10;
+	}
+	return client.bad_blocks ? 1 : 0;
+}